@@ -0,0 +1,376 @@
+/*
+** mpc micro-benchmarks
+**
+** Parses synthetic inputs of increasing size
+** with single primitives, with combinators and
+** with grammars made by `mpca_lang`, and prints
+** the throughput of each in MB/s. Each parse is
+** repeated and the fastest taken, so the figures
+** mostly measure `mpc_parse_run` and the parsers
+** themselves rather than the machine's noise.
+**
+**   mpc_bench [name]
+**
+** runs only the benchmarks whose names start
+** with `name`.
+**
+** The `threads-` benchmarks parse with one
+** grammar on several threads at once, check
+** every thread gets the same tree, and give
+** the combined throughput by the wall clock.
+** Each thread takes an equal share of the
+** input size shown.
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "mpc.h"
+
+#ifndef _WIN32
+#include <pthread.h>
+#include <sys/time.h>
+#endif
+
+#define BENCH_REPEATS 3
+#define BENCH_THREADS 4
+
+static const size_t bench_sizes[] = { 64 * 1024, 1024 * 1024, 8 * 1024 * 1024 };
+
+/*
+** Inputs
+*/
+
+/* `unit` repeated until it is at least `size` bytes long, then `end` */
+static char *bench_input(const char *unit, const char *end, size_t size) {
+  size_t ul = strlen(unit), el = strlen(end), n = 0;
+  char *s = malloc(size + ul + el + 1);
+  while (n < size) { memcpy(s + n, unit, ul); n += ul; }
+  memcpy(s + n, end, el + 1);
+  return s;
+}
+
+/* `count` keywords in a scrambled order */
+static char *bench_keywords(int count) {
+  char *s = malloc(count * 16 + 1), *c = s;
+  int i;
+  for (i = 0; i < count; i++) { c += sprintf(c, "kw%d ", i * 7 % count); }
+  return s;
+}
+
+/*
+** Timing
+*/
+
+typedef int (*bench_parse_t)(const char *input, void *data);
+
+static int bench_filtered(const char *filter, const char *name) {
+  return filter && strncmp(name, filter, strlen(filter)) != 0;
+}
+
+static void bench_run(const char *filter, const char *name, const char *unit, const char *end,
+  bench_parse_t parse, void *data) {
+
+  size_t i;
+  int j;
+
+  if (bench_filtered(filter, name)) { return; }
+
+  for (i = 0; i < sizeof(bench_sizes) / sizeof(bench_sizes[0]); i++) {
+    char *input = bench_input(unit, end, bench_sizes[i]);
+    size_t len = strlen(input);
+    double best = -1;
+    for (j = 0; j < BENCH_REPEATS; j++) {
+      clock_t start = clock();
+      double secs;
+      if (!parse(input, data)) {
+        fprintf(stderr, "%s: parse of %lu bytes failed\n", name, (unsigned long)len);
+        exit(EXIT_FAILURE);
+      }
+      secs = (double)(clock() - start) / CLOCKS_PER_SEC;
+      if (best < 0 || secs < best) { best = secs; }
+    }
+    printf("%-20s %8lu KB %10.1f MB/s\n", name, (unsigned long)(len / 1024),
+      best > 0 ? len / best / (1024 * 1024) : 0.0);
+    fflush(stdout);
+    free(input);
+  }
+
+}
+
+#ifndef _WIN32
+
+typedef struct {
+  const char *input;
+  mpc_parser_t *parser;
+  int children;
+} bench_thread_t;
+
+static double bench_wall(void) {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void *bench_thread(void *data) {
+  bench_thread_t *t = data;
+  mpc_result_t r;
+  if (!mpc_parse("<bench>", t->input, t->parser, &r)) {
+    mpc_err_delete(r.error);
+    t->children = -1;
+    return NULL;
+  }
+  t->children = ((mpc_ast_t*)r.output)->children_num;
+  mpc_ast_delete(r.output);
+  return NULL;
+}
+
+/* `BENCH_THREADS` threads each parsing an equal share of the input with the same parser */
+static void bench_run_threads(const char *filter, const char *name, const char *unit,
+  mpc_parser_t *parser) {
+
+  bench_thread_t ts[BENCH_THREADS];
+  pthread_t ids[BENCH_THREADS];
+  size_t i;
+  int j, k;
+
+  if (bench_filtered(filter, name)) { return; }
+
+  for (i = 0; i < sizeof(bench_sizes) / sizeof(bench_sizes[0]); i++) {
+    char *input = bench_input(unit, "", bench_sizes[i] / BENCH_THREADS);
+    size_t len = strlen(input) * BENCH_THREADS;
+    double best = -1;
+    for (j = 0; j < BENCH_REPEATS; j++) {
+      double start = bench_wall(), secs;
+      for (k = 0; k < BENCH_THREADS; k++) {
+        ts[k].input = input;
+        ts[k].parser = parser;
+        if (pthread_create(&ids[k], NULL, bench_thread, &ts[k]) != 0) {
+          fprintf(stderr, "%s: could not start a thread\n", name);
+          exit(EXIT_FAILURE);
+        }
+      }
+      for (k = 0; k < BENCH_THREADS; k++) { pthread_join(ids[k], NULL); }
+      secs = bench_wall() - start;
+      for (k = 0; k < BENCH_THREADS; k++) {
+        if (ts[k].children < 0 || ts[k].children != ts[0].children) {
+          fprintf(stderr, "%s: thread %d parsed %lu bytes differently\n", name, k,
+            (unsigned long)(len / BENCH_THREADS));
+          exit(EXIT_FAILURE);
+        }
+      }
+      if (best < 0 || secs < best) { best = secs; }
+    }
+    printf("%-20s %8lu KB %10.1f MB/s\n", name, (unsigned long)(len / 1024),
+      best > 0 ? len / best / (1024 * 1024) : 0.0);
+    fflush(stdout);
+    free(input);
+  }
+
+}
+
+#endif
+
+/*
+** Parse Functions
+*/
+
+static int bench_parse_value(const char *input, void *data) {
+  mpc_result_t r;
+  if (!mpc_parse("<bench>", input, data, &r)) {
+    mpc_err_print(r.error);
+    mpc_err_delete(r.error);
+    return 0;
+  }
+  free(r.output);
+  return 1;
+}
+
+static int bench_parse_ast(const char *input, void *data) {
+  mpc_result_t r;
+  if (!mpc_parse("<bench>", input, data, &r)) {
+    mpc_err_print(r.error);
+    mpc_err_delete(r.error);
+    return 0;
+  }
+  mpc_ast_delete(r.output);
+  return 1;
+}
+
+typedef struct {
+  mpc_parser_t *parser;
+  mpc_tags_t *tags;
+} bench_tree_t;
+
+static int bench_parse_tree(const char *input, void *data) {
+  bench_tree_t *b = data;
+  mpc_result_t r;
+  if (!mpc_parse_tree("<bench>", input, b->parser, b->tags, &r)) {
+    mpc_err_print(r.error);
+    mpc_err_delete(r.error);
+    return 0;
+  }
+  mpc_tree_delete(r.output);
+  return 1;
+}
+
+static int bench_parse_arena(const char *input, void *data) {
+  mpc_arena_t *a = mpc_arena_new();
+  mpc_result_t r;
+  int ok = mpc_parse_arena("<bench>", input, data, a, &r);
+  if (!ok) {
+    mpc_err_print(r.error);
+    mpc_err_delete(r.error);
+  }
+  mpc_arena_delete(a);
+  return ok;
+}
+
+/*
+** Benchmarks
+*/
+
+static void bench_primitives(const char *filter) {
+
+  mpc_parser_t *p;
+  mpc_parser_t *alternatives[32];
+  char *keywords;
+  int i;
+
+  p = mpc_total(mpc_many(mpcf_strfold, mpc_char('a')), free);
+  bench_run(filter, "char", "a", "", bench_parse_value, p);
+  mpc_delete(p);
+
+  p = mpc_total(mpc_many(mpcf_strfold, mpc_string("hello ")), free);
+  bench_run(filter, "string", "hello ", "", bench_parse_value, p);
+  mpc_delete(p);
+
+  p = mpc_total(mpc_many(mpcf_strfold, mpc_re("[a-z_][a-z0-9_]* +")), free);
+  bench_run(filter, "re-ident", "foo_1 bar baz quux ", "", bench_parse_value, p);
+  mpc_delete(p);
+
+  p = mpc_total(mpc_many(mpcf_strfold, mpc_re("-?[0-9]+(\\.[0-9]+)?(e[0-9]+)? ")), free);
+  bench_run(filter, "re-number", "12 -3.25 6e10 7.5e3 ", "", bench_parse_value, p);
+  mpc_delete(p);
+
+  p = mpc_total(mpc_many(mpcf_strfold, mpc_any()), free);
+  bench_run(filter, "many-any", "the quick brown fox ", "", bench_parse_value, p);
+  mpc_delete(p);
+
+  /* The input uses every keyword, so on average half the alternatives fail before one matches */
+  for (i = 0; i < 32; i++) {
+    char kw[16];
+    sprintf(kw, "kw%d ", 31 - i);
+    alternatives[i] = mpc_string(kw);
+  }
+  p = mpc_total(mpc_many(mpcf_strfold, mpc_or(32,
+    alternatives[ 0], alternatives[ 1], alternatives[ 2], alternatives[ 3],
+    alternatives[ 4], alternatives[ 5], alternatives[ 6], alternatives[ 7],
+    alternatives[ 8], alternatives[ 9], alternatives[10], alternatives[11],
+    alternatives[12], alternatives[13], alternatives[14], alternatives[15],
+    alternatives[16], alternatives[17], alternatives[18], alternatives[19],
+    alternatives[20], alternatives[21], alternatives[22], alternatives[23],
+    alternatives[24], alternatives[25], alternatives[26], alternatives[27],
+    alternatives[28], alternatives[29], alternatives[30], alternatives[31])), free);
+  keywords = bench_keywords(32);
+  bench_run(filter, "or-32", keywords, "", bench_parse_value, p);
+  free(keywords);
+  mpc_delete(p);
+
+}
+
+static void bench_lispy(const char *filter) {
+
+  mpc_parser_t *Number = mpc_new("number");
+  mpc_parser_t *Symbol = mpc_new("symbol");
+  mpc_parser_t *String = mpc_new("string");
+  mpc_parser_t *Sexpr  = mpc_new("sexpr");
+  mpc_parser_t *Qexpr  = mpc_new("qexpr");
+  mpc_parser_t *Expr   = mpc_new("expr");
+  mpc_parser_t *Lispy  = mpc_new("lispy");
+  mpc_program_t *g;
+  bench_tree_t tree;
+  mpc_err_t *err;
+
+  const char *unit =
+    "(def {fib} (\\ {n} {if (< n 2) {n} {+ (fib (- n 1)) (fib (- n 2))}}))\n"
+    "(print \"fib \\\"20\\\" is\" (fib 20) {1 -2 3.5 {nested {list}}})\n";
+
+  err = mpca_lang(MPCA_LANG_DEFAULT,
+    " number : /-?[0-9]+(\\.[0-9]+)?/ ;                        "
+    " symbol : /[a-zA-Z0-9_+\\-*\\/\\\\=<>!&]+/ ;               "
+    " string : /\"(\\\\.|[^\"])*\"/ ;                           "
+    " sexpr  : '(' <expr>* ')' ;                                "
+    " qexpr  : '{' <expr>* '}' ;                                "
+    " expr   : <number> | <symbol> | <string> | <sexpr> | <qexpr> ; "
+    " lispy  : /^/ <expr>* /$/ ;                                ",
+    Number, Symbol, String, Sexpr, Qexpr, Expr, Lispy, NULL);
+
+  if (err) {
+    mpc_err_print(err);
+    mpc_err_delete(err);
+    exit(EXIT_FAILURE);
+  }
+
+  bench_run(filter, "lang-lispy", unit, "", bench_parse_ast, Lispy);
+  bench_run(filter, "lang-lispy-arena", unit, "", bench_parse_arena, Lispy);
+#ifndef _WIN32
+  bench_run_threads(filter, "threads-lispy", unit, Lispy);
+#endif
+
+  mpc_optimise(Lispy);
+  g = mpc_compile(Lispy);
+  bench_run(filter, "lang-lispy-compiled", unit, "", bench_parse_ast, mpc_program_start(g));
+#ifndef _WIN32
+  bench_run_threads(filter, "threads-lispy-compiled", unit, mpc_program_start(g));
+#endif
+
+  /* As the interpreter reads its input */
+  tree.parser = mpc_program_start(g);
+  tree.tags = mpc_tags_new(tree.parser);
+  bench_run(filter, "lang-lispy-tree", unit, "", bench_parse_tree, &tree);
+  mpc_tags_delete(tree.tags);
+  mpc_program_delete(g);
+
+  mpc_cleanup(7, Number, Symbol, String, Sexpr, Qexpr, Expr, Lispy);
+
+}
+
+static void bench_maths(const char *filter) {
+
+  mpc_parser_t *Expr    = mpc_new("expression");
+  mpc_parser_t *Product = mpc_new("product");
+  mpc_parser_t *Value   = mpc_new("value");
+  mpc_parser_t *Maths   = mpc_new("maths");
+  mpc_err_t *err;
+
+  err = mpca_lang(MPCA_LANG_PREDICTIVE,
+    " expression : <product> (('+' | '-') <product>)* ; "
+    " product    : <value>   (('*' | '/') <value>)*   ; "
+    " value      : /[0-9]+/ | '(' <expression> ')'    ; "
+    " maths      : /^/ <expression> /$/               ; ",
+    Expr, Product, Value, Maths, NULL);
+
+  if (err) {
+    mpc_err_print(err);
+    mpc_err_delete(err);
+    exit(EXIT_FAILURE);
+  }
+
+  bench_run(filter, "lang-maths", "(12 + 3) * 4 - 56 / (7 - 8 * 9) + ", "0",
+    bench_parse_ast, Maths);
+
+  mpc_cleanup(4, Expr, Product, Value, Maths);
+
+}
+
+int main(int argc, char **argv) {
+
+  const char *filter = argc > 1 ? argv[1] : NULL;
+
+  printf("%-20s %11s %15s\n", "benchmark", "input", "throughput");
+  bench_primitives(filter);
+  bench_lispy(filter);
+  bench_maths(filter);
+
+  return 0;
+}
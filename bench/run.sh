@@ -0,0 +1,117 @@
+#!/usr/bin/env bash
+# Lispy benchmarks: the reader, the evaluator and the builtins.
+#
+#   bench/run.sh [-n runs] ./parsing [./parsing.old]
+#
+# Each benchmark is run `runs` times (5 by default) and the fastest wall time is kept.
+# Peak RSS, allocations and the live-byte high-water mark come from the interpreter's
+# own LISPY_MEM_STATS report. Given a second build, both are run and compared.
+# The large inputs are generated into $BENCH_OUT (bench/out by default) on first use.
+
+set -e
+
+usage() { echo "usage: $0 [-n runs] parsing [baseline]" >&2; exit 2; }
+
+runs=5
+while getopts n: opt; do
+  case $opt in
+    n) runs=$OPTARG ;;
+    *) usage ;;
+  esac
+done
+shift $((OPTIND - 1))
+[ $# -ge 1 ] && [ $# -le 2 ] || usage
+
+dir=$(cd "$(dirname "$0")" && pwd)
+out=${BENCH_OUT:-$dir/out}
+mkdir -p "$out"
+
+# String literals full of escapes, quotes and brackets, only read and thrown away
+gen_strings() {
+  awk 'BEGIN {
+    for (i = 0; i < 40000; i++)
+      printf "{\"key %d\" \"value %d with \\\"quoted\\\" words, a \\\\ and a\\nnewline\" \"(not a list) ; nor a comment\"}\n", i, i
+  }'
+}
+
+# Expressions nested far deeper than any written by hand, read and evaluated
+gen_nesting() {
+  awk 'BEGIN {
+    for (k = 0; k < 40; k++) {
+      s = "(print "
+      for (i = 0; i < 500; i++) s = s "(+ 1 "
+      s = s "0"
+      for (i = 0; i < 500; i++) s = s ")"
+      print s ")"
+    }
+    for (k = 0; k < 10; k++) {
+      s = "(def {deep} "
+      for (i = 0; i < 5000; i++) s = s "{"
+      for (i = 0; i < 5000; i++) s = s "}"
+      print s ")"
+    }
+  }'
+}
+
+# One literal holding a large table, defined and measured
+gen_data() {
+  awk 'BEGIN {
+    print "(def {data} {"
+    for (i = 0; i < 100000; i++) printf "  {%d \"row %d\" (a b %d) %d.5}\n", i, i, i % 97, i
+    print "})"
+    print "(print (len data))"
+  }'
+}
+
+# Whole numbers and fractions of every length, printed five times over
+gen_numbers() {
+  awk 'BEGIN {
+    printf "(def {xs} {"
+    for (i = 0; i < 100000; i++) printf "%d %d.%d 0.00%d ", i * 37, i, i % 997, i
+    print "})"
+    for (k = 0; k < 5; k++) print "(print xs)"
+    print "(print (/ (len xs) 3) (/ 1 3) (* 0.1 3))"
+  }'
+}
+
+for g in strings nesting data numbers; do
+  [ -s "$out/$g.lspy" ] || "gen_$g" > "$out/$g.lspy"
+done
+
+benches="fib:$dir/fib.lspy lists:$dir/lists.lspy strings:$out/strings.lspy nesting:$out/nesting.lspy data:$out/data.lspy numbers:$out/numbers.lspy"
+
+# prints "ms rss allocs high-water" for one build and benchmark
+measure() {
+  local bin=$1 file=$2 best= t
+  for ((r = 0; r < runs; r++)); do
+    t=$( { TIMEFORMAT=%R; time LISPY_MEM_STATS=1 "$bin" "$file" > /dev/null 2> "$out/stats"; } 2>&1 )
+    if [ -z "$best" ] || awk "BEGIN { exit !($t < $best) }"; then best=$t; fi
+  done
+  awk -v t="$best" '
+    /^total /       { allocs = $2 }
+    /^High-water /  { peak = $3 }
+    /^Peak RSS: /   { rss = $3 }
+    END { printf "%.1f %d %d %d\n", t * 1000, rss, allocs, peak }' "$out/stats"
+}
+
+if [ $# -eq 1 ]; then
+  printf "%-10s %10s %12s %12s %14s\n" benchmark "wall ms" "peak RSS KB" allocs "high-water B"
+  for b in $benches; do
+    read -r ms rss allocs peak <<< "$(measure "$1" "${b#*:}")"
+    printf "%-10s %10s %12s %12s %14s\n" "${b%%:*}" "$ms" "$rss" "$allocs" "$peak"
+  done
+else
+  # new / old for each figure, so below 1 is better
+  printf "%-10s %27s %27s %27s\n" benchmark "wall ms (new old ratio)" "peak RSS KB" allocs
+  for b in $benches; do
+    read -r ms rss allocs peak <<< "$(measure "$1" "${b#*:}")"
+    read -r ms0 rss0 allocs0 peak0 <<< "$(measure "$2" "${b#*:}")"
+    awk -v n="${b%%:*}" -v a="$ms" -v b="$ms0" -v c="$rss" -v d="$rss0" -v e="$allocs" -v f="$allocs0" '
+      # builds from before LISPY_MEM_STATS report nothing, so show "-" rather than 0
+      function col(x, y) {
+        if (x == 0 || y == 0) return sprintf("%9s %9s %7s", x ? x : "-", y ? y : "-", "-")
+        return sprintf("%9s %9s %6.2fx", x, y, x / y)
+      }
+      BEGIN { printf "%-10s %s %s %s\n", n, col(a, b), col(c, d), col(e, f) }'
+  done
+fi
@@ -1,17 +1,15 @@
 #include "mpc.h"
 
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 /*
 ** State Type
 */
 
-static mpc_state_t mpc_state_invalid(void) {
-  mpc_state_t s;
-  s.pos = -1;
-  s.row = -1;
-  s.col = -1;
-  return s;
-}
-
 static mpc_state_t mpc_state_new(void) {
   mpc_state_t s;
   s.pos = 0;
@@ -65,14 +63,50 @@ enum {
   MPC_INPUT_MARKS_MIN = 32
 };
 
+/*
+** Small values are served from slabs owned by
+** the input, each holding one size class, and
+** handed back through a free list per class.
+** The first slab of each class sits inside the
+** input. Each new one is twice the size of the
+** last, so large parses stay in the pool rather
+** than falling back to `malloc`, which only sees
+** values bigger than the top class.
+*/
+
+enum {
+  MPC_INPUT_MEM_CLASSES = 5,
+  MPC_INPUT_MEM_MIN     = 16,
+  MPC_INPUT_MEM_MAX     = 256,
+  MPC_INPUT_MEM_SLAB    = 4096,
+  MPC_INPUT_MEM_SLABS   = 48
+};
+
+/*
+** Packrat memo table. Direct mapped, so a
+** colliding entry simply evicts the old one
+** and memory use stays bounded no matter how
+** large the input is.
+*/
+
 enum {
-  MPC_INPUT_MEM_NUM = 512
+  MPC_INPUT_MEMO_NUM  = 4096
 };
 
-typedef struct {
-  char mem[64];
+struct mpc_memo_t;
+struct mpc_err_slot_t;
+struct mpc_tree_build_t;
+
+typedef struct mpc_mem_t {
+  struct mpc_mem_t *next;
 } mpc_mem_t;
 
+typedef struct {
+  char *start;
+  char *end;
+  int cls;
+} mpc_slab_t;
+
 typedef struct {
 
   int type;
@@ -80,11 +114,13 @@ typedef struct {
   mpc_state_t state;
   
   char *string;
+  long length;
   char *buffer;
   FILE *file;
   
   int suppress;
   int backtrack;
+  int recognise;
   int marks_slots;
   int marks_num;
   mpc_state_t *marks;
@@ -92,12 +128,47 @@ typedef struct {
   char *lasts;
   char last;
   
-  size_t mem_index;
-  char mem_full[MPC_INPUT_MEM_NUM];
-  mpc_mem_t mem[MPC_INPUT_MEM_NUM];
+  long err_pos;
+  struct mpc_err_slot_t *errs;
+  int strings_num;
+  int strings_slots;
+  char **strings;
+  
+  mpc_mem_t *mem_free[MPC_INPUT_MEM_CLASSES];
+  char *mem_next[MPC_INPUT_MEM_CLASSES];
+  char *mem_end[MPC_INPUT_MEM_CLASSES];
+  size_t mem_slab[MPC_INPUT_MEM_CLASSES];
+  int slabs_num;
+  mpc_slab_t slabs[MPC_INPUT_MEM_SLABS];
+  mpc_mem_t mem[MPC_INPUT_MEM_CLASSES * MPC_INPUT_MEM_SLAB / sizeof(mpc_mem_t)];
+  
+  unsigned long mem_pooled;
+  unsigned long mem_heap;
+  unsigned long mem_exported;
+  unsigned long mem_bytes;
+  
+  struct mpc_memo_t *memo;
+  struct mpc_tree_build_t *tree;
+  mpc_arena_t *arena;
+  int arena_owned;
   
 } mpc_input_t;
 
+static void mpc_input_mem_init(mpc_input_t *i) {
+  int j;
+  for (j = 0; j < MPC_INPUT_MEM_CLASSES; j++) {
+    i->mem_free[j] = NULL;
+    i->mem_next[j] = (char*)i->mem + j * MPC_INPUT_MEM_SLAB;
+    i->mem_end[j] = i->mem_next[j] + MPC_INPUT_MEM_SLAB;
+    i->mem_slab[j] = MPC_INPUT_MEM_SLAB;
+  }
+  i->slabs_num = 0;
+  i->mem_pooled = 0;
+  i->mem_heap = 0;
+  i->mem_exported = 0;
+  i->mem_bytes = sizeof(i->mem);
+}
+
 static mpc_input_t *mpc_input_new_string(const char *filename, const char *string) {
 
   mpc_input_t *i = malloc(sizeof(mpc_input_t));
@@ -108,12 +179,14 @@ static mpc_input_t *mpc_input_new_string(const char *filename, const char *strin
   
   i->state = mpc_state_new();
   
-  i->string = malloc(strlen(string) + 1);
+  i->length = strlen(string);
+  i->string = malloc(i->length + 1);
   strcpy(i->string, string);
   i->buffer = NULL;
   i->file = NULL;
   
   i->suppress = 0;
+  i->recognise = 0;
   i->backtrack = 1;
   i->marks_num = 0;
   i->marks_slots = MPC_INPUT_MARKS_MIN;
@@ -121,8 +194,18 @@ static mpc_input_t *mpc_input_new_string(const char *filename, const char *strin
   i->lasts = malloc(sizeof(char) * i->marks_slots);
   i->last = '\0';
   
-  i->mem_index = 0;
-  memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
+  i->err_pos = 0;
+  i->errs = NULL;
+  i->strings_num = 0;
+  i->strings_slots = 0;
+  i->strings = NULL;
+  
+  mpc_input_mem_init(i);
+  
+  i->memo = NULL;
+  i->tree = NULL;
+  i->arena = NULL;
+  i->arena_owned = 0;
   
   return i;
 }
@@ -138,10 +221,12 @@ static mpc_input_t *mpc_input_new_pipe(const char *filename, FILE *pipe) {
   i->state = mpc_state_new();
   
   i->string = NULL;
+  i->length = 0;
   i->buffer = NULL;
   i->file = pipe;
   
   i->suppress = 0;
+  i->recognise = 0;
   i->backtrack = 1;
   i->marks_num = 0;
   i->marks_slots = MPC_INPUT_MARKS_MIN;
@@ -149,8 +234,18 @@ static mpc_input_t *mpc_input_new_pipe(const char *filename, FILE *pipe) {
   i->lasts = malloc(sizeof(char) * i->marks_slots);
   i->last = '\0';
   
-  i->mem_index = 0;
-  memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
+  i->err_pos = 0;
+  i->errs = NULL;
+  i->strings_num = 0;
+  i->strings_slots = 0;
+  i->strings = NULL;
+  
+  mpc_input_mem_init(i);
+  
+  i->memo = NULL;
+  i->tree = NULL;
+  i->arena = NULL;
+  i->arena_owned = 0;
   
   return i;
   
@@ -166,10 +261,12 @@ static mpc_input_t *mpc_input_new_file(const char *filename, FILE *file) {
   i->state = mpc_state_new();
   
   i->string = NULL;
+  i->length = 0;
   i->buffer = NULL;
   i->file = file;
   
   i->suppress = 0;
+  i->recognise = 0;
   i->backtrack = 1;
   i->marks_num = 0;
   i->marks_slots = MPC_INPUT_MARKS_MIN;
@@ -177,48 +274,98 @@ static mpc_input_t *mpc_input_new_file(const char *filename, FILE *file) {
   i->lasts = malloc(sizeof(char) * i->marks_slots);
   i->last = '\0';
   
-  i->mem_index = 0;
-  memset(i->mem_full, 0, sizeof(char) * MPC_INPUT_MEM_NUM);
+  i->err_pos = 0;
+  i->errs = NULL;
+  i->strings_num = 0;
+  i->strings_slots = 0;
+  i->strings = NULL;
+  
+  mpc_input_mem_init(i);
+  
+  i->memo = NULL;
+  i->tree = NULL;
+  i->arena = NULL;
+  i->arena_owned = 0;
   
   return i;
 }
 
+static void mpc_input_memo_delete(mpc_input_t *i);
+static void mpc_err_delete_slots(mpc_input_t *i);
+static void mpc_tree_build_delete(struct mpc_tree_build_t *b);
+
 static void mpc_input_delete(mpc_input_t *i) {
   
+  int j;
+  
+  mpc_input_memo_delete(i);
+  mpc_tree_build_delete(i->tree);
+  if (i->arena_owned) { mpc_arena_delete(i->arena); }
+  
+  mpc_err_delete_slots(i);
+  for (j = 0; j < i->strings_num; j++) { free(i->strings[j]); }
+  free(i->strings);
+  
   free(i->filename);
   
   if (i->type == MPC_INPUT_STRING) { free(i->string); }
   if (i->type == MPC_INPUT_PIPE) { free(i->buffer); }
   
+  for (j = 0; j < i->slabs_num; j++) { free(i->slabs[j].start); }
+  
   free(i->marks);
   free(i->lasts);
   free(i);
 }
 
-static int mpc_mem_ptr(mpc_input_t *i, void *p) {
-  return
-    (char*)p >= (char*)(i->mem) &&
-    (char*)p <  (char*)(i->mem) + (MPC_INPUT_MEM_NUM * sizeof(mpc_mem_t));
+/* Finds the size class of the slab holding `p`, or -1 for values on the heap */
+static int mpc_mem_class_of(mpc_input_t *i, void *p) {
+  int j;
+  if ((char*)p >= (char*)i->mem && (char*)p < (char*)i->mem + sizeof(i->mem)) {
+    return (int)(((char*)p - (char*)i->mem) / MPC_INPUT_MEM_SLAB);
+  }
+  for (j = i->slabs_num-1; j >= 0; j--) {
+    if ((char*)p >= i->slabs[j].start && (char*)p < i->slabs[j].end) { return i->slabs[j].cls; }
+  }
+  return -1;
+}
+
+static int mpc_mem_class(size_t n) {
+  static const char classes[16] = { 0, 1, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 4, 4, 4, 4 };
+  return n ? classes[(n-1) / MPC_INPUT_MEM_MIN] : 0;
 }
 
 static void *mpc_malloc(mpc_input_t *i, size_t n) {
-  size_t j;
+  
+  int c;
   char *p;
   
-  if (n > sizeof(mpc_mem_t)) { return malloc(n); }
+  if (n > MPC_INPUT_MEM_MAX) { i->mem_heap++; return malloc(n); }
   
-  j = i->mem_index;
-  do {
-    if (!i->mem_full[i->mem_index]) {
-      p = (void*)(i->mem + i->mem_index);
-      i->mem_full[i->mem_index] = 1;
-      i->mem_index = (i->mem_index+1) % MPC_INPUT_MEM_NUM;
-      return p;
-    }
-    i->mem_index = (i->mem_index+1) % MPC_INPUT_MEM_NUM;
-  } while (j != i->mem_index);
+  c = mpc_mem_class(n);
+  i->mem_pooled++;
+  
+  if (i->mem_free[c]) {
+    p = (char*)i->mem_free[c];
+    i->mem_free[c] = i->mem_free[c]->next;
+    return p;
+  }
   
-  return malloc(n);
+  if (i->mem_next[c] == i->mem_end[c]) {
+    if (i->slabs_num == MPC_INPUT_MEM_SLABS) { i->mem_pooled--; i->mem_heap++; return malloc(n); }
+    i->mem_slab[c] *= 2;
+    i->mem_next[c] = malloc(i->mem_slab[c]);
+    i->mem_end[c] = i->mem_next[c] + i->mem_slab[c];
+    i->slabs[i->slabs_num].start = i->mem_next[c];
+    i->slabs[i->slabs_num].end = i->mem_end[c];
+    i->slabs[i->slabs_num].cls = c;
+    i->slabs_num++;
+    i->mem_bytes += i->mem_slab[c];
+  }
+  
+  p = i->mem_next[c];
+  i->mem_next[c] += MPC_INPUT_MEM_MIN << c;
+  return p;
 }
 
 static void *mpc_calloc(mpc_input_t *i, size_t n, size_t m) {
@@ -227,35 +374,40 @@ static void *mpc_calloc(mpc_input_t *i, size_t n, size_t m) {
   return x;
 }
 
+static void mpc_mem_release(mpc_input_t *i, int c, void *p) {
+  mpc_mem_t *m = p;
+  m->next = i->mem_free[c];
+  i->mem_free[c] = m;
+}
+
 static void mpc_free(mpc_input_t *i, void *p) {
-  size_t j;
-  if (!mpc_mem_ptr(i, p)) { free(p); return; }
-  j = ((size_t)(((char*)p) - ((char*)i->mem))) / sizeof(mpc_mem_t);
-  i->mem_full[j] = 0;
+  int c = mpc_mem_class_of(i, p);
+  if (c < 0) { free(p); return; }
+  mpc_mem_release(i, c, p);
 }
 
 static void *mpc_realloc(mpc_input_t *i, void *p, size_t n) {
   
   char *q = NULL;
+  int c = mpc_mem_class_of(i, p);
   
-  if (!mpc_mem_ptr(i, p)) { return realloc(p, n); }
-  
-  if (n > sizeof(mpc_mem_t)) {
-    q = malloc(n);
-    memcpy(q, p, sizeof(mpc_mem_t));
-    mpc_free(i, p);
-    return q;
-  }
+  if (c < 0) { return realloc(p, n); }
+  if (n <= (size_t)MPC_INPUT_MEM_MIN << c) { return p; }
   
-  return p;
+  q = mpc_malloc(i, n);
+  memcpy(q, p, MPC_INPUT_MEM_MIN << c);
+  mpc_mem_release(i, c, p);
+  return q;
 }
 
 static void *mpc_export(mpc_input_t *i, void *p) {
   char *q = NULL;
-  if (!mpc_mem_ptr(i, p)) { return p; }
-  q = malloc(sizeof(mpc_mem_t));
-  memcpy(q, p, sizeof(mpc_mem_t));
-  mpc_free(i, p);
+  int c = mpc_mem_class_of(i, p);
+  if (c < 0) { return p; }
+  q = malloc(MPC_INPUT_MEM_MIN << c);
+  memcpy(q, p, MPC_INPUT_MEM_MIN << c);
+  mpc_mem_release(i, c, p);
+  i->mem_exported++;
   return q; 
 }
 
@@ -331,7 +483,7 @@ static char mpc_input_buffer_get(mpc_input_t *i) {
 }
 
 static int mpc_input_terminated(mpc_input_t *i) {
-  if (i->type == MPC_INPUT_STRING && i->state.pos == (long)strlen(i->string)) { return 1; }
+  if (i->type == MPC_INPUT_STRING && i->string[i->state.pos] == '\0') { return 1; }
   if (i->type == MPC_INPUT_FILE && feof(i->file)) { return 1; }
   if (i->type == MPC_INPUT_PIPE && feof(i->file)) { return 1; }
   return 0;
@@ -436,7 +588,8 @@ static int mpc_input_success(mpc_input_t *i, char c, char **o) {
     i->state.row++;
   }
   
-  if (o) {
+  if (o && i->recognise) { (*o) = NULL; }
+  else if (o) {
     (*o) = mpc_malloc(i, 2);
     (*o)[0] = c;
     (*o)[1] = '\0';
@@ -475,6 +628,205 @@ static int mpc_input_noneof(mpc_input_t *i, const char *c, char **o) {
   return strchr(c, x) == 0 ? mpc_input_success(i, x, o) : mpc_input_failure(i, x);  
 }
 
+/*
+** Moves over `n` characters already known to
+** match. Only valid for string input, where the
+** characters can be read back without consuming.
+*/
+
+static void mpc_input_skip(mpc_input_t *i, long n) {
+  char c;
+  while (n-- > 0) {
+    c = i->string[i->state.pos];
+    i->last = c;
+    i->state.pos++;
+    i->state.col++;
+    if (c == '\n') {
+      i->state.col = 0;
+      i->state.row++;
+    }
+  }
+}
+
+static int mpc_input_charset_has(const unsigned char *set, char x) {
+  return set[(unsigned char)x / 8] & (1 << ((unsigned char)x % 8));
+}
+
+/*
+** Scanning
+**
+** Runs of a character class are found a vector
+** at a time when the class, or its complement,
+** has only a few members: whitespace, or the
+** bodies of comments and strings which run until
+** some delimiter. Each byte is compared against
+** every listed character at once. Other classes
+** are scanned a byte at a time with the bitmap.
+*/
+
+enum {
+  MPC_SCAN_TABLE = 0,
+  MPC_SCAN_WHILE = 1,
+  MPC_SCAN_UNTIL = 2,
+  MPC_SCAN_CHARS_MAX = 8
+};
+
+typedef struct {
+  int mode;
+  int n;
+  char cs[MPC_SCAN_CHARS_MAX];
+  unsigned char set[32];
+} mpc_scan_t;
+
+static mpc_scan_t *mpc_scan_new(const unsigned char *set) {
+  
+  int x, in = 0, out = 0;
+  mpc_scan_t *sc = malloc(sizeof(mpc_scan_t));
+  
+  memcpy(sc->set, set, 32);
+  for (x = 0; x < 256; x++) {
+    if (mpc_input_charset_has(set, (char)x)) { in++; } else { out++; }
+  }
+  
+  sc->mode = in <= MPC_SCAN_CHARS_MAX ? MPC_SCAN_WHILE
+           : out <= MPC_SCAN_CHARS_MAX ? MPC_SCAN_UNTIL : MPC_SCAN_TABLE;
+  sc->n = 0;
+  
+  if (sc->mode == MPC_SCAN_TABLE) { return sc; }
+  
+  for (x = 0; x < 256; x++) {
+    if ((sc->mode == MPC_SCAN_WHILE) == (mpc_input_charset_has(set, (char)x) != 0)) {
+      sc->cs[sc->n++] = (char)x;
+    }
+  }
+  
+  return sc;
+}
+
+#if defined(__AVX2__) || defined(__SSE2__)
+static int mpc_scan_first(unsigned int mask) {
+#if defined(__GNUC__)
+  return __builtin_ctz(mask);
+#else
+  int j = 0;
+  while (!(mask & 1)) { mask >>= 1; j++; }
+  return j;
+#endif
+}
+#endif
+
+/* Returns how many of the first `len` bytes of `s` are in the class */
+static long mpc_scan_run(const mpc_scan_t *sc, const char *s, long len) {
+  
+  long n = 0;
+  int j;
+  unsigned int mask;
+  
+#if defined(__AVX2__)
+  __m256i v, m;
+  __m256i cs[MPC_SCAN_CHARS_MAX];
+  if (sc->mode != MPC_SCAN_TABLE) {
+    for (j = 0; j < sc->n; j++) { cs[j] = _mm256_set1_epi8(sc->cs[j]); }
+    while (n + 32 <= len) {
+      v = _mm256_loadu_si256((const __m256i*)(s + n));
+      m = _mm256_setzero_si256();
+      for (j = 0; j < sc->n; j++) { m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, cs[j])); }
+      mask = (unsigned int)_mm256_movemask_epi8(m);
+      if (sc->mode == MPC_SCAN_WHILE) { mask = ~mask; }
+      if (mask) { return n + mpc_scan_first(mask); }
+      n += 32;
+    }
+  }
+#elif defined(__SSE2__)
+  __m128i v, m;
+  __m128i cs[MPC_SCAN_CHARS_MAX];
+  if (sc->mode != MPC_SCAN_TABLE) {
+    for (j = 0; j < sc->n; j++) { cs[j] = _mm_set1_epi8(sc->cs[j]); }
+    while (n + 16 <= len) {
+      v = _mm_loadu_si128((const __m128i*)(s + n));
+      m = _mm_setzero_si128();
+      for (j = 0; j < sc->n; j++) { m = _mm_or_si128(m, _mm_cmpeq_epi8(v, cs[j])); }
+      mask = (unsigned int)_mm_movemask_epi8(m);
+      if (sc->mode == MPC_SCAN_WHILE) { mask = ~mask & 0xFFFF; }
+      if (mask) { return n + mpc_scan_first(mask); }
+      n += 16;
+    }
+  }
+#else
+  (void)j; (void)mask;
+#endif
+  
+  while (n + 4 <= len
+  &&  mpc_input_charset_has(sc->set, s[n+0])
+  &&  mpc_input_charset_has(sc->set, s[n+1])
+  &&  mpc_input_charset_has(sc->set, s[n+2])
+  &&  mpc_input_charset_has(sc->set, s[n+3])) { n += 4; }
+  
+  while (n < len && mpc_input_charset_has(sc->set, s[n])) { n++; }
+  
+  return n;
+}
+
+static int mpc_input_charset(mpc_input_t *i, const unsigned char *set, char **o) {
+  char x = mpc_input_getc(i);
+  if (mpc_input_terminated(i)) { return 0; }
+  return mpc_input_charset_has(set, x) ? mpc_input_success(i, x, o) : mpc_input_failure(i, x);
+}
+
+/*
+** Runs of characters are collected into `o`, which
+** holds `n` characters so far in `slots` bytes. String
+** input instead copies the whole run out at the end.
+*/
+
+static void mpc_input_push(mpc_input_t *i, char **o, long *slots, long n, char x) {
+  if (i->recognise || i->type == MPC_INPUT_STRING) { return; }
+  if (n + 2 > *slots) {
+    *slots = *slots ? *slots * 2 : (long)MPC_INPUT_MEM_MIN;
+    *o = *o ? mpc_realloc(i, *o, *slots) : mpc_malloc(i, *slots);
+  }
+  (*o)[n] = x;
+}
+
+static char *mpc_input_pushed(mpc_input_t *i, char *o, long start, long n) {
+  if (i->recognise) { return NULL; }
+  if (i->type == MPC_INPUT_STRING) {
+    o = mpc_malloc(i, n + 1);
+    memcpy(o, i->string + start, n);
+  }
+  o = o ? o : mpc_malloc(i, 1);
+  o[n] = '\0';
+  return o;
+}
+
+/* Consumes the longest run of characters in the class, returning how many matched */
+static long mpc_input_charset_run(mpc_input_t *i, const mpc_scan_t *sc, char **o) {
+  
+  long n = 0, slots = 0;
+  long start = i->state.pos;
+  char x;
+  
+  *o = NULL;
+  
+  if (i->type == MPC_INPUT_STRING) {
+    n = mpc_scan_run(sc, i->string + start, i->length - start);
+    mpc_input_skip(i, n);
+    *o = mpc_input_pushed(i, NULL, start, n);
+    return n;
+  }
+  
+  while (1) {
+    x = mpc_input_getc(i);
+    if (mpc_input_terminated(i)) { break; }
+    if (!mpc_input_charset_has(sc->set, x)) { mpc_input_failure(i, x); break; }
+    mpc_input_success(i, x, NULL);
+    mpc_input_push(i, o, &slots, n++, x);
+  }
+  
+  *o = mpc_input_pushed(i, *o, start, n);
+  return n;
+}
+
 static int mpc_input_satisfy(mpc_input_t *i, int(*cond)(char), char **o) {
   char x = mpc_input_getc(i);
   if (mpc_input_terminated(i)) { return 0; }
@@ -495,6 +847,8 @@ static int mpc_input_string(mpc_input_t *i, const char *c, char **o) {
   }
   mpc_input_unmark(i);
   
+  if (i->recognise) { *o = NULL; return 1; }
+  
   *o = mpc_malloc(i, strlen(c) + 1);
   strcpy(*o, c);
   return 1;
@@ -505,6 +859,16 @@ static int mpc_input_anchor(mpc_input_t* i, int(*f)(char,char), char **o) {
   return f(i->last, mpc_input_peekc(i));
 }
 
+static char *mpc_input_span(mpc_input_t *i, long start) {
+  long n = i->state.pos - start;
+  char *o;
+  if (i->recognise) { return NULL; }
+  o = mpc_malloc(i, n + 1);
+  memcpy(o, i->string + start, n);
+  o[n] = '\0';
+  return o;
+}
+
 static mpc_state_t *mpc_input_state_copy(mpc_input_t *i) {
   mpc_state_t *r = mpc_malloc(i, sizeof(mpc_state_t));
   memcpy(r, &i->state, sizeof(mpc_state_t));
@@ -544,14 +908,12 @@ static void mpc_err_string_cat(char *buffer, int *pos, int *max, char const *fmt
   va_end(va);
 }
 
-static char char_unescape_buffer[4];
-
-static const char *mpc_err_char_unescape(char c) {
+static const char *mpc_err_char_unescape(char c, char *buffer) {
   
-  char_unescape_buffer[0] = '\'';
-  char_unescape_buffer[1] = ' ';
-  char_unescape_buffer[2] = '\'';
-  char_unescape_buffer[3] = '\0';
+  buffer[0] = '\'';
+  buffer[1] = ' ';
+  buffer[2] = '\'';
+  buffer[3] = '\0';
   
   switch (c) {
     case '\a': return "bell";
@@ -564,8 +926,8 @@ static const char *mpc_err_char_unescape(char c) {
     case '\t': return "tab";
     case ' ' : return "space";
     default:
-      char_unescape_buffer[1] = c;
-      return char_unescape_buffer;
+      buffer[1] = c;
+      return buffer;
   }
   
 }
@@ -575,6 +937,7 @@ char *mpc_err_string(mpc_err_t *x) {
   int i;  
   int pos = 0; 
   int max = 1023;
+  char unescaped[4];
   char *buffer = calloc(1, 1024);
   
   if (x->failure) {
@@ -600,40 +963,114 @@ char *mpc_err_string(mpc_err_t *x) {
   }
   
   mpc_err_string_cat(buffer, &pos, &max, " at ");
-  mpc_err_string_cat(buffer, &pos, &max, mpc_err_char_unescape(x->recieved));
+  mpc_err_string_cat(buffer, &pos, &max, mpc_err_char_unescape(x->recieved, unescaped));
   mpc_err_string_cat(buffer, &pos, &max, "\n");
   
   return realloc(buffer, strlen(buffer) + 1);
 }
 
+/*
+** While parsing, errors only borrow their strings:
+** the filename from the input and each expected
+** message from the parser reporting it, so each
+** message is known by its pointer alone. Strings
+** which have to be built are kept by the input.
+** Only the error finally reported is copied out
+** as text for the user.
+**
+** Just the furthest failures can ever be reported,
+** so an error behind the furthest one made so far
+** is never built at all. Errors which are merged
+** away are recycled by the input, and have room
+** for a few expected messages of their own.
+*/
+
+enum {
+  MPC_ERR_EXPECTED_MIN = 4
+};
+
+typedef struct mpc_err_slot_t {
+  mpc_err_t err;
+  int slots;
+  struct mpc_err_slot_t *next;
+  char *expected[MPC_ERR_EXPECTED_MIN];
+} mpc_err_slot_t;
+
+static mpc_err_t *mpc_err_alloc(mpc_input_t *i) {
+  mpc_err_slot_t *x = i->errs;
+  if (x) { i->errs = x->next; } else { x = malloc(sizeof(mpc_err_slot_t)); }
+  x->slots = MPC_ERR_EXPECTED_MIN;
+  x->err.filename = i->filename;
+  x->err.state = i->state;
+  x->err.expected_num = 0;
+  x->err.expected = x->expected;
+  x->err.failure = NULL;
+  x->err.recieved = ' ';
+  return &x->err;
+}
+
+static void mpc_err_delete_internal(mpc_input_t *i, mpc_err_t *x) {
+  mpc_err_slot_t *y = (mpc_err_slot_t*)x;
+  if (x == NULL) { return; }
+  if (x->expected != y->expected) { free(x->expected); }
+  y->next = i->errs;
+  i->errs = y;
+}
+
+static void mpc_err_delete_slots(mpc_input_t *i) {
+  mpc_err_slot_t *x;
+  while (i->errs) {
+    x = i->errs;
+    i->errs = x->next;
+    free(x);
+  }
+}
+
+static void mpc_err_add_expected(mpc_input_t *i, mpc_err_t *x, char *expected) {
+  mpc_err_slot_t *y = (mpc_err_slot_t*)x;
+  (void)i;
+  if (x->expected_num == y->slots) {
+    y->slots *= 2;
+    if (x->expected == y->expected) {
+      x->expected = malloc(sizeof(char*) * y->slots);
+      memcpy(x->expected, y->expected, sizeof(char*) * x->expected_num);
+    } else {
+      x->expected = realloc(x->expected, sizeof(char*) * y->slots);
+    }
+  }
+  x->expected[x->expected_num++] = expected;
+}
+
+static int mpc_err_behind(mpc_input_t *i) {
+  if (i->suppress || i->state.pos < i->err_pos) { return 1; }
+  i->err_pos = i->state.pos;
+  return 0;
+}
+
 static mpc_err_t *mpc_err_new(mpc_input_t *i, const char *expected) {
   mpc_err_t *x;
-  if (i->suppress) { return NULL; }
-  x = mpc_malloc(i, sizeof(mpc_err_t));
-  x->filename = mpc_malloc(i, strlen(i->filename) + 1);
-  strcpy(x->filename, i->filename);
-  x->state = i->state;
+  if (mpc_err_behind(i)) { return NULL; }
+  x = mpc_err_alloc(i);
   x->expected_num = 1;
-  x->expected = mpc_malloc(i, sizeof(char*));
-  x->expected[0] = mpc_malloc(i, strlen(expected) + 1);
-  strcpy(x->expected[0], expected);
-  x->failure = NULL;
+  x->expected[0] = (char*)expected;
   x->recieved = mpc_input_peekc(i);
   return x;
 }
 
 static mpc_err_t *mpc_err_fail(mpc_input_t *i, const char *failure) {
   mpc_err_t *x;
-  if (i->suppress) { return NULL; }
-  x = mpc_malloc(i, sizeof(mpc_err_t));
-  x->filename = mpc_malloc(i, strlen(i->filename) + 1);
-  strcpy(x->filename, i->filename);
-  x->state = i->state;
-  x->expected_num = 0;
-  x->expected = NULL;
-  x->failure = mpc_malloc(i, strlen(failure) + 1);
-  strcpy(x->failure, failure);
-  x->recieved = ' ';
+  if (mpc_err_behind(i)) { return NULL; }
+  x = mpc_err_alloc(i);
+  x->failure = (char*)failure;
+  return x;
+}
+
+static char *mpc_err_keep(mpc_input_t *i, char *x) {
+  if (i->strings_num == i->strings_slots) {
+    i->strings_slots = i->strings_slots ? i->strings_slots * 2 : MPC_INPUT_MARKS_MIN;
+    i->strings = realloc(i->strings, sizeof(char*) * i->strings_slots);
+  }
+  i->strings[i->strings_num++] = x;
   return x;
 }
 
@@ -651,94 +1088,103 @@ static mpc_err_t *mpc_err_file(const char *filename, const char *failure) {
   return x;
 }
 
-static void mpc_err_delete_internal(mpc_input_t *i, mpc_err_t *x) {
-  int j;
-  if (x == NULL) { return; }
-  for (j = 0; j < x->expected_num; j++) { mpc_free(i, x->expected[j]); }
-  mpc_free(i, x->expected);
-  mpc_free(i, x->filename);
-  mpc_free(i, x->failure);
-  mpc_free(i, x);
+static char *mpc_err_strdup(const char *x) {
+  char *y;
+  if (x == NULL) { return NULL; }
+  y = malloc(strlen(x) + 1);
+  strcpy(y, x);
+  return y;
 }
 
+/* Copies the text of an error out for the user */
 static mpc_err_t *mpc_err_export(mpc_input_t *i, mpc_err_t *x) {
   int j;
+  mpc_err_t *y = malloc(sizeof(mpc_err_t));
+  y->state = x->state;
+  y->recieved = x->recieved;
+  y->filename = mpc_err_strdup(x->filename);
+  y->failure = mpc_err_strdup(x->failure);
+  y->expected_num = x->expected_num;
+  y->expected = x->expected_num ? malloc(sizeof(char*) * x->expected_num) : NULL;
   for (j = 0; j < x->expected_num; j++) {
-    x->expected[j] = mpc_export(i, x->expected[j]);
+    y->expected[j] = mpc_err_strdup(x->expected[j]);
   }
-  x->expected = mpc_export(i, x->expected);
-  x->filename = mpc_export(i, x->filename);
-  x->failure = mpc_export(i, x->failure);
-  return mpc_export(i, x);
+  mpc_err_delete_internal(i, x);
+  return y;
+}
+
+static mpc_err_t *mpc_err_copy(mpc_input_t *i, mpc_err_t *x) {
+  int j;
+  mpc_err_t *y;
+  if (x == NULL) { return NULL; }
+  y = mpc_err_alloc(i);
+  y->state = x->state;
+  y->filename = x->filename;
+  y->failure = x->failure;
+  y->recieved = x->recieved;
+  for (j = 0; j < x->expected_num; j++) { mpc_err_add_expected(i, y, x->expected[j]); }
+  return y;
 }
 
 static int mpc_err_contains_expected(mpc_input_t *i, mpc_err_t *x, char *expected) {
   int j;
   (void)i;
   for (j = 0; j < x->expected_num; j++) {
-    if (strcmp(x->expected[j], expected) == 0) { return 1; }
+    if (x->expected[j] == expected || strcmp(x->expected[j], expected) == 0) { return 1; }
   }
   return 0;
 }
 
-static void mpc_err_add_expected(mpc_input_t *i, mpc_err_t *x, char *expected) {
-  (void)i;
-  x->expected_num++;
-  x->expected = mpc_realloc(i, x->expected, sizeof(char*) * x->expected_num);
-  x->expected[x->expected_num-1] = mpc_malloc(i, strlen(expected) + 1);
-  strcpy(x->expected[x->expected_num-1], expected);
+/*
+** A failure reported first at a position hides
+** everything else expected there.
+*/
+
+static mpc_err_t *mpc_err_settle(mpc_err_t *x) {
+  if (x->failure) { x->expected_num = 0; }
+  return x;
 }
 
-static mpc_err_t *mpc_err_or(mpc_input_t *i, mpc_err_t** x, int n) {
+/*
+** Merging keeps the furthest error, and at the
+** same position the expected messages of both,
+** in order and without repeats.
+*/
+
+static mpc_err_t *mpc_err_merge(mpc_input_t *i, mpc_err_t *x, mpc_err_t *y) {
   
-  int j, k, fst;
-  mpc_err_t *e;
+  int k;
   
-  fst = -1;
-  for (j = 0; j < n; j++) {
-    if (x[j] != NULL) { fst = j; }
-  }
+  if (x == NULL && y == NULL) { return NULL; }
   
-  if (fst == -1) { return NULL; }
+  if (y == NULL || (x != NULL && x->state.pos > y->state.pos)) {
+    mpc_err_delete_internal(i, y);
+    return mpc_err_settle(x);
+  }
   
-  e = mpc_malloc(i, sizeof(mpc_err_t));
-  e->state = mpc_state_invalid();
-  e->expected_num = 0;
-  e->expected = NULL;
-  e->failure = NULL;
-  e->filename = mpc_malloc(i, strlen(x[fst]->filename)+1);
-  strcpy(e->filename, x[fst]->filename);
+  if (x == NULL || y->state.pos > x->state.pos) {
+    mpc_err_delete_internal(i, x);
+    return mpc_err_settle(y);
+  }
   
-  for (j = 0; j < n; j++) {
-    if (x[j] == NULL) { continue; }
-    if (x[j]->state.pos > e->state.pos) { e->state = x[j]->state; }
+  if (x->failure) {
+    mpc_err_delete_internal(i, y);
+    return mpc_err_settle(x);
   }
   
-  for (j = 0; j < n; j++) {
-    if (x[j] == NULL) { continue; }
-    if (x[j]->state.pos < e->state.pos) { continue; }
-    
-    if (x[j]->failure) {
-      e->failure = mpc_malloc(i, strlen(x[j]->failure)+1);
-      strcpy(e->failure, x[j]->failure);
-      break;
-    }
-    
-    e->recieved = x[j]->recieved;
-    
-    for (k = 0; k < x[j]->expected_num; k++) {
-      if (!mpc_err_contains_expected(i, e, x[j]->expected[k])) {
-        mpc_err_add_expected(i, e, x[j]->expected[k]);
+  if (y->failure) {
+    x->failure = y->failure;
+  } else {
+    for (k = 0; k < y->expected_num; k++) {
+      if (!mpc_err_contains_expected(i, x, y->expected[k])) {
+        mpc_err_add_expected(i, x, y->expected[k]);
       }
     }
+    x->recieved = y->recieved;
   }
   
-  for (j = 0; j < n; j++) {
-    if (x[j] == NULL) { continue; }
-    mpc_err_delete_internal(i, x[j]);
-  }
-  
-  return e;
+  mpc_err_delete_internal(i, y);
+  return x;
 }
 
 static mpc_err_t *mpc_err_repeat(mpc_input_t *i, mpc_err_t *x, const char *prefix) {
@@ -750,19 +1196,16 @@ static mpc_err_t *mpc_err_repeat(mpc_input_t *i, mpc_err_t *x, const char *prefi
   if (x == NULL) { return NULL; }
   
   if (x->expected_num == 0) {
-    expect = mpc_calloc(i, 1, 1);
     x->expected_num = 1;
-    x->expected = mpc_realloc(i, x->expected, sizeof(char*) * x->expected_num);
-    x->expected[0] = expect;
+    x->expected[0] = "";
     return x;
   }
   
   else if (x->expected_num == 1) {
-    expect = mpc_malloc(i, strlen(prefix) + strlen(x->expected[0]) + 1);
+    expect = malloc(strlen(prefix) + strlen(x->expected[0]) + 1);
     strcpy(expect, prefix);
     strcat(expect, x->expected[0]);
-    mpc_free(i, x->expected[0]);
-    x->expected[0] = expect;
+    x->expected[0] = mpc_err_keep(i, expect);
     return x;
   }
   
@@ -776,7 +1219,7 @@ static mpc_err_t *mpc_err_repeat(mpc_input_t *i, mpc_err_t *x, const char *prefi
     l += strlen(" or ");
     l += strlen(x->expected[x->expected_num-1]);
     
-    expect = mpc_malloc(i, l + 1);
+    expect = malloc(l + 1);
     
     strcpy(expect, prefix);
     for (j = 0; j < x->expected_num-2; j++) {
@@ -785,12 +1228,9 @@ static mpc_err_t *mpc_err_repeat(mpc_input_t *i, mpc_err_t *x, const char *prefi
     strcat(expect, x->expected[x->expected_num-2]);
     strcat(expect, " or ");
     strcat(expect, x->expected[x->expected_num-1]);
-
-    for (j = 0; j < x->expected_num; j++) { mpc_free(i, x->expected[j]); }
     
     x->expected_num = 1;
-    x->expected = mpc_realloc(i, x->expected, sizeof(char*) * x->expected_num);
-    x->expected[0] = expect;
+    x->expected[0] = mpc_err_keep(i, expect);
     return x;
   }
   
@@ -812,12 +1252,6 @@ static mpc_err_t *mpc_err_count(mpc_input_t *i, mpc_err_t *x, int n) {
   return y;
 }
 
-static mpc_err_t *mpc_err_merge(mpc_input_t *i, mpc_err_t *x, mpc_err_t *y) {
-  mpc_err_t *errs[2];
-  errs[0] = x;
-  errs[1] = y;
-  return mpc_err_or(i, errs, 2);
-}
 
 /*
 ** Parser Type
@@ -851,7 +1285,13 @@ enum {
   MPC_TYPE_COUNT     = 22,
   
   MPC_TYPE_OR        = 23,
-  MPC_TYPE_AND       = 24
+  MPC_TYPE_AND       = 24,
+  
+  MPC_TYPE_MEMO      = 25,
+  MPC_TYPE_REGEX     = 26,
+  
+  MPC_TYPE_CHARSET   = 27,
+  MPC_TYPE_SPAN      = 28
 };
 
 typedef struct { char *m; } mpc_pdata_fail_t;
@@ -867,8 +1307,12 @@ typedef struct { mpc_parser_t *x; mpc_apply_to_t f; void *d; } mpc_pdata_apply_t
 typedef struct { mpc_parser_t *x; } mpc_pdata_predict_t;
 typedef struct { mpc_parser_t *x; mpc_dtor_t dx; mpc_ctor_t lf; } mpc_pdata_not_t;
 typedef struct { int n; mpc_fold_t f; mpc_parser_t *x; mpc_dtor_t dx; } mpc_pdata_repeat_t;
-typedef struct { int n; mpc_parser_t **xs; } mpc_pdata_or_t;
+typedef struct { int n; mpc_parser_t **xs; unsigned char *first; int *jump; } mpc_pdata_or_t;
 typedef struct { int n; mpc_fold_t f; mpc_parser_t **xs; mpc_dtor_t *dxs;  } mpc_pdata_and_t;
+typedef struct { mpc_parser_t *x; mpc_dtor_t dx; mpc_apply_t cp; } mpc_pdata_memo_t;
+typedef struct { mpc_parser_t *x; struct mpc_dfa_t *dfa; } mpc_pdata_regex_t;
+typedef struct { unsigned char x[32]; } mpc_pdata_charset_t;
+typedef struct { mpc_parser_t *x; int min; int esc; mpc_scan_t *scan; } mpc_pdata_span_t;
 
 typedef union {
   mpc_pdata_fail_t fail;
@@ -886,6 +1330,10 @@ typedef union {
   mpc_pdata_repeat_t repeat;
   mpc_pdata_and_t and;
   mpc_pdata_or_t or;
+  mpc_pdata_memo_t memo;
+  mpc_pdata_regex_t regex;
+  mpc_pdata_charset_t charset;
+  mpc_pdata_span_t span;
 } mpc_pdata_t;
 
 struct mpc_parser_t {
@@ -893,1518 +1341,3113 @@ struct mpc_parser_t {
   char *name;
   char type;
   mpc_pdata_t data;
+  mpc_pool_stats_t *stats;
+  mpc_profile_t *profile;
 };
 
-static mpc_val_t *mpcf_input_nth_free(mpc_input_t *i, int n, mpc_val_t **xs, int x) {
-  int j;
-  for (j = 0; j < n; j++) { if (j != x) { mpc_free(i, xs[j]); } }
-  return xs[x];
-}
- 
-static mpc_val_t *mpcf_input_fst_free(mpc_input_t *i, int n, mpc_val_t **xs) { return mpcf_input_nth_free(i, n, xs, 0); }
-static mpc_val_t *mpcf_input_snd_free(mpc_input_t *i, int n, mpc_val_t **xs) { return mpcf_input_nth_free(i, n, xs, 1); }
-static mpc_val_t *mpcf_input_trd_free(mpc_input_t *i, int n, mpc_val_t **xs) { return mpcf_input_nth_free(i, n, xs, 2); }
+/*
+** Packrat Memoisation
+*/
 
-static mpc_val_t *mpcf_input_strfold(mpc_input_t *i, int n, mpc_val_t **xs) {
-  int j;
-  size_t l = 0;
-  if (n == 0) { return mpc_calloc(i, 1, 1); }
-  for (j = 0; j < n; j++) { l += strlen(xs[j]); }
-  xs[0] = mpc_realloc(i, xs[0], l + 1);
-  for (j = 1; j < n; j++) { strcat(xs[0], xs[j]); mpc_free(i, xs[j]); }
-  return xs[0];
+typedef struct mpc_memo_t {
+  mpc_parser_t *p;
+  long pos;
+  int success;
+  mpc_state_t state;
+  char last;
+  mpc_result_t result;
+} mpc_memo_t;
+
+/*
+** Jumping over a cached result needs random
+** access, and without backtracking a failure
+** may have left the input half consumed, so
+** pipes and predictive parsing bypass the table.
+** Recognising builds no values worth caching.
+*/
+
+static int mpc_input_memo_enabled(mpc_input_t *i) {
+  return i->type != MPC_INPUT_PIPE && i->backtrack > 0 && !i->recognise;
 }
 
-static mpc_val_t *mpcf_input_state_ast(mpc_input_t *i, int n, mpc_val_t **xs) {
-  mpc_state_t *s = ((mpc_state_t**)xs)[0];
-  mpc_ast_t *a = ((mpc_ast_t**)xs)[1];
-  a = mpc_ast_state(a, *s);
-  mpc_free(i, s);
-  (void) n;
-  return a;
+static mpc_memo_t *mpc_input_memo_slot(mpc_input_t *i, mpc_parser_t *p, long pos) {
+  size_t h = ((size_t)p >> 4) * 31 + (size_t)pos * 2654435761u;
+  if (i->memo == NULL) { i->memo = calloc(MPC_INPUT_MEMO_NUM, sizeof(mpc_memo_t)); }
+  return i->memo + (h & (MPC_INPUT_MEMO_NUM-1));
 }
 
-static mpc_val_t *mpc_parse_fold(mpc_input_t *i, mpc_fold_t f, int n, mpc_val_t **xs) {
-  int j;
-  if (f == mpcf_null)      { return mpcf_null(n, xs); }
-  if (f == mpcf_fst)       { return mpcf_fst(n, xs); }
-  if (f == mpcf_snd)       { return mpcf_snd(n, xs); }
-  if (f == mpcf_trd)       { return mpcf_trd(n, xs); }
-  if (f == mpcf_fst_free)  { return mpcf_input_fst_free(i, n, xs); }
-  if (f == mpcf_snd_free)  { return mpcf_input_snd_free(i, n, xs); }
-  if (f == mpcf_trd_free)  { return mpcf_input_trd_free(i, n, xs); }
-  if (f == mpcf_strfold)   { return mpcf_input_strfold(i, n, xs); }
-  if (f == mpcf_state_ast) { return mpcf_input_state_ast(i, n, xs); }
-  for (j = 0; j < n; j++) { xs[j] = mpc_export(i, xs[j]); }
-  return f(j, xs);
+static mpc_val_t *mpc_ast_copy(mpc_val_t *x);
+
+/*
+** Compact and arena tree nodes are never
+** changed once built, so memos share them
+** rather than copying each result in and out.
+** `mpc_parse_input` builds ASTs in an arena of
+** its own for grammars with AST memos, so this
+** holds for plain parses of them too.
+*/
+static int mpc_input_memo_shared(mpc_input_t *i, mpc_parser_t *p) {
+  return (i->tree || i->arena) && p->data.memo.cp == mpc_ast_copy;
 }
 
-static mpc_val_t *mpcf_input_free(mpc_input_t *i, mpc_val_t *x) {
-  mpc_free(i, x);
-  return NULL;
+static void mpc_input_memo_clear(mpc_input_t *i, mpc_memo_t *m) {
+  if (m->p == NULL) { return; }
+  if (m->success) {
+    if (!mpc_input_memo_shared(i, m->p)) { m->p->data.memo.dx(m->result.output); }
+  } else { mpc_err_delete_internal(i, m->result.error); }
+  m->p = NULL;
 }
 
-static mpc_val_t *mpcf_input_str_ast(mpc_input_t *i, mpc_val_t *c) {
-  mpc_ast_t *a = mpc_ast_new("", c);
-  mpc_free(i, c);
-  return a;
-}
-
-static mpc_val_t *mpc_parse_apply(mpc_input_t *i, mpc_apply_t f, mpc_val_t *x) {
-  if (f == mpcf_free)     { return mpcf_input_free(i, x); }
-  if (f == mpcf_str_ast)  { return mpcf_input_str_ast(i, x); }
-  return f(mpc_export(i, x));
+static void mpc_input_memo_store(mpc_input_t *i, mpc_parser_t *p, mpc_state_t s, int x, mpc_result_t *r) {
+  
+  mpc_memo_t *m = mpc_input_memo_slot(i, p, s.pos);
+  
+  mpc_input_memo_clear(i, m);
+  m->p = p;
+  m->pos = s.pos;
+  m->success = x;
+  m->state = i->state;
+  m->last = i->last;
+  if (x) {
+    m->result.output = mpc_input_memo_shared(i, p) ? r->output : p->data.memo.cp(r->output);
+  } else {
+    m->result.error = mpc_err_copy(i, r->error);
+  }
 }
 
-static mpc_val_t *mpc_parse_apply_to(mpc_input_t *i, mpc_apply_to_t f, mpc_val_t *x, mpc_val_t *d) {
-  return f(mpc_export(i, x), d);
+static void mpc_input_memo_delete(mpc_input_t *i) {
+  int j;
+  if (i->memo == NULL) { return; }
+  for (j = 0; j < MPC_INPUT_MEMO_NUM; j++) { mpc_input_memo_clear(i, i->memo + j); }
+  free(i->memo);
 }
 
-static void mpc_parse_dtor(mpc_input_t *i, mpc_dtor_t d, mpc_val_t *x) {
-  if (d == free) { mpc_free(i, x); return; }
-  d(mpc_export(i, x));
-}
+/*
+** Regular Expression DFA
+**
+** Regexes are matched as PEGs: repetition is
+** greedy and alternatives are tried in order.
+** When the Glushkov automaton of the combinator
+** tree is deterministic, no nullable alternative
+** comes before another, and no repeated body is
+** nullable, the PEG match is the longest prefix
+** the automaton accepts, so it can be found by
+** scanning bytes with no backtracking at all.
+**
+** Each state of a deterministic Glushkov
+** automaton is the last position matched, so
+** determinising needs no subset construction.
+** The whole transition table is filled in when
+** the automaton is built, so matching only ever
+** reads it and one regex can be shared freely
+** between threads.
+**
+** Everything else falls back to running the
+** combinator tree.
+*/
 
 enum {
-  MPC_PARSE_STACK_MIN = 4
+  MPC_DFA_POSITIONS_MAX = 64,
+  MPC_DFA_DEAD = -1
 };
 
-#define MPC_SUCCESS(x) r->output = x; return 1
-#define MPC_FAILURE(x) r->error = x; return 0
-#define MPC_PRIMITIVE(x) \
-  if (x) { MPC_SUCCESS(r->output); } \
-  else { MPC_FAILURE(NULL); }
+typedef struct mpc_dfa_t {
+  int n;
+  int w;
+  int stamp;
+  unsigned char *classes;
+  char **expects;
+  unsigned int *follows;
+  int *stamps;
+  char *accepts;
+  signed char *trans;
+  mpc_scan_t **scans;
+} mpc_dfa_t;
 
-static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_err_t **e) {
+static int mpc_dfa_class(mpc_parser_t *p, unsigned char *c) {
   
-  int j = 0, k = 0;
-  mpc_result_t results_stk[MPC_PARSE_STACK_MIN];
-  mpc_result_t *results;
-  int results_slots = MPC_PARSE_STACK_MIN;
+  int j, x;
+  char y;
   
-  switch (p->type) {
-      
-    /* Basic Parsers */
+  if (p->retained) { return 0; }
+  
+  if (p->type == MPC_TYPE_EXPECT) { return mpc_dfa_class(p->data.expect.x, c); }
+  
+  if (p->type == MPC_TYPE_OR) {
+    for (j = 0; j < p->data.or.n; j++) {
+      if (!mpc_dfa_class(p->data.or.xs[j], c)) { return 0; }
+    }
+    return 1;
+  }
+  
+  for (x = 1; x < 256; x++) {
+    
+    y = (char)x;
+    
+    switch (p->type) {
+      case MPC_TYPE_ANY:     break;
+      case MPC_TYPE_SINGLE:  if (y != p->data.single.x) { continue; } break;
+      case MPC_TYPE_RANGE:   if (y < p->data.range.x || y > p->data.range.y) { continue; } break;
+      case MPC_TYPE_ONEOF:   if (!strchr(p->data.string.x, y)) { continue; } break;
+      case MPC_TYPE_NONEOF:  if (strchr(p->data.string.x, y)) { continue; } break;
+      case MPC_TYPE_SATISFY: if (!p->data.satisfy.f(y)) { continue; } break;
+      case MPC_TYPE_CHARSET: if (!mpc_input_charset_has(p->data.charset.x, y)) { continue; } break;
+      default: return 0;
+    }
+    
+    c[x / 8] |= 1 << (x % 8);
+  }
+  
+  return 1;
+}
 
-    case MPC_TYPE_ANY:     MPC_PRIMITIVE(mpc_input_any(i, (char**)&r->output));
-    case MPC_TYPE_SINGLE:  MPC_PRIMITIVE(mpc_input_char(i, p->data.single.x, (char**)&r->output));
-    case MPC_TYPE_RANGE:   MPC_PRIMITIVE(mpc_input_range(i, p->data.range.x, p->data.range.y, (char**)&r->output));
-    case MPC_TYPE_ONEOF:   MPC_PRIMITIVE(mpc_input_oneof(i, p->data.string.x, (char**)&r->output));
-    case MPC_TYPE_NONEOF:  MPC_PRIMITIVE(mpc_input_noneof(i, p->data.string.x, (char**)&r->output));
-    case MPC_TYPE_SATISFY: MPC_PRIMITIVE(mpc_input_satisfy(i, p->data.satisfy.f, (char**)&r->output));
-    case MPC_TYPE_STRING:  MPC_PRIMITIVE(mpc_input_string(i, p->data.string.x, (char**)&r->output));
-    case MPC_TYPE_ANCHOR:  MPC_PRIMITIVE(mpc_input_anchor(i, p->data.anchor.f, (char**)&r->output));
+/*
+** An alternation of characters is only merged
+** into one class under an `expect`, otherwise
+** each branch reports its own expectation.
+*/
+
+static int mpc_dfa_is_position(mpc_parser_t *p) {
+  unsigned char c[32];
+  memset(c, 0, 32);
+  return p->type != MPC_TYPE_OR && mpc_dfa_class(p, c);
+}
+
+static int mpc_dfa_positions(mpc_parser_t *p, int opt) {
+  
+  int j, k, total;
+  
+  if (p->retained) { return -1; }
+  
+  if (mpc_dfa_is_position(p)) { return 1; }
+  
+  switch (p->type) {
     
-    /* Other parsers */
+    case MPC_TYPE_PASS:
+    case MPC_TYPE_LIFT:
+      return 0;
     
-    case MPC_TYPE_UNDEFINED: MPC_FAILURE(mpc_err_fail(i, "Parser Undefined!"));
-    case MPC_TYPE_PASS:      MPC_SUCCESS(NULL);
-    case MPC_TYPE_FAIL:      MPC_FAILURE(mpc_err_fail(i, p->data.fail.m));
-    case MPC_TYPE_LIFT:      MPC_SUCCESS(p->data.lift.lf());
-    case MPC_TYPE_LIFT_VAL:  MPC_SUCCESS(p->data.lift.x);
-    case MPC_TYPE_STATE:     MPC_SUCCESS(mpc_input_state_copy(i));
+    /*
+    ** Errors from a failing `many1` or `count`
+    ** carry a prefix, which a scan cannot
+    ** reproduce when the failure is hidden
+    ** inside an otherwise successful match.
+    */
     
-    /* Application Parsers */
+    case MPC_TYPE_MAYBE: return mpc_dfa_positions(p->data.not.x, 1);
+    case MPC_TYPE_MANY:  return mpc_dfa_positions(p->data.repeat.x, 1);
+    case MPC_TYPE_MANY1: return opt ? -1 : mpc_dfa_positions(p->data.repeat.x, 1);
+    case MPC_TYPE_SPAN:
+      if (p->data.span.esc || (opt && p->data.span.min)) { return -1; }
+      return mpc_dfa_positions(p->data.span.x, 1);
+    case MPC_TYPE_COUNT:
+      k = opt ? -1 : mpc_dfa_positions(p->data.repeat.x, opt);
+      if (k < 0 || (k && p->data.repeat.n > MPC_DFA_POSITIONS_MAX / k)) { return -1; }
+      return k * p->data.repeat.n;
     
-    case MPC_TYPE_APPLY:
-      if (mpc_parse_run(i, p->data.apply.x, r, e)) {
-        MPC_SUCCESS(mpc_parse_apply(i, p->data.apply.f, r->output));
-      } else {
-        MPC_FAILURE(r->output);
+    case MPC_TYPE_OR:
+      total = 0;
+      for (j = 0; j < p->data.or.n; j++) {
+        k = mpc_dfa_positions(p->data.or.xs[j], opt);
+        if (k < 0 || (total += k) > MPC_DFA_POSITIONS_MAX) { return -1; }
       }
+      return total;
     
-    case MPC_TYPE_APPLY_TO:
-      if (mpc_parse_run(i, p->data.apply_to.x, r, e)) {
-        MPC_SUCCESS(mpc_parse_apply_to(i, p->data.apply_to.f, r->output, p->data.apply_to.d));
-      } else {
-        MPC_FAILURE(r->error);
+    case MPC_TYPE_AND:
+      total = 0;
+      for (j = 0; j < p->data.and.n; j++) {
+        k = mpc_dfa_positions(p->data.and.xs[j], opt);
+        if (k < 0 || (total += k) > MPC_DFA_POSITIONS_MAX) { return -1; }
       }
+      return total;
     
-    case MPC_TYPE_EXPECT:
-      mpc_input_suppress_enable(i);
-      if (mpc_parse_run(i, p->data.expect.x, r, e)) {
-        mpc_input_suppress_disable(i);
-        MPC_SUCCESS(r->output);
-      } else {
-        mpc_input_suppress_disable(i);
-        MPC_FAILURE(mpc_err_new(i, p->data.expect.m));
-      }
+    default: return -1;
+  }
+}
+
+/*
+** Follow positions are stamped as they are added.
+** Inner constructs are built first, so sorting by
+** stamp gives the order the tree would try them.
+*/
+
+static void mpc_dfa_follow(mpc_dfa_t *d, unsigned int *from, unsigned int *to) {
+  int j, k;
+  unsigned int *row;
+  for (j = 0; j < d->n; j++) {
+    if (!(from[j / 32] & (1u << (j % 32)))) { continue; }
+    row = d->follows + j * d->w;
+    for (k = 0; k < d->n; k++) {
+      if (!(to[k / 32] & (1u << (k % 32)))) { continue; }
+      if (row[k / 32] & (1u << (k % 32))) { continue; }
+      row[k / 32] |= 1u << (k % 32);
+      d->stamps[j * d->n + k] = ++d->stamp;
+    }
+  }
+}
+
+static int mpc_dfa_glushkov(mpc_dfa_t *d, mpc_parser_t *p, int *pos, unsigned int *first, unsigned int *last);
+
+static int mpc_dfa_glushkov_seq(mpc_dfa_t *d, mpc_parser_t **xs, int n, int *pos, unsigned int *first, unsigned int *last) {
+  
+  int j, k, x, nullable = 1;
+  unsigned int *f = calloc(d->w * 2, sizeof(unsigned int));
+  unsigned int *l = f + d->w;
+  
+  for (j = 0; j < n; j++) {
     
-    case MPC_TYPE_PREDICT:
-      mpc_input_backtrack_disable(i);
-      if (mpc_parse_run(i, p->data.predict.x, r, e)) {      
-        mpc_input_backtrack_enable(i);
-        MPC_SUCCESS(r->output);
-      } else {
-        mpc_input_backtrack_enable(i);
-        MPC_FAILURE(r->error);
-      }
+    memset(f, 0, sizeof(unsigned int) * d->w * 2);
+    x = mpc_dfa_glushkov(d, xs[j], pos, f, l);
+    if (x < 0) { free(f); return -1; }
     
-    /* Optional Parsers */
+    mpc_dfa_follow(d, last, f);
+    for (k = 0; k < d->w; k++) {
+      if (nullable) { first[k] |= f[k]; }
+      last[k] = x ? (last[k] | l[k]) : l[k];
+    }
+    nullable = nullable && x;
+  }
+  
+  free(f);
+  return nullable;
+}
+
+static int mpc_dfa_glushkov(mpc_dfa_t *d, mpc_parser_t *p, int *pos, unsigned int *first, unsigned int *last) {
+  
+  int j, k, x, nullable;
+  unsigned int *f, *l;
+  mpc_parser_t **xs;
+  
+  if (mpc_dfa_is_position(p)) {
+    mpc_dfa_class(p, d->classes + (*pos) * 32);
+    d->expects[*pos] = p->type == MPC_TYPE_EXPECT ? p->data.expect.m : NULL;
+    first[*pos / 32] |= 1u << (*pos % 32);
+    last[*pos / 32]  |= 1u << (*pos % 32);
+    (*pos)++;
+    return 0;
+  }
+  
+  switch (p->type) {
     
-    /* TODO: Update Not Error Message */
+    case MPC_TYPE_PASS:
+    case MPC_TYPE_LIFT:
+      return 1;
     
-    case MPC_TYPE_NOT:
-      mpc_input_mark(i);
-      mpc_input_suppress_enable(i);
-      if (mpc_parse_run(i, p->data.not.x, r, e)) {
-        mpc_input_rewind(i);
-        mpc_input_suppress_disable(i);
-        mpc_parse_dtor(i, p->data.not.dx, r->output);
-        MPC_FAILURE(mpc_err_new(i, "opposite"));
-      } else {
-        mpc_input_unmark(i);
-        mpc_input_suppress_disable(i);
-        MPC_SUCCESS(p->data.not.lf());
-      }
+    case MPC_TYPE_AND:
+      return mpc_dfa_glushkov_seq(d, p->data.and.xs, p->data.and.n, pos, first, last);
     
-    case MPC_TYPE_MAYBE:
-      if (mpc_parse_run(i, p->data.not.x, r, e)) {
-        MPC_SUCCESS(r->output);
-      } else {
-        *e = mpc_err_merge(i, *e, r->error);
-        MPC_SUCCESS(p->data.not.lf());
-      }
+    case MPC_TYPE_COUNT:
+      xs = malloc(sizeof(mpc_parser_t*) * p->data.repeat.n);
+      for (j = 0; j < p->data.repeat.n; j++) { xs[j] = p->data.repeat.x; }
+      x = mpc_dfa_glushkov_seq(d, xs, p->data.repeat.n, pos, first, last);
+      free(xs);
+      return x;
     
-    /* Repeat Parsers */
+    case MPC_TYPE_MAYBE:
+      return mpc_dfa_glushkov(d, p->data.not.x, pos, first, last) < 0 ? -1 : 1;
     
     case MPC_TYPE_MANY:
-      
-      results = results_stk;
-      
-      while (mpc_parse_run(i, p->data.repeat.x, &results[j], e)) {
-        j++;
-        if (j == MPC_PARSE_STACK_MIN) {
-          results_slots = j + j / 2;
-          results = mpc_malloc(i, sizeof(mpc_result_t) * results_slots);
-          memcpy(results, results_stk, sizeof(mpc_result_t) * MPC_PARSE_STACK_MIN);
-        } else if (j >= results_slots) {
-          results_slots = j + j / 2;
-          results = mpc_realloc(i, results, sizeof(mpc_result_t) * results_slots);
-        }
-      }
-      
-      *e = mpc_err_merge(i, *e, results[j].error);
-      MPC_SUCCESS(
-        mpc_parse_fold(i, p->data.repeat.f, j, (mpc_val_t**)results);
-        if (j >= MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
-    
     case MPC_TYPE_MANY1:
-      
-      results = results_stk;
-      
-      while (mpc_parse_run(i, p->data.repeat.x, &results[j], e)) {
-        j++;
-        if (j == MPC_PARSE_STACK_MIN) {
-          results_slots = j + j / 2;
-          results = mpc_malloc(i, sizeof(mpc_result_t) * results_slots);
-          memcpy(results, results_stk, sizeof(mpc_result_t) * MPC_PARSE_STACK_MIN);
-        } else if (j >= results_slots) {
-          results_slots = j + j / 2;
-          results = mpc_realloc(i, results, sizeof(mpc_result_t) * results_slots);
-        }
-      }
-      
-      if (j == 0) {
-        MPC_FAILURE(
-          mpc_err_many1(i, results[j].error);
-          if (j >= MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
-      } else {
-        *e = mpc_err_merge(i, *e, results[j].error);
-        MPC_SUCCESS(
-          mpc_parse_fold(i, p->data.repeat.f, j, (mpc_val_t**)results);
-          if (j >= MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
-      }
+      x = mpc_dfa_glushkov(d, p->data.repeat.x, pos, first, last);
+      if (x != 0) { return -1; }
+      mpc_dfa_follow(d, last, first);
+      return p->type == MPC_TYPE_MANY;
     
-    case MPC_TYPE_COUNT:
-      
-      results = p->data.repeat.n > MPC_PARSE_STACK_MIN
-        ? mpc_malloc(i, sizeof(mpc_result_t) * p->data.repeat.n)
-        : results_stk;
-      
-      while (mpc_parse_run(i, p->data.repeat.x, &results[j], e)) {
-        j++;
-        if (j == p->data.repeat.n) { break; }
-      }
-      
-      if (j == p->data.repeat.n) {
-        MPC_SUCCESS(
-          mpc_parse_fold(i, p->data.repeat.f, j, (mpc_val_t**)results);
-          if (p->data.repeat.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
-      } else {
-        for (k = 0; k < j; k++) {
-          mpc_parse_dtor(i, p->data.repeat.dx, results[k].output);
-        }
-        MPC_FAILURE(
-          mpc_err_count(i, results[j].error, p->data.repeat.n);
-          if (p->data.repeat.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });  
-      }
-      
-    /* Combinatory Parsers */
+    case MPC_TYPE_SPAN:
+      mpc_dfa_glushkov(d, p->data.span.x, pos, first, last);
+      mpc_dfa_follow(d, last, first);
+      return !p->data.span.min;
     
     case MPC_TYPE_OR:
       
-      if (p->data.or.n == 0) { MPC_SUCCESS(NULL); }
-      
-      results = p->data.or.n > MPC_PARSE_STACK_MIN
-        ? mpc_malloc(i, sizeof(mpc_result_t) * p->data.or.n)
-        : results_stk;
+      nullable = 0;
+      f = calloc(d->w * 2, sizeof(unsigned int));
+      l = f + d->w;
       
       for (j = 0; j < p->data.or.n; j++) {
-        if (mpc_parse_run(i, p->data.or.xs[j], &results[j], e)) {
-          MPC_SUCCESS(results[j].output;
-            if (p->data.or.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
-        } else {
-          *e = mpc_err_merge(i, *e, results[j].error);
-        } 
+        memset(f, 0, sizeof(unsigned int) * d->w * 2);
+        x = mpc_dfa_glushkov(d, p->data.or.xs[j], pos, f, l);
+        if (x < 0 || (x && j != p->data.or.n-1)) { free(f); return -1; }
+        for (k = 0; k < d->w; k++) {
+          first[k] |= f[k];
+          last[k]  |= l[k];
+        }
+        nullable = x;
       }
       
-      MPC_FAILURE(NULL;
-        if (p->data.or.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
+      free(f);
+      return nullable;
     
-    case MPC_TYPE_AND:
-      
-      if (p->data.and.n == 0) { MPC_SUCCESS(NULL); }
-      
-      results = p->data.or.n > MPC_PARSE_STACK_MIN
-        ? mpc_malloc(i, sizeof(mpc_result_t) * p->data.or.n)
-        : results_stk;
-      
-      mpc_input_mark(i);
-      for (j = 0; j < p->data.and.n; j++) {
-        if (!mpc_parse_run(i, p->data.and.xs[j], &results[j], e)) {
-          mpc_input_rewind(i);
-          for (k = 0; k < j; k++) {
-            mpc_parse_dtor(i, p->data.and.dxs[k], results[k].output);
-          }
-          MPC_FAILURE(results[j].error;
-            if (p->data.or.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
+    default: return -1;
+  }
+}
+
+static void mpc_dfa_delete(mpc_dfa_t *d) {
+  int j;
+  if (d == NULL) { return; }
+  for (j = 0; j <= d->n; j++) { free(d->scans[j]); }
+  free(d->trans);
+  free(d->scans);
+  free(d->accepts);
+  free(d->follows);
+  free(d->stamps);
+  free(d->expects);
+  free(d->classes);
+  free(d);
+}
+
+static int mpc_dfa_deterministic(mpc_dfa_t *d) {
+  
+  int s, a, b, k;
+  unsigned int *row;
+  
+  for (s = 0; s <= d->n; s++) {
+    row = d->follows + s * d->w;
+    for (a = 0; a < d->n; a++) {
+      if (!(row[a / 32] & (1u << (a % 32)))) { continue; }
+      for (b = a+1; b < d->n; b++) {
+        if (!(row[b / 32] & (1u << (b % 32)))) { continue; }
+        for (k = 0; k < 32; k++) {
+          if (d->classes[a * 32 + k] & d->classes[b * 32 + k]) { return 0; }
         }
       }
-      mpc_input_unmark(i); 
-      MPC_SUCCESS(
-        mpc_parse_fold(i, p->data.and.f, j, (mpc_val_t**)results);
-        if (p->data.or.n > MPC_PARSE_STACK_MIN) { mpc_free(i, results); });
-    
-    /* End */
-    
-    default:
-      
-      MPC_FAILURE(mpc_err_fail(i, "Unknown Parser Type Id!"));
+    }
   }
   
-  return 0;
-  
+  return 1;
 }
 
-#undef MPC_SUCCESS
-#undef MPC_FAILURE
-#undef MPC_PRIMITIVE
-
-int mpc_parse_input(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r) {
-  int x;
-  mpc_err_t *e = mpc_err_fail(i, "Unknown Error");
-  x = mpc_parse_run(i, p, r, &e);
-  if (x) {
-    mpc_err_delete_internal(i, e);
-    r->output = mpc_export(i, r->output);
-  } else {
-    r->error = mpc_err_export(i, mpc_err_merge(i, e, r->error));
+static mpc_dfa_t *mpc_dfa_new(mpc_parser_t *p) {
+  
+  int j, s, c, pos = 0, nullable;
+  mpc_dfa_t *d;
+  signed char *row;
+  unsigned int *last, *follow;
+  
+  d = malloc(sizeof(mpc_dfa_t));
+  d->n = mpc_dfa_positions(p, 0);
+  if (d->n < 0) { free(d); return NULL; }
+  
+  d->w = d->n / 32 + 1;
+  d->stamp = 0;
+  d->classes = calloc(d->n + 1, 32);
+  d->expects = calloc(d->n + 1, sizeof(char*));
+  d->follows = calloc((d->n + 1) * d->w, sizeof(unsigned int));
+  d->stamps = calloc((d->n + 1) * d->n + 1, sizeof(int));
+  d->accepts = calloc(d->n + 1, 1);
+  d->trans = malloc((d->n + 1) * 256);
+  d->scans = calloc(d->n + 1, sizeof(mpc_scan_t*));
+  
+  /* The start state is stored after the positions */
+  last = calloc(d->w, sizeof(unsigned int));
+  nullable = mpc_dfa_glushkov(d, p, &pos, d->follows + d->n * d->w, last);
+  
+  if (nullable < 0 || !mpc_dfa_deterministic(d)) {
+    free(last);
+    mpc_dfa_delete(d);
+    return NULL;
   }
-  return x;
-}
-
-int mpc_parse(const char *filename, const char *string, mpc_parser_t *p, mpc_result_t *r) {
-  int x;
-  mpc_input_t *i = mpc_input_new_string(filename, string);
-  x = mpc_parse_input(i, p, r);
-  mpc_input_delete(i);
-  return x;
-}
-
-int mpc_parse_file(const char *filename, FILE *file, mpc_parser_t *p, mpc_result_t *r) {
-  int x;
-  mpc_input_t *i = mpc_input_new_file(filename, file);
-  x = mpc_parse_input(i, p, r);
-  mpc_input_delete(i);
-  return x;
-}
-
-int mpc_parse_pipe(const char *filename, FILE *pipe, mpc_parser_t *p, mpc_result_t *r) {
-  int x;
-  mpc_input_t *i = mpc_input_new_pipe(filename, pipe);
-  x = mpc_parse_input(i, p, r);
-  mpc_input_delete(i);
-  return x;
-}
-
-int mpc_parse_contents(const char *filename, mpc_parser_t *p, mpc_result_t *r) {
   
-  FILE *f = fopen(filename, "rb");
-  int res;
+  for (j = 0; j < d->n; j++) {
+    d->accepts[j] = (last[j / 32] & (1u << (j % 32))) ? 1 : 0;
+  }
+  d->accepts[d->n] = nullable;
+  
+  /* Deterministic, so each byte leads to at most one of the positions that can follow */
+  for (s = 0; s <= d->n; s++) {
+    row = d->trans + s * 256;
+    follow = d->follows + s * d->w;
+    for (c = 0; c < 256; c++) {
+      row[c] = MPC_DFA_DEAD;
+      for (j = 0; j < d->n; j++) {
+        if ((follow[j / 32] & (1u << (j % 32)))
+        &&  (d->classes[j * 32 + c / 8] & (1 << (c % 8)))) {
+          row[c] = (signed char)j;
+          break;
+        }
+      }
+    }
+  }
   
-  if (f == NULL) {
-    r->output = NULL;
-    r->error = mpc_err_file(filename, "Unable to open file!");
-    return 0;
+  /* A position which can follow itself loops on its whole class, so runs of it are scanned */
+  for (j = 0; j < d->n; j++) {
+    if (d->follows[j * d->w + j / 32] & (1u << (j % 32))) {
+      d->scans[j] = mpc_scan_new(d->classes + j * 32);
+    }
   }
   
-  res = mpc_parse_file(filename, f, p, r);
-  fclose(f);
-  return res;
+  free(last);
+  return d;
+}
+
+static int mpc_dfa_next(const mpc_dfa_t *d, int s, unsigned char c) {
+  return d->trans[s * 256 + c];
 }
 
 /*
-** Building a Parser
+** On success the combinator tree would also have
+** left behind the failures that ended the match.
+** These all sit where the scan stopped and are
+** exactly the positions that could have come next.
 */
 
-static void mpc_undefine_unretained(mpc_parser_t *p, int force);
-
-static void mpc_undefine_or(mpc_parser_t *p) {
+static mpc_err_t *mpc_dfa_err(mpc_input_t *i, mpc_dfa_t *d, int s) {
   
-  int i;
-  for (i = 0; i < p->data.or.n; i++) {
-    mpc_undefine_unretained(p->data.or.xs[i], 0);
+  int j, k, t, num = 0;
+  int order[MPC_DFA_POSITIONS_MAX];
+  int *stamps = d->stamps + s * d->n;
+  unsigned int *follow = d->follows + s * d->w;
+  mpc_err_t *x = NULL;
+  
+  for (j = 0; j < d->n; j++) {
+    if (!(follow[j / 32] & (1u << (j % 32)))) { continue; }
+    if (d->expects[j] == NULL) { continue; }
+    for (k = num++; k > 0 && stamps[order[k-1]] > stamps[j]; k--) { order[k] = order[k-1]; }
+    order[k] = j;
   }
-  free(p->data.or.xs);
   
-}
-
-static void mpc_undefine_and(mpc_parser_t *p) {
-  
-  int i;
-  for (i = 0; i < p->data.and.n; i++) {
-    mpc_undefine_unretained(p->data.and.xs[i], 0);
+  for (j = 0; j < num; j++) {
+    t = order[j];
+    if (x == NULL) { x = mpc_err_new(i, d->expects[t]); continue; }
+    if (!mpc_err_contains_expected(i, x, d->expects[t])) {
+      mpc_err_add_expected(i, x, d->expects[t]);
+    }
   }
-  free(p->data.and.xs);
-  free(p->data.and.dxs);
   
+  return x;
 }
 
-static void mpc_undefine_unretained(mpc_parser_t *p, int force) {
+static int mpc_input_dfa(mpc_input_t *i, mpc_dfa_t *d, mpc_err_t **e) {
   
-  if (p->retained && !force) { return; }
+  int s = d->n, t;
+  long start = i->state.pos;
+  long pos = start;
+  long end = d->accepts[s] ? pos : -1;
+  mpc_state_t state;
+  char last;
   
-  switch (p->type) {
-    
-    case MPC_TYPE_FAIL: free(p->data.fail.m); break;
-    
-    case MPC_TYPE_ONEOF: 
-    case MPC_TYPE_NONEOF:
-    case MPC_TYPE_STRING:
-      free(p->data.string.x); 
-      break;
-    
-    case MPC_TYPE_APPLY:    mpc_undefine_unretained(p->data.apply.x, 0);    break;
-    case MPC_TYPE_APPLY_TO: mpc_undefine_unretained(p->data.apply_to.x, 0); break;
-    case MPC_TYPE_PREDICT:  mpc_undefine_unretained(p->data.predict.x, 0);  break;
-    
-    case MPC_TYPE_MAYBE:
-    case MPC_TYPE_NOT:
-      mpc_undefine_unretained(p->data.not.x, 0);
-      break;
-    
-    case MPC_TYPE_EXPECT:
-      mpc_undefine_unretained(p->data.expect.x, 0);
-      free(p->data.expect.m);
-      break;
-      
-    case MPC_TYPE_MANY:
-    case MPC_TYPE_MANY1:
-    case MPC_TYPE_COUNT:
-      mpc_undefine_unretained(p->data.repeat.x, 0);
-      break;
-    
-    case MPC_TYPE_OR:  mpc_undefine_or(p);  break;
-    case MPC_TYPE_AND: mpc_undefine_and(p); break;
-    
-    default: break;
+  while (i->string[pos] != '\0') {
+    t = mpc_dfa_next(d, s, (unsigned char)i->string[pos]);
+    if (t == MPC_DFA_DEAD) { break; }
+    s = t;
+    pos++;
+    if (d->scans[s] && mpc_input_charset_has(d->scans[s]->set, i->string[pos])) {
+      pos += mpc_scan_run(d->scans[s], i->string + pos, i->length - pos);
+    }
+    if (d->accepts[s]) { end = pos; }
   }
   
-  if (!force) {
-    free(p->name);
-    free(p);
+  if (end < 0) { return 0; }
+  
+  mpc_input_skip(i, end - start);
+  
+  if (!i->suppress) {
+    state = i->state;
+    last = i->last;
+    mpc_input_skip(i, pos - end);
+    *e = mpc_err_merge(i, *e, mpc_dfa_err(i, d, s));
+    i->state = state;
+    i->last = last;
   }
   
+  return 1;
 }
 
-void mpc_delete(mpc_parser_t *p) {
-  if (p->retained) {
+/*
+** Arenas
+**
+** Blocks of memory handed out by bumping a
+** pointer and released all together, for trees
+** whose nodes live and die as one.
+*/
 
-    if (p->type != MPC_TYPE_UNDEFINED) {
-      mpc_undefine_unretained(p, 0);
-    } 
-    
-    free(p->name);
-    free(p);
-  
-  } else {
-    mpc_undefine_unretained(p, 0);  
-  }
-}
+enum {
+  MPC_ARENA_BLOCK = 65536
+};
 
-static void mpc_soft_delete(mpc_val_t *x) {
-  mpc_undefine_unretained(x, 0);
-}
+typedef struct mpc_arena_block_t {
+  struct mpc_arena_block_t *next;
+  size_t used;
+  size_t size;
+} mpc_arena_block_t;
 
-static mpc_parser_t *mpc_undefined(void) {
-  mpc_parser_t *p = calloc(1, sizeof(mpc_parser_t));
-  p->retained = 0;
-  p->type = MPC_TYPE_UNDEFINED;
-  p->name = NULL;
-  return p;
-}
+struct mpc_arena_t {
+  mpc_arena_block_t *blocks;
+};
 
-mpc_parser_t *mpc_new(const char *name) {
-  mpc_parser_t *p = mpc_undefined();
-  p->retained = 1;
-  p->name = realloc(p->name, strlen(name) + 1);
-  strcpy(p->name, name);
-  return p;
+mpc_arena_t *mpc_arena_new(void) {
+  mpc_arena_t *a = malloc(sizeof(mpc_arena_t));
+  a->blocks = NULL;
+  return a;
 }
 
-mpc_parser_t *mpc_undefine(mpc_parser_t *p) {
-  mpc_undefine_unretained(p, 1);
-  p->type = MPC_TYPE_UNDEFINED;
-  return p;
+/* Frees everything but the newest block, which is kept for the next parse */
+void mpc_arena_clear(mpc_arena_t *a) {
+  mpc_arena_block_t *k;
+  if (a->blocks == NULL) { return; }
+  while (a->blocks->next) {
+    k = a->blocks->next;
+    a->blocks->next = k->next;
+    free(k);
+  }
+  a->blocks->used = 0;
 }
 
-mpc_parser_t *mpc_define(mpc_parser_t *p, mpc_parser_t *a) {
-  
-  if (p->retained) {
-    p->type = a->type;
-    p->data = a->data;
-  } else {
-    mpc_parser_t *a2 = mpc_failf("Attempt to assign to Unretained Parser!");
-    p->type = a2->type;
-    p->data = a2->data;
-    free(a2);
+static void mpc_arena_free(mpc_arena_t *a) {
+  mpc_arena_block_t *k;
+  while (a->blocks) {
+    k = a->blocks->next;
+    free(a->blocks);
+    a->blocks = k;
   }
-  
-  free(a);
-  return p;  
 }
 
-void mpc_cleanup(int n, ...) {
-  int i;
-  mpc_parser_t **list = malloc(sizeof(mpc_parser_t*) * n);
-  
-  va_list va;
-  va_start(va, n);
-  for (i = 0; i < n; i++) { list[i] = va_arg(va, mpc_parser_t*); }
-  for (i = 0; i < n; i++) { mpc_undefine(list[i]); }
-  for (i = 0; i < n; i++) { mpc_delete(list[i]); }  
-  va_end(va);  
+void mpc_arena_delete(mpc_arena_t *a) {
+  mpc_arena_free(a);
+  free(a);
+}
 
-  free(list);
+static void *mpc_arena_alloc(mpc_arena_t *a, size_t n) {
+  mpc_arena_block_t *k = a->blocks;
+  n = (n + sizeof(void*) - 1) / sizeof(void*) * sizeof(void*);
+  if (k == NULL || k->used + n > k->size) {
+    k = malloc(sizeof(mpc_arena_block_t) + (n > MPC_ARENA_BLOCK ? n : MPC_ARENA_BLOCK));
+    k->next = a->blocks;
+    k->used = 0;
+    k->size = n > MPC_ARENA_BLOCK ? n : MPC_ARENA_BLOCK;
+    a->blocks = k;
+  }
+  k->used += n;
+  return (char*)(k + 1) + k->used - n;
 }
 
-mpc_parser_t *mpc_pass(void) {
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_PASS;
-  return p;
+static int mpc_arena_has(mpc_arena_t *a, void *x) {
+  mpc_arena_block_t *k;
+  for (k = a->blocks; k; k = k->next) {
+    if ((char*)x >= (char*)(k + 1) && (char*)x < (char*)(k + 1) + k->used) { return 1; }
+  }
+  return 0;
 }
 
-mpc_parser_t *mpc_fail(const char *m) {
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_FAIL;
-  p->data.fail.m = malloc(strlen(m) + 1);
-  strcpy(p->data.fail.m, m);
-  return p;
+static char *mpc_arena_strdup(mpc_arena_t *a, const char *s) {
+  char *c = mpc_arena_alloc(a, strlen(s) + 1);
+  strcpy(c, s);
+  return c;
 }
 
 /*
-** As `snprintf` is not ANSI standard this 
-** function `mpc_failf` should be considered
-** unsafe.
-**
-** You have a few options if this is going to be
-** trouble.
-**
-** - Ensure the format string does not exceed
-**   the buffer length using precision specifiers
-**   such as `%.512s`.
-**
-** - Patch this function in your code base to 
-**   use `snprintf` or whatever variant your
-**   system supports.
-**
-** - Avoid it altogether.
+** Compact Trees
 **
+** When parsing into an `mpc_tree_t` the AST
+** functions are swapped for versions which build
+** nodes in blocks owned by the input. Nodes are
+** never changed once built, as packrat memos may
+** share them, so tagging a node copies it, and
+** nothing is freed until the whole lot goes at
+** once. Tags are interned through the table of
+** the grammar being parsed, which is only read.
 */
 
-mpc_parser_t *mpc_failf(const char *fmt, ...) {
-  
-  va_list va;
-  char *buffer;
+enum {
+  MPC_TREE_TEXT_MIN = 256,
+  MPC_TAGS_SLOTS_MIN = 32
+};
 
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_FAIL;
-  
-  va_start(va, fmt);
-  buffer = malloc(2048);
-  vsprintf(buffer, fmt, va);
-  va_end(va);
-  
-  buffer = realloc(buffer, strlen(buffer) + 1);
-  p->data.fail.m = buffer;
-  return p;
+enum {
+  MPC_TAGS_NONE = 0,
+  MPC_TAGS_ROOT = 1
+};
 
-}
+struct mpc_tags_t {
+  int num;
+  char **names;
+  int slots;
+  int keys_num;
+  const char **keys;
+  int *ids;
+};
 
-mpc_parser_t *mpc_lift_val(mpc_val_t *x) {
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_LIFT_VAL;
-  p->data.lift.x = x;
-  return p;
-}
+typedef struct mpc_tree_tags_t {
+  int tag;
+  struct mpc_tree_tags_t *next;
+} mpc_tree_tags_t;
 
-mpc_parser_t *mpc_lift(mpc_ctor_t lf) {
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_LIFT;
-  p->data.lift.lf = lf;
-  return p;
+typedef struct mpc_tree_node_t {
+  mpc_tree_tags_t *tags;
+  long contents;
+  long contents_len;
+  mpc_state_t state;
+  int children_num;
+  struct mpc_tree_node_t **children;
+} mpc_tree_node_t;
+
+typedef struct mpc_tree_build_t {
+  const mpc_tags_t *names;
+  mpc_arena_t arena;
+  mpc_tree_tags_t none;
+  mpc_tree_tags_t root;
+  char *text;
+  long text_num;
+  long text_slots;
+} mpc_tree_build_t;
+
+static int mpc_tags_hash(const mpc_tags_t *t, const char *key) {
+  return (int)(((unsigned long)(size_t)key >> 3) * 2654435761u) & (t->slots - 1);
+}
+
+/* Tags are looked up by the address they were given, then by name, then left blank */
+static int mpc_tags_id(const mpc_tags_t *t, const char *key) {
+  int j = mpc_tags_hash(t, key);
+  while (t->keys[j]) {
+    if (t->keys[j] == key) { return t->ids[j]; }
+    j = (j + 1) & (t->slots - 1);
+  }
+  j = mpc_tags_find(t, key);
+  return j < 0 ? MPC_TAGS_NONE : j;
 }
 
-mpc_parser_t *mpc_anchor(int(*f)(char,char)) {
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_ANCHOR;
-  p->data.anchor.f = f;
-  return mpc_expect(p, "anchor");
+static mpc_tree_build_t *mpc_tree_build_new(const mpc_tags_t *t) {
+  mpc_tree_build_t *b = malloc(sizeof(mpc_tree_build_t));
+  b->names = t;
+  b->arena.blocks = NULL;
+  b->none.tag = MPC_TAGS_NONE;
+  b->none.next = NULL;
+  b->root.tag = MPC_TAGS_ROOT;
+  b->root.next = NULL;
+  b->text_slots = MPC_TREE_TEXT_MIN;
+  b->text = malloc(b->text_slots);
+  b->text[0] = '\0';
+  b->text_num = 1;
+  return b;
 }
 
-mpc_parser_t *mpc_state(void) {
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_STATE;
-  return p;
+static void mpc_tree_build_delete(mpc_tree_build_t *b) {
+  if (b == NULL) { return; }
+  mpc_arena_free(&b->arena);
+  free(b->text);
+  free(b);
 }
 
-mpc_parser_t *mpc_expect(mpc_parser_t *a, const char *expected) {
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_EXPECT;
-  p->data.expect.x = a;
-  p->data.expect.m = malloc(strlen(expected) + 1);
-  strcpy(p->data.expect.m, expected);
-  return p;
+static void *mpc_tree_alloc(mpc_tree_build_t *b, size_t n) {
+  return mpc_arena_alloc(&b->arena, n);
 }
 
-/*
-** As `snprintf` is not ANSI standard this 
-** function `mpc_expectf` should be considered
-** unsafe.
-**
-** You have a few options if this is going to be
-** trouble.
-**
-** - Ensure the format string does not exceed
-**   the buffer length using precision specifiers
-**   such as `%.512s`.
-**
-** - Patch this function in your code base to 
-**   use `snprintf` or whatever variant your
-**   system supports.
-**
-** - Avoid it altogether.
-**
-*/
-
-mpc_parser_t *mpc_expectf(mpc_parser_t *a, const char *fmt, ...) {
-  va_list va;
-  char *buffer;
+static mpc_tree_node_t *mpc_tree_node(mpc_tree_build_t *b, mpc_tree_tags_t *tags) {
+  mpc_tree_node_t *a = mpc_tree_alloc(b, sizeof(mpc_tree_node_t));
+  a->tags = tags;
+  a->contents = 0;
+  a->contents_len = 0;
+  a->state = mpc_state_new();
+  a->children_num = 0;
+  a->children = NULL;
+  return a;
+}
 
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_EXPECT;
-  
-  va_start(va, fmt);
-  buffer = malloc(2048);
-  vsprintf(buffer, fmt, va);
-  va_end(va);
-  
-  buffer = realloc(buffer, strlen(buffer) + 1);
-  p->data.expect.x = a;
-  p->data.expect.m = buffer;
-  return p;
+static mpc_tree_node_t *mpc_tree_copy(mpc_tree_build_t *b, mpc_tree_node_t *a) {
+  mpc_tree_node_t *c = mpc_tree_alloc(b, sizeof(mpc_tree_node_t));
+  *c = *a;
+  return c;
 }
 
-/*
-** Basic Parsers
-*/
+static mpc_tree_tags_t *mpc_tree_tags(mpc_tree_build_t *b, const char *t, mpc_tree_tags_t *next) {
+  mpc_tree_tags_t *x = mpc_tree_alloc(b, sizeof(mpc_tree_tags_t));
+  x->tag = mpc_tags_id(b->names, t);
+  x->next = next;
+  return x;
+}
 
-mpc_parser_t *mpc_any(void) {
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_ANY;
-  return mpc_expect(p, "any character");
+static mpc_val_t *mpcf_tree_str(mpc_input_t *i, mpc_val_t *c) {
+  mpc_tree_build_t *b = i->tree;
+  mpc_tree_node_t *a = mpc_tree_node(b, &b->none);
+  long n = (long)strlen(c);
+  if (b->text_num + n + 1 > b->text_slots) {
+    while (b->text_num + n + 1 > b->text_slots) { b->text_slots *= 2; }
+    b->text = realloc(b->text, b->text_slots);
+  }
+  memcpy(b->text + b->text_num, c, n + 1);
+  a->contents = b->text_num;
+  a->contents_len = n;
+  b->text_num += n + 1;
+  mpc_free(i, c);
+  return a;
 }
 
-mpc_parser_t *mpc_char(char c) {
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_SINGLE;
-  p->data.single.x = c;
-  return mpc_expectf(p, "'%c'", c);
+static mpc_val_t *mpcf_tree_fold(mpc_input_t *i, int n, mpc_val_t **xs) {
+  
+  int j, k, m = 0;
+  mpc_tree_node_t **as = (mpc_tree_node_t**)xs;
+  mpc_tree_node_t *r;
+  
+  if (n == 0) { return NULL; }
+  if (n == 1) { return xs[0]; }
+  if (n == 2 && xs[1] == NULL) { return xs[0]; }
+  if (n == 2 && xs[0] == NULL) { return xs[1]; }
+  
+  for (j = 0; j < n; j++) {
+    if (as[j]) { m += as[j]->children_num ? as[j]->children_num : 1; }
+  }
+  
+  r = mpc_tree_node(i->tree, &i->tree->root);
+  r->children = m ? mpc_tree_alloc(i->tree, sizeof(mpc_tree_node_t*) * m) : NULL;
+  
+  for (j = 0; j < n; j++) {
+    if (as[j] == NULL) { continue; }
+    if (as[j]->children_num == 0) { r->children[r->children_num++] = as[j]; continue; }
+    for (k = 0; k < as[j]->children_num; k++) {
+      r->children[r->children_num++] = as[j]->children[k];
+    }
+  }
+  
+  if (r->children_num) { r->state = r->children[0]->state; }
+  
+  return r;
 }
 
-mpc_parser_t *mpc_range(char s, char e) {
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_RANGE;
-  p->data.range.x = s;
-  p->data.range.y = e;
-  return mpc_expectf(p, "character between '%c' and '%c'", s, e);
+static mpc_val_t *mpcf_tree_state(mpc_input_t *i, int n, mpc_val_t **xs) {
+  mpc_state_t *s = ((mpc_state_t**)xs)[0];
+  mpc_tree_node_t *a = ((mpc_tree_node_t**)xs)[1];
+  (void) n;
+  if (a) {
+    a = mpc_tree_copy(i->tree, a);
+    a->state = *s;
+  }
+  mpc_free(i, s);
+  return a;
 }
 
-mpc_parser_t *mpc_oneof(const char *s) {
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_ONEOF;
-  p->data.string.x = malloc(strlen(s) + 1);
-  strcpy(p->data.string.x, s);
-  return mpc_expectf(p, "one of '%s'", s);
+static mpc_val_t *mpcf_tree_root(mpc_input_t *i, mpc_val_t *x) {
+  mpc_tree_node_t *a = x, *r;
+  if (a == NULL || a->children_num <= 1) { return a; }
+  r = mpc_tree_node(i->tree, &i->tree->root);
+  r->children = mpc_tree_alloc(i->tree, sizeof(mpc_tree_node_t*));
+  r->children[0] = a;
+  r->children_num = 1;
+  return r;
 }
 
-mpc_parser_t *mpc_noneof(const char *s) {
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_NONEOF;
-  p->data.string.x = malloc(strlen(s) + 1);
-  strcpy(p->data.string.x, s);
-  return mpc_expectf(p, "none of '%s'", s);
-
+static mpc_val_t *mpcf_tree_tag(mpc_input_t *i, mpc_val_t *x, const char *t, int add) {
+  mpc_tree_node_t *a = x;
+  if (a == NULL) { return a; }
+  a = mpc_tree_copy(i->tree, a);
+  a->tags = mpc_tree_tags(i->tree, t, add ? a->tags : NULL);
+  return a;
 }
 
-mpc_parser_t *mpc_satisfy(int(*f)(char)) {
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_SATISFY;
-  p->data.satisfy.f = f;
-  return mpc_expectf(p, "character satisfying function %p", f);
+/*
+** Arena ASTs
+**
+** The same scheme for ordinary `mpc_ast_t` nodes
+** placed in an arena given by the caller.
+*/
+
+static mpc_ast_t *mpc_arena_ast(mpc_arena_t *a, char *tag, char *contents) {
+  mpc_ast_t *x = mpc_arena_alloc(a, sizeof(mpc_ast_t));
+  x->tag = tag;
+  x->contents = contents;
+  x->state = mpc_state_new();
+  x->children_num = 0;
+  x->children = NULL;
+  return x;
 }
 
-mpc_parser_t *mpc_string(const char *s) {
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_STRING;
-  p->data.string.x = malloc(strlen(s) + 1);
-  strcpy(p->data.string.x, s);
-  return mpc_expectf(p, "\"%s\"", s);
+static mpc_ast_t *mpc_arena_ast_copy(mpc_arena_t *a, mpc_ast_t *x) {
+  mpc_ast_t *c = mpc_arena_alloc(a, sizeof(mpc_ast_t));
+  *c = *x;
+  return c;
 }
 
-/*
-** Core Parsers
-*/
+static mpc_val_t *mpcf_arena_str(mpc_input_t *i, mpc_val_t *c) {
+  mpc_ast_t *a = mpc_arena_ast(i->arena, mpc_arena_strdup(i->arena, ""), mpc_arena_strdup(i->arena, c));
+  mpc_free(i, c);
+  return a;
+}
 
-mpc_parser_t *mpc_apply(mpc_parser_t *a, mpc_apply_t f) {
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_APPLY;
-  p->data.apply.x = a;
-  p->data.apply.f = f;
-  return p;
+static mpc_val_t *mpcf_arena_fold(mpc_input_t *i, int n, mpc_val_t **xs) {
+  
+  int j, k, m = 0;
+  mpc_ast_t **as = (mpc_ast_t**)xs;
+  mpc_ast_t *r;
+  
+  if (n == 0) { return NULL; }
+  if (n == 1) { return xs[0]; }
+  if (n == 2 && xs[1] == NULL) { return xs[0]; }
+  if (n == 2 && xs[0] == NULL) { return xs[1]; }
+  
+  for (j = 0; j < n; j++) {
+    if (as[j]) { m += as[j]->children_num ? as[j]->children_num : 1; }
+  }
+  
+  r = mpc_arena_ast(i->arena, mpc_arena_strdup(i->arena, ">"), mpc_arena_strdup(i->arena, ""));
+  r->children = m ? mpc_arena_alloc(i->arena, sizeof(mpc_ast_t*) * m) : NULL;
+  
+  for (j = 0; j < n; j++) {
+    if (as[j] == NULL) { continue; }
+    if (as[j]->children_num == 0) { r->children[r->children_num++] = as[j]; continue; }
+    for (k = 0; k < as[j]->children_num; k++) {
+      r->children[r->children_num++] = as[j]->children[k];
+    }
+  }
+  
+  if (r->children_num) { r->state = r->children[0]->state; }
+  
+  return r;
 }
 
-mpc_parser_t *mpc_apply_to(mpc_parser_t *a, mpc_apply_to_t f, void *x) {
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_APPLY_TO;
-  p->data.apply_to.x = a;
-  p->data.apply_to.f = f;
-  p->data.apply_to.d = x;
-  return p;
+static mpc_val_t *mpcf_arena_state(mpc_input_t *i, int n, mpc_val_t **xs) {
+  mpc_state_t *s = ((mpc_state_t**)xs)[0];
+  mpc_ast_t *a = ((mpc_ast_t**)xs)[1];
+  (void) n;
+  if (a) {
+    a = mpc_arena_ast_copy(i->arena, a);
+    a->state = *s;
+  }
+  mpc_free(i, s);
+  return a;
 }
 
-mpc_parser_t *mpc_predictive(mpc_parser_t *a) {
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_PREDICT;
-  p->data.predict.x = a;
-  return p;
+static mpc_val_t *mpcf_arena_root(mpc_input_t *i, mpc_val_t *x) {
+  mpc_ast_t *a = x, *r;
+  if (a == NULL || a->children_num <= 1) { return a; }
+  r = mpc_arena_ast(i->arena, mpc_arena_strdup(i->arena, ">"), mpc_arena_strdup(i->arena, ""));
+  r->children = mpc_arena_alloc(i->arena, sizeof(mpc_ast_t*));
+  r->children[0] = a;
+  r->children_num = 1;
+  return r;
 }
 
-mpc_parser_t *mpc_not_lift(mpc_parser_t *a, mpc_dtor_t da, mpc_ctor_t lf) {
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_NOT;
-  p->data.not.x = a;
-  p->data.not.dx = da;
-  p->data.not.lf = lf;
-  return p;
+static mpc_val_t *mpcf_arena_tag(mpc_input_t *i, mpc_val_t *x, const char *t, int add) {
+  mpc_ast_t *a = x;
+  size_t n = strlen(t);
+  if (a == NULL) { return a; }
+  a = mpc_arena_ast_copy(i->arena, a);
+  a->tag = mpc_arena_alloc(i->arena, n + 1 + (add ? strlen(((mpc_ast_t*)x)->tag) + 1 : 0));
+  strcpy(a->tag, t);
+  if (add) {
+    a->tag[n] = '|';
+    strcpy(a->tag + n + 1, ((mpc_ast_t*)x)->tag);
+  }
+  return a;
 }
 
-mpc_parser_t *mpc_not(mpc_parser_t *a, mpc_dtor_t da) {
-  return mpc_not_lift(a, da, mpcf_ctor_null);
+static mpc_val_t *mpcf_input_nth_free(mpc_input_t *i, int n, mpc_val_t **xs, int x) {
+  int j;
+  for (j = 0; j < n; j++) { if (j != x) { mpc_free(i, xs[j]); } }
+  return xs[x];
 }
+ 
+static mpc_val_t *mpcf_input_fst_free(mpc_input_t *i, int n, mpc_val_t **xs) { return mpcf_input_nth_free(i, n, xs, 0); }
+static mpc_val_t *mpcf_input_snd_free(mpc_input_t *i, int n, mpc_val_t **xs) { return mpcf_input_nth_free(i, n, xs, 1); }
+static mpc_val_t *mpcf_input_trd_free(mpc_input_t *i, int n, mpc_val_t **xs) { return mpcf_input_nth_free(i, n, xs, 2); }
 
-mpc_parser_t *mpc_maybe_lift(mpc_parser_t *a, mpc_ctor_t lf) {
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_MAYBE;
-  p->data.not.x = a;
-  p->data.not.lf = lf;
-  return p;
+static mpc_val_t *mpcf_input_strfold(mpc_input_t *i, int n, mpc_val_t **xs) {
+  int j;
+  size_t l = 0;
+  if (n == 0) { return mpc_calloc(i, 1, 1); }
+  for (j = 0; j < n; j++) { l += strlen(xs[j]); }
+  xs[0] = mpc_realloc(i, xs[0], l + 1);
+  l = strlen(xs[0]);
+  for (j = 1; j < n; j++) {
+    size_t k = strlen(xs[j]);
+    memcpy((char*)xs[0] + l, xs[j], k + 1); mpc_free(i, xs[j]);
+    l += k;
+  }
+  return xs[0];
 }
 
-mpc_parser_t *mpc_maybe(mpc_parser_t *a) {
-  return mpc_maybe_lift(a, mpcf_ctor_null);
+static mpc_val_t *mpcf_input_state_ast(mpc_input_t *i, int n, mpc_val_t **xs) {
+  mpc_state_t *s = ((mpc_state_t**)xs)[0];
+  mpc_ast_t *a = ((mpc_ast_t**)xs)[1];
+  a = mpc_ast_state(a, *s);
+  mpc_free(i, s);
+  (void) n;
+  return a;
 }
 
-mpc_parser_t *mpc_many(mpc_fold_t f, mpc_parser_t *a) {
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_MANY;
-  p->data.repeat.x = a;
-  p->data.repeat.f = f;
-  return p;
+static mpc_val_t *mpc_parse_fold(mpc_input_t *i, mpc_fold_t f, int n, mpc_val_t **xs) {
+  int j;
+  if (i->recognise)        { return NULL; }
+  if (i->tree && f == mpcf_fold_ast)  { return mpcf_tree_fold(i, n, xs); }
+  if (i->tree && f == mpcf_state_ast) { return mpcf_tree_state(i, n, xs); }
+  if (i->arena && f == mpcf_fold_ast)  { return mpcf_arena_fold(i, n, xs); }
+  if (i->arena && f == mpcf_state_ast) { return mpcf_arena_state(i, n, xs); }
+  if (f == mpcf_null)      { return mpcf_null(n, xs); }
+  if (f == mpcf_fst)       { return mpcf_fst(n, xs); }
+  if (f == mpcf_snd)       { return mpcf_snd(n, xs); }
+  if (f == mpcf_trd)       { return mpcf_trd(n, xs); }
+  if (f == mpcf_fst_free)  { return mpcf_input_fst_free(i, n, xs); }
+  if (f == mpcf_snd_free)  { return mpcf_input_snd_free(i, n, xs); }
+  if (f == mpcf_trd_free)  { return mpcf_input_trd_free(i, n, xs); }
+  if (f == mpcf_strfold)   { return mpcf_input_strfold(i, n, xs); }
+  if (f == mpcf_state_ast) { return mpcf_input_state_ast(i, n, xs); }
+  for (j = 0; j < n; j++) { xs[j] = mpc_export(i, xs[j]); }
+  return f(j, xs);
 }
 
-mpc_parser_t *mpc_many1(mpc_fold_t f, mpc_parser_t *a) {
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_MANY1;
-  p->data.repeat.x = a;
-  p->data.repeat.f = f;
-  return p;
+static mpc_val_t *mpcf_input_free(mpc_input_t *i, mpc_val_t *x) {
+  mpc_free(i, x);
+  return NULL;
 }
 
-mpc_parser_t *mpc_count(int n, mpc_fold_t f, mpc_parser_t *a, mpc_dtor_t da) {
-  mpc_parser_t *p = mpc_undefined();
-  p->type = MPC_TYPE_COUNT;
-  p->data.repeat.n = n;
-  p->data.repeat.f = f;
-  p->data.repeat.x = a;
-  p->data.repeat.dx = da;
-  return p;
+static mpc_val_t *mpcf_input_str_ast(mpc_input_t *i, mpc_val_t *c) {
+  mpc_ast_t *a = mpc_ast_new("", c);
+  mpc_free(i, c);
+  return a;
 }
 
-mpc_parser_t *mpc_or(int n, ...) {
+static mpc_val_t *mpc_parse_apply(mpc_input_t *i, mpc_apply_t f, mpc_val_t *x) {
+  if (i->recognise)       { return NULL; }
+  if (i->tree && f == mpcf_str_ast) { return mpcf_tree_str(i, x); }
+  if (i->tree && f == (mpc_apply_t)mpc_ast_add_root) { return mpcf_tree_root(i, x); }
+  if (i->arena && f == mpcf_str_ast) { return mpcf_arena_str(i, x); }
+  if (i->arena && f == (mpc_apply_t)mpc_ast_add_root) { return mpcf_arena_root(i, x); }
+  if (f == mpcf_free)     { return mpcf_input_free(i, x); }
+  if (f == mpcf_str_ast)  { return mpcf_input_str_ast(i, x); }
+  return f(mpc_export(i, x));
+}
 
-  int i;
-  va_list va;
+static mpc_val_t *mpc_parse_apply_to(mpc_input_t *i, mpc_apply_to_t f, mpc_val_t *x, mpc_val_t *d) {
+  if (i->recognise) { return NULL; }
+  if (i->tree && f == (mpc_apply_to_t)mpc_ast_tag)     { return mpcf_tree_tag(i, x, d, 0); }
+  if (i->tree && f == (mpc_apply_to_t)mpc_ast_add_tag) { return mpcf_tree_tag(i, x, d, 1); }
+  if (i->arena && f == (mpc_apply_to_t)mpc_ast_tag)     { return mpcf_arena_tag(i, x, d, 0); }
+  if (i->arena && f == (mpc_apply_to_t)mpc_ast_add_tag) { return mpcf_arena_tag(i, x, d, 1); }
+  return f(mpc_export(i, x), d);
+}
 
-  mpc_parser_t *p = mpc_undefined();
-  
-  p->type = MPC_TYPE_OR;
-  p->data.or.n = n;
-  p->data.or.xs = malloc(sizeof(mpc_parser_t*) * n);
-  
-  va_start(va, n);  
-  for (i = 0; i < n; i++) {
-    p->data.or.xs[i] = va_arg(va, mpc_parser_t*);
-  }
-  va_end(va);
-  
-  return p;
+static void mpc_parse_dtor(mpc_input_t *i, mpc_dtor_t d, mpc_val_t *x) {
+  if (i->recognise) { return; }
+  if (d == free) { mpc_free(i, x); return; }
+  if ((i->tree || i->arena) && d == (mpc_dtor_t)mpc_ast_delete) { return; }
+  d(mpc_export(i, x));
 }
 
-mpc_parser_t *mpc_and(int n, mpc_fold_t f, ...) {
+/*
+** A `span` is a `many` or `many1` of a single
+** character class, or of an escape sequence tried
+** before a class which contains the escape
+** character. The original class, escape and `or`
+** parsers are kept so that a `span` reports the
+** same errors as the repetition it replaced.
+*/
 
-  int i;
-  va_list va;
+static mpc_parser_t *mpc_span_class(mpc_parser_t *p) {
+  return p->data.span.esc ? p->data.span.x->data.or.xs[1] : p->data.span.x;
+}
 
-  mpc_parser_t *p = mpc_undefined();
-  
-  p->type = MPC_TYPE_AND;
-  p->data.and.n = n;
-  p->data.and.f = f;
-  p->data.and.xs = malloc(sizeof(mpc_parser_t*) * n);
-  p->data.and.dxs = malloc(sizeof(mpc_dtor_t) * (n-1));
+static mpc_parser_t *mpc_span_escape(mpc_parser_t *p, int j) {
+  return p->data.span.x->data.or.xs[0]->data.and.xs[j];
+}
 
-  va_start(va, f);  
-  for (i = 0; i < n; i++) {
-    p->data.and.xs[i] = va_arg(va, mpc_parser_t*);
-  }
-  for (i = 0; i < (n-1); i++) {
-    p->data.and.dxs[i] = va_arg(va, mpc_dtor_t);
-  }  
-  va_end(va);
-  
-  return p;
+static unsigned char *mpc_span_charset(mpc_parser_t *p) {
+  mpc_parser_t *x = mpc_span_class(p);
+  return x->type == MPC_TYPE_EXPECT ? x->data.expect.x->data.charset.x : x->data.charset.x;
+}
+
+static mpc_err_t *mpc_span_err(mpc_input_t *i, mpc_parser_t *x) {
+  return x->type == MPC_TYPE_EXPECT ? mpc_err_new(i, x->data.expect.m) : NULL;
 }
 
+static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_err_t **e);
+
 /*
-** Common Parsers
+** Escaped spans are only scanned over strings,
+** where an escape at the very end can be stepped
+** back over. Other input runs the repetition.
+** Either way `err` is set to the error of the
+** attempt which stopped it, as a `many` would
+** have it.
 */
 
-static int mpc_soi_anchor(char prev, char next) { (void) next; return (prev == '\0'); }
-static int mpc_eoi_anchor(char prev, char next) { (void) prev; return (next == '\0'); }
-
-mpc_parser_t *mpc_soi(void) { return mpc_expect(mpc_anchor(mpc_soi_anchor), "start of input"); }
-mpc_parser_t *mpc_eoi(void) { return mpc_expect(mpc_anchor(mpc_eoi_anchor), "end of input"); }
-
-static int mpc_boundary_anchor(char prev, char next) {
-  const char* word = "abcdefghijklmnopqrstuvwxyz"
-                     "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
-                     "0123456789_";
-  if ( strchr(word, next) &&  prev == '\0') { return 1; }
-  if ( strchr(word, prev) &&  next == '\0') { return 1; }
-  if ( strchr(word, next) && !strchr(word, prev)) { return 1; }
-  if (!strchr(word, next) &&  strchr(word, prev)) { return 1; }
-  return 0;
-}
-
-mpc_parser_t *mpc_boundary(void) { return mpc_expect(mpc_anchor(mpc_boundary_anchor), "boundary"); }
-
-mpc_parser_t *mpc_whitespace(void) { return mpc_expect(mpc_oneof(" \f\n\r\t\v"), "whitespace"); }
-mpc_parser_t *mpc_whitespaces(void) { return mpc_expect(mpc_many(mpcf_strfold, mpc_whitespace()), "spaces"); }
-mpc_parser_t *mpc_blank(void) { return mpc_expect(mpc_apply(mpc_whitespaces(), mpcf_free), "whitespace"); }
-
-mpc_parser_t *mpc_newline(void) { return mpc_expect(mpc_char('\n'), "newline"); }
-mpc_parser_t *mpc_tab(void) { return mpc_expect(mpc_char('\t'), "tab"); }
-mpc_parser_t *mpc_escape(void) { return mpc_and(2, mpcf_strfold, mpc_char('\\'), mpc_any(), free); }
-
-mpc_parser_t *mpc_digit(void) { return mpc_expect(mpc_oneof("0123456789"), "digit"); }
-mpc_parser_t *mpc_hexdigit(void) { return mpc_expect(mpc_oneof("0123456789ABCDEFabcdef"), "hex digit"); }
-mpc_parser_t *mpc_octdigit(void) { return mpc_expect(mpc_oneof("01234567"), "oct digit"); }
-mpc_parser_t *mpc_digits(void) { return mpc_expect(mpc_many1(mpcf_strfold, mpc_digit()), "digits"); }
-mpc_parser_t *mpc_hexdigits(void) { return mpc_expect(mpc_many1(mpcf_strfold, mpc_hexdigit()), "hex digits"); }
-mpc_parser_t *mpc_octdigits(void) { return mpc_expect(mpc_many1(mpcf_strfold, mpc_octdigit()), "oct digits"); }
-
-mpc_parser_t *mpc_lower(void) { return mpc_expect(mpc_oneof("abcdefghijklmnopqrstuvwxyz"), "lowercase letter"); }
-mpc_parser_t *mpc_upper(void) { return mpc_expect(mpc_oneof("ABCDEFGHIJKLMNOPQRSTUVWXYZ"), "uppercase letter"); }
-mpc_parser_t *mpc_alpha(void) { return mpc_expect(mpc_oneof("abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ"), "letter"); }
-mpc_parser_t *mpc_underscore(void) { return mpc_expect(mpc_char('_'), "underscore"); }
-mpc_parser_t *mpc_alphanum(void) { return mpc_expect(mpc_or(3, mpc_alpha(), mpc_digit(), mpc_underscore()), "alphanumeric"); }
-
-mpc_parser_t *mpc_int(void) { return mpc_expect(mpc_apply(mpc_digits(), mpcf_int), "integer"); }
-mpc_parser_t *mpc_hex(void) { return mpc_expect(mpc_apply(mpc_hexdigits(), mpcf_hex), "hexadecimal"); }
-mpc_parser_t *mpc_oct(void) { return mpc_expect(mpc_apply(mpc_octdigits(), mpcf_oct), "octadecimal"); }
-mpc_parser_t *mpc_number(void) { return mpc_expect(mpc_or(3, mpc_int(), mpc_hex(), mpc_oct()), "number"); }
-
-mpc_parser_t *mpc_real(void) {
-
-  /* [+-]?\d+(\.\d+)?([eE][+-]?[0-9]+)? */
+static long mpc_parse_span_escaped(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_err_t **e, mpc_err_t **err) {
   
-  mpc_parser_t *p0, *p1, *p2, *p30, *p31, *p32, *p3;
+  long n = 0;
+  long start = i->state.pos;
+  char esc = mpc_span_escape(p, 0)->data.expect.x->data.single.x;
+  mpc_result_t x;
+  mpc_val_t *xs[2];
   
-  p0 = mpc_maybe_lift(mpc_oneof("+-"), mpcf_ctor_str);
-  p1 = mpc_digits();
-  p2 = mpc_maybe_lift(mpc_and(2, mpcf_strfold, mpc_char('.'), mpc_digits(), free), mpcf_ctor_str);
-  p30 = mpc_oneof("eE");
-  p31 = mpc_maybe_lift(mpc_oneof("+-"), mpcf_ctor_str);
-  p32 = mpc_digits();
-  p3 = mpc_maybe_lift(mpc_and(3, mpcf_strfold, p30, p31, p32, free, free), mpcf_ctor_str);
+  if (i->type != MPC_INPUT_STRING) {
+    r->output = NULL;
+    while (mpc_parse_run(i, p->data.span.x, &x, e)) {
+      xs[0] = r->output; xs[1] = x.output;
+      r->output = n++ ? mpcf_input_strfold(i, 2, xs) : x.output;
+    }
+    *err = x.error;
+    if (n == 0) { r->output = mpc_calloc(i, 1, 1); }
+    return n;
+  }
   
-  return mpc_expect(mpc_and(4, mpcf_strfold, p0, p1, p2, p3, free, free, free), "real");
-
-}
-
-mpc_parser_t *mpc_float(void) {
-  return mpc_expect(mpc_apply(mpc_real(), mpcf_float), "float");
+  while (1) {
+    
+    mpc_input_skip(i, mpc_scan_run(p->data.span.scan, i->string + i->state.pos, i->length - i->state.pos));
+    if (i->string[i->state.pos] != esc) { break; }
+    
+    /* An escape with nothing after it is matched by the class instead */
+    if (i->state.pos + 1 == i->length) {
+      mpc_input_skip(i, 1);
+      *e = mpc_err_merge(i, *e, mpc_span_err(i, mpc_span_escape(p, 1)));
+    } else {
+      mpc_input_skip(i, 2);
+    }
+  }
+  
+  /* Both alternatives fail where the span stops, leaving no error from the `or` itself */
+  *e = mpc_err_merge(i, *e, mpc_span_err(i, mpc_span_escape(p, 0)));
+  *e = mpc_err_merge(i, *e, mpc_span_err(i, mpc_span_class(p)));
+  *err = NULL;
+  
+  n = i->state.pos - start;
+  r->output = mpc_input_pushed(i, NULL, start, n);
+  return n;
 }
 
-mpc_parser_t *mpc_char_lit(void) {
-  return mpc_expect(mpc_between(mpc_or(2, mpc_escape(), mpc_any()), free, "'", "'"), "char");
+static int mpc_parse_span(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_err_t **e) {
+  
+  long n;
+  mpc_err_t *err;
+  
+  if (p->data.span.esc) {
+    n = mpc_parse_span_escaped(i, p, r, e, &err);
+  } else {
+    n = mpc_input_charset_run(i, p->data.span.scan, (char**)&r->output);
+    err = mpc_span_err(i, mpc_span_class(p));
+  }
+  
+  if (n < p->data.span.min) {
+    mpc_parse_dtor(i, free, r->output);
+    r->error = mpc_err_many1(i, err);
+    return 0;
+  }
+  
+  *e = mpc_err_merge(i, *e, err);
+  return 1;
 }
 
-mpc_parser_t *mpc_string_lit(void) {
-  mpc_parser_t *strchar = mpc_or(2, mpc_escape(), mpc_noneof("\""));
-  return mpc_expect(mpc_between(mpc_many(mpcf_strfold, strchar), free, "\"", "\""), "string");
-}
+/*
+** Over string input an `or` with a first set
+** table only runs alternatives which could match
+** the next character. The skipped alternatives
+** would each have failed where they started, and
+** their errors are made up here instead.
+*/
 
-mpc_parser_t *mpc_regex_lit(void) {  
-  mpc_parser_t *regexchar = mpc_or(2, mpc_escape(), mpc_noneof("/"));
-  return mpc_expect(mpc_between(mpc_many(mpcf_strfold, regexchar), free, "/", "/"), "regex");
+static mpc_err_t *mpc_parse_skipped(mpc_input_t *i, mpc_parser_t *p) {
+  switch (p->type) {
+    case MPC_TYPE_EXPECT:   return mpc_err_new(i, p->data.expect.m);
+    case MPC_TYPE_MEMO:     return mpc_parse_skipped(i, p->data.memo.x);
+    case MPC_TYPE_APPLY:    return mpc_parse_skipped(i, p->data.apply.x);
+    case MPC_TYPE_APPLY_TO: return mpc_parse_skipped(i, p->data.apply_to.x);
+    default: return NULL;
+  }
 }
 
-mpc_parser_t *mpc_ident(void) {
-  mpc_parser_t *p0, *p1; 
-  p0 = mpc_or(2, mpc_alpha(), mpc_underscore());
-  p1 = mpc_many(mpcf_strfold, mpc_alphanum()); 
-  return mpc_and(2, mpcf_strfold, p0, p1, free);
+static int mpc_parse_or_first(mpc_input_t *i, mpc_parser_t *p) {
+  if (p->data.or.first == NULL || i->type != MPC_INPUT_STRING) { return -1; }
+  return (unsigned char)i->string[i->state.pos];
 }
 
 /*
-** Useful Parsers
+** Parse Engine
+**
+** Parsers are run without recursing in C. Each
+** combinator being run has a frame on a stack
+** held on the heap, so nesting in the input is
+** only limited by memory. Entering a frame either
+** finishes straight away or asks for a child to
+** be run, and once that child finishes the frame
+** is resumed with its result.
 */
 
-mpc_parser_t *mpc_startwith(mpc_parser_t *a) { return mpc_and(2, mpcf_snd, mpc_soi(), a, mpcf_dtor_null); }
-mpc_parser_t *mpc_endwith(mpc_parser_t *a, mpc_dtor_t da) { return mpc_and(2, mpcf_fst, a, mpc_eoi(), da); }
-mpc_parser_t *mpc_whole(mpc_parser_t *a, mpc_dtor_t da) { return mpc_and(3, mpcf_snd, mpc_soi(), a, mpc_eoi(), mpcf_dtor_null, da); }
-
-mpc_parser_t *mpc_stripl(mpc_parser_t *a) { return mpc_and(2, mpcf_snd, mpc_blank(), a, mpcf_dtor_null); }
-mpc_parser_t *mpc_stripr(mpc_parser_t *a) { return mpc_and(2, mpcf_fst, a, mpc_blank(), mpcf_dtor_null); }
-mpc_parser_t *mpc_strip(mpc_parser_t *a) { return mpc_and(3, mpcf_snd, mpc_blank(), a, mpc_blank(), mpcf_dtor_null, mpcf_dtor_null); }
-mpc_parser_t *mpc_tok(mpc_parser_t *a) { return mpc_and(2, mpcf_fst, a, mpc_blank(), mpcf_dtor_null); }
-mpc_parser_t *mpc_sym(const char *s) { return mpc_tok(mpc_string(s)); }
+enum {
+  MPC_PARSE_STACK_MIN = 4,
+  MPC_PARSE_FRAMES_MIN = 64
+};
 
-mpc_parser_t *mpc_total(mpc_parser_t *a, mpc_dtor_t da) { return mpc_whole(mpc_strip(a), da); }
+enum {
+  MPC_PARSE_FAILURE = 0,
+  MPC_PARSE_SUCCESS = 1,
+  MPC_PARSE_CHILD   = 2
+};
 
-mpc_parser_t *mpc_between(mpc_parser_t *a, mpc_dtor_t ad, const char *o, const char *c) {
-  return mpc_and(3, mpcf_snd_free,
-    mpc_string(o), a, mpc_string(c),
-    free, ad);
-}
+typedef struct {
+  mpc_parser_t *p;
+  int j;
+  int k;
+  int slots;
+  mpc_result_t *results;
+  mpc_result_t results_stk[MPC_PARSE_STACK_MIN];
+  mpc_state_t s;
+} mpc_frame_t;
 
-mpc_parser_t *mpc_parens(mpc_parser_t *a, mpc_dtor_t ad)   { return mpc_between(a, ad, "(", ")"); }
-mpc_parser_t *mpc_braces(mpc_parser_t *a, mpc_dtor_t ad)   { return mpc_between(a, ad, "<", ">"); }
-mpc_parser_t *mpc_brackets(mpc_parser_t *a, mpc_dtor_t ad) { return mpc_between(a, ad, "{", "}"); }
-mpc_parser_t *mpc_squares(mpc_parser_t *a, mpc_dtor_t ad)  { return mpc_between(a, ad, "[", "]"); }
+#define MPC_SUCCESS(x) r->output = x; return MPC_PARSE_SUCCESS
+#define MPC_FAILURE(x) r->error = x; return MPC_PARSE_FAILURE
+#define MPC_PRIMITIVE(x) \
+  if (x) { MPC_SUCCESS(r->output); } \
+  else { MPC_FAILURE(NULL); }
+#define MPC_CHILD(x) *c = x; return MPC_PARSE_CHILD
 
-mpc_parser_t *mpc_tok_between(mpc_parser_t *a, mpc_dtor_t ad, const char *o, const char *c) {
-  return mpc_and(3, mpcf_snd_free,
-    mpc_sym(o), mpc_tok(a), mpc_sym(c),
-    free, ad);
+static mpc_result_t *mpc_frame_results(mpc_frame_t *f) {
+  return f->results ? f->results : f->results_stk;
 }
 
-mpc_parser_t *mpc_tok_parens(mpc_parser_t *a, mpc_dtor_t ad)   { return mpc_tok_between(a, ad, "(", ")"); }
-mpc_parser_t *mpc_tok_braces(mpc_parser_t *a, mpc_dtor_t ad)   { return mpc_tok_between(a, ad, "<", ">"); }
-mpc_parser_t *mpc_tok_brackets(mpc_parser_t *a, mpc_dtor_t ad) { return mpc_tok_between(a, ad, "{", "}"); }
-mpc_parser_t *mpc_tok_squares(mpc_parser_t *a, mpc_dtor_t ad)  { return mpc_tok_between(a, ad, "[", "]"); }
-
-/*
-** Regular Expression Parsers
-*/
-
-/*
-** So here is a cute bootstrapping.
-**
-** I'm using the previously defined
-** mpc constructs and functions to
-** parse the user regex string and
-** construct a parser from it.
-**
-** As it turns out lots of the standard
-** mpc functions look a lot like `fold`
-** functions and so can be used indirectly
-** by many of the parsing functions to build
-** a parser directly - as we are parsing.
-**
-** This is certainly something that
-** would be less elegant/interesting 
-** in a two-phase parser which first
-** builds an AST and then traverses it
-** to generate the object.
-**
-** This whole thing acts as a great
-** case study for how trivial it can be
-** to write a great parser in a few
-** lines of code using mpc.
-*/
-
-/*
-**
-**  ### Regular Expression Grammar
-**
-**      <regex> : <term> | (<term> "|" <regex>)
-**     
-**      <term> : <factor>*
-**
-**      <factor> : <base>
-**               | <base> "*"
-**               | <base> "+"
-**               | <base> "?"
-**               | <base> "{" <digits> "}"
-**           
-**      <base> : <char>
-**             | "\" <char>
-**             | "(" <regex> ")"
-**             | "[" <range> "]"
-*/
-
-static mpc_val_t *mpcf_re_or(int n, mpc_val_t **xs) {
-  (void) n;
-  if (xs[1] == NULL) { return xs[0]; }
-  else { return mpc_or(2, xs[0], xs[1]); }
+static void mpc_frame_results_free(mpc_input_t *i, mpc_frame_t *f) {
+  if (f->results) { mpc_free(i, f->results); }
 }
 
-static mpc_val_t *mpcf_re_and(int n, mpc_val_t **xs) {
-  int i;
-  mpc_parser_t *p = mpc_lift(mpcf_ctor_str);
-  for (i = 0; i < n; i++) {
-    p = mpc_and(2, mpcf_strfold, p, xs[i], free);
+/* Makes room for result `j` of a repetition, moving onto the heap when the frame fills */
+static void mpc_frame_results_grow(mpc_input_t *i, mpc_frame_t *f) {
+  if (f->j == MPC_PARSE_STACK_MIN && f->results == NULL) {
+    f->slots = f->j + f->j / 2;
+    f->results = mpc_malloc(i, sizeof(mpc_result_t) * f->slots);
+    memcpy(f->results, f->results_stk, sizeof(mpc_result_t) * MPC_PARSE_STACK_MIN);
+  } else if (f->j >= f->slots) {
+    f->slots = f->j + f->j / 2;
+    f->results = mpc_realloc(i, f->results, sizeof(mpc_result_t) * f->slots);
   }
-  return p;
-}
-
-static mpc_val_t *mpcf_re_repeat(int n, mpc_val_t **xs) {
-  int num;
-  (void) n;
-  if (xs[1] == NULL) { return xs[0]; }
-  if (strcmp(xs[1], "*") == 0) { free(xs[1]); return mpc_many(mpcf_strfold, xs[0]); }
-  if (strcmp(xs[1], "+") == 0) { free(xs[1]); return mpc_many1(mpcf_strfold, xs[0]); }
-  if (strcmp(xs[1], "?") == 0) { free(xs[1]); return mpc_maybe_lift(xs[0], mpcf_ctor_str); }
-  num = *(int*)xs[1];
-  free(xs[1]);
-  
-  return mpc_count(num, mpcf_strfold, xs[0], free);
 }
 
-static mpc_parser_t *mpc_re_escape_char(char c) {
-  switch (c) {
-    case 'a': return mpc_char('\a');
-    case 'f': return mpc_char('\f');
-    case 'n': return mpc_char('\n');
-    case 'r': return mpc_char('\r');
-    case 't': return mpc_char('\t');
-    case 'v': return mpc_char('\v');
-    case 'b': return mpc_and(2, mpcf_snd, mpc_boundary(), mpc_lift(mpcf_ctor_str), free);
-    case 'B': return mpc_not_lift(mpc_boundary(), free, mpcf_ctor_str);
-    case 'A': return mpc_and(2, mpcf_snd, mpc_soi(), mpc_lift(mpcf_ctor_str), free);
-    case 'Z': return mpc_and(2, mpcf_snd, mpc_eoi(), mpc_lift(mpcf_ctor_str), free);
-    case 'd': return mpc_digit();
-    case 'D': return mpc_not_lift(mpc_digit(), free, mpcf_ctor_str);
-    case 's': return mpc_whitespace();
-    case 'S': return mpc_not_lift(mpc_whitespace(), free, mpcf_ctor_str);
-    case 'w': return mpc_alphanum();
-    case 'W': return mpc_not_lift(mpc_alphanum(), free, mpcf_ctor_str);
-    default: return NULL;
+/* Moves an `or` on to the next alternative which could match, making up errors for those skipped */
+static int mpc_parse_or_next(mpc_input_t *i, mpc_frame_t *f, mpc_result_t *r, mpc_err_t **e, mpc_parser_t **c) {
+  mpc_parser_t *p = f->p;
+  for (; f->j < p->data.or.n; f->j++) {
+    if (f->k >= 0 && !mpc_input_charset_has(p->data.or.first + f->j * 32, (char)f->k)) {
+      *e = mpc_err_merge(i, *e, mpc_parse_skipped(i, p->data.or.xs[f->j]));
+      continue;
+    }
+    MPC_CHILD(p->data.or.xs[f->j]);
   }
+  MPC_FAILURE(NULL);
 }
 
-static mpc_val_t *mpcf_re_escape(mpc_val_t *x) {
-  
-  char *s = x;
-  mpc_parser_t *p;
+static int mpc_parse_enter(mpc_input_t *i, mpc_frame_t *f, mpc_result_t *r, mpc_err_t **e, mpc_parser_t **c) {
   
-  /* Regex Special Characters */
-  if (s[0] == '.') { free(s); return mpc_any(); }
-  if (s[0] == '^') { free(s); return mpc_and(2, mpcf_snd, mpc_soi(), mpc_lift(mpcf_ctor_str), free); }
-  if (s[0] == '$') { free(s); return mpc_and(2, mpcf_snd, mpc_eoi(), mpc_lift(mpcf_ctor_str), free); }
+  mpc_parser_t *p = f->p;
+  mpc_memo_t *m;
   
-  /* Regex Escape */
-  if (s[0] == '\\') {
-    p = mpc_re_escape_char(s[1]);
-    p = (p == NULL) ? mpc_char(s[1]) : p;
-    free(s);
-    return p;
-  }
+  f->j = 0;
+  f->k = 0;
+  f->slots = MPC_PARSE_STACK_MIN;
+  f->results = NULL;
   
-  /* Regex Standard */
-  p = mpc_char(s[0]);
-  free(s);
-  return p;
-}
+  switch (p->type) {
+      
+    /* Basic Parsers */
 
-static const char *mpc_re_range_escape_char(char c) {
-  switch (c) {
-    case '-': return "-";
-    case 'a': return "\a";
-    case 'f': return "\f";
-    case 'n': return "\n";
-    case 'r': return "\r";
-    case 't': return "\t";
-    case 'v': return "\v";
-    case 'b': return "\b";
-    case 'd': return "0123456789";
-    case 's': return " \f\n\r\t\v";
-    case 'w': return "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_";
-    default: return NULL;
+    case MPC_TYPE_ANY:     MPC_PRIMITIVE(mpc_input_any(i, (char**)&r->output));
+    case MPC_TYPE_SINGLE:  MPC_PRIMITIVE(mpc_input_char(i, p->data.single.x, (char**)&r->output));
+    case MPC_TYPE_RANGE:   MPC_PRIMITIVE(mpc_input_range(i, p->data.range.x, p->data.range.y, (char**)&r->output));
+    case MPC_TYPE_ONEOF:   MPC_PRIMITIVE(mpc_input_oneof(i, p->data.string.x, (char**)&r->output));
+    case MPC_TYPE_NONEOF:  MPC_PRIMITIVE(mpc_input_noneof(i, p->data.string.x, (char**)&r->output));
+    case MPC_TYPE_SATISFY: MPC_PRIMITIVE(mpc_input_satisfy(i, p->data.satisfy.f, (char**)&r->output));
+    case MPC_TYPE_CHARSET: MPC_PRIMITIVE(mpc_input_charset(i, p->data.charset.x, (char**)&r->output));
+    case MPC_TYPE_STRING:  MPC_PRIMITIVE(mpc_input_string(i, p->data.string.x, (char**)&r->output));
+    case MPC_TYPE_ANCHOR:  MPC_PRIMITIVE(mpc_input_anchor(i, p->data.anchor.f, (char**)&r->output));
+    
+    /* Other parsers */
+    
+    case MPC_TYPE_UNDEFINED: MPC_FAILURE(mpc_err_fail(i, "Parser Undefined!"));
+    case MPC_TYPE_PASS:      MPC_SUCCESS(NULL);
+    case MPC_TYPE_FAIL:      MPC_FAILURE(mpc_err_fail(i, p->data.fail.m));
+    case MPC_TYPE_LIFT:      MPC_SUCCESS(i->recognise ? NULL : p->data.lift.lf());
+    case MPC_TYPE_LIFT_VAL:  MPC_SUCCESS(i->recognise ? NULL : p->data.lift.x);
+    case MPC_TYPE_STATE:     MPC_SUCCESS(i->recognise ? NULL : mpc_input_state_copy(i));
+    
+    /* Application Parsers */
+    
+    case MPC_TYPE_APPLY:    MPC_CHILD(p->data.apply.x);
+    case MPC_TYPE_APPLY_TO: MPC_CHILD(p->data.apply_to.x);
+    
+    case MPC_TYPE_EXPECT:
+      mpc_input_suppress_enable(i);
+      MPC_CHILD(p->data.expect.x);
+    
+    /* A memo which is bypassed is marked so its result is passed straight back */
+    
+    case MPC_TYPE_MEMO:
+      
+      if (!mpc_input_memo_enabled(i)) {
+        f->k = -1;
+        MPC_CHILD(p->data.memo.x);
+      }
+      
+      m = mpc_input_memo_slot(i, p, i->state.pos);
+      
+      if (m->p == p && m->pos == i->state.pos
+      && (m->success || m->result.error || i->suppress)) {
+        i->state = m->state;
+        i->last = m->last;
+        if (i->type == MPC_INPUT_FILE) { fseek(i->file, i->state.pos, SEEK_SET); }
+        if (m->success && mpc_input_memo_shared(i, p)) { MPC_SUCCESS(m->result.output); }
+        if (m->success) { MPC_SUCCESS(p->data.memo.cp(m->result.output)); }
+        MPC_FAILURE(mpc_err_copy(i, m->result.error));
+      }
+      
+      f->s = i->state;
+      MPC_CHILD(p->data.memo.x);
+    
+    /*
+    ** Only string input can hand back the span
+    ** it matched, so other inputs run the tree.
+    ** A failed scan reruns the tree too, as
+    ** that gives the exact error message.
+    */
+    
+    case MPC_TYPE_REGEX:
+      
+      if (i->type != MPC_INPUT_STRING) {
+        f->k = -1;
+        MPC_CHILD(p->data.regex.x);
+      }
+      
+      f->s = i->state;
+      if (p->data.regex.dfa && mpc_input_dfa(i, p->data.regex.dfa, e)) {
+        MPC_SUCCESS(mpc_input_span(i, f->s.pos));
+      }
+      
+      i->recognise++;
+      MPC_CHILD(p->data.regex.x);
+    
+    case MPC_TYPE_PREDICT:
+      mpc_input_backtrack_disable(i);
+      MPC_CHILD(p->data.predict.x);
+    
+    /* Optional Parsers */
+    
+    case MPC_TYPE_NOT:
+      mpc_input_mark(i);
+      mpc_input_suppress_enable(i);
+      MPC_CHILD(p->data.not.x);
+    
+    case MPC_TYPE_MAYBE: MPC_CHILD(p->data.not.x);
+    
+    /* Repeat Parsers */
+    
+    case MPC_TYPE_SPAN: return mpc_parse_span(i, p, r, e);
+    
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:
+      MPC_CHILD(p->data.repeat.x);
+    
+    case MPC_TYPE_COUNT:
+      if (p->data.repeat.n > MPC_PARSE_STACK_MIN) {
+        f->results = mpc_malloc(i, sizeof(mpc_result_t) * p->data.repeat.n);
+      }
+      MPC_CHILD(p->data.repeat.x);
+    
+    /* Combinatory Parsers */
+    
+    case MPC_TYPE_OR:
+      
+      if (p->data.or.n == 0) { MPC_SUCCESS(NULL); }
+      
+      /* With errors suppressed the skipped alternatives need not be visited at all */
+      f->k = mpc_parse_or_first(i, p);
+      f->j = f->k >= 0 && i->suppress ? p->data.or.jump[f->k] : 0;
+      return mpc_parse_or_next(i, f, r, e, c);
+    
+    case MPC_TYPE_AND:
+      
+      if (p->data.and.n == 0) { MPC_SUCCESS(NULL); }
+      
+      if (p->data.and.n > MPC_PARSE_STACK_MIN) {
+        f->results = mpc_malloc(i, sizeof(mpc_result_t) * p->data.and.n);
+      }
+      
+      mpc_input_mark(i);
+      MPC_CHILD(p->data.and.xs[0]);
+    
+    /* End */
+    
+    default:
+      
+      MPC_FAILURE(mpc_err_fail(i, "Unknown Parser Type Id!"));
   }
+  
 }
 
-static mpc_val_t *mpcf_re_range(mpc_val_t *x) {
-  
-  mpc_parser_t *out;
-  size_t i, j;
-  size_t start, end;
-  const char *tmp = NULL;
-  const char *s = x;
-  int comp = s[0] == '^' ? 1 : 0;
-  char *range = calloc(1,1);
+/* Resumes a frame once its child has finished, leaving the child's result in `r` */
+static int mpc_parse_resume(mpc_input_t *i, mpc_frame_t *f, int ok, mpc_result_t *r, mpc_err_t **e, mpc_parser_t **c) {
   
-  if (s[0] == '\0') { free(x); return mpc_fail("Invalid Regex Range Expression"); } 
-  if (s[0] == '^' && 
-      s[1] == '\0') { free(x); return mpc_fail("Invalid Regex Range Expression"); }
+  mpc_parser_t *p = f->p;
+  mpc_result_t *results = mpc_frame_results(f);
+  int k;
   
-  for (i = comp; i < strlen(s); i++){
+  switch (p->type) {
     
-    /* Regex Range Escape */
-    if (s[i] == '\\') {
-      tmp = mpc_re_range_escape_char(s[i+1]);
-      if (tmp != NULL) {
-        range = realloc(range, strlen(range) + strlen(tmp) + 1);
-        strcat(range, tmp);
-      } else {
-        range = realloc(range, strlen(range) + 1 + 1);
-        range[strlen(range) + 1] = '\0';
-        range[strlen(range) + 0] = s[i+1];      
+    case MPC_TYPE_APPLY:
+      if (ok) { MPC_SUCCESS(mpc_parse_apply(i, p->data.apply.f, r->output)); }
+      MPC_FAILURE(r->error);
+    
+    case MPC_TYPE_APPLY_TO:
+      if (ok) { MPC_SUCCESS(mpc_parse_apply_to(i, p->data.apply_to.f, r->output, p->data.apply_to.d)); }
+      MPC_FAILURE(r->error);
+    
+    case MPC_TYPE_EXPECT:
+      mpc_input_suppress_disable(i);
+      if (ok) { MPC_SUCCESS(r->output); }
+      mpc_err_delete_internal(i, r->error);
+      MPC_FAILURE(mpc_err_new(i, p->data.expect.m));
+    
+    case MPC_TYPE_MEMO:
+      if (f->k == 0) { mpc_input_memo_store(i, p, f->s, ok, r); }
+      return ok;
+    
+    case MPC_TYPE_REGEX:
+      if (f->k < 0) { return ok; }
+      i->recognise--;
+      if (ok) { MPC_SUCCESS(mpc_input_span(i, f->s.pos)); }
+      MPC_FAILURE(r->error);
+    
+    case MPC_TYPE_PREDICT:
+      mpc_input_backtrack_enable(i);
+      return ok;
+    
+    /* TODO: Update Not Error Message */
+    
+    case MPC_TYPE_NOT:
+      if (ok) {
+        mpc_input_rewind(i);
+        mpc_input_suppress_disable(i);
+        mpc_parse_dtor(i, p->data.not.dx, r->output);
+        MPC_FAILURE(mpc_err_new(i, "opposite"));
       }
-      i++;
-    }
+      mpc_input_unmark(i);
+      mpc_input_suppress_disable(i);
+      mpc_err_delete_internal(i, r->error);
+      MPC_SUCCESS(i->recognise ? NULL : p->data.not.lf());
     
-    /* Regex Range...Range */
-    else if (s[i] == '-') {
-      if (s[i+1] == '\0' || i == 0) {
-          range = realloc(range, strlen(range) + strlen("-") + 1);
-          strcat(range, "-");
-      } else {
-        start = s[i-1]+1;
-        end = s[i+1]-1;
-        for (j = start; j <= end; j++) {
-          range = realloc(range, strlen(range) + 1 + 1 + 1);
-          range[strlen(range) + 1] = '\0';
-          range[strlen(range) + 0] = j;
-        }        
+    case MPC_TYPE_MAYBE:
+      if (ok) { MPC_SUCCESS(r->output); }
+      *e = mpc_err_merge(i, *e, r->error);
+      MPC_SUCCESS(i->recognise ? NULL : p->data.not.lf());
+    
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:
+      
+      if (ok) {
+        results[f->j++] = *r;
+        mpc_frame_results_grow(i, f);
+        MPC_CHILD(p->data.repeat.x);
       }
-    }
+      
+      if (f->j == 0 && p->type == MPC_TYPE_MANY1) {
+        MPC_FAILURE(mpc_err_many1(i, r->error));
+      }
+      
+      *e = mpc_err_merge(i, *e, r->error);
+      r->output = mpc_parse_fold(i, p->data.repeat.f, f->j, (mpc_val_t**)results);
+      mpc_frame_results_free(i, f);
+      return MPC_PARSE_SUCCESS;
     
-    /* Regex Range Normal */
-    else {
-      range = realloc(range, strlen(range) + 1 + 1);
-      range[strlen(range) + 1] = '\0';
-      range[strlen(range) + 0] = s[i];
+    case MPC_TYPE_COUNT:
+      
+      if (ok) {
+        results[f->j++] = *r;
+        if (f->j != p->data.repeat.n) { MPC_CHILD(p->data.repeat.x); }
+        r->output = mpc_parse_fold(i, p->data.repeat.f, f->j, (mpc_val_t**)results);
+        mpc_frame_results_free(i, f);
+        return MPC_PARSE_SUCCESS;
+      }
+      
+      for (k = 0; k < f->j; k++) {
+        mpc_parse_dtor(i, p->data.repeat.dx, results[k].output);
+      }
+      mpc_frame_results_free(i, f);
+      MPC_FAILURE(mpc_err_count(i, r->error, p->data.repeat.n));
+    
+    case MPC_TYPE_OR:
+      if (ok) { MPC_SUCCESS(r->output); }
+      *e = mpc_err_merge(i, *e, r->error);
+      f->j++;
+      return mpc_parse_or_next(i, f, r, e, c);
+    
+    case MPC_TYPE_AND:
+      
+      if (!ok) {
+        mpc_input_rewind(i);
+        for (k = 0; k < f->j; k++) {
+          mpc_parse_dtor(i, p->data.and.dxs[k], results[k].output);
+        }
+        mpc_frame_results_free(i, f);
+        MPC_FAILURE(r->error);
+      }
+      
+      results[f->j++] = *r;
+      if (f->j < p->data.and.n) { MPC_CHILD(p->data.and.xs[f->j]); }
+      
+      mpc_input_unmark(i);
+      r->output = mpc_parse_fold(i, p->data.and.f, f->j, (mpc_val_t**)results);
+      mpc_frame_results_free(i, f);
+      return MPC_PARSE_SUCCESS;
+    
+    default:
+      
+      MPC_FAILURE(mpc_err_fail(i, "Unknown Parser Type Id!"));
+  }
+  
+}
+
+#undef MPC_SUCCESS
+#undef MPC_FAILURE
+#undef MPC_PRIMITIVE
+#undef MPC_CHILD
+
+static int mpc_parse_run(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r, mpc_err_t **e) {
+  
+  int n = 1, slots = MPC_PARSE_FRAMES_MIN, x;
+  mpc_frame_t *fs = malloc(sizeof(mpc_frame_t) * slots);
+  mpc_parser_t *c;
+  
+  fs[0].p = p;
+  x = mpc_parse_enter(i, &fs[0], r, e, &c);
+  
+  while (1) {
+    
+    if (x == MPC_PARSE_CHILD) {
+      if (n == slots) {
+        slots *= 2;
+        fs = realloc(fs, sizeof(mpc_frame_t) * slots);
+      }
+      fs[n].p = c;
+      x = mpc_parse_enter(i, &fs[n++], r, e, &c);
+      continue;
     }
+    
+    if (--n == 0) { break; }
+    
+    x = mpc_parse_resume(i, &fs[n-1], x, r, e, &c);
+  }
+  
+  free(fs);
+  return x;
+}
+
+/*
+** Profiling
+**
+** A profiled parse runs the same frames through
+** a copy of the loop above which also tracks the
+** named rules being run, so parses without a
+** profile pay nothing for it. Rows are found
+** from the parser by a pointer keyed table.
+*/
+
+typedef struct {
+  mpc_rule_stats_t s;
+  int active;
+  clock_t time;
+  clock_t self;
+} mpc_profile_row_t;
+
+typedef struct {
+  int row;
+  long pos;
+  clock_t start;
+  clock_t inner;
+} mpc_profile_frame_t;
+
+struct mpc_profile_t {
+  int rows_num;
+  int rows_slots;
+  mpc_profile_row_t *rows;
+  int keys_slots;
+  mpc_parser_t **keys;
+  int *vals;
+  int stack_num;
+  int stack_slots;
+  mpc_profile_frame_t *stack;
+};
+
+static int mpc_profile_hash(mpc_parser_t *p, int slots) {
+  return (int)((((unsigned long)(size_t)p >> 4) * 2654435761UL) & (unsigned long)(slots - 1));
+}
+
+static void mpc_profile_insert(mpc_profile_t *f, mpc_parser_t *p, int row) {
+  int h = mpc_profile_hash(p, f->keys_slots);
+  while (f->keys[h]) { h = (h + 1) & (f->keys_slots - 1); }
+  f->keys[h] = p;
+  f->vals[h] = row;
+}
+
+static int mpc_profile_find(mpc_profile_t *f, mpc_parser_t *p) {
+  
+  int j, h, slots;
+  mpc_parser_t **keys;
+  int *vals;
+  mpc_profile_row_t *w;
   
+  h = mpc_profile_hash(p, f->keys_slots);
+  while (f->keys[h]) {
+    if (f->keys[h] == p) { return f->vals[h]; }
+    h = (h + 1) & (f->keys_slots - 1);
   }
   
-  out = comp == 1 ? mpc_noneof(range) : mpc_oneof(range);
+  /* Kept at most half full */
+  if (2 * (f->rows_num + 1) > f->keys_slots) {
+    slots = f->keys_slots;
+    keys = f->keys;
+    vals = f->vals;
+    f->keys_slots *= 2;
+    f->keys = calloc(f->keys_slots, sizeof(mpc_parser_t*));
+    f->vals = malloc(sizeof(int) * f->keys_slots);
+    for (j = 0; j < slots; j++) {
+      if (keys[j]) { mpc_profile_insert(f, keys[j], vals[j]); }
+    }
+    free(keys);
+    free(vals);
+  }
   
-  free(x);
-  free(range);
+  if (f->rows_num == f->rows_slots) {
+    f->rows_slots *= 2;
+    f->rows = realloc(f->rows, sizeof(mpc_profile_row_t) * f->rows_slots);
+  }
   
-  return out;
+  /* The name is copied as the parser may be deleted before the profile */
+  w = &f->rows[f->rows_num];
+  memset(w, 0, sizeof(mpc_profile_row_t));
+  w->s.name = strcpy(malloc(strlen(p->name) + 1), p->name);
+  mpc_profile_insert(f, p, f->rows_num);
+  return f->rows_num++;
 }
 
-mpc_parser_t *mpc_re(const char *re) {
+static void mpc_profile_enter(mpc_profile_t *f, mpc_input_t *i, mpc_parser_t *p) {
   
-  char *err_msg;
-  mpc_parser_t *err_out;
-  mpc_result_t r;
-  mpc_parser_t *Regex, *Term, *Factor, *Base, *Range, *RegexEnclose; 
+  mpc_profile_frame_t *x;
   
-  Regex  = mpc_new("regex");
-  Term   = mpc_new("term");
-  Factor = mpc_new("factor");
-  Base   = mpc_new("base");
-  Range  = mpc_new("range");
+  if (f->stack_num == f->stack_slots) {
+    f->stack_slots *= 2;
+    f->stack = realloc(f->stack, sizeof(mpc_profile_frame_t) * f->stack_slots);
+  }
   
-  mpc_define(Regex, mpc_and(2, mpcf_re_or,
-    Term, 
-    mpc_maybe(mpc_and(2, mpcf_snd_free, mpc_char('|'), Regex, free)),
-    (mpc_dtor_t)mpc_delete
-  ));
+  x = &f->stack[f->stack_num++];
+  x->row = mpc_profile_find(f, p);
+  x->pos = i->state.pos;
+  x->inner = 0;
+  f->rows[x->row].s.calls++;
+  f->rows[x->row].active++;
+  x->start = clock();
+}
+
+/* Time in a rule which is already running further out is only counted there */
+static void mpc_profile_leave(mpc_profile_t *f, mpc_input_t *i, int ok) {
   
-  mpc_define(Term, mpc_many(mpcf_re_and, Factor));
+  clock_t t = clock();
+  mpc_profile_frame_t *x = &f->stack[--f->stack_num];
+  mpc_profile_row_t *w = &f->rows[x->row];
   
-  mpc_define(Factor, mpc_and(2, mpcf_re_repeat,
-    Base,
-    mpc_or(5,
-      mpc_char('*'), mpc_char('+'), mpc_char('?'),
-      mpc_brackets(mpc_int(), free),
-      mpc_pass()),
-    (mpc_dtor_t)mpc_delete
-  ));
+  t -= x->start;
+  w->self += t - x->inner;
+  if (--w->active == 0) { w->time += t; }
+  if (f->stack_num) { f->stack[f->stack_num-1].inner += t; }
   
-  mpc_define(Base, mpc_or(4,
-    mpc_parens(Regex, (mpc_dtor_t)mpc_delete),
-    mpc_squares(Range, (mpc_dtor_t)mpc_delete),
-    mpc_apply(mpc_escape(), mpcf_re_escape),
-    mpc_apply(mpc_noneof(")|"), mpcf_re_escape)
-  ));
-  
-  mpc_define(Range, mpc_apply(
-    mpc_many(mpcf_strfold, mpc_or(2, mpc_escape(), mpc_noneof("]"))),
-    mpcf_re_range
-  ));
-  
-  RegexEnclose = mpc_whole(mpc_predictive(Regex), (mpc_dtor_t)mpc_delete);
-  
-  mpc_optimise(RegexEnclose);
-  mpc_optimise(Regex);
-  mpc_optimise(Term);
-  mpc_optimise(Factor);
-  mpc_optimise(Base);
-  mpc_optimise(Range);
-  
-  if(!mpc_parse("<mpc_re_compiler>", re, RegexEnclose, &r)) {
-    err_msg = mpc_err_string(r.error);
-    err_out = mpc_failf("Invalid Regex: %s", err_msg);
-    mpc_err_delete(r.error);  
-    free(err_msg);
-    r.output = err_out;
+  if (ok) {
+    w->s.successes++;
+    w->s.consumed += i->state.pos - x->pos;
+  } else {
+    w->s.failures++;
   }
+}
+
+static int mpc_parse_run_profiled(mpc_input_t *i, mpc_profile_t *f, mpc_parser_t *p, mpc_result_t *r, mpc_err_t **e) {
   
-  mpc_cleanup(6, RegexEnclose, Regex, Term, Factor, Base, Range);
+  int n = 1, slots = MPC_PARSE_FRAMES_MIN, x;
+  long pos;
+  mpc_frame_t *fs = malloc(sizeof(mpc_frame_t) * slots);
+  mpc_parser_t *c;
   
-  mpc_optimise(r.output);
+  fs[0].p = p;
+  if (p->name) { mpc_profile_enter(f, i, p); }
+  x = mpc_parse_enter(i, &fs[0], r, e, &c);
   
-  return r.output;
+  while (1) {
+    
+    if (x == MPC_PARSE_CHILD) {
+      if (n == slots) {
+        slots *= 2;
+        fs = realloc(fs, sizeof(mpc_frame_t) * slots);
+      }
+      fs[n].p = c;
+      if (c->name) { mpc_profile_enter(f, i, c); }
+      x = mpc_parse_enter(i, &fs[n++], r, e, &c);
+      continue;
+    }
+    
+    if (fs[n-1].p->name) { mpc_profile_leave(f, i, x); }
+    if (--n == 0) { break; }
+    
+    pos = i->state.pos;
+    x = mpc_parse_resume(i, &fs[n-1], x, r, e, &c);
+    
+    /* Charged to the innermost named rule, which may be the `and` itself */
+    if (fs[n-1].p->type == MPC_TYPE_AND && x == MPC_PARSE_FAILURE
+    && i->state.pos < pos && f->stack_num) {
+      f->rows[f->stack[f->stack_num-1].row].s.rewinds++;
+    }
+  }
   
+  free(fs);
+  return x;
 }
 
-/*
-** Common Fold Functions
-*/
-
-void mpcf_dtor_null(mpc_val_t *x) { (void) x; return; }
-
-mpc_val_t *mpcf_ctor_null(void) { return NULL; }
-mpc_val_t *mpcf_ctor_str(void) { return calloc(1, 1); }
-mpc_val_t *mpcf_free(mpc_val_t *x) { free(x); return NULL; }
+mpc_profile_t *mpc_profile_new(void) {
+  mpc_profile_t *f = malloc(sizeof(mpc_profile_t));
+  f->rows_num = 0;
+  f->rows_slots = 16;
+  f->rows = malloc(sizeof(mpc_profile_row_t) * f->rows_slots);
+  f->keys_slots = 32;
+  f->keys = calloc(f->keys_slots, sizeof(mpc_parser_t*));
+  f->vals = malloc(sizeof(int) * f->keys_slots);
+  f->stack_num = 0;
+  f->stack_slots = 64;
+  f->stack = malloc(sizeof(mpc_profile_frame_t) * f->stack_slots);
+  return f;
+}
 
-mpc_val_t *mpcf_int(mpc_val_t *x) {
-  int *y = malloc(sizeof(int));
-  *y = strtol(x, NULL, 10);
-  free(x);
-  return y;
+void mpc_profile_delete(mpc_profile_t *f) {
+  int j;
+  for (j = 0; j < f->rows_num; j++) { free((char*)f->rows[j].s.name); }
+  free(f->rows);
+  free(f->keys);
+  free(f->vals);
+  free(f->stack);
+  free(f);
 }
 
-mpc_val_t *mpcf_hex(mpc_val_t *x) {
-  int *y = malloc(sizeof(int));
-  *y = strtol(x, NULL, 16);
-  free(x);
-  return y;
+void mpc_profile(mpc_parser_t *p, mpc_profile_t *f) {
+  p->profile = f;
 }
 
-mpc_val_t *mpcf_oct(mpc_val_t *x) {
-  int *y = malloc(sizeof(int));
-  *y = strtol(x, NULL, 8);
-  free(x);
-  return y;
+int mpc_profile_rule(const mpc_profile_t *f, int j, mpc_rule_stats_t *s) {
+  if (j < 0 || j >= f->rows_num) { return 0; }
+  *s = f->rows[j].s;
+  s->time = (double)f->rows[j].time / CLOCKS_PER_SEC;
+  s->self = (double)f->rows[j].self / CLOCKS_PER_SEC;
+  return 1;
 }
 
-mpc_val_t *mpcf_float(mpc_val_t *x) {
-  float *y = malloc(sizeof(float));
-  *y = strtod(x, NULL);
-  free(x);
-  return y;
+static int mpc_profile_cmp(const void *a, const void *b) {
+  const mpc_rule_stats_t *x = a, *y = b;
+  if (x->self != y->self) { return x->self < y->self ? 1 : -1; }
+  if (x->calls != y->calls) { return x->calls < y->calls ? 1 : -1; }
+  return strcmp(x->name, y->name);
 }
 
-mpc_val_t *mpcf_strtriml(mpc_val_t *x) {
-  char *s = x;
-  while (isspace(*s)) {
-    memmove(s, s+1, strlen(s));
-  }
+/* Rows with the most time of their own come first */
+static mpc_rule_stats_t *mpc_profile_sorted(const mpc_profile_t *f) {
+  int j;
+  mpc_rule_stats_t *s = malloc(sizeof(mpc_rule_stats_t) * (f->rows_num ? f->rows_num : 1));
+  for (j = 0; j < f->rows_num; j++) { mpc_profile_rule(f, j, &s[j]); }
+  qsort(s, f->rows_num, sizeof(mpc_rule_stats_t), mpc_profile_cmp);
   return s;
 }
 
-mpc_val_t *mpcf_strtrimr(mpc_val_t *x) {
-  char *s = x;
-  size_t l = strlen(s);
-  while (isspace(s[l-1])) {
-    s[l-1] = '\0'; l--;
+void mpc_profile_print(const mpc_profile_t *f, FILE *out) {
+  int j;
+  mpc_rule_stats_t *s = mpc_profile_sorted(f);
+  fprintf(out, "%-20s %10s %10s %10s %12s %10s %10s %10s\n",
+    "Rule", "Calls", "Successes", "Failures", "Consumed", "Rewinds", "Total ms", "Self ms");
+  for (j = 0; j < f->rows_num; j++) {
+    fprintf(out, "%-20s %10lu %10lu %10lu %12lu %10lu %10.3f %10.3f\n",
+      s[j].name, s[j].calls, s[j].successes, s[j].failures,
+      s[j].consumed, s[j].rewinds, s[j].time * 1000.0, s[j].self * 1000.0);
   }
-  return s;
+  free(s);
 }
 
-mpc_val_t *mpcf_strtrim(mpc_val_t *x) {
-  return mpcf_strtriml(mpcf_strtrimr(x));
+void mpc_profile_print_json(const mpc_profile_t *f, FILE *out) {
+  int j;
+  const char *c;
+  mpc_rule_stats_t *s = mpc_profile_sorted(f);
+  fprintf(out, "[");
+  for (j = 0; j < f->rows_num; j++) {
+    fprintf(out, "%s\n  {\"rule\": \"", j ? "," : "");
+    for (c = s[j].name; *c; c++) {
+      if (*c == '"' || *c == '\\') { fprintf(out, "\\%c", *c); }
+      else if ((unsigned char)*c < 0x20) { fprintf(out, "\\u%04x", (unsigned char)*c); }
+      else { fputc(*c, out); }
+    }
+    fprintf(out, "\", \"calls\": %lu, \"successes\": %lu, \"failures\": %lu, "
+      "\"consumed\": %lu, \"rewinds\": %lu, \"time\": %.6f, \"self\": %.6f}",
+      s[j].calls, s[j].successes, s[j].failures,
+      s[j].consumed, s[j].rewinds, s[j].time, s[j].self);
+  }
+  fprintf(out, "%s]\n", f->rows_num ? "\n" : "");
+  free(s);
 }
 
-static const char mpc_escape_input_c[]  = {
-  '\a', '\b', '\f', '\n', '\r',
-  '\t', '\v', '\\', '\'', '\"', '\0'};
-    
-static const char *mpc_escape_output_c[] = {
-  "\\a", "\\b", "\\f", "\\n", "\\r", "\\t", 
-  "\\v", "\\\\", "\\'", "\\\"", "\\0", NULL};
-
-static const char mpc_escape_input_raw_re[] = { '/' };
-static const char *mpc_escape_output_raw_re[] = { "\\/", NULL };
+/* Adds the allocation counts of a finished parse to those being collected for `p` */
+static void mpc_input_mem_stats(mpc_input_t *i, mpc_parser_t *p) {
+  if (p->stats == NULL) { return; }
+  p->stats->parses++;
+  p->stats->pooled += i->mem_pooled;
+  p->stats->heap += i->mem_heap;
+  p->stats->exported += i->mem_exported;
+  if (i->mem_bytes > p->stats->pool_bytes) { p->stats->pool_bytes = i->mem_bytes; }
+}
 
-static const char mpc_escape_input_raw_cstr[] = { '"' };
-static const char *mpc_escape_output_raw_cstr[] = { "\\\"", NULL };
+static int mpc_memo_shares_ast(mpc_parser_t *p);
 
-static const char mpc_escape_input_raw_cchar[] = { '\'' };
-static const char *mpc_escape_output_raw_cchar[] = { "\\'", NULL };
+/*
+** Nothing found beyond where parsing started is
+** reported as an unknown error.
+**
+** A grammar with AST memos, as made with
+** `MPCA_LANG_PACKRAT`, is parsed into an arena
+** so that the memos can share nodes, and only
+** the finished tree is copied out to the heap.
+*/
 
-static mpc_val_t *mpcf_escape_new(mpc_val_t *x, const char *input, const char **output) {
+int mpc_parse_input(mpc_input_t *i, mpc_parser_t *p, mpc_result_t *r) {
   
-  int i;
-  int found;
-  char buff[2];
-  char *s = x;
-  char *y = calloc(1, 1);
+  int x;
+  mpc_err_t *e = NULL;
+  mpc_state_t s = i->state;
   
-  while (*s) {
-    
-    i = 0;
-    found = 0;
-
-    while (output[i]) {
-      if (*s == input[i]) {
-        y = realloc(y, strlen(y) + strlen(output[i]) + 1);
-        strcat(y, output[i]);
-        found = 1;
-        break;
-      }
-      i++;
-    }
-    
-    if (!found) {
-      y = realloc(y, strlen(y) + 2);
-      buff[0] = *s; buff[1] = '\0';
-      strcat(y, buff);
-    }
-    
-    s++;
+  if (i->tree == NULL && i->arena == NULL
+  &&  mpc_input_memo_enabled(i) && mpc_memo_shares_ast(p)) {
+    i->arena = mpc_arena_new();
+    i->arena_owned = 1;
   }
   
+  i->err_pos = s.pos;
+  x = p->profile ? mpc_parse_run_profiled(i, p->profile, p, r, &e) : mpc_parse_run(i, p, r, &e);
   
-  return y;
-}
-
-static mpc_val_t *mpcf_unescape_new(mpc_val_t *x, const char *input, const char **output) {
+  if (x) {
+    mpc_err_delete_internal(i, e);
+    r->output = mpc_export(i, r->output);
+    if (i->arena_owned && mpc_arena_has(i->arena, r->output)) { r->output = mpc_ast_copy(r->output); }
+    mpc_input_mem_stats(i, p);
+    return x;
+  }
   
-  int i;
-  int found = 0;
-  char buff[2];
-  char *s = x;
-  char *y = calloc(1, 1);
+  e = mpc_err_merge(i, e, r->error);
   
-  while (*s) {
-    
-    i = 0;
-    found = 0;
-    
-    while (output[i]) {
-      if ((*(s+0)) == output[i][0] &&
-          (*(s+1)) == output[i][1]) {
-        y = realloc(y, strlen(y) + 1 + 1);
-        buff[0] = input[i]; buff[1] = '\0';
-        strcat(y, buff);
-        found = 1;
-        s++;
-        break;
-      }
-      i++;
-    }
-    
-    if (!found) {
-      y = realloc(y, strlen(y) + 1 + 1);
-      buff[0] = *s; buff[1] = '\0';
-      strcat(y, buff);
-    }
-    
-    if (*s == '\0') { break; }
-    else { s++; }
+  if (e == NULL || e->state.pos <= s.pos) {
+    mpc_err_delete_internal(i, e);
+    i->state = s;
+    i->err_pos = s.pos;
+    e = mpc_err_fail(i, "Unknown Error");
   }
   
-  return y;
-  
+  r->error = mpc_err_export(i, e);
+  mpc_input_mem_stats(i, p);
+  return x;
 }
 
-mpc_val_t *mpcf_escape(mpc_val_t *x) {
-  mpc_val_t *y = mpcf_escape_new(x, mpc_escape_input_c, mpc_escape_output_c);
-  free(x);
-  return y;
+int mpc_parse(const char *filename, const char *string, mpc_parser_t *p, mpc_result_t *r) {
+  int x;
+  mpc_input_t *i = mpc_input_new_string(filename, string);
+  x = mpc_parse_input(i, p, r);
+  mpc_input_delete(i);
+  return x;
 }
 
-mpc_val_t *mpcf_unescape(mpc_val_t *x) {
-  mpc_val_t *y = mpcf_unescape_new(x, mpc_escape_input_c, mpc_escape_output_c);
-  free(x);
-  return y;
+int mpc_parse_file(const char *filename, FILE *file, mpc_parser_t *p, mpc_result_t *r) {
+  int x;
+  mpc_input_t *i = mpc_input_new_file(filename, file);
+  x = mpc_parse_input(i, p, r);
+  mpc_input_delete(i);
+  return x;
 }
 
-mpc_val_t *mpcf_escape_regex(mpc_val_t *x) {
-  mpc_val_t *y = mpcf_escape_new(x, mpc_escape_input_raw_re, mpc_escape_output_raw_re);
-  free(x);
-  return y;  
+int mpc_parse_pipe(const char *filename, FILE *pipe, mpc_parser_t *p, mpc_result_t *r) {
+  int x;
+  mpc_input_t *i = mpc_input_new_pipe(filename, pipe);
+  x = mpc_parse_input(i, p, r);
+  mpc_input_delete(i);
+  return x;
 }
 
-mpc_val_t *mpcf_unescape_regex(mpc_val_t *x) {
-  mpc_val_t *y = mpcf_unescape_new(x, mpc_escape_input_raw_re, mpc_escape_output_raw_re);
-  free(x);
-  return y;  
+int mpc_parse_contents(const char *filename, mpc_parser_t *p, mpc_result_t *r) {
+  
+  FILE *f = fopen(filename, "rb");
+  int res;
+  
+  if (f == NULL) {
+    r->output = NULL;
+    r->error = mpc_err_file(filename, "Unable to open file!");
+    return 0;
+  }
+  
+  res = mpc_parse_file(filename, f, p, r);
+  fclose(f);
+  return res;
 }
 
-mpc_val_t *mpcf_escape_string_raw(mpc_val_t *x) {
-  mpc_val_t *y = mpcf_escape_new(x, mpc_escape_input_raw_cstr, mpc_escape_output_raw_cstr);
-  free(x);
-  return y;
+static mpc_tree_t *mpc_tree_layout(mpc_tree_build_t *b, mpc_tree_node_t *root) {
+  
+  int j, k, tags_num = 0, slots = 64;
+  mpc_tree_node_t **q = malloc(sizeof(mpc_tree_node_t*) * slots);
+  mpc_tree_tags_t *x;
+  mpc_tree_t *t = malloc(sizeof(mpc_tree_t));
+  
+  t->names = b->names;
+  t->nodes_num = 0;
+  
+  /* Breadth first, so each node's children land next to each other */
+  if (root) { q[t->nodes_num++] = root; }
+  for (j = 0; j < t->nodes_num; j++) {
+    if (t->nodes_num + q[j]->children_num > slots) {
+      while (t->nodes_num + q[j]->children_num > slots) { slots *= 2; }
+      q = realloc(q, sizeof(mpc_tree_node_t*) * slots);
+    }
+    for (k = 0; k < q[j]->children_num; k++) { q[t->nodes_num++] = q[j]->children[k]; }
+    for (x = q[j]->tags; x; x = x->next) { tags_num++; }
+    tags_num++;
+  }
+  
+  t->nodes = malloc(sizeof(mpc_node_t) * (t->nodes_num ? t->nodes_num : 1));
+  t->tags = malloc(sizeof(int) * (tags_num ? tags_num : 1));
+  
+  tags_num = 0;
+  k = 1;
+  for (j = 0; j < t->nodes_num; j++) {
+    t->nodes[j].tags = tags_num;
+    for (x = q[j]->tags; x; x = x->next) { t->tags[tags_num++] = x->tag; }
+    t->tags[tags_num++] = -1;
+    t->nodes[j].contents = q[j]->contents;
+    t->nodes[j].contents_len = q[j]->contents_len;
+    t->nodes[j].state = q[j]->state;
+    t->nodes[j].children = k;
+    t->nodes[j].children_num = q[j]->children_num;
+    k += q[j]->children_num;
+  }
+  
+  t->text = b->text;
+  b->text = NULL;
+  
+  free(q);
+  return t;
 }
 
-mpc_val_t *mpcf_unescape_string_raw(mpc_val_t *x) {
-  mpc_val_t *y = mpcf_unescape_new(x, mpc_escape_input_raw_cstr, mpc_escape_output_raw_cstr);
-  free(x);
-  return y;
+int mpc_parse_arena(const char *filename, const char *string, mpc_parser_t *p, mpc_arena_t *a, mpc_result_t *r) {
+  int x;
+  mpc_input_t *i = mpc_input_new_string(filename, string);
+  i->arena = a;
+  x = mpc_parse_input(i, p, r);
+  mpc_input_delete(i);
+  return x;
 }
 
-mpc_val_t *mpcf_escape_char_raw(mpc_val_t *x) {
-  mpc_val_t *y = mpcf_escape_new(x, mpc_escape_input_raw_cchar, mpc_escape_output_raw_cchar);
-  free(x);
-  return y;
+int mpc_parse_tree(const char *filename, const char *string, mpc_parser_t *p, const mpc_tags_t *t, mpc_result_t *r) {
+  int x;
+  mpc_input_t *i = mpc_input_new_string(filename, string);
+  i->tree = mpc_tree_build_new(t);
+  x = mpc_parse_input(i, p, r);
+  if (x) { r->output = mpc_tree_layout(i->tree, r->output); }
+  mpc_input_delete(i);
+  return x;
 }
 
-mpc_val_t *mpcf_unescape_char_raw(mpc_val_t *x) {
-  mpc_val_t *y = mpcf_unescape_new(x, mpc_escape_input_raw_cchar, mpc_escape_output_raw_cchar);
-  free(x);
-  return y;
-}
+/*
+** Building a Parser
+*/
 
-mpc_val_t *mpcf_null(int n, mpc_val_t** xs) { (void) n; (void) xs; return NULL; }
-mpc_val_t *mpcf_fst(int n, mpc_val_t **xs) { (void) n; return xs[0]; }
-mpc_val_t *mpcf_snd(int n, mpc_val_t **xs) { (void) n; return xs[1]; }
-mpc_val_t *mpcf_trd(int n, mpc_val_t **xs) { (void) n; return xs[2]; }
+static void mpc_undefine_unretained(mpc_parser_t *p, int force);
 
-static mpc_val_t *mpcf_nth_free(int n, mpc_val_t **xs, int x) {
+static void mpc_undefine_or(mpc_parser_t *p) {
+  
   int i;
-  for (i = 0; i < n; i++) {
-    if (i != x) { free(xs[i]); }
+  for (i = 0; i < p->data.or.n; i++) {
+    mpc_undefine_unretained(p->data.or.xs[i], 0);
   }
-  return xs[x];
+  free(p->data.or.xs);
+  free(p->data.or.first);
+  free(p->data.or.jump);
+  
 }
- 
-mpc_val_t *mpcf_fst_free(int n, mpc_val_t **xs) { return mpcf_nth_free(n, xs, 0); }
-mpc_val_t *mpcf_snd_free(int n, mpc_val_t **xs) { return mpcf_nth_free(n, xs, 1); }
-mpc_val_t *mpcf_trd_free(int n, mpc_val_t **xs) { return mpcf_nth_free(n, xs, 2); }
 
-mpc_val_t *mpcf_strfold(int n, mpc_val_t **xs) {
+static void mpc_undefine_and(mpc_parser_t *p) {
+  
   int i;
-  size_t l = 0;
+  for (i = 0; i < p->data.and.n; i++) {
+    mpc_undefine_unretained(p->data.and.xs[i], 0);
+  }
+  free(p->data.and.xs);
+  free(p->data.and.dxs);
   
-  if (n == 0) { return calloc(1, 1); }
+}
+
+static void mpc_undefine_unretained(mpc_parser_t *p, int force) {
   
-  for (i = 0; i < n; i++) { l += strlen(xs[i]); }
+  if (p->retained && !force) { return; }
   
-  xs[0] = realloc(xs[0], l + 1);
+  switch (p->type) {
+    
+    case MPC_TYPE_FAIL: free(p->data.fail.m); break;
+    
+    case MPC_TYPE_ONEOF: 
+    case MPC_TYPE_NONEOF:
+    case MPC_TYPE_STRING:
+      free(p->data.string.x); 
+      break;
+    
+    case MPC_TYPE_APPLY:    mpc_undefine_unretained(p->data.apply.x, 0);    break;
+    case MPC_TYPE_APPLY_TO: mpc_undefine_unretained(p->data.apply_to.x, 0); break;
+    case MPC_TYPE_PREDICT:  mpc_undefine_unretained(p->data.predict.x, 0);  break;
+    case MPC_TYPE_MEMO:     mpc_undefine_unretained(p->data.memo.x, 0);     break;
+    
+    case MPC_TYPE_REGEX:
+      mpc_undefine_unretained(p->data.regex.x, 0);
+      mpc_dfa_delete(p->data.regex.dfa);
+      break;
+    
+    case MPC_TYPE_MAYBE:
+    case MPC_TYPE_NOT:
+      mpc_undefine_unretained(p->data.not.x, 0);
+      break;
+    
+    case MPC_TYPE_EXPECT:
+      mpc_undefine_unretained(p->data.expect.x, 0);
+      free(p->data.expect.m);
+      break;
+      
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:
+    case MPC_TYPE_COUNT:
+      mpc_undefine_unretained(p->data.repeat.x, 0);
+      break;
+    
+    case MPC_TYPE_SPAN:
+      mpc_undefine_unretained(p->data.span.x, 0);
+      free(p->data.span.scan);
+      break;
+    
+    case MPC_TYPE_OR:  mpc_undefine_or(p);  break;
+    case MPC_TYPE_AND: mpc_undefine_and(p); break;
+    
+    default: break;
+  }
   
-  for (i = 1; i < n; i++) {
-    strcat(xs[0], xs[i]); free(xs[i]);
+  if (!force) {
+    free(p->name);
+    free(p);
   }
   
-  return xs[0];
 }
 
-mpc_val_t *mpcf_maths(int n, mpc_val_t **xs) {
-  int **vs = (int**)xs;
-  (void) n;
+void mpc_delete(mpc_parser_t *p) {
+  if (p->retained) {
+
+    if (p->type != MPC_TYPE_UNDEFINED) {
+      mpc_undefine_unretained(p, 0);
+    } 
+    
+    free(p->name);
+    free(p);
   
-  if (strcmp(xs[1], "*") == 0) { *vs[0] *= *vs[2]; }
-  if (strcmp(xs[1], "/") == 0) { *vs[0] /= *vs[2]; }
-  if (strcmp(xs[1], "%") == 0) { *vs[0] %= *vs[2]; }
-  if (strcmp(xs[1], "+") == 0) { *vs[0] += *vs[2]; }
-  if (strcmp(xs[1], "-") == 0) { *vs[0] -= *vs[2]; }
+  } else {
+    mpc_undefine_unretained(p, 0);  
+  }
+}
+
+static void mpc_soft_delete(mpc_val_t *x) {
+  mpc_undefine_unretained(x, 0);
+}
+
+static mpc_parser_t *mpc_undefined(void) {
+  mpc_parser_t *p = calloc(1, sizeof(mpc_parser_t));
+  p->retained = 0;
+  p->type = MPC_TYPE_UNDEFINED;
+  p->name = NULL;
+  return p;
+}
+
+mpc_parser_t *mpc_new(const char *name) {
+  mpc_parser_t *p = mpc_undefined();
+  p->retained = 1;
+  p->name = realloc(p->name, strlen(name) + 1);
+  strcpy(p->name, name);
+  return p;
+}
+
+mpc_parser_t *mpc_undefine(mpc_parser_t *p) {
+  mpc_undefine_unretained(p, 1);
+  p->type = MPC_TYPE_UNDEFINED;
+  return p;
+}
+
+mpc_parser_t *mpc_define(mpc_parser_t *p, mpc_parser_t *a) {
   
-  free(xs[1]); free(xs[2]);
+  if (p->retained) {
+    p->type = a->type;
+    p->data = a->data;
+  } else {
+    mpc_parser_t *a2 = mpc_failf("Attempt to assign to Unretained Parser!");
+    p->type = a2->type;
+    p->data = a2->data;
+    free(a2);
+  }
   
-  return xs[0];
+  free(a);
+  return p;  
+}
+
+void mpc_cleanup(int n, ...) {
+  int i;
+  mpc_parser_t **list = malloc(sizeof(mpc_parser_t*) * n);
+  
+  va_list va;
+  va_start(va, n);
+  for (i = 0; i < n; i++) { list[i] = va_arg(va, mpc_parser_t*); }
+  for (i = 0; i < n; i++) { mpc_undefine(list[i]); }
+  for (i = 0; i < n; i++) { mpc_delete(list[i]); }  
+  va_end(va);  
+
+  free(list);
+}
+
+mpc_parser_t *mpc_pass(void) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_PASS;
+  return p;
+}
+
+mpc_parser_t *mpc_fail(const char *m) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_FAIL;
+  p->data.fail.m = malloc(strlen(m) + 1);
+  strcpy(p->data.fail.m, m);
+  return p;
 }
 
 /*
-** Printing
+** As `snprintf` is not ANSI standard this 
+** function `mpc_failf` should be considered
+** unsafe.
+**
+** You have a few options if this is going to be
+** trouble.
+**
+** - Ensure the format string does not exceed
+**   the buffer length using precision specifiers
+**   such as `%.512s`.
+**
+** - Patch this function in your code base to 
+**   use `snprintf` or whatever variant your
+**   system supports.
+**
+** - Avoid it altogether.
+**
 */
 
-static void mpc_print_unretained(mpc_parser_t *p, int force) {
-  
-  /* TODO: Print Everything Escaped */
-  
-  int i;
-  char *s, *e;
-  char buff[2];
+mpc_parser_t *mpc_failf(const char *fmt, ...) {
   
-  if (p->retained && !force) {;
-    if (p->name) { printf("<%s>", p->name); }
-    else { printf("<anon>"); }
-    return;
-  }
+  va_list va;
+  char *buffer;
+
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_FAIL;
   
-  if (p->type == MPC_TYPE_UNDEFINED) { printf("<?>"); }
-  if (p->type == MPC_TYPE_PASS)   { printf("<:>"); }
-  if (p->type == MPC_TYPE_FAIL)   { printf("<!>"); }
-  if (p->type == MPC_TYPE_LIFT)   { printf("<#>"); }
-  if (p->type == MPC_TYPE_STATE)  { printf("<S>"); }
-  if (p->type == MPC_TYPE_ANCHOR) { printf("<@>"); }
-  if (p->type == MPC_TYPE_EXPECT) {
-    printf("%s", p->data.expect.m);
-    /*mpc_print_unretained(p->data.expect.x, 0);*/
-  }
+  va_start(va, fmt);
+  buffer = malloc(2048);
+  vsprintf(buffer, fmt, va);
+  va_end(va);
   
-  if (p->type == MPC_TYPE_ANY) { printf("<.>"); }
-  if (p->type == MPC_TYPE_SATISFY) { printf("<f>"); }
+  buffer = realloc(buffer, strlen(buffer) + 1);
+  p->data.fail.m = buffer;
+  return p;
 
-  if (p->type == MPC_TYPE_SINGLE) {
-    buff[0] = p->data.single.x; buff[1] = '\0';
-    s = mpcf_escape_new(
-      buff,
-      mpc_escape_input_c,
-      mpc_escape_output_c);
-    printf("'%s'", s);
-    free(s);
-  }
-  
-  if (p->type == MPC_TYPE_RANGE) {
-    buff[0] = p->data.range.x; buff[1] = '\0';
-    s = mpcf_escape_new(
-      buff,
-      mpc_escape_input_c,
-      mpc_escape_output_c);
+}
+
+mpc_parser_t *mpc_lift_val(mpc_val_t *x) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_LIFT_VAL;
+  p->data.lift.x = x;
+  return p;
+}
+
+mpc_parser_t *mpc_lift(mpc_ctor_t lf) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_LIFT;
+  p->data.lift.lf = lf;
+  return p;
+}
+
+mpc_parser_t *mpc_anchor(int(*f)(char,char)) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_ANCHOR;
+  p->data.anchor.f = f;
+  return mpc_expect(p, "anchor");
+}
+
+mpc_parser_t *mpc_state(void) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_STATE;
+  return p;
+}
+
+mpc_parser_t *mpc_expect(mpc_parser_t *a, const char *expected) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_EXPECT;
+  p->data.expect.x = a;
+  p->data.expect.m = malloc(strlen(expected) + 1);
+  strcpy(p->data.expect.m, expected);
+  return p;
+}
+
+/*
+** As `snprintf` is not ANSI standard this 
+** function `mpc_expectf` should be considered
+** unsafe.
+**
+** You have a few options if this is going to be
+** trouble.
+**
+** - Ensure the format string does not exceed
+**   the buffer length using precision specifiers
+**   such as `%.512s`.
+**
+** - Patch this function in your code base to 
+**   use `snprintf` or whatever variant your
+**   system supports.
+**
+** - Avoid it altogether.
+**
+*/
+
+mpc_parser_t *mpc_expectf(mpc_parser_t *a, const char *fmt, ...) {
+  va_list va;
+  char *buffer;
+
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_EXPECT;
+  
+  va_start(va, fmt);
+  buffer = malloc(2048);
+  vsprintf(buffer, fmt, va);
+  va_end(va);
+  
+  buffer = realloc(buffer, strlen(buffer) + 1);
+  p->data.expect.x = a;
+  p->data.expect.m = buffer;
+  return p;
+}
+
+/*
+** Basic Parsers
+*/
+
+mpc_parser_t *mpc_any(void) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_ANY;
+  return mpc_expect(p, "any character");
+}
+
+mpc_parser_t *mpc_char(char c) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_SINGLE;
+  p->data.single.x = c;
+  return mpc_expectf(p, "'%c'", c);
+}
+
+mpc_parser_t *mpc_range(char s, char e) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_RANGE;
+  p->data.range.x = s;
+  p->data.range.y = e;
+  return mpc_expectf(p, "character between '%c' and '%c'", s, e);
+}
+
+mpc_parser_t *mpc_oneof(const char *s) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_ONEOF;
+  p->data.string.x = malloc(strlen(s) + 1);
+  strcpy(p->data.string.x, s);
+  return mpc_expectf(p, "one of '%s'", s);
+}
+
+mpc_parser_t *mpc_noneof(const char *s) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_NONEOF;
+  p->data.string.x = malloc(strlen(s) + 1);
+  strcpy(p->data.string.x, s);
+  return mpc_expectf(p, "none of '%s'", s);
+
+}
+
+mpc_parser_t *mpc_satisfy(int(*f)(char)) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_SATISFY;
+  p->data.satisfy.f = f;
+  return mpc_expectf(p, "character satisfying function %p", f);
+}
+
+mpc_parser_t *mpc_string(const char *s) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_STRING;
+  p->data.string.x = malloc(strlen(s) + 1);
+  strcpy(p->data.string.x, s);
+  return mpc_expectf(p, "\"%s\"", s);
+}
+
+/*
+** Core Parsers
+*/
+
+mpc_parser_t *mpc_apply(mpc_parser_t *a, mpc_apply_t f) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_APPLY;
+  p->data.apply.x = a;
+  p->data.apply.f = f;
+  return p;
+}
+
+mpc_parser_t *mpc_apply_to(mpc_parser_t *a, mpc_apply_to_t f, void *x) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_APPLY_TO;
+  p->data.apply_to.x = a;
+  p->data.apply_to.f = f;
+  p->data.apply_to.d = x;
+  return p;
+}
+
+mpc_parser_t *mpc_predictive(mpc_parser_t *a) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_PREDICT;
+  p->data.predict.x = a;
+  return p;
+}
+
+/*
+** Packrat parsing. Results of `a` are cached by
+** input position so a rule reached again through
+** a different alternative is not reparsed. `ca`
+** must return a heap allocated copy which `da`
+** can free. The memos `MPCA_LANG_PACKRAT` adds
+** share their ASTs rather than copying them.
+** The table is bounded, so the linear time
+** guarantee only holds while results fit, and
+** a failure served from the table reports
+** only its own expectation, not those of the
+** alternatives that were tried beneath it.
+*/
+
+mpc_parser_t *mpc_memo(mpc_parser_t *a, mpc_dtor_t da, mpc_apply_t ca) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_MEMO;
+  p->data.memo.x = a;
+  p->data.memo.dx = da;
+  p->data.memo.cp = ca;
+  return p;
+}
+
+mpc_parser_t *mpc_not_lift(mpc_parser_t *a, mpc_dtor_t da, mpc_ctor_t lf) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_NOT;
+  p->data.not.x = a;
+  p->data.not.dx = da;
+  p->data.not.lf = lf;
+  return p;
+}
+
+mpc_parser_t *mpc_not(mpc_parser_t *a, mpc_dtor_t da) {
+  return mpc_not_lift(a, da, mpcf_ctor_null);
+}
+
+mpc_parser_t *mpc_maybe_lift(mpc_parser_t *a, mpc_ctor_t lf) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_MAYBE;
+  p->data.not.x = a;
+  p->data.not.lf = lf;
+  return p;
+}
+
+mpc_parser_t *mpc_maybe(mpc_parser_t *a) {
+  return mpc_maybe_lift(a, mpcf_ctor_null);
+}
+
+mpc_parser_t *mpc_many(mpc_fold_t f, mpc_parser_t *a) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_MANY;
+  p->data.repeat.x = a;
+  p->data.repeat.f = f;
+  return p;
+}
+
+mpc_parser_t *mpc_many1(mpc_fold_t f, mpc_parser_t *a) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_MANY1;
+  p->data.repeat.x = a;
+  p->data.repeat.f = f;
+  return p;
+}
+
+mpc_parser_t *mpc_count(int n, mpc_fold_t f, mpc_parser_t *a, mpc_dtor_t da) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_COUNT;
+  p->data.repeat.n = n;
+  p->data.repeat.f = f;
+  p->data.repeat.x = a;
+  p->data.repeat.dx = da;
+  return p;
+}
+
+mpc_parser_t *mpc_or(int n, ...) {
+
+  int i;
+  va_list va;
+
+  mpc_parser_t *p = mpc_undefined();
+  
+  p->type = MPC_TYPE_OR;
+  p->data.or.n = n;
+  p->data.or.xs = malloc(sizeof(mpc_parser_t*) * n);
+  p->data.or.first = NULL;
+  p->data.or.jump = NULL;
+  
+  va_start(va, n);  
+  for (i = 0; i < n; i++) {
+    p->data.or.xs[i] = va_arg(va, mpc_parser_t*);
+  }
+  va_end(va);
+  
+  return p;
+}
+
+mpc_parser_t *mpc_and(int n, mpc_fold_t f, ...) {
+
+  int i;
+  va_list va;
+
+  mpc_parser_t *p = mpc_undefined();
+  
+  p->type = MPC_TYPE_AND;
+  p->data.and.n = n;
+  p->data.and.f = f;
+  p->data.and.xs = malloc(sizeof(mpc_parser_t*) * n);
+  p->data.and.dxs = malloc(sizeof(mpc_dtor_t) * (n-1));
+
+  va_start(va, f);  
+  for (i = 0; i < n; i++) {
+    p->data.and.xs[i] = va_arg(va, mpc_parser_t*);
+  }
+  for (i = 0; i < (n-1); i++) {
+    p->data.and.dxs[i] = va_arg(va, mpc_dtor_t);
+  }  
+  va_end(va);
+  
+  return p;
+}
+
+/*
+** Common Parsers
+*/
+
+static int mpc_soi_anchor(char prev, char next) { (void) next; return (prev == '\0'); }
+static int mpc_eoi_anchor(char prev, char next) { (void) prev; return (next == '\0'); }
+
+mpc_parser_t *mpc_soi(void) { return mpc_expect(mpc_anchor(mpc_soi_anchor), "start of input"); }
+mpc_parser_t *mpc_eoi(void) { return mpc_expect(mpc_anchor(mpc_eoi_anchor), "end of input"); }
+
+static int mpc_boundary_anchor(char prev, char next) {
+  const char* word = "abcdefghijklmnopqrstuvwxyz"
+                     "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+                     "0123456789_";
+  if ( strchr(word, next) &&  prev == '\0') { return 1; }
+  if ( strchr(word, prev) &&  next == '\0') { return 1; }
+  if ( strchr(word, next) && !strchr(word, prev)) { return 1; }
+  if (!strchr(word, next) &&  strchr(word, prev)) { return 1; }
+  return 0;
+}
+
+mpc_parser_t *mpc_boundary(void) { return mpc_expect(mpc_anchor(mpc_boundary_anchor), "boundary"); }
+
+mpc_parser_t *mpc_whitespace(void) { return mpc_expect(mpc_oneof(" \f\n\r\t\v"), "whitespace"); }
+mpc_parser_t *mpc_whitespaces(void) { return mpc_expect(mpc_many(mpcf_strfold, mpc_whitespace()), "spaces"); }
+mpc_parser_t *mpc_blank(void) { return mpc_expect(mpc_apply(mpc_whitespaces(), mpcf_free), "whitespace"); }
+
+mpc_parser_t *mpc_newline(void) { return mpc_expect(mpc_char('\n'), "newline"); }
+mpc_parser_t *mpc_tab(void) { return mpc_expect(mpc_char('\t'), "tab"); }
+mpc_parser_t *mpc_escape(void) { return mpc_and(2, mpcf_strfold, mpc_char('\\'), mpc_any(), free); }
+
+mpc_parser_t *mpc_digit(void) { return mpc_expect(mpc_oneof("0123456789"), "digit"); }
+mpc_parser_t *mpc_hexdigit(void) { return mpc_expect(mpc_oneof("0123456789ABCDEFabcdef"), "hex digit"); }
+mpc_parser_t *mpc_octdigit(void) { return mpc_expect(mpc_oneof("01234567"), "oct digit"); }
+mpc_parser_t *mpc_digits(void) { return mpc_expect(mpc_many1(mpcf_strfold, mpc_digit()), "digits"); }
+mpc_parser_t *mpc_hexdigits(void) { return mpc_expect(mpc_many1(mpcf_strfold, mpc_hexdigit()), "hex digits"); }
+mpc_parser_t *mpc_octdigits(void) { return mpc_expect(mpc_many1(mpcf_strfold, mpc_octdigit()), "oct digits"); }
+
+mpc_parser_t *mpc_lower(void) { return mpc_expect(mpc_oneof("abcdefghijklmnopqrstuvwxyz"), "lowercase letter"); }
+mpc_parser_t *mpc_upper(void) { return mpc_expect(mpc_oneof("ABCDEFGHIJKLMNOPQRSTUVWXYZ"), "uppercase letter"); }
+mpc_parser_t *mpc_alpha(void) { return mpc_expect(mpc_oneof("abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ"), "letter"); }
+mpc_parser_t *mpc_underscore(void) { return mpc_expect(mpc_char('_'), "underscore"); }
+mpc_parser_t *mpc_alphanum(void) { return mpc_expect(mpc_or(3, mpc_alpha(), mpc_digit(), mpc_underscore()), "alphanumeric"); }
+
+mpc_parser_t *mpc_int(void) { return mpc_expect(mpc_apply(mpc_digits(), mpcf_int), "integer"); }
+mpc_parser_t *mpc_hex(void) { return mpc_expect(mpc_apply(mpc_hexdigits(), mpcf_hex), "hexadecimal"); }
+mpc_parser_t *mpc_oct(void) { return mpc_expect(mpc_apply(mpc_octdigits(), mpcf_oct), "octadecimal"); }
+mpc_parser_t *mpc_number(void) { return mpc_expect(mpc_or(3, mpc_int(), mpc_hex(), mpc_oct()), "number"); }
+
+mpc_parser_t *mpc_real(void) {
+
+  /* [+-]?\d+(\.\d+)?([eE][+-]?[0-9]+)? */
+  
+  mpc_parser_t *p0, *p1, *p2, *p30, *p31, *p32, *p3;
+  
+  p0 = mpc_maybe_lift(mpc_oneof("+-"), mpcf_ctor_str);
+  p1 = mpc_digits();
+  p2 = mpc_maybe_lift(mpc_and(2, mpcf_strfold, mpc_char('.'), mpc_digits(), free), mpcf_ctor_str);
+  p30 = mpc_oneof("eE");
+  p31 = mpc_maybe_lift(mpc_oneof("+-"), mpcf_ctor_str);
+  p32 = mpc_digits();
+  p3 = mpc_maybe_lift(mpc_and(3, mpcf_strfold, p30, p31, p32, free, free), mpcf_ctor_str);
+  
+  return mpc_expect(mpc_and(4, mpcf_strfold, p0, p1, p2, p3, free, free, free), "real");
+
+}
+
+mpc_parser_t *mpc_float(void) {
+  return mpc_expect(mpc_apply(mpc_real(), mpcf_float), "float");
+}
+
+mpc_parser_t *mpc_char_lit(void) {
+  return mpc_expect(mpc_between(mpc_or(2, mpc_escape(), mpc_any()), free, "'", "'"), "char");
+}
+
+mpc_parser_t *mpc_string_lit(void) {
+  mpc_parser_t *strchar = mpc_or(2, mpc_escape(), mpc_noneof("\""));
+  return mpc_expect(mpc_between(mpc_many(mpcf_strfold, strchar), free, "\"", "\""), "string");
+}
+
+mpc_parser_t *mpc_regex_lit(void) {  
+  mpc_parser_t *regexchar = mpc_or(2, mpc_escape(), mpc_noneof("/"));
+  return mpc_expect(mpc_between(mpc_many(mpcf_strfold, regexchar), free, "/", "/"), "regex");
+}
+
+mpc_parser_t *mpc_ident(void) {
+  mpc_parser_t *p0, *p1; 
+  p0 = mpc_or(2, mpc_alpha(), mpc_underscore());
+  p1 = mpc_many(mpcf_strfold, mpc_alphanum()); 
+  return mpc_and(2, mpcf_strfold, p0, p1, free);
+}
+
+/*
+** Useful Parsers
+*/
+
+mpc_parser_t *mpc_startwith(mpc_parser_t *a) { return mpc_and(2, mpcf_snd, mpc_soi(), a, mpcf_dtor_null); }
+mpc_parser_t *mpc_endwith(mpc_parser_t *a, mpc_dtor_t da) { return mpc_and(2, mpcf_fst, a, mpc_eoi(), da); }
+mpc_parser_t *mpc_whole(mpc_parser_t *a, mpc_dtor_t da) { return mpc_and(3, mpcf_snd, mpc_soi(), a, mpc_eoi(), mpcf_dtor_null, da); }
+
+mpc_parser_t *mpc_stripl(mpc_parser_t *a) { return mpc_and(2, mpcf_snd, mpc_blank(), a, mpcf_dtor_null); }
+mpc_parser_t *mpc_stripr(mpc_parser_t *a) { return mpc_and(2, mpcf_fst, a, mpc_blank(), mpcf_dtor_null); }
+mpc_parser_t *mpc_strip(mpc_parser_t *a) { return mpc_and(3, mpcf_snd, mpc_blank(), a, mpc_blank(), mpcf_dtor_null, mpcf_dtor_null); }
+mpc_parser_t *mpc_tok(mpc_parser_t *a) { return mpc_and(2, mpcf_fst, a, mpc_blank(), mpcf_dtor_null); }
+mpc_parser_t *mpc_sym(const char *s) { return mpc_tok(mpc_string(s)); }
+
+mpc_parser_t *mpc_total(mpc_parser_t *a, mpc_dtor_t da) { return mpc_whole(mpc_strip(a), da); }
+
+mpc_parser_t *mpc_between(mpc_parser_t *a, mpc_dtor_t ad, const char *o, const char *c) {
+  return mpc_and(3, mpcf_snd_free,
+    mpc_string(o), a, mpc_string(c),
+    free, ad);
+}
+
+mpc_parser_t *mpc_parens(mpc_parser_t *a, mpc_dtor_t ad)   { return mpc_between(a, ad, "(", ")"); }
+mpc_parser_t *mpc_braces(mpc_parser_t *a, mpc_dtor_t ad)   { return mpc_between(a, ad, "<", ">"); }
+mpc_parser_t *mpc_brackets(mpc_parser_t *a, mpc_dtor_t ad) { return mpc_between(a, ad, "{", "}"); }
+mpc_parser_t *mpc_squares(mpc_parser_t *a, mpc_dtor_t ad)  { return mpc_between(a, ad, "[", "]"); }
+
+mpc_parser_t *mpc_tok_between(mpc_parser_t *a, mpc_dtor_t ad, const char *o, const char *c) {
+  return mpc_and(3, mpcf_snd_free,
+    mpc_sym(o), mpc_tok(a), mpc_sym(c),
+    free, ad);
+}
+
+mpc_parser_t *mpc_tok_parens(mpc_parser_t *a, mpc_dtor_t ad)   { return mpc_tok_between(a, ad, "(", ")"); }
+mpc_parser_t *mpc_tok_braces(mpc_parser_t *a, mpc_dtor_t ad)   { return mpc_tok_between(a, ad, "<", ">"); }
+mpc_parser_t *mpc_tok_brackets(mpc_parser_t *a, mpc_dtor_t ad) { return mpc_tok_between(a, ad, "{", "}"); }
+mpc_parser_t *mpc_tok_squares(mpc_parser_t *a, mpc_dtor_t ad)  { return mpc_tok_between(a, ad, "[", "]"); }
+
+/*
+** Regular Expression Parsers
+*/
+
+/*
+** So here is a cute bootstrapping.
+**
+** I'm using the previously defined
+** mpc constructs and functions to
+** parse the user regex string and
+** construct a parser from it.
+**
+** As it turns out lots of the standard
+** mpc functions look a lot like `fold`
+** functions and so can be used indirectly
+** by many of the parsing functions to build
+** a parser directly - as we are parsing.
+**
+** This is certainly something that
+** would be less elegant/interesting 
+** in a two-phase parser which first
+** builds an AST and then traverses it
+** to generate the object.
+**
+** This whole thing acts as a great
+** case study for how trivial it can be
+** to write a great parser in a few
+** lines of code using mpc.
+*/
+
+/*
+**
+**  ### Regular Expression Grammar
+**
+**      <regex> : <term> | (<term> "|" <regex>)
+**     
+**      <term> : <factor>*
+**
+**      <factor> : <base>
+**               | <base> "*"
+**               | <base> "+"
+**               | <base> "?"
+**               | <base> "{" <digits> "}"
+**           
+**      <base> : <char>
+**             | "\" <char>
+**             | "(" <regex> ")"
+**             | "[" <range> "]"
+*/
+
+static mpc_val_t *mpcf_re_or(int n, mpc_val_t **xs) {
+  (void) n;
+  if (xs[1] == NULL) { return xs[0]; }
+  else { return mpc_or(2, xs[0], xs[1]); }
+}
+
+static mpc_val_t *mpcf_re_and(int n, mpc_val_t **xs) {
+  int i;
+  mpc_parser_t *p = mpc_lift(mpcf_ctor_str);
+  for (i = 0; i < n; i++) {
+    p = mpc_and(2, mpcf_strfold, p, xs[i], free);
+  }
+  return p;
+}
+
+static mpc_val_t *mpcf_re_repeat(int n, mpc_val_t **xs) {
+  int num;
+  (void) n;
+  if (xs[1] == NULL) { return xs[0]; }
+  if (strcmp(xs[1], "*") == 0) { free(xs[1]); return mpc_many(mpcf_strfold, xs[0]); }
+  if (strcmp(xs[1], "+") == 0) { free(xs[1]); return mpc_many1(mpcf_strfold, xs[0]); }
+  if (strcmp(xs[1], "?") == 0) { free(xs[1]); return mpc_maybe_lift(xs[0], mpcf_ctor_str); }
+  num = *(int*)xs[1];
+  free(xs[1]);
+  
+  return mpc_count(num, mpcf_strfold, xs[0], free);
+}
+
+static mpc_parser_t *mpc_re_escape_char(char c) {
+  switch (c) {
+    case 'a': return mpc_char('\a');
+    case 'f': return mpc_char('\f');
+    case 'n': return mpc_char('\n');
+    case 'r': return mpc_char('\r');
+    case 't': return mpc_char('\t');
+    case 'v': return mpc_char('\v');
+    case 'b': return mpc_and(2, mpcf_snd, mpc_boundary(), mpc_lift(mpcf_ctor_str), free);
+    case 'B': return mpc_not_lift(mpc_boundary(), free, mpcf_ctor_str);
+    case 'A': return mpc_and(2, mpcf_snd, mpc_soi(), mpc_lift(mpcf_ctor_str), free);
+    case 'Z': return mpc_and(2, mpcf_snd, mpc_eoi(), mpc_lift(mpcf_ctor_str), free);
+    case 'd': return mpc_digit();
+    case 'D': return mpc_not_lift(mpc_digit(), free, mpcf_ctor_str);
+    case 's': return mpc_whitespace();
+    case 'S': return mpc_not_lift(mpc_whitespace(), free, mpcf_ctor_str);
+    case 'w': return mpc_alphanum();
+    case 'W': return mpc_not_lift(mpc_alphanum(), free, mpcf_ctor_str);
+    default: return NULL;
+  }
+}
+
+static mpc_val_t *mpcf_re_escape(mpc_val_t *x) {
+  
+  char *s = x;
+  mpc_parser_t *p;
+  
+  /* Regex Special Characters */
+  if (s[0] == '.') { free(s); return mpc_any(); }
+  if (s[0] == '^') { free(s); return mpc_and(2, mpcf_snd, mpc_soi(), mpc_lift(mpcf_ctor_str), free); }
+  if (s[0] == '$') { free(s); return mpc_and(2, mpcf_snd, mpc_eoi(), mpc_lift(mpcf_ctor_str), free); }
+  
+  /* Regex Escape */
+  if (s[0] == '\\') {
+    p = mpc_re_escape_char(s[1]);
+    p = (p == NULL) ? mpc_char(s[1]) : p;
+    free(s);
+    return p;
+  }
+  
+  /* Regex Standard */
+  p = mpc_char(s[0]);
+  free(s);
+  return p;
+}
+
+static const char *mpc_re_range_escape_char(char c) {
+  switch (c) {
+    case '-': return "-";
+    case 'a': return "\a";
+    case 'f': return "\f";
+    case 'n': return "\n";
+    case 'r': return "\r";
+    case 't': return "\t";
+    case 'v': return "\v";
+    case 'b': return "\b";
+    case 'd': return "0123456789";
+    case 's': return " \f\n\r\t\v";
+    case 'w': return "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_";
+    default: return NULL;
+  }
+}
+
+static mpc_val_t *mpcf_re_range(mpc_val_t *x) {
+  
+  mpc_parser_t *out;
+  size_t i, j;
+  size_t start, end;
+  const char *tmp = NULL;
+  const char *s = x;
+  int comp = s[0] == '^' ? 1 : 0;
+  char *range = calloc(1,1);
+  
+  if (s[0] == '\0') { free(x); return mpc_fail("Invalid Regex Range Expression"); } 
+  if (s[0] == '^' && 
+      s[1] == '\0') { free(x); return mpc_fail("Invalid Regex Range Expression"); }
+  
+  for (i = comp; i < strlen(s); i++){
+    
+    /* Regex Range Escape */
+    if (s[i] == '\\') {
+      tmp = mpc_re_range_escape_char(s[i+1]);
+      if (tmp != NULL) {
+        range = realloc(range, strlen(range) + strlen(tmp) + 1);
+        strcat(range, tmp);
+      } else {
+        range = realloc(range, strlen(range) + 1 + 1);
+        range[strlen(range) + 1] = '\0';
+        range[strlen(range) + 0] = s[i+1];      
+      }
+      i++;
+    }
+    
+    /* Regex Range...Range */
+    else if (s[i] == '-') {
+      if (s[i+1] == '\0' || i == 0) {
+          range = realloc(range, strlen(range) + strlen("-") + 1);
+          strcat(range, "-");
+      } else {
+        start = s[i-1]+1;
+        end = s[i+1]-1;
+        for (j = start; j <= end; j++) {
+          range = realloc(range, strlen(range) + 1 + 1 + 1);
+          range[strlen(range) + 1] = '\0';
+          range[strlen(range) + 0] = j;
+        }        
+      }
+    }
+    
+    /* Regex Range Normal */
+    else {
+      range = realloc(range, strlen(range) + 1 + 1);
+      range[strlen(range) + 1] = '\0';
+      range[strlen(range) + 0] = s[i];
+    }
+  
+  }
+  
+  out = comp == 1 ? mpc_noneof(range) : mpc_oneof(range);
+  
+  free(x);
+  free(range);
+  
+  return out;
+}
+
+/*
+** The combinator tree is kept alongside the
+** DFA, both as a fallback for regexes the DFA
+** cannot express and to report exact errors.
+*/
+
+static mpc_parser_t *mpc_regex(mpc_parser_t *a) {
+  mpc_parser_t *p = mpc_undefined();
+  p->type = MPC_TYPE_REGEX;
+  p->data.regex.x = a;
+  p->data.regex.dfa = mpc_dfa_new(a);
+  return p;
+}
+
+mpc_parser_t *mpc_re(const char *re) {
+  
+  char *err_msg;
+  mpc_parser_t *err_out;
+  mpc_result_t r;
+  mpc_parser_t *Regex, *Term, *Factor, *Base, *Range, *RegexEnclose; 
+  
+  Regex  = mpc_new("regex");
+  Term   = mpc_new("term");
+  Factor = mpc_new("factor");
+  Base   = mpc_new("base");
+  Range  = mpc_new("range");
+  
+  mpc_define(Regex, mpc_and(2, mpcf_re_or,
+    Term, 
+    mpc_maybe(mpc_and(2, mpcf_snd_free, mpc_char('|'), Regex, free)),
+    (mpc_dtor_t)mpc_delete
+  ));
+  
+  mpc_define(Term, mpc_many(mpcf_re_and, Factor));
+  
+  mpc_define(Factor, mpc_and(2, mpcf_re_repeat,
+    Base,
+    mpc_or(5,
+      mpc_char('*'), mpc_char('+'), mpc_char('?'),
+      mpc_brackets(mpc_int(), free),
+      mpc_pass()),
+    (mpc_dtor_t)mpc_delete
+  ));
+  
+  mpc_define(Base, mpc_or(4,
+    mpc_parens(Regex, (mpc_dtor_t)mpc_delete),
+    mpc_squares(Range, (mpc_dtor_t)mpc_delete),
+    mpc_apply(mpc_escape(), mpcf_re_escape),
+    mpc_apply(mpc_noneof(")|"), mpcf_re_escape)
+  ));
+  
+  mpc_define(Range, mpc_apply(
+    mpc_many(mpcf_strfold, mpc_or(2, mpc_escape(), mpc_noneof("]"))),
+    mpcf_re_range
+  ));
+  
+  RegexEnclose = mpc_whole(mpc_predictive(Regex), (mpc_dtor_t)mpc_delete);
+  
+  mpc_optimise(RegexEnclose);
+  mpc_optimise(Regex);
+  mpc_optimise(Term);
+  mpc_optimise(Factor);
+  mpc_optimise(Base);
+  mpc_optimise(Range);
+  
+  if(!mpc_parse("<mpc_re_compiler>", re, RegexEnclose, &r)) {
+    err_msg = mpc_err_string(r.error);
+    err_out = mpc_failf("Invalid Regex: %s", err_msg);
+    mpc_err_delete(r.error);  
+    free(err_msg);
+    r.output = err_out;
+  }
+  
+  mpc_cleanup(6, RegexEnclose, Regex, Term, Factor, Base, Range);
+  
+  mpc_optimise(r.output);
+  
+  return mpc_regex(r.output);
+  
+}
+
+/*
+** Common Fold Functions
+*/
+
+void mpcf_dtor_null(mpc_val_t *x) { (void) x; return; }
+
+mpc_val_t *mpcf_ctor_null(void) { return NULL; }
+mpc_val_t *mpcf_ctor_str(void) { return calloc(1, 1); }
+mpc_val_t *mpcf_free(mpc_val_t *x) { free(x); return NULL; }
+
+mpc_val_t *mpcf_int(mpc_val_t *x) {
+  int *y = malloc(sizeof(int));
+  *y = strtol(x, NULL, 10);
+  free(x);
+  return y;
+}
+
+mpc_val_t *mpcf_hex(mpc_val_t *x) {
+  int *y = malloc(sizeof(int));
+  *y = strtol(x, NULL, 16);
+  free(x);
+  return y;
+}
+
+mpc_val_t *mpcf_oct(mpc_val_t *x) {
+  int *y = malloc(sizeof(int));
+  *y = strtol(x, NULL, 8);
+  free(x);
+  return y;
+}
+
+mpc_val_t *mpcf_float(mpc_val_t *x) {
+  float *y = malloc(sizeof(float));
+  *y = strtod(x, NULL);
+  free(x);
+  return y;
+}
+
+mpc_val_t *mpcf_strtriml(mpc_val_t *x) {
+  char *s = x;
+  while (isspace(*s)) {
+    memmove(s, s+1, strlen(s));
+  }
+  return s;
+}
+
+mpc_val_t *mpcf_strtrimr(mpc_val_t *x) {
+  char *s = x;
+  size_t l = strlen(s);
+  while (isspace(s[l-1])) {
+    s[l-1] = '\0'; l--;
+  }
+  return s;
+}
+
+mpc_val_t *mpcf_strtrim(mpc_val_t *x) {
+  return mpcf_strtriml(mpcf_strtrimr(x));
+}
+
+static const char mpc_escape_input_c[]  = {
+  '\a', '\b', '\f', '\n', '\r',
+  '\t', '\v', '\\', '\'', '\"', '\0'};
+    
+static const char *mpc_escape_output_c[] = {
+  "\\a", "\\b", "\\f", "\\n", "\\r", "\\t", 
+  "\\v", "\\\\", "\\'", "\\\"", "\\0", NULL};
+
+static const char mpc_escape_input_raw_re[] = { '/' };
+static const char *mpc_escape_output_raw_re[] = { "\\/", NULL };
+
+static const char mpc_escape_input_raw_cstr[] = { '"' };
+static const char *mpc_escape_output_raw_cstr[] = { "\\\"", NULL };
+
+static const char mpc_escape_input_raw_cchar[] = { '\'' };
+static const char *mpc_escape_output_raw_cchar[] = { "\\'", NULL };
+
+static mpc_val_t *mpcf_escape_new(mpc_val_t *x, const char *input, const char **output) {
+  
+  int i;
+  int found;
+  char buff[2];
+  char *s = x;
+  char *y = calloc(1, 1);
+  
+  while (*s) {
+    
+    i = 0;
+    found = 0;
+
+    while (output[i]) {
+      if (*s == input[i]) {
+        y = realloc(y, strlen(y) + strlen(output[i]) + 1);
+        strcat(y, output[i]);
+        found = 1;
+        break;
+      }
+      i++;
+    }
+    
+    if (!found) {
+      y = realloc(y, strlen(y) + 2);
+      buff[0] = *s; buff[1] = '\0';
+      strcat(y, buff);
+    }
+    
+    s++;
+  }
+  
+  
+  return y;
+}
+
+static mpc_val_t *mpcf_unescape_new(mpc_val_t *x, const char *input, const char **output) {
+  
+  int i;
+  int found = 0;
+  char buff[2];
+  char *s = x;
+  char *y = calloc(1, 1);
+  
+  while (*s) {
+    
+    i = 0;
+    found = 0;
+    
+    while (output[i]) {
+      if ((*(s+0)) == output[i][0] &&
+          (*(s+1)) == output[i][1]) {
+        y = realloc(y, strlen(y) + 1 + 1);
+        buff[0] = input[i]; buff[1] = '\0';
+        strcat(y, buff);
+        found = 1;
+        s++;
+        break;
+      }
+      i++;
+    }
+    
+    if (!found) {
+      y = realloc(y, strlen(y) + 1 + 1);
+      buff[0] = *s; buff[1] = '\0';
+      strcat(y, buff);
+    }
+    
+    if (*s == '\0') { break; }
+    else { s++; }
+  }
+  
+  return y;
+  
+}
+
+mpc_val_t *mpcf_escape(mpc_val_t *x) {
+  mpc_val_t *y = mpcf_escape_new(x, mpc_escape_input_c, mpc_escape_output_c);
+  free(x);
+  return y;
+}
+
+mpc_val_t *mpcf_unescape(mpc_val_t *x) {
+  mpc_val_t *y = mpcf_unescape_new(x, mpc_escape_input_c, mpc_escape_output_c);
+  free(x);
+  return y;
+}
+
+mpc_val_t *mpcf_escape_regex(mpc_val_t *x) {
+  mpc_val_t *y = mpcf_escape_new(x, mpc_escape_input_raw_re, mpc_escape_output_raw_re);
+  free(x);
+  return y;  
+}
+
+mpc_val_t *mpcf_unescape_regex(mpc_val_t *x) {
+  mpc_val_t *y = mpcf_unescape_new(x, mpc_escape_input_raw_re, mpc_escape_output_raw_re);
+  free(x);
+  return y;  
+}
+
+mpc_val_t *mpcf_escape_string_raw(mpc_val_t *x) {
+  mpc_val_t *y = mpcf_escape_new(x, mpc_escape_input_raw_cstr, mpc_escape_output_raw_cstr);
+  free(x);
+  return y;
+}
+
+mpc_val_t *mpcf_unescape_string_raw(mpc_val_t *x) {
+  mpc_val_t *y = mpcf_unescape_new(x, mpc_escape_input_raw_cstr, mpc_escape_output_raw_cstr);
+  free(x);
+  return y;
+}
+
+mpc_val_t *mpcf_escape_char_raw(mpc_val_t *x) {
+  mpc_val_t *y = mpcf_escape_new(x, mpc_escape_input_raw_cchar, mpc_escape_output_raw_cchar);
+  free(x);
+  return y;
+}
+
+mpc_val_t *mpcf_unescape_char_raw(mpc_val_t *x) {
+  mpc_val_t *y = mpcf_unescape_new(x, mpc_escape_input_raw_cchar, mpc_escape_output_raw_cchar);
+  free(x);
+  return y;
+}
+
+mpc_val_t *mpcf_null(int n, mpc_val_t** xs) { (void) n; (void) xs; return NULL; }
+mpc_val_t *mpcf_fst(int n, mpc_val_t **xs) { (void) n; return xs[0]; }
+mpc_val_t *mpcf_snd(int n, mpc_val_t **xs) { (void) n; return xs[1]; }
+mpc_val_t *mpcf_trd(int n, mpc_val_t **xs) { (void) n; return xs[2]; }
+
+static mpc_val_t *mpcf_nth_free(int n, mpc_val_t **xs, int x) {
+  int i;
+  for (i = 0; i < n; i++) {
+    if (i != x) { free(xs[i]); }
+  }
+  return xs[x];
+}
+ 
+mpc_val_t *mpcf_fst_free(int n, mpc_val_t **xs) { return mpcf_nth_free(n, xs, 0); }
+mpc_val_t *mpcf_snd_free(int n, mpc_val_t **xs) { return mpcf_nth_free(n, xs, 1); }
+mpc_val_t *mpcf_trd_free(int n, mpc_val_t **xs) { return mpcf_nth_free(n, xs, 2); }
+
+mpc_val_t *mpcf_strfold(int n, mpc_val_t **xs) {
+  int i;
+  size_t l = 0;
+  
+  if (n == 0) { return calloc(1, 1); }
+  
+  for (i = 0; i < n; i++) { l += strlen(xs[i]); }
+  
+  xs[0] = realloc(xs[0], l + 1);
+  
+  /* Append at the end found so far, as strcat would rescan the whole string each time */
+  l = strlen(xs[0]);
+  for (i = 1; i < n; i++) {
+    size_t k = strlen(xs[i]);
+    memcpy((char*)xs[0] + l, xs[i], k + 1); free(xs[i]);
+    l += k;
+  }
+  
+  return xs[0];
+}
+
+mpc_val_t *mpcf_maths(int n, mpc_val_t **xs) {
+  int **vs = (int**)xs;
+  (void) n;
+  
+  if (strcmp(xs[1], "*") == 0) { *vs[0] *= *vs[2]; }
+  if (strcmp(xs[1], "/") == 0) { *vs[0] /= *vs[2]; }
+  if (strcmp(xs[1], "%") == 0) { *vs[0] %= *vs[2]; }
+  if (strcmp(xs[1], "+") == 0) { *vs[0] += *vs[2]; }
+  if (strcmp(xs[1], "-") == 0) { *vs[0] -= *vs[2]; }
+  
+  free(xs[1]); free(xs[2]);
+  
+  return xs[0];
+}
+
+/*
+** Printing
+*/
+
+static void mpc_print_unretained(mpc_parser_t *p, int force) {
+  
+  /* TODO: Print Everything Escaped */
+  
+  int i;
+  char *s, *e;
+  char buff[2];
+  
+  if (p->retained && !force) {;
+    if (p->name) { printf("<%s>", p->name); }
+    else { printf("<anon>"); }
+    return;
+  }
+  
+  if (p->type == MPC_TYPE_UNDEFINED) { printf("<?>"); }
+  if (p->type == MPC_TYPE_PASS)   { printf("<:>"); }
+  if (p->type == MPC_TYPE_FAIL)   { printf("<!>"); }
+  if (p->type == MPC_TYPE_LIFT)   { printf("<#>"); }
+  if (p->type == MPC_TYPE_STATE)  { printf("<S>"); }
+  if (p->type == MPC_TYPE_ANCHOR) { printf("<@>"); }
+  if (p->type == MPC_TYPE_EXPECT) {
+    printf("%s", p->data.expect.m);
+    /*mpc_print_unretained(p->data.expect.x, 0);*/
+  }
+  if (p->type == MPC_TYPE_MEMO) { mpc_print_unretained(p->data.memo.x, 0); }
+  if (p->type == MPC_TYPE_REGEX) { mpc_print_unretained(p->data.regex.x, 0); }
+  
+  if (p->type == MPC_TYPE_ANY) { printf("<.>"); }
+  if (p->type == MPC_TYPE_SATISFY) { printf("<f>"); }
+
+  if (p->type == MPC_TYPE_SINGLE) {
+    buff[0] = p->data.single.x; buff[1] = '\0';
+    s = mpcf_escape_new(
+      buff,
+      mpc_escape_input_c,
+      mpc_escape_output_c);
+    printf("'%s'", s);
+    free(s);
+  }
+  
+  if (p->type == MPC_TYPE_RANGE) {
+    buff[0] = p->data.range.x; buff[1] = '\0';
+    s = mpcf_escape_new(
+      buff,
+      mpc_escape_input_c,
+      mpc_escape_output_c);
     buff[0] = p->data.range.y; buff[1] = '\0';
     e = mpcf_escape_new(
       buff,
@@ -2415,1125 +4458,3671 @@ static void mpc_print_unretained(mpc_parser_t *p, int force) {
     free(e);
   }
   
-  if (p->type == MPC_TYPE_ONEOF) {
-    s = mpcf_escape_new(
-      p->data.string.x,
-      mpc_escape_input_c,
-      mpc_escape_output_c);
-    printf("[%s]", s);
-    free(s);
+  if (p->type == MPC_TYPE_ONEOF) {
+    s = mpcf_escape_new(
+      p->data.string.x,
+      mpc_escape_input_c,
+      mpc_escape_output_c);
+    printf("[%s]", s);
+    free(s);
+  }
+  
+  if (p->type == MPC_TYPE_NONEOF) {
+    s = mpcf_escape_new(
+      p->data.string.x,
+      mpc_escape_input_c,
+      mpc_escape_output_c);
+    printf("[^%s]", s);
+    free(s);
+  }
+  
+  if (p->type == MPC_TYPE_CHARSET) {
+    printf("[");
+    for (i = 1; i < 256; i++) {
+      if (!mpc_input_charset_has(p->data.charset.x, (char)i)) { continue; }
+      buff[0] = (char)i; buff[1] = '\0';
+      s = mpcf_escape_new(
+        buff,
+        mpc_escape_input_c,
+        mpc_escape_output_c);
+      printf("%s", s);
+      free(s);
+    }
+    printf("]");
+  }
+  
+  if (p->type == MPC_TYPE_STRING) {
+    s = mpcf_escape_new(
+      p->data.string.x,
+      mpc_escape_input_c,
+      mpc_escape_output_c);
+    printf("\"%s\"", s);
+    free(s);
+  }
+  
+  if (p->type == MPC_TYPE_APPLY)    { mpc_print_unretained(p->data.apply.x, 0); }
+  if (p->type == MPC_TYPE_APPLY_TO) { mpc_print_unretained(p->data.apply_to.x, 0); }
+  if (p->type == MPC_TYPE_PREDICT)  { mpc_print_unretained(p->data.predict.x, 0); }
+
+  if (p->type == MPC_TYPE_NOT)   { mpc_print_unretained(p->data.not.x, 0); printf("!"); }
+  if (p->type == MPC_TYPE_MAYBE) { mpc_print_unretained(p->data.not.x, 0); printf("?"); }
+
+  if (p->type == MPC_TYPE_MANY)  { mpc_print_unretained(p->data.repeat.x, 0); printf("*"); }
+  if (p->type == MPC_TYPE_MANY1) { mpc_print_unretained(p->data.repeat.x, 0); printf("+"); }
+  if (p->type == MPC_TYPE_COUNT) { mpc_print_unretained(p->data.repeat.x, 0); printf("{%i}", p->data.repeat.n); }
+  if (p->type == MPC_TYPE_SPAN)  { mpc_print_unretained(p->data.span.x, 0); printf(p->data.span.min ? "+" : "*"); }
+  
+  if (p->type == MPC_TYPE_OR) {
+    printf("(");
+    for(i = 0; i < p->data.or.n-1; i++) {
+      mpc_print_unretained(p->data.or.xs[i], 0);
+      printf(" | ");
+    }
+    mpc_print_unretained(p->data.or.xs[p->data.or.n-1], 0);
+    printf(")");
+  }
+  
+  if (p->type == MPC_TYPE_AND) {
+    printf("(");
+    for(i = 0; i < p->data.and.n-1; i++) {
+      mpc_print_unretained(p->data.and.xs[i], 0);
+      printf(" ");
+    }
+    mpc_print_unretained(p->data.and.xs[p->data.and.n-1], 0);
+    printf(")");
+  }
+  
+}
+
+void mpc_print(mpc_parser_t *p) {
+  mpc_print_unretained(p, 1);
+  printf("\n");
+}
+
+/*
+** Testing
+*/
+
+/*
+** These functions are slightly unwieldy and
+** also the whole of the testing suite for mpc
+** mpc is pretty shaky.
+**
+** It could do with a lot more tests and more
+** precision. Currently I am only really testing
+** changes off of the examples.
+**
+*/
+
+int mpc_test_fail(mpc_parser_t *p, const char *s, const void *d,
+  int(*tester)(const void*, const void*),
+  mpc_dtor_t destructor,
+  void(*printer)(const void*)) {
+  mpc_result_t r;
+  (void) printer;
+  if (mpc_parse("<test>", s, p, &r)) {
+
+    if (tester(r.output, d)) {
+      destructor(r.output);
+      return 0;
+    } else {
+      destructor(r.output);
+      return 1;
+    }
+  
+  } else {
+    mpc_err_delete(r.error);
+    return 1;
+  }
+  
+}
+
+int mpc_test_pass(mpc_parser_t *p, const char *s, const void *d,
+  int(*tester)(const void*, const void*), 
+  mpc_dtor_t destructor, 
+  void(*printer)(const void*)) {
+
+  mpc_result_t r;  
+  if (mpc_parse("<test>", s, p, &r)) {
+    
+    if (tester(r.output, d)) {
+      destructor(r.output);
+      return 1;
+    } else {
+      printf("Got "); printer(r.output); printf("\n");
+      printf("Expected "); printer(d); printf("\n");
+      destructor(r.output);
+      return 0;
+    }
+    
+  } else {    
+    mpc_err_print(r.error);
+    mpc_err_delete(r.error);
+    return 0;
+    
+  }
+  
+}
+
+
+/*
+** AST
+*/
+
+/* Children waiting to be deleted are kept on the heap, so deeply nested trees can't overflow the stack */
+void mpc_ast_delete(mpc_ast_t *a) {
+  
+  int i, n = 0, slots = 0;
+  mpc_ast_t **stack = NULL;
+  
+  while (a) {
+    
+    if (n + a->children_num > slots) {
+      slots = (n + a->children_num) * 2;
+      stack = realloc(stack, sizeof(mpc_ast_t*) * slots);
+    }
+    
+    for (i = 0; i < a->children_num; i++) { stack[n++] = a->children[i]; }
+    
+    free(a->children);
+    free(a->tag);
+    free(a->contents);
+    free(a);
+    
+    a = n ? stack[--n] : NULL;
+  }
+  
+  free(stack);
+}
+
+static mpc_val_t *mpc_ast_copy(mpc_val_t *x) {
+  
+  int i;
+  mpc_ast_t *a = x;
+  mpc_ast_t *b;
+  
+  if (a == NULL) { return NULL; }
+  
+  b = mpc_ast_new(a->tag, a->contents);
+  b->state = a->state;
+  b->children_num = a->children_num;
+  b->children = a->children_num ? malloc(sizeof(mpc_ast_t*) * a->children_num) : NULL;
+  
+  for (i = 0; i < a->children_num; i++) {
+    b->children[i] = mpc_ast_copy(a->children[i]);
+  }
+  
+  return b;
+  
+}
+
+static void mpc_ast_delete_no_children(mpc_ast_t *a) {
+  free(a->children);
+  free(a->tag);
+  free(a->contents);
+  free(a);
+}
+
+mpc_ast_t *mpc_ast_new(const char *tag, const char *contents) {
+  
+  mpc_ast_t *a = malloc(sizeof(mpc_ast_t));
+  
+  a->tag = malloc(strlen(tag) + 1);
+  strcpy(a->tag, tag);
+  
+  a->contents = malloc(strlen(contents) + 1);
+  strcpy(a->contents, contents);
+  
+  a->state = mpc_state_new();
+  
+  a->children_num = 0;
+  a->children = NULL;
+  return a;
+  
+}
+
+mpc_ast_t *mpc_ast_build(int n, const char *tag, ...) {
+  
+  mpc_ast_t *a = mpc_ast_new(tag, "");
+  
+  int i;
+  va_list va;
+  va_start(va, tag);
+  
+  for (i = 0; i < n; i++) {
+    mpc_ast_add_child(a, va_arg(va, mpc_ast_t*));
+  }
+  
+  va_end(va);
+  
+  return a;
+  
+}
+
+mpc_ast_t *mpc_ast_add_root(mpc_ast_t *a) {
+
+  mpc_ast_t *r;
+
+  if (a == NULL) { return a; }
+  if (a->children_num == 0) { return a; }
+  if (a->children_num == 1) { return a; }
+
+  r = mpc_ast_new(">", "");
+  mpc_ast_add_child(r, a);
+  return r;
+}
+
+int mpc_ast_eq(mpc_ast_t *a, mpc_ast_t *b) {
+  
+  int i;
+
+  if (strcmp(a->tag, b->tag) != 0) { return 0; }
+  if (strcmp(a->contents, b->contents) != 0) { return 0; }
+  if (a->children_num != b->children_num) { return 0; }
+  
+  for (i = 0; i < a->children_num; i++) {
+    if (!mpc_ast_eq(a->children[i], b->children[i])) { return 0; }
+  }
+  
+  return 1;
+}
+
+mpc_ast_t *mpc_ast_add_child(mpc_ast_t *r, mpc_ast_t *a) {
+  r->children_num++;
+  r->children = realloc(r->children, sizeof(mpc_ast_t*) * r->children_num);
+  r->children[r->children_num-1] = a;
+  return r;
+}
+
+mpc_ast_t *mpc_ast_add_tag(mpc_ast_t *a, const char *t) {
+  if (a == NULL) { return a; }
+  a->tag = realloc(a->tag, strlen(t) + 1 + strlen(a->tag) + 1);
+  memmove(a->tag + strlen(t) + 1, a->tag, strlen(a->tag)+1);
+  memmove(a->tag, t, strlen(t));
+  memmove(a->tag + strlen(t), "|", 1);
+  return a;
+}
+
+mpc_ast_t *mpc_ast_tag(mpc_ast_t *a, const char *t) {
+  a->tag = realloc(a->tag, strlen(t) + 1);
+  strcpy(a->tag, t);
+  return a;
+}
+
+mpc_ast_t *mpc_ast_state(mpc_ast_t *a, mpc_state_t s) {
+  if (a == NULL) { return a; }
+  a->state = s;
+  return a;
+}
+
+static void mpc_ast_print_depth(mpc_ast_t *a, int d, FILE *fp) {
+  
+  int i;
+  
+  if (a == NULL) {
+    fprintf(fp, "NULL\n");
+    return;
+  }
+  
+  for (i = 0; i < d; i++) { fprintf(fp, "  "); }
+  
+  if (strlen(a->contents)) {
+    fprintf(fp, "%s:%lu:%lu '%s'\n", a->tag, 
+      (long unsigned int)(a->state.row+1),
+      (long unsigned int)(a->state.col+1),
+      a->contents);
+  } else {
+    fprintf(fp, "%s \n", a->tag);
+  }
+  
+  for (i = 0; i < a->children_num; i++) {
+    mpc_ast_print_depth(a->children[i], d+1, fp);
+  }
+  
+}
+
+void mpc_ast_print(mpc_ast_t *a) {
+  mpc_ast_print_depth(a, 0, stdout);
+}
+
+void mpc_ast_print_to(mpc_ast_t *a, FILE *fp) {
+  mpc_ast_print_depth(a, 0, fp);
+}
+
+/*
+** Compact AST
+*/
+
+static void mpc_tags_insert(mpc_tags_t *t, const char *key) {
+  
+  int j, k;
+  const char **keys;
+  int *ids;
+  
+  for (j = mpc_tags_hash(t, key); t->keys[j]; j = (j + 1) & (t->slots - 1)) {
+    if (t->keys[j] == key) { return; }
+  }
+  
+  k = mpc_tags_find(t, key);
+  if (k < 0) {
+    k = t->num++;
+    t->names = realloc(t->names, sizeof(char*) * t->num);
+    t->names[k] = malloc(strlen(key) + 1);
+    strcpy(t->names[k], key);
+  }
+  
+  t->keys[j] = key;
+  t->ids[j] = k;
+  
+  /* Keep the table at most half full */
+  if (++t->keys_num * 2 <= t->slots) { return; }
+  
+  keys = t->keys;
+  ids = t->ids;
+  t->slots *= 2;
+  t->keys = calloc(t->slots, sizeof(char*));
+  t->ids = calloc(t->slots, sizeof(int));
+  for (k = 0; k < t->slots / 2; k++) {
+    if (keys[k] == NULL) { continue; }
+    for (j = mpc_tags_hash(t, keys[k]); t->keys[j]; j = (j + 1) & (t->slots - 1));
+    t->keys[j] = keys[k];
+    t->ids[j] = ids[k];
+  }
+  free(keys);
+  free(ids);
+}
+
+static void mpc_tags_collect(mpc_tags_t *t, mpc_parser_t *p, mpc_parser_t ***seen, int *seen_num) {
+  
+  int j;
+  
+  if (p->retained) {
+    for (j = 0; j < *seen_num; j++) { if ((*seen)[j] == p) { return; } }
+    *seen = realloc(*seen, sizeof(mpc_parser_t*) * (*seen_num + 1));
+    (*seen)[(*seen_num)++] = p;
+  }
+  
+  switch (p->type) {
+    case MPC_TYPE_APPLY_TO:
+      if (p->data.apply_to.f == (mpc_apply_to_t)mpc_ast_tag
+      ||  p->data.apply_to.f == (mpc_apply_to_t)mpc_ast_add_tag) {
+        mpc_tags_insert(t, p->data.apply_to.d);
+      }
+      mpc_tags_collect(t, p->data.apply_to.x, seen, seen_num);
+      break;
+    case MPC_TYPE_EXPECT:  mpc_tags_collect(t, p->data.expect.x, seen, seen_num); break;
+    case MPC_TYPE_APPLY:   mpc_tags_collect(t, p->data.apply.x, seen, seen_num); break;
+    case MPC_TYPE_PREDICT: mpc_tags_collect(t, p->data.predict.x, seen, seen_num); break;
+    case MPC_TYPE_MEMO:    mpc_tags_collect(t, p->data.memo.x, seen, seen_num); break;
+    case MPC_TYPE_NOT:
+    case MPC_TYPE_MAYBE:   mpc_tags_collect(t, p->data.not.x, seen, seen_num); break;
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:
+    case MPC_TYPE_COUNT:   mpc_tags_collect(t, p->data.repeat.x, seen, seen_num); break;
+    case MPC_TYPE_OR:
+      for (j = 0; j < p->data.or.n; j++) { mpc_tags_collect(t, p->data.or.xs[j], seen, seen_num); }
+      break;
+    case MPC_TYPE_AND:
+      for (j = 0; j < p->data.and.n; j++) { mpc_tags_collect(t, p->data.and.xs[j], seen, seen_num); }
+      break;
+    default: break;
+  }
+  
+}
+
+mpc_tags_t *mpc_tags_new(mpc_parser_t *p) {
+  
+  mpc_parser_t **seen = NULL;
+  int seen_num = 0;
+  mpc_tags_t *t = malloc(sizeof(mpc_tags_t));
+  
+  t->num = 2;
+  t->names = malloc(sizeof(char*) * t->num);
+  t->names[MPC_TAGS_NONE] = calloc(1, 1);
+  t->names[MPC_TAGS_ROOT] = malloc(2);
+  strcpy(t->names[MPC_TAGS_ROOT], ">");
+  t->slots = MPC_TAGS_SLOTS_MIN;
+  t->keys_num = 0;
+  t->keys = calloc(t->slots, sizeof(char*));
+  t->ids = calloc(t->slots, sizeof(int));
+  
+  mpc_tags_collect(t, p, &seen, &seen_num);
+  free(seen);
+  return t;
+}
+
+void mpc_tags_delete(mpc_tags_t *t) {
+  int j;
+  for (j = 0; j < t->num; j++) { free(t->names[j]); }
+  free(t->names);
+  free(t->keys);
+  free(t->ids);
+  free(t);
+}
+
+int mpc_tags_find(const mpc_tags_t *t, const char *name) {
+  int j;
+  for (j = 0; j < t->num; j++) {
+    if (strcmp(t->names[j], name) == 0) { return j; }
+  }
+  return -1;
+}
+
+const char *mpc_tags_name(const mpc_tags_t *t, int tag) {
+  return tag >= 0 && tag < t->num ? t->names[tag] : NULL;
+}
+
+void mpc_tree_delete(mpc_tree_t *t) {
+  if (t == NULL) { return; }
+  free(t->nodes);
+  free(t->tags);
+  free(t->text);
+  free(t);
+}
+
+static void mpc_tree_print_depth(mpc_tree_t *t, int n, int d, FILE *fp) {
+  
+  int j;
+  const int *tags = t->tags + t->nodes[n].tags;
+  
+  for (j = 0; j < d; j++) { fprintf(fp, "  "); }
+  
+  for (j = 0; tags[j] >= 0; j++) {
+    fprintf(fp, j ? "|%s" : "%s", mpc_tags_name(t->names, tags[j]));
+  }
+  
+  if (t->nodes[n].contents_len) {
+    fprintf(fp, ":%lu:%lu '%s'\n",
+      (long unsigned int)(t->nodes[n].state.row+1),
+      (long unsigned int)(t->nodes[n].state.col+1),
+      t->text + t->nodes[n].contents);
+  } else {
+    fprintf(fp, " \n");
+  }
+  
+  for (j = 0; j < t->nodes[n].children_num; j++) {
+    mpc_tree_print_depth(t, t->nodes[n].children + j, d+1, fp);
+  }
+  
+}
+
+void mpc_tree_print(mpc_tree_t *t) {
+  mpc_tree_print_to(t, stdout);
+}
+
+void mpc_tree_print_to(mpc_tree_t *t, FILE *fp) {
+  if (t == NULL || t->nodes_num == 0) { fprintf(fp, "NULL\n"); return; }
+  mpc_tree_print_depth(t, 0, 0, fp);
+}
+
+int mpc_tree_has_tag(const mpc_tree_t *t, int n, int tag) {
+  const int *tags = t->tags + t->nodes[n].tags;
+  while (*tags >= 0) { if (*tags++ == tag) { return 1; } }
+  return 0;
+}
+
+const char *mpc_tree_contents(const mpc_tree_t *t, int n) {
+  return t->text + t->nodes[n].contents;
+}
+
+mpc_val_t *mpcf_fold_ast(int n, mpc_val_t **xs) {
+  
+  int i, j;
+  mpc_ast_t** as = (mpc_ast_t**)xs;
+  mpc_ast_t *r;
+  
+  if (n == 0) { return NULL; }
+  if (n == 1) { return xs[0]; }
+  if (n == 2 && xs[1] == NULL) { return xs[0]; }
+  if (n == 2 && xs[0] == NULL) { return xs[1]; }
+  
+  r = mpc_ast_new(">", "");
+  
+  for (i = 0; i < n; i++) {
+    
+    if (as[i] == NULL) { continue; }
+    
+    if (as[i] && as[i]->children_num > 0) {
+      
+      for (j = 0; j < as[i]->children_num; j++) {
+        mpc_ast_add_child(r, as[i]->children[j]);
+      }
+      
+      mpc_ast_delete_no_children(as[i]);
+      
+    } else if (as[i] && as[i]->children_num == 0) {
+      mpc_ast_add_child(r, as[i]);
+    }
+  
+  }
+  
+  if (r->children_num) {
+    r->state = r->children[0]->state;
+  }
+  
+  return r;
+}
+
+mpc_val_t *mpcf_str_ast(mpc_val_t *c) {
+  mpc_ast_t *a = mpc_ast_new("", c);
+  free(c);
+  return a;
+}
+
+mpc_val_t *mpcf_state_ast(int n, mpc_val_t **xs) {
+  mpc_state_t *s = ((mpc_state_t**)xs)[0];
+  mpc_ast_t *a = ((mpc_ast_t**)xs)[1];
+  (void)n;
+  a = mpc_ast_state(a, *s);
+  free(s);
+  return a;
+}
+
+mpc_parser_t *mpca_state(mpc_parser_t *a) {
+  return mpc_and(2, mpcf_state_ast, mpc_state(), a, free);
+}
+
+mpc_parser_t *mpca_tag(mpc_parser_t *a, const char *t) {
+  return mpc_apply_to(a, (mpc_apply_to_t)mpc_ast_tag, (void*)t);
+}
+
+mpc_parser_t *mpca_add_tag(mpc_parser_t *a, const char *t) {
+  return mpc_apply_to(a, (mpc_apply_to_t)mpc_ast_add_tag, (void*)t);
+}
+
+mpc_parser_t *mpca_root(mpc_parser_t *a) {
+  return mpc_apply(a, (mpc_apply_t)mpc_ast_add_root);
+}
+
+mpc_parser_t *mpca_not(mpc_parser_t *a) { return mpc_not(a, (mpc_dtor_t)mpc_ast_delete); }
+mpc_parser_t *mpca_maybe(mpc_parser_t *a) { return mpc_maybe(a); }
+mpc_parser_t *mpca_many(mpc_parser_t *a) { return mpc_many(mpcf_fold_ast, a); }
+mpc_parser_t *mpca_many1(mpc_parser_t *a) { return mpc_many1(mpcf_fold_ast, a); }
+mpc_parser_t *mpca_count(int n, mpc_parser_t *a) { return mpc_count(n, mpcf_fold_ast, a, (mpc_dtor_t)mpc_ast_delete); }
+
+mpc_parser_t *mpca_or(int n, ...) {
+
+  int i;
+  va_list va;
+
+  mpc_parser_t *p = mpc_undefined();
+  
+  p->type = MPC_TYPE_OR;
+  p->data.or.n = n;
+  p->data.or.xs = malloc(sizeof(mpc_parser_t*) * n);
+  p->data.or.first = NULL;
+  p->data.or.jump = NULL;
+  
+  va_start(va, n);  
+  for (i = 0; i < n; i++) {
+    p->data.or.xs[i] = va_arg(va, mpc_parser_t*);
+  }
+  va_end(va);
+  
+  return p;
+  
+}
+
+mpc_parser_t *mpca_and(int n, ...) {
+  
+  int i;
+  va_list va;
+  
+  mpc_parser_t *p = mpc_undefined();
+  
+  p->type = MPC_TYPE_AND;
+  p->data.and.n = n;
+  p->data.and.f = mpcf_fold_ast;
+  p->data.and.xs = malloc(sizeof(mpc_parser_t*) * n);
+  p->data.and.dxs = malloc(sizeof(mpc_dtor_t) * (n-1));
+  
+  va_start(va, n);
+  for (i = 0; i < n; i++) {
+    p->data.and.xs[i] = va_arg(va, mpc_parser_t*);
+  }
+  for (i = 0; i < (n-1); i++) {
+    p->data.and.dxs[i] = (mpc_dtor_t)mpc_ast_delete;
+  }    
+  va_end(va);
+  
+  return p;  
+}
+
+mpc_parser_t *mpca_total(mpc_parser_t *a) { return mpc_total(a, (mpc_dtor_t)mpc_ast_delete); }
+
+/*
+** Grammar Parser
+*/
+
+/*
+** This is another interesting bootstrapping.
+**
+** Having a general purpose AST type allows
+** users to specify the grammar alone and
+** let all fold rules be automatically taken
+** care of by existing functions.
+**
+** You don't get to control the type spat
+** out but this means you can make a nice
+** parser to take in some grammar in nice
+** syntax and spit out a parser that works.
+**
+** The grammar for this looks surprisingly
+** like regex but the main difference is that
+** it is now whitespace insensitive and the
+** base type takes literals of some form.
+*/
+
+/*
+**
+**  ### Grammar Grammar
+**
+**      <grammar> : (<term> "|" <grammar>) | <term>
+**     
+**      <term> : <factor>*
+**
+**      <factor> : <base>
+**               | <base> "*"
+**               | <base> "+"
+**               | <base> "?"
+**               | <base> "{" <digits> "}"
+**           
+**      <base> : "<" (<digits> | <ident>) ">"
+**             | <string_lit>
+**             | <char_lit>
+**             | <regex_lit>
+**             | "(" <grammar> ")"
+*/
+
+typedef struct {
+  va_list *va;
+  int parsers_num;
+  mpc_parser_t **parsers;
+  int flags;
+} mpca_grammar_st_t;
+
+static mpc_val_t *mpcaf_grammar_or(int n, mpc_val_t **xs) {
+  (void) n;
+  if (xs[1] == NULL) { return xs[0]; }
+  else { return mpca_or(2, xs[0], xs[1]); }
+}
+
+static mpc_val_t *mpcaf_grammar_and(int n, mpc_val_t **xs) {
+  int i;
+  mpc_parser_t *p = mpc_pass();  
+  for (i = 0; i < n; i++) {
+    if (xs[i] != NULL) { p = mpca_and(2, p, xs[i]); }
+  }
+  return p;
+}
+
+static mpc_val_t *mpcaf_grammar_repeat(int n, mpc_val_t **xs) { 
+  int num;
+  (void) n;
+  if (xs[1] == NULL) { return xs[0]; }  
+  if (strcmp(xs[1], "*") == 0) { free(xs[1]); return mpca_many(xs[0]); }
+  if (strcmp(xs[1], "+") == 0) { free(xs[1]); return mpca_many1(xs[0]); }
+  if (strcmp(xs[1], "?") == 0) { free(xs[1]); return mpca_maybe(xs[0]); }
+  if (strcmp(xs[1], "!") == 0) { free(xs[1]); return mpca_not(xs[0]); }
+  num = *((int*)xs[1]);
+  free(xs[1]);
+  return mpca_count(num, xs[0]);
+}
+
+static mpc_val_t *mpcaf_grammar_string(mpc_val_t *x, void *s) {
+  mpca_grammar_st_t *st = s;
+  char *y = mpcf_unescape(x);
+  mpc_parser_t *p = (st->flags & MPCA_LANG_WHITESPACE_SENSITIVE) ? mpc_string(y) : mpc_tok(mpc_string(y));
+  free(y);
+  return mpca_state(mpca_tag(mpc_apply(p, mpcf_str_ast), "string"));
+}
+
+static mpc_val_t *mpcaf_grammar_char(mpc_val_t *x, void *s) {
+  mpca_grammar_st_t *st = s;
+  char *y = mpcf_unescape(x);
+  mpc_parser_t *p = (st->flags & MPCA_LANG_WHITESPACE_SENSITIVE) ? mpc_char(y[0]) : mpc_tok(mpc_char(y[0]));
+  free(y);
+  return mpca_state(mpca_tag(mpc_apply(p, mpcf_str_ast), "char"));
+}
+
+static mpc_val_t *mpcaf_grammar_regex(mpc_val_t *x, void *s) {
+  mpca_grammar_st_t *st = s;
+  char *y = mpcf_unescape_regex(x);
+  mpc_parser_t *p = (st->flags & MPCA_LANG_WHITESPACE_SENSITIVE) ? mpc_re(y) : mpc_tok(mpc_re(y));
+  free(y);
+  return mpca_state(mpca_tag(mpc_apply(p, mpcf_str_ast), "regex"));
+}
+
+/* Should this just use `isdigit` instead? */
+static int is_number(const char* s) {
+  size_t i;
+  for (i = 0; i < strlen(s); i++) { if (!strchr("0123456789", s[i])) { return 0; } }
+  return 1;
+}
+
+static mpc_parser_t *mpca_grammar_find_parser(char *x, mpca_grammar_st_t *st) {
+  
+  int i;
+  mpc_parser_t *p;
+  
+  /* Case of Number */
+  if (is_number(x)) {
+
+    i = strtol(x, NULL, 10);
+    
+    while (st->parsers_num <= i) {
+      st->parsers_num++;
+      st->parsers = realloc(st->parsers, sizeof(mpc_parser_t*) * st->parsers_num);
+      st->parsers[st->parsers_num-1] = va_arg(*st->va, mpc_parser_t*);
+      if (st->parsers[st->parsers_num-1] == NULL) {
+        return mpc_failf("No Parser in position %i! Only supplied %i Parsers!", i, st->parsers_num);
+      }
+    }
+    
+    return st->parsers[st->parsers_num-1];
+  
+  /* Case of Identifier */
+  } else {
+    
+    /* Search Existing Parsers */
+    for (i = 0; i < st->parsers_num; i++) {
+      mpc_parser_t *q = st->parsers[i];
+      if (q == NULL) { return mpc_failf("Unknown Parser '%s'!", x); }
+      if (q->name && strcmp(q->name, x) == 0) { return q; }
+    }
+    
+    /* Search New Parsers */
+    while (1) {
+    
+      p = va_arg(*st->va, mpc_parser_t*);
+      
+      st->parsers_num++;
+      st->parsers = realloc(st->parsers, sizeof(mpc_parser_t*) * st->parsers_num);
+      st->parsers[st->parsers_num-1] = p;
+      
+      if (p == NULL) { return mpc_failf("Unknown Parser '%s'!", x); }
+      if (p->name && strcmp(p->name, x) == 0) { return p; }
+      
+    }
+  
+  }  
+  
+}
+
+static mpc_val_t *mpcaf_grammar_id(mpc_val_t *x, void *s) {
+  
+  mpca_grammar_st_t *st = s;
+  mpc_parser_t *p = mpca_grammar_find_parser(x, st);
+  free(x);
+
+  if (p->name) {
+    return mpca_state(mpca_root(mpca_add_tag(p, p->name)));
+  } else {
+    return mpca_state(mpca_root(p));
+  }
+}
+
+mpc_parser_t *mpca_grammar_st(const char *grammar, mpca_grammar_st_t *st) {
+  
+  char *err_msg;
+  mpc_parser_t *err_out;
+  mpc_result_t r;
+  mpc_parser_t *GrammarTotal, *Grammar, *Term, *Factor, *Base;
+  
+  GrammarTotal = mpc_new("grammar_total");
+  Grammar = mpc_new("grammar");
+  Term = mpc_new("term");
+  Factor = mpc_new("factor");
+  Base = mpc_new("base");
+  
+  mpc_define(GrammarTotal,
+    mpc_predictive(mpc_total(Grammar, mpc_soft_delete))
+  );
+  
+  mpc_define(Grammar, mpc_and(2, mpcaf_grammar_or,
+    Term,
+    mpc_maybe(mpc_and(2, mpcf_snd_free, mpc_sym("|"), Grammar, free)),
+    mpc_soft_delete
+  ));
+  
+  mpc_define(Term, mpc_many1(mpcaf_grammar_and, Factor));
+  
+  mpc_define(Factor, mpc_and(2, mpcaf_grammar_repeat,
+    Base,
+      mpc_or(6,
+        mpc_sym("*"),
+        mpc_sym("+"),
+        mpc_sym("?"),
+        mpc_sym("!"),
+        mpc_tok_brackets(mpc_int(), free),
+        mpc_pass()),
+    mpc_soft_delete
+  ));
+  
+  mpc_define(Base, mpc_or(5,
+    mpc_apply_to(mpc_tok(mpc_string_lit()), mpcaf_grammar_string, st),
+    mpc_apply_to(mpc_tok(mpc_char_lit()),   mpcaf_grammar_char, st),
+    mpc_apply_to(mpc_tok(mpc_regex_lit()),  mpcaf_grammar_regex, st),
+    mpc_apply_to(mpc_tok_braces(mpc_or(2, mpc_digits(), mpc_ident()), free), mpcaf_grammar_id, st),
+    mpc_tok_parens(Grammar, mpc_soft_delete)
+  ));
+  
+  mpc_optimise(GrammarTotal);
+  mpc_optimise(Grammar);
+  mpc_optimise(Factor);
+  mpc_optimise(Term);
+  mpc_optimise(Base);
+  
+  if(!mpc_parse("<mpc_grammar_compiler>", grammar, GrammarTotal, &r)) {
+    err_msg = mpc_err_string(r.error);
+    err_out = mpc_failf("Invalid Grammar: %s", err_msg);
+    mpc_err_delete(r.error);
+    free(err_msg);
+    r.output = err_out;
+  }
+  
+  mpc_cleanup(5, GrammarTotal, Grammar, Term, Factor, Base);
+  
+  mpc_optimise(r.output);
+  
+  return (st->flags & MPCA_LANG_PREDICTIVE) ? mpc_predictive(r.output) : r.output;
+  
+}
+
+mpc_parser_t *mpca_grammar(int flags, const char *grammar, ...) {
+  mpca_grammar_st_t st;
+  mpc_parser_t *res;
+  va_list va;
+  va_start(va, grammar);
+  
+  st.va = &va;
+  st.parsers_num = 0;
+  st.parsers = NULL;
+  st.flags = flags;
+  
+  res = mpca_grammar_st(grammar, &st);  
+  free(st.parsers);
+  va_end(va);
+  return res;
+}
+
+typedef struct {
+  char *ident;
+  char *name;
+  mpc_parser_t *grammar;
+} mpca_stmt_t;
+
+static mpc_val_t *mpca_stmt_afold(int n, mpc_val_t **xs) {
+  mpca_stmt_t *stmt = malloc(sizeof(mpca_stmt_t));
+  stmt->ident = ((char**)xs)[0];
+  stmt->name = ((char**)xs)[1];
+  stmt->grammar = ((mpc_parser_t**)xs)[3];
+  (void) n;
+  free(((char**)xs)[2]);
+  free(((char**)xs)[4]);
+  
+  return stmt;
+}
+
+static mpc_val_t *mpca_stmt_fold(int n, mpc_val_t **xs) {
+  
+  int i;
+  mpca_stmt_t **stmts = malloc(sizeof(mpca_stmt_t*) * (n+1));
+  
+  for (i = 0; i < n; i++) {
+    stmts[i] = xs[i];
+  }
+  stmts[n] = NULL;  
+  
+  return stmts;
+}
+
+static void mpca_stmt_list_delete(mpc_val_t *x) {
+
+  mpca_stmt_t **stmts = x;
+
+  while(*stmts) {
+    mpca_stmt_t *stmt = *stmts; 
+    free(stmt->ident);
+    free(stmt->name);
+    mpc_soft_delete(stmt->grammar);
+    free(stmt);  
+    stmts++;
+  }
+  free(x);
+
+}
+
+static mpc_val_t *mpca_stmt_list_apply_to(mpc_val_t *x, void *s) {
+
+  mpca_grammar_st_t *st = s;
+  mpca_stmt_t *stmt;
+  mpca_stmt_t **stmts = x;
+  mpc_parser_t *left;
+
+  while(*stmts) {
+    stmt = *stmts;
+    left = mpca_grammar_find_parser(stmt->ident, st);
+    if (st->flags & MPCA_LANG_PREDICTIVE) { stmt->grammar = mpc_predictive(stmt->grammar); }
+    if (stmt->name) { stmt->grammar = mpc_expect(stmt->grammar, stmt->name); }
+    if (st->flags & MPCA_LANG_PACKRAT) {
+      stmt->grammar = mpc_memo(stmt->grammar, (mpc_dtor_t)mpc_ast_delete, mpc_ast_copy);
+    }
+    mpc_optimise(stmt->grammar);
+    mpc_define(left, stmt->grammar);
+    free(stmt->ident);
+    free(stmt->name);
+    free(stmt);
+    stmts++;
+  }
+  
+  free(x);
+  
+  return NULL;
+}
+
+static mpc_err_t *mpca_lang_st(mpc_input_t *i, mpca_grammar_st_t *st) {
+  
+  mpc_result_t r;
+  mpc_err_t *e;
+  mpc_parser_t *Lang, *Stmt, *Grammar, *Term, *Factor, *Base; 
+  
+  Lang    = mpc_new("lang");
+  Stmt    = mpc_new("stmt");
+  Grammar = mpc_new("grammar");
+  Term    = mpc_new("term");
+  Factor  = mpc_new("factor");
+  Base    = mpc_new("base");
+  
+  mpc_define(Lang, mpc_apply_to(
+    mpc_total(mpc_predictive(mpc_many(mpca_stmt_fold, Stmt)), mpca_stmt_list_delete),
+    mpca_stmt_list_apply_to, st
+  ));
+  
+  mpc_define(Stmt, mpc_and(5, mpca_stmt_afold,
+    mpc_tok(mpc_ident()), mpc_maybe(mpc_tok(mpc_string_lit())), mpc_sym(":"), Grammar, mpc_sym(";"),
+    free, free, free, mpc_soft_delete
+  ));
+  
+  mpc_define(Grammar, mpc_and(2, mpcaf_grammar_or,
+      Term,
+      mpc_maybe(mpc_and(2, mpcf_snd_free, mpc_sym("|"), Grammar, free)),
+      mpc_soft_delete
+  ));
+  
+  mpc_define(Term, mpc_many1(mpcaf_grammar_and, Factor));
+  
+  mpc_define(Factor, mpc_and(2, mpcaf_grammar_repeat,
+    Base,
+      mpc_or(6,
+        mpc_sym("*"),
+        mpc_sym("+"),
+        mpc_sym("?"),
+        mpc_sym("!"),
+        mpc_tok_brackets(mpc_int(), free),
+        mpc_pass()),
+    mpc_soft_delete
+  ));
+  
+  mpc_define(Base, mpc_or(5,
+    mpc_apply_to(mpc_tok(mpc_string_lit()), mpcaf_grammar_string, st),
+    mpc_apply_to(mpc_tok(mpc_char_lit()),   mpcaf_grammar_char, st),
+    mpc_apply_to(mpc_tok(mpc_regex_lit()),  mpcaf_grammar_regex, st),
+    mpc_apply_to(mpc_tok_braces(mpc_or(2, mpc_digits(), mpc_ident()), free), mpcaf_grammar_id, st),
+    mpc_tok_parens(Grammar, mpc_soft_delete)
+  ));
+  
+  mpc_optimise(Lang);
+  mpc_optimise(Stmt);
+  mpc_optimise(Grammar);
+  mpc_optimise(Term);
+  mpc_optimise(Factor);
+  mpc_optimise(Base);
+  
+  if (!mpc_parse_input(i, Lang, &r)) {
+    e = r.error;
+  } else {
+    e = NULL;
+  }
+  
+  mpc_cleanup(6, Lang, Stmt, Grammar, Term, Factor, Base);
+  
+  return e;
+}
+
+mpc_err_t *mpca_lang_file(int flags, FILE *f, ...) {
+  mpca_grammar_st_t st;
+  mpc_input_t *i;
+  mpc_err_t *err;
+
+  va_list va;  
+  va_start(va, f);
+  
+  st.va = &va;
+  st.parsers_num = 0;
+  st.parsers = NULL;
+  st.flags = flags;
+  
+  i = mpc_input_new_file("<mpca_lang_file>", f);
+  err = mpca_lang_st(i, &st);
+  mpc_input_delete(i);
+  
+  free(st.parsers);
+  va_end(va);
+  return err;
+}
+
+mpc_err_t *mpca_lang_pipe(int flags, FILE *p, ...) {
+  mpca_grammar_st_t st;
+  mpc_input_t *i;
+  mpc_err_t *err;
+
+  va_list va;  
+  va_start(va, p);
+  
+  st.va = &va;
+  st.parsers_num = 0;
+  st.parsers = NULL;
+  st.flags = flags;
+  
+  i = mpc_input_new_pipe("<mpca_lang_pipe>", p);
+  err = mpca_lang_st(i, &st);
+  mpc_input_delete(i);
+  
+  free(st.parsers);
+  va_end(va);
+  return err;
+}
+
+mpc_err_t *mpca_lang(int flags, const char *language, ...) {
+  
+  mpca_grammar_st_t st;
+  mpc_input_t *i;
+  mpc_err_t *err;
+  
+  va_list va;  
+  va_start(va, language);
+  
+  st.va = &va;
+  st.parsers_num = 0;
+  st.parsers = NULL;
+  st.flags = flags;
+  
+  i = mpc_input_new_string("<mpca_lang>", language);
+  err = mpca_lang_st(i, &st);
+  mpc_input_delete(i);
+  
+  free(st.parsers);
+  va_end(va);
+  return err;
+}
+
+mpc_err_t *mpca_lang_contents(int flags, const char *filename, ...) {
+  
+  mpca_grammar_st_t st;
+  mpc_input_t *i;
+  mpc_err_t *err;
+  
+  va_list va;
+
+  FILE *f = fopen(filename, "rb");
+  
+  if (f == NULL) {
+    err = mpc_err_file(filename, "Unable to open file!");
+    return err;
+  }
+  
+  va_start(va, filename);
+  
+  st.va = &va;
+  st.parsers_num = 0;
+  st.parsers = NULL;
+  st.flags = flags;
+  
+  i = mpc_input_new_file(filename, f);
+  err = mpca_lang_st(i, &st);
+  mpc_input_delete(i);
+  
+  free(st.parsers);
+  va_end(va);  
+  
+  fclose(f);
+  
+  return err;
+}
+
+static int mpc_nodecount_unretained(mpc_parser_t* p, int force) {
+
+  int i, total;
+
+  if (p->retained && !force) { return 0; }
+
+  if (p->type == MPC_TYPE_EXPECT) { return 1 + mpc_nodecount_unretained(p->data.expect.x, 0); }
+
+  if (p->type == MPC_TYPE_APPLY)    { return 1 + mpc_nodecount_unretained(p->data.apply.x, 0); }
+  if (p->type == MPC_TYPE_APPLY_TO) { return 1 + mpc_nodecount_unretained(p->data.apply_to.x, 0); }
+  if (p->type == MPC_TYPE_PREDICT)  { return 1 + mpc_nodecount_unretained(p->data.predict.x, 0); }
+  if (p->type == MPC_TYPE_MEMO)     { return 1 + mpc_nodecount_unretained(p->data.memo.x, 0); }
+  if (p->type == MPC_TYPE_REGEX)    { return 1 + mpc_nodecount_unretained(p->data.regex.x, 0); }
+
+  if (p->type == MPC_TYPE_NOT)   { return 1 + mpc_nodecount_unretained(p->data.not.x, 0); }
+  if (p->type == MPC_TYPE_MAYBE) { return 1 + mpc_nodecount_unretained(p->data.not.x, 0); }
+
+  if (p->type == MPC_TYPE_MANY)  { return 1 + mpc_nodecount_unretained(p->data.repeat.x, 0); }
+  if (p->type == MPC_TYPE_MANY1) { return 1 + mpc_nodecount_unretained(p->data.repeat.x, 0); }
+  if (p->type == MPC_TYPE_COUNT) { return 1 + mpc_nodecount_unretained(p->data.repeat.x, 0); }
+  if (p->type == MPC_TYPE_SPAN)  { return 1 + mpc_nodecount_unretained(p->data.span.x, 0); }
+
+  if (p->type == MPC_TYPE_OR) { 
+    total = 0;
+    for(i = 0; i < p->data.or.n; i++) {
+      total += mpc_nodecount_unretained(p->data.or.xs[i], 0);
+    }
+    return total;
+  }
+  
+  if (p->type == MPC_TYPE_AND) {
+    total = 0;
+    for(i = 0; i < p->data.and.n; i++) {
+      total += mpc_nodecount_unretained(p->data.and.xs[i], 0);
+    }
+    return total;
+  }
+
+  return 1;
+  
+}
+
+void mpc_stats(mpc_parser_t* p) {
+  mpc_pool_stats_t *s = p->stats;
+  printf("Stats\n");
+  printf("=====\n");
+  printf("Node Count: %i\n", mpc_nodecount_unretained(p, 1));
+  if (s) {
+    printf("Parses: %lu\n", s->parses);
+    printf("Pool Hits: %lu of %lu (%.1f%%)\n", s->pooled, s->pooled + s->heap,
+      s->pooled + s->heap ? 100.0 * s->pooled / (s->pooled + s->heap) : 100.0);
+    printf("Exported: %lu\n", s->exported);
+    printf("Largest Pool: %lu bytes\n", s->pool_bytes);
+  }
+  if (p->profile) { mpc_profile_print(p->profile, stdout); }
+}
+
+void mpc_pool_stats(mpc_parser_t *p, mpc_pool_stats_t *s) {
+  if (s) { memset(s, 0, sizeof(mpc_pool_stats_t)); }
+  p->stats = s;
+}
+
+/*
+** Alternatives can only be merged into one class
+** when none of them reports its own expectation,
+** either because they have none or because an
+** enclosing `expect` suppresses it.
+*/
+
+static int mpc_optimise_is_charset(mpc_parser_t *p, int suppressed) {
+  
+  int i;
+  
+  if (p->retained) { return 0; }
+  
+  switch (p->type) {
+    case MPC_TYPE_SINGLE:
+    case MPC_TYPE_RANGE:
+    case MPC_TYPE_ONEOF:
+    case MPC_TYPE_NONEOF:
+    case MPC_TYPE_CHARSET:
+      return 1;
+    case MPC_TYPE_EXPECT:
+      return suppressed && mpc_optimise_is_charset(p->data.expect.x, 1);
+    case MPC_TYPE_OR:
+      for (i = 0; i < p->data.or.n; i++) {
+        if (!mpc_optimise_is_charset(p->data.or.xs[i], suppressed)) { return 0; }
+      }
+      return 1;
+    default: return 0;
+  }
+}
+
+static void mpc_optimise_charset_fill(mpc_parser_t *p, unsigned char *set) {
+  
+  int i;
+  char x;
+  
+  if (p->type == MPC_TYPE_EXPECT) { mpc_optimise_charset_fill(p->data.expect.x, set); return; }
+  
+  if (p->type == MPC_TYPE_OR) {
+    for (i = 0; i < p->data.or.n; i++) { mpc_optimise_charset_fill(p->data.or.xs[i], set); }
+    return;
+  }
+  
+  /* The null character always ends the input so is never a member */
+  for (i = 1; i < 256; i++) {
+    x = (char)i;
+    if ((p->type == MPC_TYPE_SINGLE  && x == p->data.single.x)
+    ||  (p->type == MPC_TYPE_RANGE   && x >= p->data.range.x && x <= p->data.range.y)
+    ||  (p->type == MPC_TYPE_ONEOF   && strchr(p->data.string.x, x))
+    ||  (p->type == MPC_TYPE_NONEOF  && !strchr(p->data.string.x, x))
+    ||  (p->type == MPC_TYPE_CHARSET && mpc_input_charset_has(p->data.charset.x, x))) {
+      set[i / 8] |= 1 << (i % 8);
+    }
+  }
+}
+
+/* Converts a class parser into a `charset` in place, discarding its old data */
+static void mpc_optimise_charset(mpc_parser_t *p, unsigned char *out) {
+  unsigned char set[32];
+  memset(set, 0, 32);
+  mpc_optimise_charset_fill(p, set);
+  mpc_undefine_unretained(p, 1);
+  p->type = MPC_TYPE_CHARSET;
+  memcpy(out, set, 32);
+}
+
+static int mpc_optimise_is_span(mpc_parser_t *p) {
+  if (p->type == MPC_TYPE_CHARSET) { return 1; }
+  return p->type == MPC_TYPE_EXPECT
+    && !p->data.expect.x->retained
+    &&  p->data.expect.x->type == MPC_TYPE_CHARSET;
+}
+
+/*
+** An escaped body, such as that of a string
+** literal, is an `or` trying an escape character
+** followed by any character before a class which
+** itself contains the escape character.
+*/
+
+static int mpc_optimise_is_escaped(mpc_parser_t *p) {
+  
+  mpc_parser_t *a, *c;
+  
+  if (p->type != MPC_TYPE_OR || p->data.or.n != 2) { return 0; }
+  
+  a = p->data.or.xs[0];
+  c = p->data.or.xs[1];
+  
+  if (a->retained || a->type != MPC_TYPE_AND || a->data.and.n != 2 || a->data.and.f != mpcf_strfold) { return 0; }
+  if (c->retained || !mpc_optimise_is_span(c)) { return 0; }
+  
+  if (a->data.and.xs[0]->retained || a->data.and.xs[0]->type != MPC_TYPE_EXPECT
+  ||  a->data.and.xs[1]->retained || a->data.and.xs[1]->type != MPC_TYPE_EXPECT) { return 0; }
+  
+  if (a->data.and.xs[0]->data.expect.x->retained
+  ||  a->data.and.xs[0]->data.expect.x->type != MPC_TYPE_SINGLE
+  ||  a->data.and.xs[1]->data.expect.x->retained
+  ||  a->data.and.xs[1]->data.expect.x->type != MPC_TYPE_ANY) { return 0; }
+  
+  if (c->type == MPC_TYPE_EXPECT) { c = c->data.expect.x; }
+  return mpc_input_charset_has(c->data.charset.x, a->data.and.xs[0]->data.expect.x->data.single.x);
+}
+
+static void mpc_optimise_span(mpc_parser_t *p, int esc) {
+  
+  unsigned char set[32];
+  char x;
+  mpc_parser_t *t = p->data.repeat.x;
+  
+  p->data.span.min = p->type == MPC_TYPE_MANY1;
+  p->data.span.x = t;
+  p->data.span.esc = esc;
+  p->type = MPC_TYPE_SPAN;
+  
+  /* The scan stops at the escape character so the parser can step over what follows it */
+  memcpy(set, mpc_span_charset(p), 32);
+  if (esc) {
+    x = mpc_span_escape(p, 0)->data.expect.x->data.single.x;
+    set[(unsigned char)x / 8] &= ~(1 << ((unsigned char)x % 8));
+  }
+  
+  p->data.span.scan = mpc_scan_new(set);
+}
+
+/*
+** First Sets
+**
+** Most alternatives can only match when the next
+** character is one of a few. These are collected
+** into a table for each `or`, so that over string
+** input alternatives which cannot match are never
+** run. An alternative is only skipped when it is
+** known how it would have failed: an `expect`
+** reports its message where it started, and
+** single character parsers report nothing.
+**
+** Tables are built when a parser is optimised, so
+** a parser which is redefined afterwards must be
+** optimised again.
+*/
+
+enum {
+  MPC_FIRST_UNKNOWN = -1,
+  MPC_FIRST_CONSUMES = 0,
+  MPC_FIRST_NULLABLE = 1,
+  MPC_FIRST_DEPTH_MAX = 64
+};
+
+static int mpc_first_seq(mpc_parser_t **xs, int n, unsigned char *set, int depth);
+
+/* Adds the characters `p` could start with to `set`, returning if it can also match nothing */
+static int mpc_first(mpc_parser_t *p, unsigned char *set, int depth) {
+  
+  int j, x, k;
+  
+  if (depth > MPC_FIRST_DEPTH_MAX) { return MPC_FIRST_UNKNOWN; }
+  
+  switch (p->type) {
+    
+    case MPC_TYPE_SINGLE:
+    case MPC_TYPE_RANGE:
+    case MPC_TYPE_ONEOF:
+    case MPC_TYPE_NONEOF:
+    case MPC_TYPE_CHARSET:
+      mpc_optimise_charset_fill(p, set);
+      return MPC_FIRST_CONSUMES;
+    
+    case MPC_TYPE_ANY:
+      for (j = 1; j < 256; j++) { set[j / 8] |= 1 << (j % 8); }
+      return MPC_FIRST_CONSUMES;
+    
+    case MPC_TYPE_STRING:
+      x = (unsigned char)p->data.string.x[0];
+      if (x == 0) { return MPC_FIRST_NULLABLE; }
+      set[x / 8] |= 1 << (x % 8);
+      return MPC_FIRST_CONSUMES;
+    
+    case MPC_TYPE_SPAN:
+      for (j = 0; j < 32; j++) { set[j] |= mpc_span_charset(p)[j]; }
+      return p->data.span.min ? MPC_FIRST_CONSUMES : MPC_FIRST_NULLABLE;
+    
+    case MPC_TYPE_PASS:
+    case MPC_TYPE_LIFT:
+    case MPC_TYPE_LIFT_VAL:
+    case MPC_TYPE_STATE:
+    case MPC_TYPE_ANCHOR:
+      return MPC_FIRST_NULLABLE;
+    
+    case MPC_TYPE_FAIL:
+      return MPC_FIRST_CONSUMES;
+    
+    case MPC_TYPE_EXPECT:   return mpc_first(p->data.expect.x, set, depth+1);
+    case MPC_TYPE_APPLY:    return mpc_first(p->data.apply.x, set, depth+1);
+    case MPC_TYPE_APPLY_TO: return mpc_first(p->data.apply_to.x, set, depth+1);
+    case MPC_TYPE_PREDICT:  return mpc_first(p->data.predict.x, set, depth+1);
+    case MPC_TYPE_MEMO:     return mpc_first(p->data.memo.x, set, depth+1);
+    case MPC_TYPE_REGEX:    return mpc_first(p->data.regex.x, set, depth+1);
+    case MPC_TYPE_MANY1:    return mpc_first(p->data.repeat.x, set, depth+1);
+    
+    case MPC_TYPE_COUNT:
+      if (p->data.repeat.n == 0) { return MPC_FIRST_NULLABLE; }
+      return mpc_first(p->data.repeat.x, set, depth+1);
+    
+    case MPC_TYPE_MAYBE:
+      return mpc_first(p->data.not.x, set, depth+1) < 0 ? MPC_FIRST_UNKNOWN : MPC_FIRST_NULLABLE;
+    
+    case MPC_TYPE_MANY:
+      return mpc_first(p->data.repeat.x, set, depth+1) < 0 ? MPC_FIRST_UNKNOWN : MPC_FIRST_NULLABLE;
+    
+    case MPC_TYPE_AND:
+      return mpc_first_seq(p->data.and.xs, p->data.and.n, set, depth+1);
+    
+    case MPC_TYPE_OR:
+      x = MPC_FIRST_CONSUMES;
+      for (j = 0; j < p->data.or.n; j++) {
+        k = mpc_first(p->data.or.xs[j], set, depth+1);
+        if (k < 0) { return MPC_FIRST_UNKNOWN; }
+        if (k > 0) { x = MPC_FIRST_NULLABLE; }
+      }
+      return x;
+    
+    default: return MPC_FIRST_UNKNOWN;
+  }
+}
+
+static int mpc_first_seq(mpc_parser_t **xs, int n, unsigned char *set, int depth) {
+  int j, k;
+  for (j = 0; j < n; j++) {
+    k = mpc_first(xs[j], set, depth);
+    if (k != MPC_FIRST_NULLABLE) { return k; }
+  }
+  return MPC_FIRST_NULLABLE;
+}
+
+/* Parsers whose failure on their first character can be reported without running them */
+static int mpc_first_skippable(mpc_parser_t *p) {
+  switch (p->type) {
+    case MPC_TYPE_EXPECT:
+    case MPC_TYPE_SINGLE:
+    case MPC_TYPE_RANGE:
+    case MPC_TYPE_ONEOF:
+    case MPC_TYPE_NONEOF:
+    case MPC_TYPE_CHARSET:
+    case MPC_TYPE_STRING:
+    case MPC_TYPE_ANY:
+      return 1;
+    case MPC_TYPE_MEMO:     return mpc_first_skippable(p->data.memo.x);
+    case MPC_TYPE_APPLY:    return mpc_first_skippable(p->data.apply.x);
+    case MPC_TYPE_APPLY_TO: return mpc_first_skippable(p->data.apply_to.x);
+    default: return 0;
   }
+}
+
+static void mpc_optimise_first(mpc_parser_t *p) {
   
-  if (p->type == MPC_TYPE_NONEOF) {
-    s = mpcf_escape_new(
-      p->data.string.x,
-      mpc_escape_input_c,
-      mpc_escape_output_c);
-    printf("[^%s]", s);
-    free(s);
+  int j, c, skips = 0;
+  unsigned char *set;
+  
+  free(p->data.or.first);
+  free(p->data.or.jump);
+  p->data.or.first = calloc(p->data.or.n, 32);
+  p->data.or.jump = NULL;
+  
+  for (j = 0; j < p->data.or.n; j++) {
+    set = p->data.or.first + j * 32;
+    if (mpc_first_skippable(p->data.or.xs[j])
+    &&  mpc_first(p->data.or.xs[j], set, 0) == MPC_FIRST_CONSUMES) {
+      skips = 1;
+    } else {
+      memset(set, 0xFF, 32);
+    }
   }
   
-  if (p->type == MPC_TYPE_STRING) {
-    s = mpcf_escape_new(
-      p->data.string.x,
-      mpc_escape_input_c,
-      mpc_escape_output_c);
-    printf("\"%s\"", s);
-    free(s);
+  if (!skips) {
+    free(p->data.or.first);
+    p->data.or.first = NULL;
+    return;
   }
   
-  if (p->type == MPC_TYPE_APPLY)    { mpc_print_unretained(p->data.apply.x, 0); }
-  if (p->type == MPC_TYPE_APPLY_TO) { mpc_print_unretained(p->data.apply_to.x, 0); }
-  if (p->type == MPC_TYPE_PREDICT)  { mpc_print_unretained(p->data.predict.x, 0); }
-
-  if (p->type == MPC_TYPE_NOT)   { mpc_print_unretained(p->data.not.x, 0); printf("!"); }
-  if (p->type == MPC_TYPE_MAYBE) { mpc_print_unretained(p->data.not.x, 0); printf("?"); }
+  /* The jump table gives the first alternative which could match each character */
+  p->data.or.jump = malloc(sizeof(int) * 256);
+  for (c = 0; c < 256; c++) {
+    for (j = 0; j < p->data.or.n; j++) {
+      if (p->data.or.first[j * 32 + c / 8] & (1 << (c % 8))) { break; }
+    }
+    p->data.or.jump[c] = j;
+  }
+}
 
-  if (p->type == MPC_TYPE_MANY)  { mpc_print_unretained(p->data.repeat.x, 0); printf("*"); }
-  if (p->type == MPC_TYPE_MANY1) { mpc_print_unretained(p->data.repeat.x, 0); printf("+"); }
-  if (p->type == MPC_TYPE_COUNT) { mpc_print_unretained(p->data.repeat.x, 0); printf("{%i}", p->data.repeat.n); }
+static void mpc_optimise_unretained(mpc_parser_t *p, int force) {
   
-  if (p->type == MPC_TYPE_OR) {
-    printf("(");
-    for(i = 0; i < p->data.or.n-1; i++) {
-      mpc_print_unretained(p->data.or.xs[i], 0);
-      printf(" | ");
+  int i, n, m;
+  mpc_parser_t *t;
+  
+  if (p->retained && !force) { return; }
+  
+  /* Optimise Subexpressions */
+  
+  if (p->type == MPC_TYPE_EXPECT)   { mpc_optimise_unretained(p->data.expect.x, 0); }
+  if (p->type == MPC_TYPE_APPLY)    { mpc_optimise_unretained(p->data.apply.x, 0); }
+  if (p->type == MPC_TYPE_APPLY_TO) { mpc_optimise_unretained(p->data.apply_to.x, 0); }
+  if (p->type == MPC_TYPE_PREDICT)  { mpc_optimise_unretained(p->data.predict.x, 0); }
+  if (p->type == MPC_TYPE_MEMO)     { mpc_optimise_unretained(p->data.memo.x, 0); }
+  if (p->type == MPC_TYPE_NOT)      { mpc_optimise_unretained(p->data.not.x, 0); }
+  if (p->type == MPC_TYPE_MAYBE)    { mpc_optimise_unretained(p->data.not.x, 0); }
+  if (p->type == MPC_TYPE_MANY)     { mpc_optimise_unretained(p->data.repeat.x, 0); }
+  if (p->type == MPC_TYPE_MANY1)    { mpc_optimise_unretained(p->data.repeat.x, 0); }
+  if (p->type == MPC_TYPE_COUNT)    { mpc_optimise_unretained(p->data.repeat.x, 0); }
+  if (p->type == MPC_TYPE_SPAN)     { mpc_optimise_unretained(p->data.span.x, 0); }
+  
+  if (p->type == MPC_TYPE_OR) { 
+    for(i = 0; i < p->data.or.n; i++) {
+      mpc_optimise_unretained(p->data.or.xs[i], 0);
     }
-    mpc_print_unretained(p->data.or.xs[p->data.or.n-1], 0);
-    printf(")");
   }
   
   if (p->type == MPC_TYPE_AND) {
-    printf("(");
-    for(i = 0; i < p->data.and.n-1; i++) {
-      mpc_print_unretained(p->data.and.xs[i], 0);
-      printf(" ");
+    for(i = 0; i < p->data.and.n; i++) {
+      mpc_optimise_unretained(p->data.and.xs[i], 0);
+    }
+  }  
+  
+  /* Perform optimisations */
+  
+  while (1) {
+    
+    /* Convert class to `charset` */
+    if (p->type == MPC_TYPE_ONEOF
+    ||  p->type == MPC_TYPE_NONEOF
+    ||  p->type == MPC_TYPE_RANGE) {
+      mpc_optimise_charset(p, p->data.charset.x);
+      continue;
+    }
+    
+    /* Merge `or` of classes */
+    if (p->type == MPC_TYPE_OR
+    &&  mpc_optimise_is_charset(p, 0)) {
+      mpc_optimise_charset(p, p->data.charset.x);
+      continue;
+    }
+    
+    /* Merge `or` of classes under `expect` */
+    if (p->type == MPC_TYPE_EXPECT
+    &&  p->data.expect.x->type == MPC_TYPE_OR
+    && !p->data.expect.x->retained
+    &&  mpc_optimise_is_charset(p->data.expect.x, 1)) {
+      mpc_optimise_charset(p->data.expect.x, p->data.expect.x->data.charset.x);
+      continue;
+    }
+    
+    /* Convert `many` of class to `span` */
+    if ((p->type == MPC_TYPE_MANY || p->type == MPC_TYPE_MANY1)
+    &&  p->data.repeat.f == mpcf_strfold
+    && !p->data.repeat.x->retained
+    &&  mpc_optimise_is_span(p->data.repeat.x)) {
+      mpc_optimise_span(p, 0);
+      continue;
+    }
+    
+    /* Convert `many` of escape or class to escaped `span` */
+    if ((p->type == MPC_TYPE_MANY || p->type == MPC_TYPE_MANY1)
+    &&  p->data.repeat.f == mpcf_strfold
+    && !p->data.repeat.x->retained
+    &&  mpc_optimise_is_escaped(p->data.repeat.x)) {
+      mpc_optimise_span(p, 1);
+      continue;
+    }
+    
+    /* Merge rhs `or` */
+    if (p->type == MPC_TYPE_OR
+    &&  p->data.or.xs[p->data.or.n-1]->type == MPC_TYPE_OR
+    && !p->data.or.xs[p->data.or.n-1]->retained) {
+      t = p->data.or.xs[p->data.or.n-1];
+      n = p->data.or.n; m = t->data.or.n;
+      p->data.or.n = n + m - 1;
+      p->data.or.xs = realloc(p->data.or.xs, sizeof(mpc_parser_t*) * (n + m -1));
+      memmove(p->data.or.xs + n - 1, t->data.or.xs, m * sizeof(mpc_parser_t*));
+      free(t->data.or.xs); free(t->data.or.first); free(t->data.or.jump); free(t->name); free(t);
+      continue;
+    }
+
+    /* Merge lhs `or` */
+    if (p->type == MPC_TYPE_OR
+    &&  p->data.or.xs[0]->type == MPC_TYPE_OR
+    && !p->data.or.xs[0]->retained) {
+      t = p->data.or.xs[0];
+      n = p->data.or.n; m = t->data.or.n;
+      p->data.or.n = n + m - 1;
+      p->data.or.xs = realloc(p->data.or.xs, sizeof(mpc_parser_t*) * (n + m -1));
+      memmove(p->data.or.xs + m, t->data.or.xs + 1, n * sizeof(mpc_parser_t*));
+      memmove(p->data.or.xs, t->data.or.xs, m * sizeof(mpc_parser_t*));
+      free(t->data.or.xs); free(t->data.or.first); free(t->data.or.jump); free(t->name); free(t);
+      continue;
+    }
+    
+    /* Remove ast `pass` */
+    if (p->type == MPC_TYPE_AND
+    &&  p->data.and.n == 2
+    &&  p->data.and.xs[0]->type == MPC_TYPE_PASS
+    && !p->data.and.xs[0]->retained
+    &&  p->data.and.f == mpcf_fold_ast) {
+      t = p->data.and.xs[1];
+      mpc_delete(p->data.and.xs[0]);
+      free(p->data.and.xs); free(p->data.and.dxs); free(p->name);
+      memcpy(p, t, sizeof(mpc_parser_t));
+      free(t);
+      continue;
+    }
+    
+    /* Merge ast lhs `and` */
+    if (p->type == MPC_TYPE_AND
+    &&  p->data.and.f == mpcf_fold_ast
+    &&  p->data.and.xs[0]->type == MPC_TYPE_AND
+    && !p->data.and.xs[0]->retained
+    &&  p->data.and.xs[0]->data.and.f == mpcf_fold_ast) {
+      t = p->data.and.xs[0];
+      n = p->data.and.n; m = t->data.and.n;
+      p->data.and.n = n + m - 1;
+      p->data.and.xs = realloc(p->data.and.xs, sizeof(mpc_parser_t*) * (n + m - 1));
+      p->data.and.dxs = realloc(p->data.and.dxs, sizeof(mpc_dtor_t) * (n + m - 1 - 1));
+      memmove(p->data.and.xs + m, p->data.and.xs + 1, (n - 1) * sizeof(mpc_parser_t*));
+      memmove(p->data.and.xs, t->data.and.xs, m * sizeof(mpc_parser_t*));
+      for (i = 0; i < p->data.and.n-1; i++) { p->data.and.dxs[i] = (mpc_dtor_t)mpc_ast_delete; }
+      free(t->data.and.xs); free(t->data.and.dxs); free(t->name); free(t); 
+      continue;
+    }
+    
+    /* Merge ast rhs `and` */
+    if (p->type == MPC_TYPE_AND
+    &&  p->data.and.f == mpcf_fold_ast
+    &&  p->data.and.xs[p->data.and.n-1]->type == MPC_TYPE_AND
+    && !p->data.and.xs[p->data.and.n-1]->retained
+    &&  p->data.and.xs[p->data.and.n-1]->data.and.f == mpcf_fold_ast) {
+      t = p->data.and.xs[p->data.and.n-1];
+      n = p->data.and.n; m = t->data.and.n;
+      p->data.and.n = n + m - 1;
+      p->data.and.xs = realloc(p->data.and.xs, sizeof(mpc_parser_t*) * (n + m -1));
+      p->data.and.dxs = realloc(p->data.and.dxs, sizeof(mpc_dtor_t) * (n + m - 1 - 1));
+      memmove(p->data.and.xs + n - 1, t->data.and.xs, m * sizeof(mpc_parser_t*));
+      for (i = 0; i < p->data.and.n-1; i++) { p->data.and.dxs[i] = (mpc_dtor_t)mpc_ast_delete; }
+      free(t->data.and.xs); free(t->data.and.dxs); free(t->name); free(t); 
+      continue;
+    }
+
+    /* Remove re `lift` */
+    if (p->type == MPC_TYPE_AND
+    &&  p->data.and.n == 2
+    &&  p->data.and.xs[0]->type == MPC_TYPE_LIFT
+    &&  p->data.and.xs[0]->data.lift.lf == mpcf_ctor_str
+    && !p->data.and.xs[0]->retained
+    &&  p->data.and.f == mpcf_strfold) {
+      t = p->data.and.xs[1];
+      mpc_delete(p->data.and.xs[0]);
+      free(p->data.and.xs); free(p->data.and.dxs); free(p->name);
+      memcpy(p, t, sizeof(mpc_parser_t));
+      free(t);
+      continue;
+    }
+
+    /* Merge re lhs `and` */
+    if (p->type == MPC_TYPE_AND
+    &&  p->data.and.f == mpcf_strfold
+    &&  p->data.and.xs[0]->type == MPC_TYPE_AND
+    && !p->data.and.xs[0]->retained
+    &&  p->data.and.xs[0]->data.and.f == mpcf_strfold) {
+      t = p->data.and.xs[0];
+      n = p->data.and.n; m = t->data.and.n;
+      p->data.and.n = n + m - 1;
+      p->data.and.xs = realloc(p->data.and.xs, sizeof(mpc_parser_t*) * (n + m - 1));
+      p->data.and.dxs = realloc(p->data.and.dxs, sizeof(mpc_dtor_t) * (n + m - 1 - 1));
+      memmove(p->data.and.xs + m, p->data.and.xs + 1, (n - 1) * sizeof(mpc_parser_t*));
+      memmove(p->data.and.xs, t->data.and.xs, m * sizeof(mpc_parser_t*));
+      for (i = 0; i < p->data.and.n-1; i++) { p->data.and.dxs[i] = free; }
+      free(t->data.and.xs); free(t->data.and.dxs); free(t->name); free(t); 
+      continue;
+    }
+    
+    /* Merge re rhs `and` */
+    if (p->type == MPC_TYPE_AND
+    &&  p->data.and.f == mpcf_strfold
+    &&  p->data.and.xs[p->data.and.n-1]->type == MPC_TYPE_AND
+    && !p->data.and.xs[p->data.and.n-1]->retained
+    &&  p->data.and.xs[p->data.and.n-1]->data.and.f == mpcf_strfold) {
+      t = p->data.and.xs[p->data.and.n-1];
+      n = p->data.and.n; m = t->data.and.n;
+      p->data.and.n = n + m - 1;
+      p->data.and.xs = realloc(p->data.and.xs, sizeof(mpc_parser_t*) * (n + m -1));
+      p->data.and.dxs = realloc(p->data.and.dxs, sizeof(mpc_dtor_t) * (n + m - 1 - 1));
+      memmove(p->data.and.xs + n - 1, t->data.and.xs, m * sizeof(mpc_parser_t*));
+      for (i = 0; i < p->data.and.n-1; i++) { p->data.and.dxs[i] = free; }
+      free(t->data.and.xs); free(t->data.and.dxs); free(t->name); free(t); 
+      continue;
     }
-    mpc_print_unretained(p->data.and.xs[p->data.and.n-1], 0);
-    printf(")");
+    
+    if (p->type == MPC_TYPE_OR) { mpc_optimise_first(p); }
+    
+    return;
+    
   }
   
 }
 
-void mpc_print(mpc_parser_t *p) {
-  mpc_print_unretained(p, 1);
-  printf("\n");
+void mpc_optimise(mpc_parser_t *p) {
+  mpc_optimise_unretained(p, 1);
 }
 
-/*
-** Testing
-*/
 
 /*
-** These functions are slightly unwieldy and
-** also the whole of the testing suite for mpc
-** mpc is pretty shaky.
-**
-** It could do with a lot more tests and more
-** precision. Currently I am only really testing
-** changes off of the examples.
+** Compiling
 **
+** A grammar is copied into one array of nodes,
+** numbered depth first from the start parser so
+** each node is usually followed by its first
+** child. Child lists, strings and tables go in
+** an arena alongside, and regex automata are
+** rebuilt from the copied nodes, so a program
+** shares nothing with the grammar it came from
+** except values given to `mpc_lift_val` and
+** `mpc_apply_to`, other than tag names.
 */
 
-int mpc_test_fail(mpc_parser_t *p, const char *s, const void *d,
-  int(*tester)(const void*, const void*),
-  mpc_dtor_t destructor,
-  void(*printer)(const void*)) {
-  mpc_result_t r;
-  (void) printer;
-  if (mpc_parse("<test>", s, p, &r)) {
+enum {
+  MPC_COMPILE_SLOTS_MIN = 64
+};
 
-    if (tester(r.output, d)) {
-      destructor(r.output);
-      return 0;
-    } else {
-      destructor(r.output);
-      return 1;
-    }
-  
-  } else {
-    mpc_err_delete(r.error);
-    return 1;
-  }
-  
+struct mpc_program_t {
+  int nodes_num;
+  mpc_parser_t *nodes;
+  mpc_arena_t data;
+};
+
+typedef struct {
+  int num;
+  int slots;
+  mpc_parser_t **keys;
+  int *ids;
+  mpc_parser_t **order;
+} mpc_compile_t;
+
+static int mpc_compile_hash(mpc_compile_t *c, mpc_parser_t *p) {
+  return (int)(((unsigned long)(size_t)p >> 4) * 2654435761u) & (c->slots - 1);
 }
 
-int mpc_test_pass(mpc_parser_t *p, const char *s, const void *d,
-  int(*tester)(const void*, const void*), 
-  mpc_dtor_t destructor, 
-  void(*printer)(const void*)) {
+static int mpc_compile_find(mpc_compile_t *c, mpc_parser_t *p) {
+  int j = mpc_compile_hash(c, p);
+  while (c->keys[j]) {
+    if (c->keys[j] == p) { return c->ids[j]; }
+    j = (j + 1) & (c->slots - 1);
+  }
+  return -1;
+}
 
-  mpc_result_t r;  
-  if (mpc_parse("<test>", s, p, &r)) {
-    
-    if (tester(r.output, d)) {
-      destructor(r.output);
-      return 1;
-    } else {
-      printf("Got "); printer(r.output); printf("\n");
-      printf("Expected "); printer(d); printf("\n");
-      destructor(r.output);
-      return 0;
+static void mpc_compile_insert(mpc_compile_t *c, mpc_parser_t *p) {
+  
+  int j, k;
+  mpc_parser_t **keys = c->keys;
+  int *ids = c->ids;
+  
+  if ((c->num + 1) * 2 > c->slots) {
+    c->slots *= 2;
+    c->keys = calloc(c->slots, sizeof(mpc_parser_t*));
+    c->ids = malloc(sizeof(int) * c->slots);
+    c->order = realloc(c->order, sizeof(mpc_parser_t*) * c->slots / 2);
+    for (k = 0; k < c->slots / 2; k++) {
+      if (keys[k] == NULL) { continue; }
+      for (j = mpc_compile_hash(c, keys[k]); c->keys[j]; j = (j + 1) & (c->slots - 1));
+      c->keys[j] = keys[k];
+      c->ids[j] = ids[k];
     }
-    
-  } else {    
-    mpc_err_print(r.error);
-    mpc_err_delete(r.error);
-    return 0;
-    
+    free(keys);
+    free(ids);
   }
   
+  for (j = mpc_compile_hash(c, p); c->keys[j]; j = (j + 1) & (c->slots - 1));
+  c->keys[j] = p;
+  c->ids[j] = c->num;
+  c->order[c->num++] = p;
 }
 
-
-/*
-** AST
-*/
-
-void mpc_ast_delete(mpc_ast_t *a) {
+static void mpc_compile_number(mpc_compile_t *c, mpc_parser_t *p) {
   
-  int i;
+  int j;
   
-  if (a == NULL) { return; }
+  if (mpc_compile_find(c, p) >= 0) { return; }
+  mpc_compile_insert(c, p);
   
-  for (i = 0; i < a->children_num; i++) {
-    mpc_ast_delete(a->children[i]);
+  switch (p->type) {
+    case MPC_TYPE_EXPECT:   mpc_compile_number(c, p->data.expect.x); break;
+    case MPC_TYPE_APPLY:    mpc_compile_number(c, p->data.apply.x); break;
+    case MPC_TYPE_APPLY_TO: mpc_compile_number(c, p->data.apply_to.x); break;
+    case MPC_TYPE_PREDICT:  mpc_compile_number(c, p->data.predict.x); break;
+    case MPC_TYPE_MEMO:     mpc_compile_number(c, p->data.memo.x); break;
+    case MPC_TYPE_REGEX:    mpc_compile_number(c, p->data.regex.x); break;
+    case MPC_TYPE_SPAN:     mpc_compile_number(c, p->data.span.x); break;
+    case MPC_TYPE_NOT:
+    case MPC_TYPE_MAYBE:    mpc_compile_number(c, p->data.not.x); break;
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:
+    case MPC_TYPE_COUNT:    mpc_compile_number(c, p->data.repeat.x); break;
+    case MPC_TYPE_OR:
+      for (j = 0; j < p->data.or.n; j++) { mpc_compile_number(c, p->data.or.xs[j]); }
+      break;
+    case MPC_TYPE_AND:
+      for (j = 0; j < p->data.and.n; j++) { mpc_compile_number(c, p->data.and.xs[j]); }
+      break;
+    default: break;
   }
   
-  free(a->children);
-  free(a->tag);
-  free(a->contents);
-  free(a);
-  
 }
 
-static void mpc_ast_delete_no_children(mpc_ast_t *a) {
-  free(a->children);
-  free(a->tag);
-  free(a->contents);
-  free(a);
+static void *mpc_compile_copy(mpc_program_t *g, const void *x, size_t n) {
+  void *y;
+  if (x == NULL) { return NULL; }
+  y = mpc_arena_alloc(&g->data, n);
+  memcpy(y, x, n);
+  return y;
 }
 
-mpc_ast_t *mpc_ast_new(const char *tag, const char *contents) {
-  
-  mpc_ast_t *a = malloc(sizeof(mpc_ast_t));
-  
-  a->tag = malloc(strlen(tag) + 1);
-  strcpy(a->tag, tag);
-  
-  a->contents = malloc(strlen(contents) + 1);
-  strcpy(a->contents, contents);
-  
-  a->state = mpc_state_new();
-  
-  a->children_num = 0;
-  a->children = NULL;
-  return a;
-  
+static char *mpc_compile_string(mpc_program_t *g, const char *x) {
+  return x ? mpc_compile_copy(g, x, strlen(x) + 1) : NULL;
 }
 
-mpc_ast_t *mpc_ast_build(int n, const char *tag, ...) {
-  
-  mpc_ast_t *a = mpc_ast_new(tag, "");
+static mpc_parser_t **mpc_compile_children(mpc_program_t *g, mpc_compile_t *c, mpc_parser_t **xs, int n) {
+  int j;
+  mpc_parser_t **ys = mpc_arena_alloc(&g->data, sizeof(mpc_parser_t*) * (n ? n : 1));
+  for (j = 0; j < n; j++) { ys[j] = g->nodes + mpc_compile_find(c, xs[j]); }
+  return ys;
+}
+
+#define MPC_COMPILE_CHILD(x) (g->nodes + mpc_compile_find(c, x))
+
+static void mpc_compile_node(mpc_program_t *g, mpc_compile_t *c, mpc_parser_t *q, mpc_parser_t *p) {
   
-  int i;
-  va_list va;
-  va_start(va, tag);
+  *q = *p;
+  q->name = mpc_compile_string(g, p->name);
+  q->stats = NULL;
+  q->profile = NULL;
   
-  for (i = 0; i < n; i++) {
-    mpc_ast_add_child(a, va_arg(va, mpc_ast_t*));
+  switch (p->type) {
+    
+    case MPC_TYPE_FAIL: q->data.fail.m = mpc_compile_string(g, p->data.fail.m); break;
+    
+    case MPC_TYPE_ONEOF:
+    case MPC_TYPE_NONEOF:
+    case MPC_TYPE_STRING:
+      q->data.string.x = mpc_compile_string(g, p->data.string.x);
+      break;
+    
+    case MPC_TYPE_EXPECT:
+      q->data.expect.x = MPC_COMPILE_CHILD(p->data.expect.x);
+      q->data.expect.m = mpc_compile_string(g, p->data.expect.m);
+      break;
+    
+    case MPC_TYPE_APPLY:   q->data.apply.x = MPC_COMPILE_CHILD(p->data.apply.x); break;
+    case MPC_TYPE_PREDICT: q->data.predict.x = MPC_COMPILE_CHILD(p->data.predict.x); break;
+    case MPC_TYPE_MEMO:    q->data.memo.x = MPC_COMPILE_CHILD(p->data.memo.x); break;
+    case MPC_TYPE_NOT:
+    case MPC_TYPE_MAYBE:   q->data.not.x = MPC_COMPILE_CHILD(p->data.not.x); break;
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:
+    case MPC_TYPE_COUNT:   q->data.repeat.x = MPC_COMPILE_CHILD(p->data.repeat.x); break;
+    
+    case MPC_TYPE_APPLY_TO:
+      q->data.apply_to.x = MPC_COMPILE_CHILD(p->data.apply_to.x);
+      if (p->data.apply_to.f == (mpc_apply_to_t)mpc_ast_tag
+      ||  p->data.apply_to.f == (mpc_apply_to_t)mpc_ast_add_tag) {
+        q->data.apply_to.d = mpc_compile_string(g, p->data.apply_to.d);
+      }
+      break;
+    
+    case MPC_TYPE_SPAN:
+      q->data.span.x = MPC_COMPILE_CHILD(p->data.span.x);
+      q->data.span.scan = mpc_compile_copy(g, p->data.span.scan, sizeof(mpc_scan_t));
+      break;
+    
+    case MPC_TYPE_OR:
+      q->data.or.xs = mpc_compile_children(g, c, p->data.or.xs, p->data.or.n);
+      q->data.or.first = mpc_compile_copy(g, p->data.or.first, p->data.or.n * 32);
+      q->data.or.jump = mpc_compile_copy(g, p->data.or.jump, sizeof(int) * 256);
+      break;
+    
+    case MPC_TYPE_AND:
+      q->data.and.xs = mpc_compile_children(g, c, p->data.and.xs, p->data.and.n);
+      q->data.and.dxs = p->data.and.n > 1 ? mpc_compile_copy(g, p->data.and.dxs, sizeof(mpc_dtor_t) * (p->data.and.n-1)) : NULL;
+      break;
+    
+    /* The automaton is a function of the nodes below, so is built again from the copies */
+    case MPC_TYPE_REGEX:
+      q->data.regex.x = MPC_COMPILE_CHILD(p->data.regex.x);
+      q->data.regex.dfa = NULL;
+      break;
+    
+    default: break;
   }
   
-  va_end(va);
-  
-  return a;
-  
 }
 
-mpc_ast_t *mpc_ast_add_root(mpc_ast_t *a) {
-
-  mpc_ast_t *r;
-
-  if (a == NULL) { return a; }
-  if (a->children_num == 0) { return a; }
-  if (a->children_num == 1) { return a; }
-
-  r = mpc_ast_new(">", "");
-  mpc_ast_add_child(r, a);
-  return r;
-}
+#undef MPC_COMPILE_CHILD
 
-int mpc_ast_eq(mpc_ast_t *a, mpc_ast_t *b) {
+mpc_program_t *mpc_compile(mpc_parser_t *p) {
   
-  int i;
-
-  if (strcmp(a->tag, b->tag) != 0) { return 0; }
-  if (strcmp(a->contents, b->contents) != 0) { return 0; }
-  if (a->children_num != b->children_num) { return 0; }
+  int j;
+  mpc_compile_t c;
+  mpc_program_t *g = malloc(sizeof(mpc_program_t));
+  
+  c.num = 0;
+  c.slots = MPC_COMPILE_SLOTS_MIN;
+  c.keys = calloc(c.slots, sizeof(mpc_parser_t*));
+  c.ids = malloc(sizeof(int) * c.slots);
+  c.order = malloc(sizeof(mpc_parser_t*) * c.slots / 2);
+  mpc_compile_number(&c, p);
+  
+  g->nodes_num = c.num;
+  g->nodes = malloc(sizeof(mpc_parser_t) * c.num);
+  g->data.blocks = NULL;
+  
+  for (j = 0; j < c.num; j++) {
+    mpc_compile_node(g, &c, g->nodes + j, c.order[j]);
+  }
   
-  for (i = 0; i < a->children_num; i++) {
-    if (!mpc_ast_eq(a->children[i], b->children[i])) { return 0; }
+  for (j = 0; j < c.num; j++) {
+    if (g->nodes[j].type == MPC_TYPE_REGEX && c.order[j]->data.regex.dfa) {
+      g->nodes[j].data.regex.dfa = mpc_dfa_new(g->nodes[j].data.regex.x);
+    }
   }
   
-  return 1;
+  free(c.keys);
+  free(c.ids);
+  free(c.order);
+  return g;
 }
 
-mpc_ast_t *mpc_ast_add_child(mpc_ast_t *r, mpc_ast_t *a) {
-  r->children_num++;
-  r->children = realloc(r->children, sizeof(mpc_ast_t*) * r->children_num);
-  r->children[r->children_num-1] = a;
-  return r;
+mpc_parser_t *mpc_program_start(mpc_program_t *g) {
+  return g->nodes;
 }
 
-mpc_ast_t *mpc_ast_add_tag(mpc_ast_t *a, const char *t) {
-  if (a == NULL) { return a; }
-  a->tag = realloc(a->tag, strlen(t) + 1 + strlen(a->tag) + 1);
-  memmove(a->tag + strlen(t) + 1, a->tag, strlen(a->tag)+1);
-  memmove(a->tag, t, strlen(t));
-  memmove(a->tag + strlen(t), "|", 1);
-  return a;
+void mpc_program_delete(mpc_program_t *g) {
+  int j;
+  for (j = 0; j < g->nodes_num; j++) {
+    if (g->nodes[j].type == MPC_TYPE_REGEX) { mpc_dfa_delete(g->nodes[j].data.regex.dfa); }
+  }
+  mpc_arena_free(&g->data);
+  free(g->nodes);
+  free(g);
 }
 
-mpc_ast_t *mpc_ast_tag(mpc_ast_t *a, const char *t) {
-  a->tag = realloc(a->tag, strlen(t) + 1);
-  strcpy(a->tag, t);
-  return a;
-}
+/*
+** Saving Programs
+**
+** A saved program is a header followed by each
+** node in order, with children written as node
+** numbers, then a checksum of all of it. Saved
+** functions are their place in the table below,
+** so only grammars built from mpc's own functions
+** can be saved. New entries must only ever be
+** added at the end. Automata and scan tables are
+** rebuilt when loading.
+**
+** Each function is tagged with the kind of slot
+** it may be loaded into. `mpcf_state_ast` has a
+** kind of its own, as it only folds a `state`
+** followed by one other result.
+*/
 
-mpc_ast_t *mpc_ast_state(mpc_ast_t *a, mpc_state_t s) {
-  if (a == NULL) { return a; }
-  a->state = s;
-  return a;
-}
+typedef void (*mpc_program_fn_t)(void);
 
-static void mpc_ast_print_depth(mpc_ast_t *a, int d, FILE *fp) {
-  
-  int i;
-  
-  if (a == NULL) {
-    fprintf(fp, "NULL\n");
-    return;
-  }
-  
-  for (i = 0; i < d; i++) { fprintf(fp, "  "); }
-  
-  if (strlen(a->contents)) {
-    fprintf(fp, "%s:%lu:%lu '%s'\n", a->tag, 
-      (long unsigned int)(a->state.row+1),
-      (long unsigned int)(a->state.col+1),
-      a->contents);
-  } else {
-    fprintf(fp, "%s \n", a->tag);
-  }
-  
-  for (i = 0; i < a->children_num; i++) {
-    mpc_ast_print_depth(a->children[i], d+1, fp);
+enum {
+  MPC_PROGRAM_VERSION = 3,
+  MPC_PROGRAM_ORDER = 0x01020304,
+  MPC_PROGRAM_FNS = 40
+};
+
+enum {
+  MPC_FN_DTOR     = 1,
+  MPC_FN_CTOR     = 2,
+  MPC_FN_APPLY    = 4,
+  MPC_FN_APPLY_TO = 8,
+  MPC_FN_FOLD     = 16,
+  MPC_FN_STATE    = 32,
+  MPC_FN_ANCHOR   = 64,
+  MPC_FN_SATISFY  = 128
+};
+
+typedef struct {
+  mpc_program_fn_t f;
+  int kind;
+} mpc_program_fn_entry_t;
+
+static const mpc_program_fn_entry_t mpc_program_fns[MPC_PROGRAM_FNS] = {
+  { (mpc_program_fn_t)free,                     MPC_FN_DTOR },
+  { (mpc_program_fn_t)mpcf_dtor_null,           MPC_FN_DTOR },
+  { (mpc_program_fn_t)mpcf_ctor_null,           MPC_FN_CTOR },
+  { (mpc_program_fn_t)mpcf_ctor_str,            MPC_FN_CTOR },
+  { (mpc_program_fn_t)mpcf_free,                MPC_FN_APPLY },
+  { (mpc_program_fn_t)mpcf_int,                 MPC_FN_APPLY },
+  { (mpc_program_fn_t)mpcf_hex,                 MPC_FN_APPLY },
+  { (mpc_program_fn_t)mpcf_oct,                 MPC_FN_APPLY },
+  { (mpc_program_fn_t)mpcf_float,               MPC_FN_APPLY },
+  { (mpc_program_fn_t)mpcf_strtriml,            MPC_FN_APPLY },
+  { (mpc_program_fn_t)mpcf_strtrimr,            MPC_FN_APPLY },
+  { (mpc_program_fn_t)mpcf_strtrim,             MPC_FN_APPLY },
+  { (mpc_program_fn_t)mpcf_escape,              MPC_FN_APPLY },
+  { (mpc_program_fn_t)mpcf_unescape,            MPC_FN_APPLY },
+  { (mpc_program_fn_t)mpcf_escape_regex,        MPC_FN_APPLY },
+  { (mpc_program_fn_t)mpcf_unescape_regex,      MPC_FN_APPLY },
+  { (mpc_program_fn_t)mpcf_escape_string_raw,   MPC_FN_APPLY },
+  { (mpc_program_fn_t)mpcf_unescape_string_raw, MPC_FN_APPLY },
+  { (mpc_program_fn_t)mpcf_escape_char_raw,     MPC_FN_APPLY },
+  { (mpc_program_fn_t)mpcf_unescape_char_raw,   MPC_FN_APPLY },
+  { (mpc_program_fn_t)mpcf_null,                MPC_FN_FOLD },
+  { (mpc_program_fn_t)mpcf_fst,                 MPC_FN_FOLD },
+  { (mpc_program_fn_t)mpcf_snd,                 MPC_FN_FOLD },
+  { (mpc_program_fn_t)mpcf_trd,                 MPC_FN_FOLD },
+  { (mpc_program_fn_t)mpcf_fst_free,            MPC_FN_FOLD },
+  { (mpc_program_fn_t)mpcf_snd_free,            MPC_FN_FOLD },
+  { (mpc_program_fn_t)mpcf_trd_free,            MPC_FN_FOLD },
+  { (mpc_program_fn_t)mpcf_strfold,             MPC_FN_FOLD },
+  { (mpc_program_fn_t)mpcf_maths,               MPC_FN_FOLD },
+  { (mpc_program_fn_t)mpc_ast_delete,           MPC_FN_DTOR },
+  { (mpc_program_fn_t)mpc_ast_tag,              MPC_FN_APPLY_TO },
+  { (mpc_program_fn_t)mpc_ast_add_tag,          MPC_FN_APPLY_TO },
+  { (mpc_program_fn_t)mpc_ast_add_root,         MPC_FN_APPLY },
+  { (mpc_program_fn_t)mpc_ast_copy,             MPC_FN_APPLY },
+  { (mpc_program_fn_t)mpcf_fold_ast,            MPC_FN_FOLD },
+  { (mpc_program_fn_t)mpcf_str_ast,             MPC_FN_APPLY },
+  { (mpc_program_fn_t)mpcf_state_ast,           MPC_FN_STATE },
+  { (mpc_program_fn_t)mpc_soi_anchor,           MPC_FN_ANCHOR },
+  { (mpc_program_fn_t)mpc_eoi_anchor,           MPC_FN_ANCHOR },
+  { (mpc_program_fn_t)mpc_boundary_anchor,      MPC_FN_ANCHOR }
+};
+
+static int mpc_program_own_fn(mpc_program_fn_t fn) {
+  int j;
+  if (fn == NULL) { return 1; }
+  for (j = 0; j < MPC_PROGRAM_FNS; j++) {
+    if (mpc_program_fns[j].f == fn) { return 1; }
   }
-  
+  return 0;
 }
 
-void mpc_ast_print(mpc_ast_t *a) {
-  mpc_ast_print_depth(a, 0, stdout);
-}
+/*
+** Whether a grammar has AST memos and otherwise
+** uses only mpc's own functions, so that parsing
+** it into an arena hands arena nodes to nothing
+** which might change or free them.
+*/
 
-void mpc_ast_print_to(mpc_ast_t *a, FILE *fp) {
-  mpc_ast_print_depth(a, 0, fp);
-}
+enum {
+  MPC_MEMO_AST     = 1,
+  MPC_MEMO_FOREIGN = 2
+};
 
-mpc_val_t *mpcf_fold_ast(int n, mpc_val_t **xs) {
-  
-  int i, j;
-  mpc_ast_t** as = (mpc_ast_t**)xs;
-  mpc_ast_t *r;
-  
-  if (n == 0) { return NULL; }
-  if (n == 1) { return xs[0]; }
-  if (n == 2 && xs[1] == NULL) { return xs[0]; }
-  if (n == 2 && xs[0] == NULL) { return xs[1]; }
-  
-  r = mpc_ast_new(">", "");
+#define MPC_MEMO_FN(f) (mpc_program_own_fn((mpc_program_fn_t)(f)) ? 0 : MPC_MEMO_FOREIGN)
+
+static int mpc_memo_uses(mpc_parser_t *p, mpc_parser_t ***seen, int *seen_num) {
   
-  for (i = 0; i < n; i++) {
-    
-    if (as[i] == NULL) { continue; }
-    
-    if (as[i] && as[i]->children_num > 0) {
-      
-      for (j = 0; j < as[i]->children_num; j++) {
-        mpc_ast_add_child(r, as[i]->children[j]);
-      }
-      
-      mpc_ast_delete_no_children(as[i]);
-      
-    } else if (as[i] && as[i]->children_num == 0) {
-      mpc_ast_add_child(r, as[i]);
-    }
+  int j, u = 0;
   
+  if (p->retained) {
+    for (j = 0; j < *seen_num; j++) { if ((*seen)[j] == p) { return 0; } }
+    *seen = realloc(*seen, sizeof(mpc_parser_t*) * (*seen_num + 1));
+    (*seen)[(*seen_num)++] = p;
   }
   
-  if (r->children_num) {
-    r->state = r->children[0]->state;
+  switch (p->type) {
+    case MPC_TYPE_LIFT:     return MPC_MEMO_FN(p->data.lift.lf);
+    case MPC_TYPE_EXPECT:   return mpc_memo_uses(p->data.expect.x, seen, seen_num);
+    case MPC_TYPE_PREDICT:  return mpc_memo_uses(p->data.predict.x, seen, seen_num);
+    case MPC_TYPE_SPAN:     return mpc_memo_uses(p->data.span.x, seen, seen_num);
+    case MPC_TYPE_APPLY:
+      return MPC_MEMO_FN(p->data.apply.f) | mpc_memo_uses(p->data.apply.x, seen, seen_num);
+    case MPC_TYPE_APPLY_TO:
+      return MPC_MEMO_FN(p->data.apply_to.f) | mpc_memo_uses(p->data.apply_to.x, seen, seen_num);
+    case MPC_TYPE_NOT:
+    case MPC_TYPE_MAYBE:
+      return MPC_MEMO_FN(p->data.not.dx) | MPC_MEMO_FN(p->data.not.lf)
+        | mpc_memo_uses(p->data.not.x, seen, seen_num);
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:
+    case MPC_TYPE_COUNT:
+      return MPC_MEMO_FN(p->data.repeat.f) | MPC_MEMO_FN(p->data.repeat.dx)
+        | mpc_memo_uses(p->data.repeat.x, seen, seen_num);
+    case MPC_TYPE_OR:
+      for (j = 0; j < p->data.or.n; j++) { u |= mpc_memo_uses(p->data.or.xs[j], seen, seen_num); }
+      return u;
+    case MPC_TYPE_AND:
+      u = MPC_MEMO_FN(p->data.and.f);
+      for (j = 0; j < p->data.and.n-1; j++) { u |= MPC_MEMO_FN(p->data.and.dxs[j]); }
+      for (j = 0; j < p->data.and.n; j++) { u |= mpc_memo_uses(p->data.and.xs[j], seen, seen_num); }
+      return u;
+    case MPC_TYPE_MEMO:
+      u = p->data.memo.cp == mpc_ast_copy && p->data.memo.dx == (mpc_dtor_t)mpc_ast_delete
+        ? MPC_MEMO_AST : MPC_MEMO_FN(p->data.memo.cp) | MPC_MEMO_FN(p->data.memo.dx);
+      return u | mpc_memo_uses(p->data.memo.x, seen, seen_num);
+    default: return 0;
   }
   
-  return r;
 }
 
-mpc_val_t *mpcf_str_ast(mpc_val_t *c) {
-  mpc_ast_t *a = mpc_ast_new("", c);
-  free(c);
-  return a;
+static int mpc_memo_shares_ast(mpc_parser_t *p) {
+  mpc_parser_t **seen = NULL;
+  int seen_num = 0;
+  int u = mpc_memo_uses(p, &seen, &seen_num);
+  free(seen);
+  return u == MPC_MEMO_AST;
 }
 
-mpc_val_t *mpcf_state_ast(int n, mpc_val_t **xs) {
-  mpc_state_t *s = ((mpc_state_t**)xs)[0];
-  mpc_ast_t *a = ((mpc_ast_t**)xs)[1];
-  (void)n;
-  a = mpc_ast_state(a, *s);
-  free(s);
-  return a;
-}
+static const char mpc_program_magic[4] = { 'm', 'p', 'c', 'g' };
 
-mpc_parser_t *mpca_state(mpc_parser_t *a) {
-  return mpc_and(2, mpcf_state_ast, mpc_state(), a, free);
-}
+/*
+** A program is saved into, and loaded from, an
+** image in memory, so a checksum can be taken of
+** it and every length read from it can be held
+** to the bytes actually left.
+*/
 
-mpc_parser_t *mpca_tag(mpc_parser_t *a, const char *t) {
-  return mpc_apply_to(a, (mpc_apply_to_t)mpc_ast_tag, (void*)t);
+typedef struct {
+  char *data;
+  long num;
+  long slots;
+  long pos;
+} mpc_image_t;
+
+/* FNV-1a, kept to 32 bits so it is the same whatever the size of a long */
+static long mpc_image_sum(const char *x, long n) {
+  unsigned long h = 2166136261UL;
+  long j;
+  for (j = 0; j < n; j++) { h = ((h ^ (unsigned char)x[j]) * 16777619UL) & 0xFFFFFFFFUL; }
+  return (long)h;
+}
+
+static int mpc_save_raw(mpc_image_t *b, const void *x, long n) {
+  char *data;
+  if (b->num + n > b->slots) {
+    b->slots = b->num + n > b->slots * 2 ? b->num + n : b->slots * 2;
+    data = realloc(b->data, b->slots);
+    if (data == NULL) { return 0; }
+    b->data = data;
+  }
+  memcpy(b->data + b->num, x, n);
+  b->num += n;
+  return 1;
 }
 
-mpc_parser_t *mpca_add_tag(mpc_parser_t *a, const char *t) {
-  return mpc_apply_to(a, (mpc_apply_to_t)mpc_ast_add_tag, (void*)t);
+static int mpc_save_long(mpc_image_t *b, long x) {
+  return mpc_save_raw(b, &x, sizeof(long));
 }
 
-mpc_parser_t *mpca_root(mpc_parser_t *a) {
-  return mpc_apply(a, (mpc_apply_t)mpc_ast_add_root);
+static int mpc_save_bytes(mpc_image_t *b, const void *x, long n) {
+  if (!mpc_save_long(b, x ? n : -1)) { return 0; }
+  return x == NULL || n == 0 || mpc_save_raw(b, x, n);
 }
 
-mpc_parser_t *mpca_not(mpc_parser_t *a) { return mpc_not(a, (mpc_dtor_t)mpc_ast_delete); }
-mpc_parser_t *mpca_maybe(mpc_parser_t *a) { return mpc_maybe(a); }
-mpc_parser_t *mpca_many(mpc_parser_t *a) { return mpc_many(mpcf_fold_ast, a); }
-mpc_parser_t *mpca_many1(mpc_parser_t *a) { return mpc_many1(mpcf_fold_ast, a); }
-mpc_parser_t *mpca_count(int n, mpc_parser_t *a) { return mpc_count(n, mpcf_fold_ast, a, (mpc_dtor_t)mpc_ast_delete); }
+static int mpc_save_string(mpc_image_t *b, const char *x) {
+  return mpc_save_bytes(b, x, x ? (long)strlen(x) : 0);
+}
 
-mpc_parser_t *mpca_or(int n, ...) {
+static int mpc_save_fn(mpc_image_t *b, mpc_program_fn_t fn) {
+  int j;
+  if (fn == NULL) { return mpc_save_long(b, -1); }
+  for (j = 0; j < MPC_PROGRAM_FNS; j++) {
+    if (mpc_program_fns[j].f == fn) { return mpc_save_long(b, j); }
+  }
+  return 0;
+}
 
-  int i;
-  va_list va;
+static int mpc_save_child(mpc_image_t *b, mpc_program_t *g, mpc_parser_t *x) {
+  return mpc_save_long(b, (long)(x - g->nodes));
+}
 
-  mpc_parser_t *p = mpc_undefined();
+static int mpc_save_node(mpc_image_t *b, mpc_program_t *g, mpc_parser_t *p) {
   
-  p->type = MPC_TYPE_OR;
-  p->data.or.n = n;
-  p->data.or.xs = malloc(sizeof(mpc_parser_t*) * n);
+  int j;
   
-  va_start(va, n);  
-  for (i = 0; i < n; i++) {
-    p->data.or.xs[i] = va_arg(va, mpc_parser_t*);
-  }
-  va_end(va);
+  if (!mpc_save_long(b, p->type)
+  ||  !mpc_save_long(b, p->retained)
+  ||  !mpc_save_string(b, p->name)) { return 0; }
   
-  return p;
+  switch (p->type) {
+    
+    case MPC_TYPE_UNDEFINED:
+    case MPC_TYPE_PASS:
+    case MPC_TYPE_STATE:
+    case MPC_TYPE_ANY:
+      return 1;
+    
+    case MPC_TYPE_FAIL: return mpc_save_string(b, p->data.fail.m);
+    case MPC_TYPE_LIFT: return mpc_save_fn(b, (mpc_program_fn_t)p->data.lift.lf);
+    case MPC_TYPE_LIFT_VAL: return p->data.lift.x == NULL;
+    case MPC_TYPE_ANCHOR: return mpc_save_fn(b, (mpc_program_fn_t)p->data.anchor.f);
+    case MPC_TYPE_SATISFY: return mpc_save_fn(b, (mpc_program_fn_t)p->data.satisfy.f);
+    case MPC_TYPE_SINGLE: return mpc_save_long(b, p->data.single.x);
+    case MPC_TYPE_RANGE: return mpc_save_long(b, p->data.range.x) && mpc_save_long(b, p->data.range.y);
+    case MPC_TYPE_CHARSET: return mpc_save_bytes(b, p->data.charset.x, 32);
+    
+    case MPC_TYPE_ONEOF:
+    case MPC_TYPE_NONEOF:
+    case MPC_TYPE_STRING:
+      return mpc_save_string(b, p->data.string.x);
+    
+    case MPC_TYPE_EXPECT:
+      return mpc_save_child(b, g, p->data.expect.x) && mpc_save_string(b, p->data.expect.m);
+    
+    case MPC_TYPE_APPLY:
+      return mpc_save_child(b, g, p->data.apply.x) && mpc_save_fn(b, (mpc_program_fn_t)p->data.apply.f);
+    
+    case MPC_TYPE_APPLY_TO:
+      if (p->data.apply_to.f != (mpc_apply_to_t)mpc_ast_tag
+      &&  p->data.apply_to.f != (mpc_apply_to_t)mpc_ast_add_tag) { return 0; }
+      return mpc_save_child(b, g, p->data.apply_to.x)
+          && mpc_save_fn(b, (mpc_program_fn_t)p->data.apply_to.f)
+          && mpc_save_string(b, p->data.apply_to.d);
+    
+    case MPC_TYPE_PREDICT: return mpc_save_child(b, g, p->data.predict.x);
+    
+    case MPC_TYPE_NOT:
+    case MPC_TYPE_MAYBE:
+      return mpc_save_child(b, g, p->data.not.x)
+          && mpc_save_fn(b, (mpc_program_fn_t)p->data.not.dx)
+          && mpc_save_fn(b, (mpc_program_fn_t)p->data.not.lf);
+    
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:
+    case MPC_TYPE_COUNT:
+      return mpc_save_long(b, p->data.repeat.n)
+          && mpc_save_fn(b, (mpc_program_fn_t)p->data.repeat.f)
+          && mpc_save_child(b, g, p->data.repeat.x)
+          && mpc_save_fn(b, (mpc_program_fn_t)p->data.repeat.dx);
+    
+    case MPC_TYPE_MEMO:
+      return mpc_save_child(b, g, p->data.memo.x)
+          && mpc_save_fn(b, (mpc_program_fn_t)p->data.memo.dx)
+          && mpc_save_fn(b, (mpc_program_fn_t)p->data.memo.cp);
+    
+    case MPC_TYPE_REGEX:
+      return mpc_save_child(b, g, p->data.regex.x) && mpc_save_long(b, p->data.regex.dfa != NULL);
+    
+    case MPC_TYPE_SPAN:
+      return mpc_save_child(b, g, p->data.span.x)
+          && mpc_save_long(b, p->data.span.min)
+          && mpc_save_long(b, p->data.span.esc)
+          && mpc_save_bytes(b, p->data.span.scan->set, 32);
+    
+    case MPC_TYPE_OR:
+      if (!mpc_save_long(b, p->data.or.n)) { return 0; }
+      for (j = 0; j < p->data.or.n; j++) {
+        if (!mpc_save_child(b, g, p->data.or.xs[j])) { return 0; }
+      }
+      return mpc_save_long(b, p->data.or.first != NULL);
+    
+    case MPC_TYPE_AND:
+      if (!mpc_save_long(b, p->data.and.n)
+      ||  !mpc_save_fn(b, (mpc_program_fn_t)p->data.and.f)) { return 0; }
+      for (j = 0; j < p->data.and.n; j++) {
+        if (!mpc_save_child(b, g, p->data.and.xs[j])) { return 0; }
+      }
+      for (j = 0; j < p->data.and.n-1; j++) {
+        if (!mpc_save_fn(b, (mpc_program_fn_t)p->data.and.dxs[j])) { return 0; }
+      }
+      return 1;
+    
+    default: return 0;
+  }
   
 }
 
-mpc_parser_t *mpca_and(int n, ...) {
+/* The image ends with a checksum of everything before it */
+int mpc_program_save(mpc_program_t *g, FILE *f) {
   
-  int i;
-  va_list va;
+  int j, ok;
+  mpc_image_t b;
   
-  mpc_parser_t *p = mpc_undefined();
+  b.data = NULL;
+  b.num = 0;
+  b.slots = 0;
   
-  p->type = MPC_TYPE_AND;
-  p->data.and.n = n;
-  p->data.and.f = mpcf_fold_ast;
-  p->data.and.xs = malloc(sizeof(mpc_parser_t*) * n);
-  p->data.and.dxs = malloc(sizeof(mpc_dtor_t) * (n-1));
+  ok = mpc_save_raw(&b, mpc_program_magic, 4)
+    && mpc_save_long(&b, MPC_PROGRAM_VERSION)
+    && mpc_save_long(&b, MPC_PROGRAM_ORDER)
+    && mpc_save_long(&b, sizeof(long))
+    && mpc_save_long(&b, sizeof(int))
+    && mpc_save_long(&b, g->nodes_num);
   
-  va_start(va, n);
-  for (i = 0; i < n; i++) {
-    p->data.and.xs[i] = va_arg(va, mpc_parser_t*);
+  for (j = 0; ok && j < g->nodes_num; j++) {
+    ok = mpc_save_node(&b, g, g->nodes + j);
   }
-  for (i = 0; i < (n-1); i++) {
-    p->data.and.dxs[i] = (mpc_dtor_t)mpc_ast_delete;
-  }    
-  va_end(va);
   
-  return p;  
+  ok = ok && mpc_save_long(&b, mpc_image_sum(b.data, b.num))
+    && fwrite(b.data, 1, b.num, f) == (size_t)b.num;
+  
+  free(b.data);
+  return ok;
 }
 
-mpc_parser_t *mpca_total(mpc_parser_t *a) { return mpc_total(a, (mpc_dtor_t)mpc_ast_delete); }
-
-/*
-** Grammar Parser
-*/
-
-/*
-** This is another interesting bootstrapping.
-**
-** Having a general purpose AST type allows
-** users to specify the grammar alone and
-** let all fold rules be automatically taken
-** care of by existing functions.
-**
-** You don't get to control the type spat
-** out but this means you can make a nice
-** parser to take in some grammar in nice
-** syntax and spit out a parser that works.
-**
-** The grammar for this looks surprisingly
-** like regex but the main difference is that
-** it is now whitespace insensitive and the
-** base type takes literals of some form.
-*/
-
-/*
-**
-**  ### Grammar Grammar
-**
-**      <grammar> : (<term> "|" <grammar>) | <term>
-**     
-**      <term> : <factor>*
-**
-**      <factor> : <base>
-**               | <base> "*"
-**               | <base> "+"
-**               | <base> "?"
-**               | <base> "{" <digits> "}"
-**           
-**      <base> : "<" (<digits> | <ident>) ">"
-**             | <string_lit>
-**             | <char_lit>
-**             | <regex_lit>
-**             | "(" <grammar> ")"
-*/
-
-typedef struct {
-  va_list *va;
-  int parsers_num;
-  mpc_parser_t **parsers;
-  int flags;
-} mpca_grammar_st_t;
+static long mpc_load_left(mpc_image_t *b) {
+  return b->num - b->pos;
+}
 
-static mpc_val_t *mpcaf_grammar_or(int n, mpc_val_t **xs) {
-  (void) n;
-  if (xs[1] == NULL) { return xs[0]; }
-  else { return mpca_or(2, xs[0], xs[1]); }
+static int mpc_load_raw(mpc_image_t *b, void *x, long n) {
+  if (n < 0 || n > mpc_load_left(b)) { return 0; }
+  memcpy(x, b->data + b->pos, n);
+  b->pos += n;
+  return 1;
 }
 
-static mpc_val_t *mpcaf_grammar_and(int n, mpc_val_t **xs) {
-  int i;
-  mpc_parser_t *p = mpc_pass();  
-  for (i = 0; i < n; i++) {
-    if (xs[i] != NULL) { p = mpca_and(2, p, xs[i]); }
-  }
-  return p;
+static int mpc_load_long(mpc_image_t *b, long *x) {
+  return mpc_load_raw(b, x, sizeof(long));
 }
 
-static mpc_val_t *mpcaf_grammar_repeat(int n, mpc_val_t **xs) { 
-  int num;
-  (void) n;
-  if (xs[1] == NULL) { return xs[0]; }  
-  if (strcmp(xs[1], "*") == 0) { free(xs[1]); return mpca_many(xs[0]); }
-  if (strcmp(xs[1], "+") == 0) { free(xs[1]); return mpca_many1(xs[0]); }
-  if (strcmp(xs[1], "?") == 0) { free(xs[1]); return mpca_maybe(xs[0]); }
-  if (strcmp(xs[1], "!") == 0) { free(xs[1]); return mpca_not(xs[0]); }
-  num = *((int*)xs[1]);
-  free(xs[1]);
-  return mpca_count(num, xs[0]);
+/* Reads `n` bytes into the program, or NULL into `x` if none were saved */
+static int mpc_load_bytes(mpc_image_t *b, mpc_program_t *g, void **x, long n, int string) {
+  long m;
+  if (!mpc_load_long(b, &m)) { return 0; }
+  if (m < 0) { *x = NULL; return 1; }
+  if ((n >= 0 && m != n) || m > mpc_load_left(b)) { return 0; }
+  *x = mpc_arena_alloc(&g->data, m + (string ? 1 : 0));
+  mpc_load_raw(b, *x, m);
+  if (string) { ((char*)*x)[m] = '\0'; }
+  return 1;
 }
 
-static mpc_val_t *mpcaf_grammar_string(mpc_val_t *x, void *s) {
-  mpca_grammar_st_t *st = s;
-  char *y = mpcf_unescape(x);
-  mpc_parser_t *p = (st->flags & MPCA_LANG_WHITESPACE_SENSITIVE) ? mpc_string(y) : mpc_tok(mpc_string(y));
-  free(y);
-  return mpca_state(mpca_tag(mpc_apply(p, mpcf_str_ast), "string"));
+static int mpc_load_string(mpc_image_t *b, mpc_program_t *g, char **x) {
+  return mpc_load_bytes(b, g, (void**)x, -1, 1);
 }
 
-static mpc_val_t *mpcaf_grammar_char(mpc_val_t *x, void *s) {
-  mpca_grammar_st_t *st = s;
-  char *y = mpcf_unescape(x);
-  mpc_parser_t *p = (st->flags & MPCA_LANG_WHITESPACE_SENSITIVE) ? mpc_char(y[0]) : mpc_tok(mpc_char(y[0]));
-  free(y);
-  return mpca_state(mpca_tag(mpc_apply(p, mpcf_str_ast), "char"));
+/* A function must be of one of the `kinds` the slot it is loaded into takes */
+static int mpc_load_fn(mpc_image_t *b, mpc_program_fn_t *fn, int kinds) {
+  long j;
+  if (!mpc_load_long(b, &j) || j < -1 || j >= MPC_PROGRAM_FNS) { return 0; }
+  if (j >= 0 && !(mpc_program_fns[j].kind & kinds)) { return 0; }
+  *fn = j < 0 ? NULL : mpc_program_fns[j].f;
+  return 1;
 }
 
-static mpc_val_t *mpcaf_grammar_regex(mpc_val_t *x, void *s) {
-  mpca_grammar_st_t *st = s;
-  char *y = mpcf_unescape_regex(x);
-  mpc_parser_t *p = (st->flags & MPCA_LANG_WHITESPACE_SENSITIVE) ? mpc_re(y) : mpc_tok(mpc_re(y));
-  free(y);
-  return mpca_state(mpca_tag(mpc_apply(p, mpcf_str_ast), "regex"));
+static int mpc_load_child(mpc_image_t *b, mpc_program_t *g, mpc_parser_t **x) {
+  long j;
+  if (!mpc_load_long(b, &j) || j < 0 || j >= g->nodes_num) { return 0; }
+  *x = g->nodes + j;
+  return 1;
 }
 
-/* Should this just use `isdigit` instead? */
-static int is_number(const char* s) {
-  size_t i;
-  for (i = 0; i < strlen(s); i++) { if (!strchr("0123456789", s[i])) { return 0; } }
+static int mpc_load_int(mpc_image_t *b, int *x) {
+  long y;
+  if (!mpc_load_long(b, &y) || (long)(int)y != y) { return 0; }
+  *x = (int)y;
   return 1;
 }
 
-static mpc_parser_t *mpca_grammar_find_parser(char *x, mpca_grammar_st_t *st) {
+#define MPC_LOAD_FN(x, k) mpc_load_fn(b, (mpc_program_fn_t*)&(x), k)
+
+static int mpc_load_node(mpc_image_t *b, mpc_program_t *g, mpc_parser_t *p) {
+  
+  int j;
+  long x, y;
+  void *set;
+  mpc_scan_t *scan;
   
-  int i;
-  mpc_parser_t *p;
+  memset(p, 0, sizeof(mpc_parser_t));
   
-  /* Case of Number */
-  if (is_number(x)) {
-
-    i = strtol(x, NULL, 10);
+  if (!mpc_load_long(b, &x)
+  ||  !mpc_load_long(b, &y)
+  ||  !mpc_load_string(b, g, &p->name)) { return 0; }
+  
+  p->type = (char)x;
+  p->retained = (char)y;
+  
+  switch (p->type) {
     
-    while (st->parsers_num <= i) {
-      st->parsers_num++;
-      st->parsers = realloc(st->parsers, sizeof(mpc_parser_t*) * st->parsers_num);
-      st->parsers[st->parsers_num-1] = va_arg(*st->va, mpc_parser_t*);
-      if (st->parsers[st->parsers_num-1] == NULL) {
-        return mpc_failf("No Parser in position %i! Only supplied %i Parsers!", i, st->parsers_num);
-      }
-    }
+    case MPC_TYPE_UNDEFINED:
+    case MPC_TYPE_PASS:
+    case MPC_TYPE_STATE:
+    case MPC_TYPE_ANY:
+    case MPC_TYPE_LIFT_VAL:
+      return 1;
     
-    return st->parsers[st->parsers_num-1];
-  
-  /* Case of Identifier */
-  } else {
+    case MPC_TYPE_FAIL: return mpc_load_string(b, g, &p->data.fail.m) && p->data.fail.m;
+    case MPC_TYPE_LIFT: return MPC_LOAD_FN(p->data.lift.lf, MPC_FN_CTOR);
+    case MPC_TYPE_ANCHOR: return MPC_LOAD_FN(p->data.anchor.f, MPC_FN_ANCHOR) && p->data.anchor.f;
+    case MPC_TYPE_SATISFY: return MPC_LOAD_FN(p->data.satisfy.f, MPC_FN_SATISFY) && p->data.satisfy.f;
     
-    /* Search Existing Parsers */
-    for (i = 0; i < st->parsers_num; i++) {
-      mpc_parser_t *q = st->parsers[i];
-      if (q == NULL) { return mpc_failf("Unknown Parser '%s'!", x); }
-      if (q->name && strcmp(q->name, x) == 0) { return q; }
-    }
+    case MPC_TYPE_SINGLE:
+      if (!mpc_load_long(b, &x)) { return 0; }
+      p->data.single.x = (char)x;
+      return 1;
     
-    /* Search New Parsers */
-    while (1) {
+    case MPC_TYPE_RANGE:
+      if (!mpc_load_long(b, &x) || !mpc_load_long(b, &y)) { return 0; }
+      p->data.range.x = (char)x;
+      p->data.range.y = (char)y;
+      return 1;
     
-      p = va_arg(*st->va, mpc_parser_t*);
-      
-      st->parsers_num++;
-      st->parsers = realloc(st->parsers, sizeof(mpc_parser_t*) * st->parsers_num);
-      st->parsers[st->parsers_num-1] = p;
-      
-      if (p == NULL) { return mpc_failf("Unknown Parser '%s'!", x); }
-      if (p->name && strcmp(p->name, x) == 0) { return p; }
-      
-    }
-  
-  }  
+    case MPC_TYPE_CHARSET:
+      if (!mpc_load_bytes(b, g, &set, 32, 0) || set == NULL) { return 0; }
+      memcpy(p->data.charset.x, set, 32);
+      return 1;
+    
+    case MPC_TYPE_ONEOF:
+    case MPC_TYPE_NONEOF:
+    case MPC_TYPE_STRING:
+      return mpc_load_string(b, g, &p->data.string.x) && p->data.string.x;
+    
+    case MPC_TYPE_EXPECT:
+      return mpc_load_child(b, g, &p->data.expect.x)
+          && mpc_load_string(b, g, &p->data.expect.m) && p->data.expect.m;
+    
+    case MPC_TYPE_APPLY:
+      return mpc_load_child(b, g, &p->data.apply.x) && MPC_LOAD_FN(p->data.apply.f, MPC_FN_APPLY) && p->data.apply.f;
+    
+    case MPC_TYPE_APPLY_TO:
+      return mpc_load_child(b, g, &p->data.apply_to.x)
+          && MPC_LOAD_FN(p->data.apply_to.f, MPC_FN_APPLY_TO)
+          && (p->data.apply_to.f == (mpc_apply_to_t)mpc_ast_tag
+          ||  p->data.apply_to.f == (mpc_apply_to_t)mpc_ast_add_tag)
+          && mpc_load_string(b, g, (char**)&p->data.apply_to.d) && p->data.apply_to.d;
+    
+    case MPC_TYPE_PREDICT: return mpc_load_child(b, g, &p->data.predict.x);
+    
+    case MPC_TYPE_NOT:
+    case MPC_TYPE_MAYBE:
+      return mpc_load_child(b, g, &p->data.not.x)
+          && MPC_LOAD_FN(p->data.not.dx, MPC_FN_DTOR)
+          && MPC_LOAD_FN(p->data.not.lf, MPC_FN_CTOR);
+    
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:
+    case MPC_TYPE_COUNT:
+      return mpc_load_int(b, &p->data.repeat.n)
+          && MPC_LOAD_FN(p->data.repeat.f, MPC_FN_FOLD)
+          && mpc_load_child(b, g, &p->data.repeat.x)
+          && MPC_LOAD_FN(p->data.repeat.dx, MPC_FN_DTOR);
+    
+    case MPC_TYPE_MEMO:
+      return mpc_load_child(b, g, &p->data.memo.x)
+          && MPC_LOAD_FN(p->data.memo.dx, MPC_FN_DTOR) && p->data.memo.dx
+          && MPC_LOAD_FN(p->data.memo.cp, MPC_FN_APPLY) && p->data.memo.cp;
+    
+    /* A non-NULL automaton marks one to be rebuilt once every node is loaded */
+    case MPC_TYPE_REGEX:
+      if (!mpc_load_child(b, g, &p->data.regex.x) || !mpc_load_long(b, &x)) { return 0; }
+      p->data.regex.dfa = x ? (mpc_dfa_t*)p : NULL;
+      return 1;
+    
+    case MPC_TYPE_SPAN:
+      if (!mpc_load_child(b, g, &p->data.span.x)
+      ||  !mpc_load_int(b, &p->data.span.min)
+      ||  !mpc_load_int(b, &p->data.span.esc)
+      ||  !mpc_load_bytes(b, g, &set, 32, 0) || set == NULL) { return 0; }
+      scan = mpc_scan_new(set);
+      p->data.span.scan = mpc_compile_copy(g, scan, sizeof(mpc_scan_t));
+      free(scan);
+      return 1;
+    
+    /* As are the FIRST sets, as a jump out of range would read past the alternatives */
+    case MPC_TYPE_OR:
+      if (!mpc_load_int(b, &p->data.or.n) || p->data.or.n < 0
+      ||  p->data.or.n > mpc_load_left(b) / (long)sizeof(long)) { return 0; }
+      p->data.or.xs = mpc_arena_alloc(&g->data, sizeof(mpc_parser_t*) * (p->data.or.n + 1));
+      for (j = 0; j < p->data.or.n; j++) {
+        if (!mpc_load_child(b, g, &p->data.or.xs[j])) { return 0; }
+      }
+      if (!mpc_load_long(b, &x)) { return 0; }
+      p->data.or.first = x ? (unsigned char*)p : NULL;
+      p->data.or.jump = NULL;
+      return 1;
+    
+    case MPC_TYPE_AND:
+      if (!mpc_load_int(b, &p->data.and.n) || p->data.and.n < 0
+      ||  p->data.and.n > mpc_load_left(b) / (long)sizeof(long)
+      ||  !MPC_LOAD_FN(p->data.and.f, MPC_FN_FOLD | MPC_FN_STATE)) { return 0; }
+      p->data.and.xs = mpc_arena_alloc(&g->data, sizeof(mpc_parser_t*) * (p->data.and.n + 1));
+      p->data.and.dxs = mpc_arena_alloc(&g->data, sizeof(mpc_dtor_t) * (p->data.and.n + 1));
+      for (j = 0; j < p->data.and.n; j++) {
+        if (!mpc_load_child(b, g, &p->data.and.xs[j])) { return 0; }
+      }
+      for (j = 0; j < p->data.and.n-1; j++) {
+        if (!MPC_LOAD_FN(p->data.and.dxs[j], MPC_FN_DTOR)) { return 0; }
+      }
+      return 1;
+    
+    default: return 0;
+  }
   
 }
 
-static mpc_val_t *mpcaf_grammar_id(mpc_val_t *x, void *s) {
-  
-  mpca_grammar_st_t *st = s;
-  mpc_parser_t *p = mpca_grammar_find_parser(x, st);
-  free(x);
+#undef MPC_LOAD_FN
 
-  if (p->name) {
-    return mpca_state(mpca_root(mpca_add_tag(p, p->name)));
-  } else {
-    return mpca_state(mpca_root(p));
+static void mpc_program_load_first(mpc_program_t *g, mpc_parser_t *p) {
+  unsigned char *first;
+  int *jump;
+  p->data.or.first = NULL;
+  mpc_optimise_first(p);
+  first = p->data.or.first;
+  jump = p->data.or.jump;
+  p->data.or.first = mpc_compile_copy(g, first, p->data.or.n * 32);
+  p->data.or.jump = mpc_compile_copy(g, jump, sizeof(int) * 256);
+  free(first);
+  free(jump);
+}
+
+/* What can only be checked once every node is loaded */
+static int mpc_load_check(mpc_parser_t *p) {
+  switch (p->type) {
+    case MPC_TYPE_SPAN:
+      return p->data.span.esc
+        ? mpc_optimise_is_escaped(p->data.span.x)
+        : mpc_optimise_is_span(p->data.span.x);
+    case MPC_TYPE_AND:
+      return p->data.and.f != mpcf_state_ast
+        || (p->data.and.n == 2 && p->data.and.xs[0]->type == MPC_TYPE_STATE);
+    default: return 1;
   }
 }
 
-mpc_parser_t *mpca_grammar_st(const char *grammar, mpca_grammar_st_t *st) {
-  
-  char *err_msg;
-  mpc_parser_t *err_out;
-  mpc_result_t r;
-  mpc_parser_t *GrammarTotal, *Grammar, *Term, *Factor, *Base;
-  
-  GrammarTotal = mpc_new("grammar_total");
-  Grammar = mpc_new("grammar");
-  Term = mpc_new("term");
-  Factor = mpc_new("factor");
-  Base = mpc_new("base");
+/* Deletes a program with its first `n` nodes loaded, none of whose automata are built yet */
+static mpc_program_t *mpc_program_load_fail(mpc_program_t *g, int n) {
+  int j;
+  g->nodes_num = n;
+  for (j = 0; j < n; j++) {
+    if (g->nodes[j].type == MPC_TYPE_REGEX) { g->nodes[j].data.regex.dfa = NULL; }
+  }
+  mpc_program_delete(g);
+  return NULL;
+}
+
+/* Every node takes at least its type, flag and name length, which bounds how many there can be */
+static mpc_program_t *mpc_program_load_image(mpc_image_t *b) {
   
-  mpc_define(GrammarTotal,
-    mpc_predictive(mpc_total(Grammar, mpc_soft_delete))
-  );
+  int j;
+  char magic[4];
+  long version, order, lsize, isize, n;
+  mpc_program_t *g;
+  
+  if (!mpc_load_raw(b, magic, 4)
+  ||  memcmp(magic, mpc_program_magic, 4) != 0
+  ||  !mpc_load_long(b, &version) || version != MPC_PROGRAM_VERSION
+  ||  !mpc_load_long(b, &order) || order != MPC_PROGRAM_ORDER
+  ||  !mpc_load_long(b, &lsize) || lsize != (long)sizeof(long)
+  ||  !mpc_load_long(b, &isize) || isize != (long)sizeof(int)
+  ||  !mpc_load_long(b, &n) || n <= 0
+  ||  n > mpc_load_left(b) / (3 * (long)sizeof(long))) { return NULL; }
+  
+  g = malloc(sizeof(mpc_program_t));
+  if (g == NULL) { return NULL; }
+  g->nodes_num = (int)n;
+  g->nodes = calloc(n, sizeof(mpc_parser_t));
+  g->data.blocks = NULL;
+  if (g->nodes == NULL) { free(g); return NULL; }
+  
+  for (j = 0; j < g->nodes_num; j++) {
+    if (!mpc_load_node(b, g, g->nodes + j)) { return mpc_program_load_fail(g, j + 1); }
+  }
   
-  mpc_define(Grammar, mpc_and(2, mpcaf_grammar_or,
-    Term,
-    mpc_maybe(mpc_and(2, mpcf_snd_free, mpc_sym("|"), Grammar, free)),
-    mpc_soft_delete
-  ));
+  if (mpc_load_left(b) != 0) { return mpc_program_load_fail(g, g->nodes_num); }
+  for (j = 0; j < g->nodes_num; j++) {
+    if (!mpc_load_check(g->nodes + j)) { return mpc_program_load_fail(g, g->nodes_num); }
+  }
   
-  mpc_define(Term, mpc_many1(mpcaf_grammar_and, Factor));
+  for (j = 0; j < g->nodes_num; j++) {
+    if (g->nodes[j].type == MPC_TYPE_REGEX && g->nodes[j].data.regex.dfa) {
+      g->nodes[j].data.regex.dfa = mpc_dfa_new(g->nodes[j].data.regex.x);
+    }
+    if (g->nodes[j].type == MPC_TYPE_OR && g->nodes[j].data.or.first) {
+      mpc_program_load_first(g, g->nodes + j);
+    }
+  }
   
-  mpc_define(Factor, mpc_and(2, mpcaf_grammar_repeat,
-    Base,
-      mpc_or(6,
-        mpc_sym("*"),
-        mpc_sym("+"),
-        mpc_sym("?"),
-        mpc_sym("!"),
-        mpc_tok_brackets(mpc_int(), free),
-        mpc_pass()),
-    mpc_soft_delete
-  ));
+  return g;
+}
+
+/* The program runs to the end of the file, and is only loaded if its checksum matches */
+mpc_program_t *mpc_program_load(FILE *f) {
   
-  mpc_define(Base, mpc_or(5,
-    mpc_apply_to(mpc_tok(mpc_string_lit()), mpcaf_grammar_string, st),
-    mpc_apply_to(mpc_tok(mpc_char_lit()),   mpcaf_grammar_char, st),
-    mpc_apply_to(mpc_tok(mpc_regex_lit()),  mpcaf_grammar_regex, st),
-    mpc_apply_to(mpc_tok_braces(mpc_or(2, mpc_digits(), mpc_ident()), free), mpcaf_grammar_id, st),
-    mpc_tok_parens(Grammar, mpc_soft_delete)
-  ));
+  mpc_image_t b;
+  mpc_program_t *g = NULL;
+  char *data;
+  size_t k;
+  long sum;
   
-  mpc_optimise(GrammarTotal);
-  mpc_optimise(Grammar);
-  mpc_optimise(Factor);
-  mpc_optimise(Term);
-  mpc_optimise(Base);
+  b.slots = 4096;
+  b.num = 0;
+  b.pos = 0;
+  b.data = malloc(b.slots);
   
-  if(!mpc_parse("<mpc_grammar_compiler>", grammar, GrammarTotal, &r)) {
-    err_msg = mpc_err_string(r.error);
-    err_out = mpc_failf("Invalid Grammar: %s", err_msg);
-    mpc_err_delete(r.error);
-    free(err_msg);
-    r.output = err_out;
+  while (b.data && (k = fread(b.data + b.num, 1, b.slots - b.num, f)) > 0) {
+    b.num += (long)k;
+    if (b.num < b.slots) { continue; }
+    data = realloc(b.data, b.slots * 2);
+    if (data == NULL) { free(b.data); b.data = NULL; break; }
+    b.data = data;
+    b.slots *= 2;
   }
   
-  mpc_cleanup(5, GrammarTotal, Grammar, Term, Factor, Base);
-  
-  mpc_optimise(r.output);
-  
-  return (st->flags & MPCA_LANG_PREDICTIVE) ? mpc_predictive(r.output) : r.output;
+  if (b.data && !ferror(f) && b.num >= (long)sizeof(long)) {
+    b.num -= sizeof(long);
+    memcpy(&sum, b.data + b.num, sizeof(long));
+    if (sum == mpc_image_sum(b.data, b.num)) { g = mpc_program_load_image(&b); }
+  }
   
+  free(b.data);
+  return g;
 }
 
-mpc_parser_t *mpca_grammar(int flags, const char *grammar, ...) {
-  mpca_grammar_st_t st;
-  mpc_parser_t *res;
+/*
+** Generating C
+**
+** A program is written out as C with a function
+** for each node and each way its result is used:
+** only recognised, built into a compact tree, or
+** kept as the span of input it matched. Character
+** tests are written inline and every call is
+** direct, so nothing is interpreted at parse time.
+** Only grammars made of mpc's own functions, as
+** `mpca_lang` makes, can be written out.
+**
+** The generated parser only handles the common
+** case of a successful parse of a string. When the
+** input fails to parse, or nests too deeply for
+** the C stack, the parse is run again by the
+** grammar it was generated from, which gives the
+** error message and result `mpc_parse_tree` would.
+*/
+
+enum {
+  MPC_GEN_R = 0,
+  MPC_GEN_T = 1,
+  MPC_GEN_S = 2,
+  MPC_GEN_Q = 3,
+  MPC_GEN_MODES = 4
+};
+
+static const char mpc_gen_modes[MPC_GEN_MODES] = { 'r', 't', 's', 'q' };
+
+static const char *mpc_gen_runtime[] = {
+  "#define MPCG_IN(s, x) ((s)[(x) >> 3] & (1 << ((x) & 7)))",
+  "",
+  "enum {",
+  "  MPCG_DEPTH_MAX = 1024,",
+  "  MPCG_BLOCK = 65536",
+  "};",
+  "",
+  "typedef struct mpcg_tags_t {",
+  "  int tag;",
+  "  struct mpcg_tags_t *next;",
+  "} mpcg_tags_t;",
+  "",
+  "typedef struct mpcg_node_t {",
+  "  mpcg_tags_t *tags;",
+  "  long contents;",
+  "  long contents_len;",
+  "  mpc_state_t state;",
+  "  int children_num;",
+  "  struct mpcg_node_t **children;",
+  "} mpcg_node_t;",
+  "",
+  "typedef struct mpcg_block_t {",
+  "  struct mpcg_block_t *next;",
+  "  size_t used;",
+  "  size_t size;",
+  "} mpcg_block_t;",
+  "",
+  "typedef struct {",
+  "  const char *in;",
+  "  long pos;",
+  "  int depth;",
+  "  int deep;",
+  "  int backtrack;",
+  "  long line_pos;",
+  "  long line_row;",
+  "  long line_start;",
+  "  mpcg_block_t *blocks;",
+  "  char *text;",
+  "  long text_num;",
+  "  long text_slots;",
+  "  mpcg_node_t **vals;",
+  "  int vals_num;",
+  "  int vals_slots;",
+  "  mpcg_tags_t none;",
+  "  mpcg_tags_t root;",
+  "  int *tags;",
+  "} mpcg_t;",
+  "",
+  "static void *mpcg_alloc(mpcg_t *c, size_t n) {",
+  "  mpcg_block_t *b = c->blocks;",
+  "  n = (n + sizeof(void*) - 1) / sizeof(void*) * sizeof(void*);",
+  "  if (b == NULL || b->used + n > b->size) {",
+  "    b = malloc(sizeof(mpcg_block_t) + (n > MPCG_BLOCK ? n : MPCG_BLOCK));",
+  "    b->next = c->blocks;",
+  "    b->used = 0;",
+  "    b->size = n > MPCG_BLOCK ? n : MPCG_BLOCK;",
+  "    c->blocks = b;",
+  "  }",
+  "  b->used += n;",
+  "  return (char*)(b + 1) + b->used - n;",
+  "}",
+  "",
+  "static mpcg_node_t *mpcg_node(mpcg_t *c, mpcg_tags_t *tags) {",
+  "  mpcg_node_t *a = mpcg_alloc(c, sizeof(mpcg_node_t));",
+  "  a->tags = tags;",
+  "  a->contents = 0;",
+  "  a->contents_len = 0;",
+  "  a->state.pos = 0;",
+  "  a->state.row = 0;",
+  "  a->state.col = 0;",
+  "  a->children_num = 0;",
+  "  a->children = NULL;",
+  "  return a;",
+  "}",
+  "",
+  "static mpcg_node_t *mpcg_str(mpcg_t *c, long s, long e) {",
+  "  mpcg_node_t *a = mpcg_node(c, &c->none);",
+  "  long n = e - s;",
+  "  if (c->text_num + n + 1 > c->text_slots) {",
+  "    while (c->text_num + n + 1 > c->text_slots) { c->text_slots *= 2; }",
+  "    c->text = realloc(c->text, c->text_slots);",
+  "  }",
+  "  memcpy(c->text + c->text_num, c->in + s, n);",
+  "  c->text[c->text_num + n] = '\\0';",
+  "  a->contents = c->text_num;",
+  "  a->contents_len = n;",
+  "  c->text_num += n + 1;",
+  "  return a;",
+  "}",
+  "",
+  "static mpcg_node_t *mpcg_fold(mpcg_t *c, int n, mpcg_node_t **xs) {",
+  "  int j, k, m = 0;",
+  "  mpcg_node_t *r;",
+  "  if (n == 0) { return NULL; }",
+  "  if (n == 1) { return xs[0]; }",
+  "  if (n == 2 && xs[1] == NULL) { return xs[0]; }",
+  "  if (n == 2 && xs[0] == NULL) { return xs[1]; }",
+  "  for (j = 0; j < n; j++) {",
+  "    if (xs[j]) { m += xs[j]->children_num ? xs[j]->children_num : 1; }",
+  "  }",
+  "  r = mpcg_node(c, &c->root);",
+  "  r->children = m ? mpcg_alloc(c, sizeof(mpcg_node_t*) * m) : NULL;",
+  "  for (j = 0; j < n; j++) {",
+  "    if (xs[j] == NULL) { continue; }",
+  "    if (xs[j]->children_num == 0) { r->children[r->children_num++] = xs[j]; continue; }",
+  "    for (k = 0; k < xs[j]->children_num; k++) {",
+  "      r->children[r->children_num++] = xs[j]->children[k];",
+  "    }",
+  "  }",
+  "  if (r->children_num) { r->state = r->children[0]->state; }",
+  "  return r;",
+  "}",
+  "",
+  "/* Nothing is memoised, so each node has one owner and is changed in place */",
+  "static mpcg_node_t *mpcg_with_state(mpcg_node_t *a, mpc_state_t s) {",
+  "  if (a) { a->state = s; }",
+  "  return a;",
+  "}",
+  "",
+  "static mpcg_node_t *mpcg_root(mpcg_t *c, mpcg_node_t *a) {",
+  "  mpcg_node_t *r;",
+  "  if (a == NULL || a->children_num <= 1) { return a; }",
+  "  r = mpcg_node(c, &c->root);",
+  "  r->children = mpcg_alloc(c, sizeof(mpcg_node_t*));",
+  "  r->children[0] = a;",
+  "  r->children_num = 1;",
+  "  return r;",
+  "}",
+  "",
+  "static mpcg_node_t *mpcg_tag(mpcg_t *c, mpcg_node_t *a, int tag, int add) {",
+  "  mpcg_tags_t *t;",
+  "  if (a == NULL) { return a; }",
+  "  t = mpcg_alloc(c, sizeof(mpcg_tags_t));",
+  "  t->tag = tag;",
+  "  t->next = add ? a->tags : NULL;",
+  "  a->tags = t;",
+  "  return a;",
+  "}",
+  "",
+  "static void mpcg_push(mpcg_t *c, mpcg_node_t *a) {",
+  "  if (c->vals_num == c->vals_slots) {",
+  "    c->vals_slots = c->vals_slots ? c->vals_slots * 2 : 64;",
+  "    c->vals = realloc(c->vals, sizeof(mpcg_node_t*) * c->vals_slots);",
+  "  }",
+  "  c->vals[c->vals_num++] = a;",
+  "}",
+  "",
+  "static mpcg_node_t *mpcg_pop(mpcg_t *c, int base) {",
+  "  mpcg_node_t *r = mpcg_fold(c, c->vals_num - base, c->vals + base);",
+  "  c->vals_num = base;",
+  "  return r;",
+  "}",
+  "",
+  "/* Rows and columns are only worked out when asked for, from the last place asked */",
+  "static mpc_state_t mpcg_state(mpcg_t *c) {",
+  "  mpc_state_t s;",
+  "  long j;",
+  "  while (c->line_pos < c->pos) {",
+  "    if (c->in[c->line_pos++] == '\\n') { c->line_row++; c->line_start = c->line_pos; }",
+  "  }",
+  "  while (c->line_pos > c->pos) {",
+  "    if (c->in[--c->line_pos] == '\\n') { c->line_row--; }",
+  "  }",
+  "  if (c->line_start > c->pos) {",
+  "    for (j = c->pos; j > 0 && c->in[j-1] != '\\n'; j--);",
+  "    c->line_start = j;",
+  "  }",
+  "  s.pos = c->pos;",
+  "  s.row = c->line_row;",
+  "  s.col = c->pos - c->line_start;",
+  "  return s;",
+  "}",
+  "",
+  NULL
+};
+
+static const char *mpc_gen_runtime_boundary[] = {
+  "static int mpcg_word(char x) {",
+  "  return strchr(\"abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_\", x) != NULL;",
+  "}",
+  "",
+  "static int mpcg_boundary(mpcg_t *c) {",
+  "  char prev = c->pos ? c->in[c->pos-1] : '\\0', next = c->in[c->pos];",
+  "  if ( mpcg_word(next) &&  prev == '\\0') { return 1; }",
+  "  if ( mpcg_word(prev) &&  next == '\\0') { return 1; }",
+  "  if ( mpcg_word(next) && !mpcg_word(prev)) { return 1; }",
+  "  if (!mpcg_word(next) &&  mpcg_word(prev)) { return 1; }",
+  "  return 0;",
+  "}",
+  "",
+  NULL
+};
+
+static const char *mpc_gen_runtime_tree[] = {
+  "/* Lays the tree out breadth first, as `mpc_parse_tree` does */",
+  "static mpc_tree_t *mpcg_layout(mpcg_t *c, const mpc_tags_t *names, mpcg_node_t *root) {",
+  "  int j, k, tags_num = 0, slots = 64;",
+  "  mpcg_node_t **q = malloc(sizeof(mpcg_node_t*) * slots);",
+  "  mpcg_tags_t *x;",
+  "  mpc_tree_t *t = malloc(sizeof(mpc_tree_t));",
+  "  t->names = names;",
+  "  t->nodes_num = 0;",
+  "  if (root) { q[t->nodes_num++] = root; }",
+  "  for (j = 0; j < t->nodes_num; j++) {",
+  "    if (t->nodes_num + q[j]->children_num > slots) {",
+  "      while (t->nodes_num + q[j]->children_num > slots) { slots *= 2; }",
+  "      q = realloc(q, sizeof(mpcg_node_t*) * slots);",
+  "    }",
+  "    for (k = 0; k < q[j]->children_num; k++) { q[t->nodes_num++] = q[j]->children[k]; }",
+  "    for (x = q[j]->tags; x; x = x->next) { tags_num++; }",
+  "    tags_num++;",
+  "  }",
+  "  t->nodes = malloc(sizeof(mpc_node_t) * (t->nodes_num ? t->nodes_num : 1));",
+  "  t->tags = malloc(sizeof(int) * (tags_num ? tags_num : 1));",
+  "  tags_num = 0;",
+  "  k = 1;",
+  "  for (j = 0; j < t->nodes_num; j++) {",
+  "    t->nodes[j].tags = tags_num;",
+  "    for (x = q[j]->tags; x; x = x->next) { t->tags[tags_num++] = x->tag; }",
+  "    t->tags[tags_num++] = -1;",
+  "    t->nodes[j].contents = q[j]->contents;",
+  "    t->nodes[j].contents_len = q[j]->contents_len;",
+  "    t->nodes[j].state = q[j]->state;",
+  "    t->nodes[j].children = k;",
+  "    t->nodes[j].children_num = q[j]->children_num;",
+  "    k += q[j]->children_num;",
+  "  }",
+  "  t->text = c->text;",
+  "  c->text = NULL;",
+  "  free(q);",
+  "  return t;",
+  "}",
+  "",
+  "static int mpcg_tag_id(const mpc_tags_t *t, const char *name) {",
+  "  int j = mpc_tags_find(t, name);",
+  "  return j < 0 ? 0 : j;",
+  "}",
+  "",
+  "static void mpcg_init(mpcg_t *c, const char *string, const mpc_tags_t *t, int *tags) {",
+  "  c->in = string;",
+  "  c->pos = 0;",
+  "  c->depth = 0;",
+  "  c->deep = 0;",
+  "  c->backtrack = 1;",
+  "  c->line_pos = 0;",
+  "  c->line_row = 0;",
+  "  c->line_start = 0;",
+  "  c->blocks = NULL;",
+  "  c->text_slots = 256;",
+  "  c->text = malloc(c->text_slots);",
+  "  c->text[0] = '\\0';",
+  "  c->text_num = 1;",
+  "  c->vals = NULL;",
+  "  c->vals_num = 0;",
+  "  c->vals_slots = 0;",
+  "  c->none.tag = mpcg_tag_id(t, \"\");",
+  "  c->none.next = NULL;",
+  "  c->root.tag = mpcg_tag_id(t, \">\");",
+  "  c->root.next = NULL;",
+  "  c->tags = tags;",
+  "}",
+  "",
+  "static void mpcg_done(mpcg_t *c) {",
+  "  mpcg_block_t *b;",
+  "  while (c->blocks) {",
+  "    b = c->blocks->next;",
+  "    free(c->blocks);",
+  "    c->blocks = b;",
+  "  }",
+  "  free(c->text);",
+  "  free(c->vals);",
+  "}",
+  NULL
+};
+
+typedef struct {
+  mpc_program_t *g;
+  FILE *f;
+  int ok;
+  char *want;
+  char *guard;
+  char *exact;
+  int todo_num;
+  int *todo;
+  int tags_num;
+  const char **tags;
+  int sets_num;
+  unsigned char *sets;
+  int predict;
+  int boundary;
+} mpc_gen_t;
+
+static void mpc_gen_out(mpc_gen_t *G, const char *fmt, ...) {
   va_list va;
-  va_start(va, grammar);
-  
-  st.va = &va;
-  st.parsers_num = 0;
-  st.parsers = NULL;
-  st.flags = flags;
-  
-  res = mpca_grammar_st(grammar, &st);  
-  free(st.parsers);
+  if (G->f == NULL) { return; }
+  va_start(va, fmt);
+  vfprintf(G->f, fmt, va);
   va_end(va);
-  return res;
 }
 
-typedef struct {
-  char *ident;
-  char *name;
-  mpc_parser_t *grammar;
-} mpca_stmt_t;
-
-static mpc_val_t *mpca_stmt_afold(int n, mpc_val_t **xs) {
-  mpca_stmt_t *stmt = malloc(sizeof(mpca_stmt_t));
-  stmt->ident = ((char**)xs)[0];
-  stmt->name = ((char**)xs)[1];
-  stmt->grammar = ((mpc_parser_t**)xs)[3];
-  (void) n;
-  free(((char**)xs)[2]);
-  free(((char**)xs)[4]);
-  
-  return stmt;
+static int mpc_gen_id(mpc_gen_t *G, mpc_parser_t *p) {
+  return (int)(p - G->g->nodes);
 }
 
-static mpc_val_t *mpca_stmt_fold(int n, mpc_val_t **xs) {
-  
-  int i;
-  mpca_stmt_t **stmts = malloc(sizeof(mpca_stmt_t*) * (n+1));
-  
-  for (i = 0; i < n; i++) {
-    stmts[i] = xs[i];
+static mpc_parser_t *mpc_gen_child(mpc_parser_t *p, int j) {
+  switch (p->type) {
+    case MPC_TYPE_EXPECT:   return j ? NULL : p->data.expect.x;
+    case MPC_TYPE_APPLY:    return j ? NULL : p->data.apply.x;
+    case MPC_TYPE_APPLY_TO: return j ? NULL : p->data.apply_to.x;
+    case MPC_TYPE_PREDICT:  return j ? NULL : p->data.predict.x;
+    case MPC_TYPE_MEMO:     return j ? NULL : p->data.memo.x;
+    case MPC_TYPE_REGEX:    return j ? NULL : p->data.regex.x;
+    case MPC_TYPE_NOT:
+    case MPC_TYPE_MAYBE:    return j ? NULL : p->data.not.x;
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:
+    case MPC_TYPE_COUNT:    return j ? NULL : p->data.repeat.x;
+    case MPC_TYPE_OR:       return j < p->data.or.n ? p->data.or.xs[j] : NULL;
+    case MPC_TYPE_AND:      return j < p->data.and.n ? p->data.and.xs[j] : NULL;
+    default: return NULL;
   }
-  stmts[n] = NULL;  
-  
-  return stmts;
 }
 
-static void mpca_stmt_list_delete(mpc_val_t *x) {
+/* Asks for the function for `p` used in `mode`, planning it if it is new */
+static void mpc_gen_want(mpc_gen_t *G, mpc_parser_t *p, int mode) {
+  int k = mpc_gen_id(G, p) * MPC_GEN_MODES + mode;
+  if (G->want[k]) { return; }
+  G->want[k] = 1;
+  G->todo[G->todo_num++] = k;
+}
 
-  mpca_stmt_t **stmts = x;
+static void mpc_gen_call(mpc_gen_t *G, mpc_parser_t *p, int mode, const char *args) {
+  mpc_gen_want(G, p, mode);
+  mpc_gen_out(G, "mpcg_%c%d(c%s)", mpc_gen_modes[mode], mpc_gen_id(G, p), args);
+}
 
-  while(*stmts) {
-    mpca_stmt_t *stmt = *stmts; 
-    free(stmt->ident);
-    free(stmt->name);
-    mpc_soft_delete(stmt->grammar);
-    free(stmt);  
-    stmts++;
+static int mpc_gen_tag(mpc_gen_t *G, const char *t) {
+  int j;
+  for (j = 0; j < G->tags_num; j++) {
+    if (strcmp(G->tags[j], t) == 0) { return j; }
   }
-  free(x);
-
+  G->tags = realloc(G->tags, sizeof(char*) * (G->tags_num + 1));
+  G->tags[G->tags_num] = t;
+  return G->tags_num++;
 }
 
-static mpc_val_t *mpca_stmt_list_apply_to(mpc_val_t *x, void *s) {
-
-  mpca_grammar_st_t *st = s;
-  mpca_stmt_t *stmt;
-  mpca_stmt_t **stmts = x;
-  mpc_parser_t *left;
-
-  while(*stmts) {
-    stmt = *stmts;
-    left = mpca_grammar_find_parser(stmt->ident, st);
-    if (st->flags & MPCA_LANG_PREDICTIVE) { stmt->grammar = mpc_predictive(stmt->grammar); }
-    if (stmt->name) { stmt->grammar = mpc_expect(stmt->grammar, stmt->name); }
-    mpc_optimise(stmt->grammar);
-    mpc_define(left, stmt->grammar);
-    free(stmt->ident);
-    free(stmt->name);
-    free(stmt);
-    stmts++;
+static int mpc_gen_set(mpc_gen_t *G, const unsigned char *set) {
+  int j;
+  for (j = 0; j < G->sets_num; j++) {
+    if (memcmp(G->sets + j * 32, set, 32) == 0) { return j; }
   }
-  
-  free(x);
-  
-  return NULL;
+  G->sets = realloc(G->sets, (G->sets_num + 1) * 32);
+  memcpy(G->sets + G->sets_num * 32, set, 32);
+  return G->sets_num++;
+}
+
+static int mpc_gen_ranges(const unsigned char *set, int in, int *ranges) {
+  int x, n = 0;
+  for (x = 0; x < 256; x++) {
+    if ((mpc_input_charset_has(set, (char)x) != 0) != in) { continue; }
+    if (n && ranges[n*2-1] == x - 1) { ranges[n*2-1] = x; continue; }
+    if (n == 3) { return 4; }
+    ranges[n*2+0] = x;
+    ranges[n*2+1] = x;
+    n++;
+  }
+  return n;
 }
 
-static mpc_err_t *mpca_lang_st(mpc_input_t *i, mpca_grammar_st_t *st) {
-  
-  mpc_result_t r;
-  mpc_err_t *e;
-  mpc_parser_t *Lang, *Stmt, *Grammar, *Term, *Factor, *Base; 
+/* Writes a test of the unsigned char `x` against a set, as comparisons if it is simple enough */
+static void mpc_gen_test(mpc_gen_t *G, const unsigned char *set, const char *x) {
   
-  Lang    = mpc_new("lang");
-  Stmt    = mpc_new("stmt");
-  Grammar = mpc_new("grammar");
-  Term    = mpc_new("term");
-  Factor  = mpc_new("factor");
-  Base    = mpc_new("base");
+  int ranges[8], n, in = 1, j;
   
-  mpc_define(Lang, mpc_apply_to(
-    mpc_total(mpc_predictive(mpc_many(mpca_stmt_fold, Stmt)), mpca_stmt_list_delete),
-    mpca_stmt_list_apply_to, st
-  ));
+  n = mpc_gen_ranges(set, 1, ranges);
+  if (n > 3) { n = mpc_gen_ranges(set, 0, ranges); in = 0; }
   
-  mpc_define(Stmt, mpc_and(5, mpca_stmt_afold,
-    mpc_tok(mpc_ident()), mpc_maybe(mpc_tok(mpc_string_lit())), mpc_sym(":"), Grammar, mpc_sym(";"),
-    free, free, free, mpc_soft_delete
-  ));
+  if (n > 3) {
+    mpc_gen_out(G, "MPCG_IN(mpcg_set%d, %s)", mpc_gen_set(G, set), x);
+    return;
+  }
   
-  mpc_define(Grammar, mpc_and(2, mpcaf_grammar_or,
-      Term,
-      mpc_maybe(mpc_and(2, mpcf_snd_free, mpc_sym("|"), Grammar, free)),
-      mpc_soft_delete
-  ));
+  if (n == 0) { mpc_gen_out(G, in ? "0" : "1"); return; }
   
-  mpc_define(Term, mpc_many1(mpcaf_grammar_and, Factor));
+  mpc_gen_out(G, in ? "(" : "!(");
+  for (j = 0; j < n; j++) {
+    if (j) { mpc_gen_out(G, " || "); }
+    if (ranges[j*2+0] == ranges[j*2+1]) {
+      mpc_gen_out(G, "%s == %d", x, ranges[j*2+0]);
+    } else if (ranges[j*2+0] == 0 && ranges[j*2+1] == 255) {
+      mpc_gen_out(G, "1");
+    } else if (ranges[j*2+0] == 0) {
+      mpc_gen_out(G, "%s <= %d", x, ranges[j*2+1]);
+    } else if (ranges[j*2+1] == 255) {
+      mpc_gen_out(G, "%s >= %d", x, ranges[j*2+0]);
+    } else {
+      mpc_gen_out(G, "(%s >= %d && %s <= %d)", x, ranges[j*2+0], x, ranges[j*2+1]);
+    }
+  }
+  mpc_gen_out(G, ")");
+}
+
+/* The characters a primitive parser matches, never including the end of input */
+static void mpc_gen_charset(mpc_parser_t *p, unsigned char *set) {
+  int x;
+  char c;
+  memset(set, 0, 32);
+  for (x = 1; x < 256; x++) {
+    c = (char)x;
+    switch (p->type) {
+      case MPC_TYPE_ANY:     break;
+      case MPC_TYPE_SINGLE:  if (c != p->data.single.x) { continue; } break;
+      case MPC_TYPE_RANGE:   if (!(c >= p->data.range.x && c <= p->data.range.y)) { continue; } break;
+      case MPC_TYPE_ONEOF:   if (strchr(p->data.string.x, c) == 0) { continue; } break;
+      case MPC_TYPE_NONEOF:  if (strchr(p->data.string.x, c) != 0) { continue; } break;
+      case MPC_TYPE_CHARSET: if (!mpc_input_charset_has(p->data.charset.x, c)) { continue; } break;
+      default: continue;
+    }
+    set[x / 8] |= (unsigned char)(1 << (x % 8));
+  }
+}
+
+static void mpc_gen_rewind(mpc_gen_t *G, const char *indent) {
+  if (G->predict) {
+    mpc_gen_out(G, "%sif (c->backtrack > 0) { c->pos = m; }\n", indent);
+  } else {
+    mpc_gen_out(G, "%sc->pos = m;\n", indent);
+  }
+}
+
+/* Whether the string result of `p` is always exactly the input it consumed */
+static int mpc_gen_exact(mpc_gen_t *G, mpc_parser_t *p) {
   
-  mpc_define(Factor, mpc_and(2, mpcaf_grammar_repeat,
-    Base,
-      mpc_or(6,
-        mpc_sym("*"),
-        mpc_sym("+"),
-        mpc_sym("?"),
-        mpc_sym("!"),
-        mpc_tok_brackets(mpc_int(), free),
-        mpc_pass()),
-    mpc_soft_delete
-  ));
+  int n = mpc_gen_id(G, p), j, x = 0;
   
-  mpc_define(Base, mpc_or(5,
-    mpc_apply_to(mpc_tok(mpc_string_lit()), mpcaf_grammar_string, st),
-    mpc_apply_to(mpc_tok(mpc_char_lit()),   mpcaf_grammar_char, st),
-    mpc_apply_to(mpc_tok(mpc_regex_lit()),  mpcaf_grammar_regex, st),
-    mpc_apply_to(mpc_tok_braces(mpc_or(2, mpc_digits(), mpc_ident()), free), mpcaf_grammar_id, st),
-    mpc_tok_parens(Grammar, mpc_soft_delete)
-  ));
+  if (G->exact[n]) { return G->exact[n] == 1; }
   
-  mpc_optimise(Lang);
-  mpc_optimise(Stmt);
-  mpc_optimise(Grammar);
-  mpc_optimise(Term);
-  mpc_optimise(Factor);
-  mpc_optimise(Base);
+  /* Assumed not while it is being worked out, so recursion gives up */
+  G->exact[n] = 2;
   
-  if (!mpc_parse_input(i, Lang, &r)) {
-    e = r.error;
-  } else {
-    e = NULL;
+  switch (p->type) {
+    case MPC_TYPE_ANY:
+    case MPC_TYPE_SINGLE:
+    case MPC_TYPE_RANGE:
+    case MPC_TYPE_ONEOF:
+    case MPC_TYPE_NONEOF:
+    case MPC_TYPE_CHARSET:
+    case MPC_TYPE_STRING:
+    case MPC_TYPE_REGEX:
+    case MPC_TYPE_SPAN:
+      x = 1; break;
+    case MPC_TYPE_LIFT:
+      x = p->data.lift.lf == mpcf_ctor_str; break;
+    case MPC_TYPE_EXPECT:
+    case MPC_TYPE_MEMO:
+    case MPC_TYPE_PREDICT:
+      x = mpc_gen_exact(G, mpc_gen_child(p, 0)); break;
+    case MPC_TYPE_MAYBE:
+      x = p->data.not.lf == mpcf_ctor_str && mpc_gen_exact(G, p->data.not.x); break;
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:
+    case MPC_TYPE_COUNT:
+      x = p->data.repeat.f == mpcf_strfold && mpc_gen_exact(G, p->data.repeat.x); break;
+    case MPC_TYPE_AND:
+      x = p->data.and.f == mpcf_strfold;
+      for (j = 0; x && j < p->data.and.n; j++) { x = mpc_gen_exact(G, p->data.and.xs[j]); }
+      break;
+    default: break;
   }
   
-  mpc_cleanup(6, Lang, Stmt, Grammar, Term, Factor, Base);
-  
-  return e;
+  G->exact[n] = x ? 1 : 2;
+  return x;
 }
 
-mpc_err_t *mpca_lang_file(int flags, FILE *f, ...) {
-  mpca_grammar_st_t st;
-  mpc_input_t *i;
-  mpc_err_t *err;
+/* Whether the result of `p` is always NULL */
+static int mpc_gen_null(mpc_parser_t *p) {
+  switch (p->type) {
+    case MPC_TYPE_UNDEFINED:
+    case MPC_TYPE_PASS:
+    case MPC_TYPE_FAIL:
+    case MPC_TYPE_ANCHOR:
+      return 1;
+    case MPC_TYPE_LIFT:     return p->data.lift.lf == mpcf_ctor_null;
+    case MPC_TYPE_LIFT_VAL: return p->data.lift.x == NULL;
+    case MPC_TYPE_NOT:      return p->data.not.lf == mpcf_ctor_null;
+    case MPC_TYPE_APPLY:    return p->data.apply.f == mpcf_free;
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:
+    case MPC_TYPE_COUNT:    return p->data.repeat.f == mpcf_null;
+    case MPC_TYPE_AND:      return p->data.and.f == mpcf_null;
+    default: return 0;
+  }
+}
 
-  va_list va;  
-  va_start(va, f);
-  
-  st.va = &va;
-  st.parsers_num = 0;
-  st.parsers = NULL;
-  st.flags = flags;
-  
-  i = mpc_input_new_file("<mpca_lang_file>", f);
-  err = mpca_lang_st(i, &st);
-  mpc_input_delete(i);
-  
-  free(st.parsers);
-  va_end(va);
-  return err;
+/* Which child an `and` keeps, or -1 if it folds them all */
+static int mpc_gen_nth(mpc_parser_t *p) {
+  mpc_fold_t f = p->data.and.f;
+  if (f == mpcf_fst || f == mpcf_fst_free) { return 0; }
+  if (f == mpcf_snd || f == mpcf_snd_free) { return 1; }
+  if (f == mpcf_trd || f == mpcf_trd_free) { return 2; }
+  return -1;
 }
 
-mpc_err_t *mpca_lang_pipe(int flags, FILE *p, ...) {
-  mpca_grammar_st_t st;
-  mpc_input_t *i;
-  mpc_err_t *err;
+static void mpc_gen_signature(mpc_gen_t *G, int n, int mode, const char *suffix) {
+  mpc_gen_out(G, "static int mpcg_%c%d%s(mpcg_t *c", mpc_gen_modes[mode], n, suffix);
+  switch (mode) {
+    case MPC_GEN_T: mpc_gen_out(G, ", mpcg_node_t **x"); break;
+    case MPC_GEN_S: mpc_gen_out(G, ", long *s, long *e"); break;
+    case MPC_GEN_Q: mpc_gen_out(G, ", mpc_state_t *x"); break;
+    default: break;
+  }
+  mpc_gen_out(G, ")");
+}
 
-  va_list va;  
-  va_start(va, p);
+static const char *mpc_gen_args(int mode) {
+  switch (mode) {
+    case MPC_GEN_T: return ", x";
+    case MPC_GEN_S: return ", s, e";
+    case MPC_GEN_Q: return ", x";
+    default: return "";
+  }
+}
+
+/* Alternatives are only tried when the first set allows the character the `or` started at */
+static void mpc_gen_or(mpc_gen_t *G, mpc_parser_t *p, int mode) {
+  int j;
+  if (p->data.or.n == 0) {
+    mpc_gen_out(G, mode == MPC_GEN_T ? "  *x = NULL;\n  return 1;\n" : "  return 1;\n");
+    return;
+  }
+  mpc_gen_out(G, "  unsigned char ch = (unsigned char)c->in[c->pos];\n");
+  mpc_gen_out(G, "  (void)ch;\n");
+  for (j = 0; j < p->data.or.n; j++) {
+    mpc_gen_out(G, "  if (");
+    if (p->data.or.first) {
+      mpc_gen_test(G, p->data.or.first + j * 32, "ch");
+      mpc_gen_out(G, " && ");
+    }
+    mpc_gen_call(G, p->data.or.xs[j], mode, mpc_gen_args(mode));
+    mpc_gen_out(G, ") { return 1; }\n");
+  }
+  mpc_gen_out(G, "  return 0;\n");
+}
+
+/* Recognising parsers, which give no result, so can be written for any node */
+static int mpc_gen_recognise(mpc_gen_t *G, mpc_parser_t *p) {
   
-  st.va = &va;
-  st.parsers_num = 0;
-  st.parsers = NULL;
-  st.flags = flags;
+  int j;
+  const char *s;
+  unsigned char set[32];
   
-  i = mpc_input_new_pipe("<mpca_lang_pipe>", p);
-  err = mpca_lang_st(i, &st);
-  mpc_input_delete(i);
+  switch (p->type) {
+    
+    case MPC_TYPE_UNDEFINED:
+    case MPC_TYPE_FAIL:
+      mpc_gen_out(G, "  (void)c;\n  return 0;\n");
+      return 1;
+    
+    case MPC_TYPE_PASS:
+    case MPC_TYPE_LIFT:
+    case MPC_TYPE_LIFT_VAL:
+    case MPC_TYPE_STATE:
+      mpc_gen_out(G, "  (void)c;\n  return 1;\n");
+      return 1;
+    
+    case MPC_TYPE_ANCHOR:
+      if (p->data.anchor.f == mpc_soi_anchor) { mpc_gen_out(G, "  return c->pos == 0;\n"); return 1; }
+      if (p->data.anchor.f == mpc_eoi_anchor) { mpc_gen_out(G, "  return c->in[c->pos] == '\\0';\n"); return 1; }
+      if (p->data.anchor.f == mpc_boundary_anchor) {
+        G->boundary = 1;
+        mpc_gen_out(G, "  return mpcg_boundary(c);\n");
+        return 1;
+      }
+      return 0;
+    
+    case MPC_TYPE_ANY:
+    case MPC_TYPE_SINGLE:
+    case MPC_TYPE_RANGE:
+    case MPC_TYPE_ONEOF:
+    case MPC_TYPE_NONEOF:
+    case MPC_TYPE_CHARSET:
+      mpc_gen_charset(p, set);
+      mpc_gen_out(G, "  unsigned char ch = (unsigned char)c->in[c->pos];\n");
+      mpc_gen_out(G, "  if (!");
+      mpc_gen_test(G, set, "ch");
+      mpc_gen_out(G, ") { return 0; }\n");
+      mpc_gen_out(G, "  c->pos++;\n");
+      mpc_gen_out(G, "  return 1;\n");
+      return 1;
+    
+    case MPC_TYPE_STRING:
+      s = p->data.string.x;
+      if (*s == '\0') {
+        mpc_gen_out(G, "  (void)c;\n  return 1;\n");
+        return 1;
+      }
+      if (G->predict) {
+        mpc_gen_out(G, "  long m = c->pos;\n");
+        for (j = 0; s[j]; j++) {
+          mpc_gen_out(G, "  if (c->in[c->pos] != %d) {\n", (unsigned char)s[j]);
+          mpc_gen_rewind(G, "    ");
+          mpc_gen_out(G, "    return 0;\n  }\n  c->pos++;\n");
+        }
+        mpc_gen_out(G, "  return 1;\n");
+        return 1;
+      }
+      mpc_gen_out(G, "  const char *in = c->in + c->pos;\n");
+      mpc_gen_out(G, "  if (!(1");
+      for (j = 0; s[j]; j++) { mpc_gen_out(G, " && in[%d] == %d", j, (unsigned char)s[j]); }
+      mpc_gen_out(G, ")) { return 0; }\n");
+      mpc_gen_out(G, "  c->pos += %d;\n", (int)strlen(s));
+      mpc_gen_out(G, "  return 1;\n");
+      return 1;
+    
+    case MPC_TYPE_SPAN:
+      memcpy(set, p->data.span.scan->set, 32);
+      set[0] &= 0xFE;
+      mpc_gen_out(G, "  long start = c->pos;\n");
+      mpc_gen_out(G, "  unsigned char ch;\n");
+      if (p->data.span.esc) {
+        mpc_gen_out(G, "  while (1) {\n");
+        mpc_gen_out(G, "    while ((ch = (unsigned char)c->in[c->pos]), ");
+        mpc_gen_test(G, set, "ch");
+        mpc_gen_out(G, ") { c->pos++; }\n");
+        mpc_gen_out(G, "    if (ch != %d) { break; }\n",
+          (unsigned char)mpc_span_escape(p, 0)->data.expect.x->data.single.x);
+        mpc_gen_out(G, "    c->pos += c->in[c->pos+1] ? 2 : 1;\n");
+        mpc_gen_out(G, "  }\n");
+      } else {
+        mpc_gen_out(G, "  while ((ch = (unsigned char)c->in[c->pos]), ");
+        mpc_gen_test(G, set, "ch");
+        mpc_gen_out(G, ") { c->pos++; }\n");
+      }
+      mpc_gen_out(G, "  return c->pos - start >= %d;\n", p->data.span.min);
+      return 1;
+    
+    case MPC_TYPE_APPLY:
+    case MPC_TYPE_APPLY_TO:
+    case MPC_TYPE_EXPECT:
+    case MPC_TYPE_MEMO:
+    case MPC_TYPE_REGEX:
+      mpc_gen_out(G, "  return ");
+      mpc_gen_call(G, mpc_gen_child(p, 0), MPC_GEN_R, "");
+      mpc_gen_out(G, ";\n");
+      return 1;
+    
+    case MPC_TYPE_PREDICT:
+      mpc_gen_out(G, "  int ok;\n  c->backtrack--;\n  ok = ");
+      mpc_gen_call(G, p->data.predict.x, MPC_GEN_R, "");
+      mpc_gen_out(G, ";\n  c->backtrack++;\n  return ok;\n");
+      return 1;
+    
+    case MPC_TYPE_NOT:
+      mpc_gen_out(G, "  long m = c->pos;\n  if (");
+      mpc_gen_call(G, p->data.not.x, MPC_GEN_R, "");
+      mpc_gen_out(G, ") {\n");
+      mpc_gen_rewind(G, "    ");
+      mpc_gen_out(G, "    return 0;\n  }\n  return 1;\n");
+      return 1;
+    
+    case MPC_TYPE_MAYBE:
+      mpc_gen_out(G, "  ");
+      mpc_gen_call(G, p->data.not.x, MPC_GEN_R, "");
+      mpc_gen_out(G, ";\n  return 1;\n");
+      return 1;
+    
+    case MPC_TYPE_OR:
+      mpc_gen_or(G, p, MPC_GEN_R);
+      return 1;
+    
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:
+      mpc_gen_out(G, "  long n = 0;\n");
+      mpc_gen_out(G, "  while (");
+      mpc_gen_call(G, p->data.repeat.x, MPC_GEN_R, "");
+      mpc_gen_out(G, ") { n++; }\n");
+      mpc_gen_out(G, p->type == MPC_TYPE_MANY1 ? "  return n > 0;\n" : "  (void)n;\n  return 1;\n");
+      return 1;
+    
+    case MPC_TYPE_COUNT:
+      mpc_gen_out(G, "  int j;\n");
+      mpc_gen_out(G, "  for (j = 0; j < %d; j++) {\n    if (!", p->data.repeat.n);
+      mpc_gen_call(G, p->data.repeat.x, MPC_GEN_R, "");
+      mpc_gen_out(G, ") { return 0; }\n  }\n  return 1;\n");
+      return 1;
+    
+    case MPC_TYPE_AND:
+      mpc_gen_out(G, "  long m = c->pos;\n");
+      mpc_gen_out(G, "  if (0");
+      for (j = 0; j < p->data.and.n; j++) {
+        mpc_gen_out(G, "\n  || !");
+        mpc_gen_call(G, p->data.and.xs[j], MPC_GEN_R, "");
+      }
+      mpc_gen_out(G, ") {\n");
+      mpc_gen_rewind(G, "    ");
+      mpc_gen_out(G, "    return 0;\n  }\n  return 1;\n");
+      return 1;
+    
+    default: return 0;
+  }
   
-  free(st.parsers);
-  va_end(va);
-  return err;
 }
 
-mpc_err_t *mpca_lang(int flags, const char *language, ...) {
-  
-  mpca_grammar_st_t st;
-  mpc_input_t *i;
-  mpc_err_t *err;
+/* An `and` keeping one child, which gives the result, while the rest are only recognised */
+static void mpc_gen_and_nth(mpc_gen_t *G, mpc_parser_t *p, int mode, int k) {
+  int j;
+  mpc_gen_out(G, "  long m = c->pos;\n");
+  mpc_gen_out(G, "  if (0");
+  for (j = 0; j < p->data.and.n; j++) {
+    mpc_gen_out(G, "\n  || !");
+    mpc_gen_call(G, p->data.and.xs[j], j == k ? mode : MPC_GEN_R, j == k ? mpc_gen_args(mode) : "");
+  }
+  mpc_gen_out(G, ") {\n");
+  mpc_gen_rewind(G, "    ");
+  mpc_gen_out(G, "    return 0;\n  }\n  return 1;\n");
+}
+
+static int mpc_gen_tree(mpc_gen_t *G, mpc_parser_t *p) {
   
-  va_list va;  
-  va_start(va, language);
+  int j, k;
+  char args[32];
   
-  st.va = &va;
-  st.parsers_num = 0;
-  st.parsers = NULL;
-  st.flags = flags;
+  if (mpc_gen_null(p)) {
+    mpc_gen_out(G, "  *x = NULL;\n  return ");
+    mpc_gen_call(G, p, MPC_GEN_R, "");
+    mpc_gen_out(G, ";\n");
+    return 1;
+  }
   
-  i = mpc_input_new_string("<mpca_lang>", language);
-  err = mpca_lang_st(i, &st);
-  mpc_input_delete(i);
+  switch (p->type) {
+    
+    case MPC_TYPE_EXPECT:
+    case MPC_TYPE_MEMO:
+      mpc_gen_out(G, "  return ");
+      mpc_gen_call(G, mpc_gen_child(p, 0), MPC_GEN_T, ", x");
+      mpc_gen_out(G, ";\n");
+      return 1;
+    
+    case MPC_TYPE_PREDICT:
+      mpc_gen_out(G, "  int ok;\n  c->backtrack--;\n  ok = ");
+      mpc_gen_call(G, p->data.predict.x, MPC_GEN_T, ", x");
+      mpc_gen_out(G, ";\n  c->backtrack++;\n  return ok;\n");
+      return 1;
+    
+    case MPC_TYPE_APPLY:
+      if (p->data.apply.f == mpcf_str_ast) {
+        mpc_gen_out(G, "  long s, e;\n  if (!");
+        mpc_gen_call(G, p->data.apply.x, MPC_GEN_S, ", &s, &e");
+        mpc_gen_out(G, ") { return 0; }\n  *x = mpcg_str(c, s, e);\n  return 1;\n");
+        return 1;
+      }
+      if (p->data.apply.f == (mpc_apply_t)mpc_ast_add_root) {
+        mpc_gen_out(G, "  if (!");
+        mpc_gen_call(G, p->data.apply.x, MPC_GEN_T, ", x");
+        mpc_gen_out(G, ") { return 0; }\n  *x = mpcg_root(c, *x);\n  return 1;\n");
+        return 1;
+      }
+      return 0;
+    
+    case MPC_TYPE_APPLY_TO:
+      if (p->data.apply_to.f != (mpc_apply_to_t)mpc_ast_tag
+      &&  p->data.apply_to.f != (mpc_apply_to_t)mpc_ast_add_tag) { return 0; }
+      mpc_gen_out(G, "  if (!");
+      mpc_gen_call(G, p->data.apply_to.x, MPC_GEN_T, ", x");
+      mpc_gen_out(G, ") { return 0; }\n  *x = mpcg_tag(c, *x, c->tags[%d], %d);\n  return 1;\n",
+        mpc_gen_tag(G, p->data.apply_to.d), p->data.apply_to.f == (mpc_apply_to_t)mpc_ast_add_tag);
+      return 1;
+    
+    case MPC_TYPE_MAYBE:
+      if (p->data.not.lf != mpcf_ctor_null) { return 0; }
+      mpc_gen_out(G, "  if (!");
+      mpc_gen_call(G, p->data.not.x, MPC_GEN_T, ", x");
+      mpc_gen_out(G, ") { *x = NULL; }\n  return 1;\n");
+      return 1;
+    
+    case MPC_TYPE_MANY:
+    case MPC_TYPE_MANY1:
+    case MPC_TYPE_COUNT:
+      if (p->data.repeat.f != mpcf_fold_ast) { return 0; }
+      mpc_gen_out(G, "  int base = c->vals_num;\n  mpcg_node_t *y;\n");
+      if (p->type == MPC_TYPE_COUNT) {
+        mpc_gen_out(G, "  int j;\n  for (j = 0; j < %d; j++) {\n    if (!", p->data.repeat.n);
+        mpc_gen_call(G, p->data.repeat.x, MPC_GEN_T, ", &y");
+        mpc_gen_out(G, ") { c->vals_num = base; return 0; }\n    mpcg_push(c, y);\n  }\n");
+      } else {
+        mpc_gen_out(G, "  while (");
+        mpc_gen_call(G, p->data.repeat.x, MPC_GEN_T, ", &y");
+        mpc_gen_out(G, ") { mpcg_push(c, y); }\n");
+        if (p->type == MPC_TYPE_MANY1) {
+          mpc_gen_out(G, "  if (c->vals_num == base) { return 0; }\n");
+        }
+      }
+      mpc_gen_out(G, "  *x = mpcg_pop(c, base);\n  return 1;\n");
+      return 1;
+    
+    case MPC_TYPE_OR:
+      mpc_gen_or(G, p, MPC_GEN_T);
+      return 1;
+    
+    case MPC_TYPE_AND:
+      
+      k = mpc_gen_nth(p);
+      if (k >= 0 && k < p->data.and.n) { mpc_gen_and_nth(G, p, MPC_GEN_T, k); return 1; }
+      
+      if (p->data.and.f == mpcf_state_ast && p->data.and.n == 2) {
+        mpc_gen_out(G, "  long m = c->pos;\n  mpc_state_t s;\n  if (!");
+        mpc_gen_call(G, p->data.and.xs[0], MPC_GEN_Q, ", &s");
+        mpc_gen_out(G, "\n  || !");
+        mpc_gen_call(G, p->data.and.xs[1], MPC_GEN_T, ", x");
+        mpc_gen_out(G, ") {\n");
+        mpc_gen_rewind(G, "    ");
+        mpc_gen_out(G, "    return 0;\n  }\n  *x = mpcg_with_state(*x, s);\n  return 1;\n");
+        return 1;
+      }
+      
+      if (p->data.and.f != mpcf_fold_ast) { return 0; }
+      if (p->data.and.n == 0) { mpc_gen_out(G, "  *x = NULL;\n  return 1;\n"); return 1; }
+      
+      mpc_gen_out(G, "  long m = c->pos;\n  mpcg_node_t *xs[%d];\n  if (0", p->data.and.n);
+      for (j = 0; j < p->data.and.n; j++) {
+        sprintf(args, ", &xs[%d]", j);
+        mpc_gen_out(G, "\n  || !");
+        mpc_gen_call(G, p->data.and.xs[j], MPC_GEN_T, args);
+      }
+      mpc_gen_out(G, ") {\n");
+      mpc_gen_rewind(G, "    ");
+      mpc_gen_out(G, "    return 0;\n  }\n  *x = mpcg_fold(c, %d, xs);\n  return 1;\n", p->data.and.n);
+      return 1;
+    
+    default: return 0;
+  }
   
-  free(st.parsers);
-  va_end(va);
-  return err;
 }
 
-mpc_err_t *mpca_lang_contents(int flags, const char *filename, ...) {
+/* Spans of input, which for exact parsers is everything they consumed */
+static int mpc_gen_span(mpc_gen_t *G, mpc_parser_t *p) {
   
-  mpca_grammar_st_t st;
-  mpc_input_t *i;
-  mpc_err_t *err;
-  
-  va_list va;
-
-  FILE *f = fopen(filename, "rb");
+  int k;
   
-  if (f == NULL) {
-    err = mpc_err_file(filename, "Unable to open file!");
-    return err;
+  if (mpc_gen_exact(G, p)) {
+    mpc_gen_out(G, "  *s = c->pos;\n  if (!");
+    mpc_gen_call(G, p, MPC_GEN_R, "");
+    mpc_gen_out(G, ") { return 0; }\n  *e = c->pos;\n  return 1;\n");
+    return 1;
   }
   
-  va_start(va, filename);
-  
-  st.va = &va;
-  st.parsers_num = 0;
-  st.parsers = NULL;
-  st.flags = flags;
-  
-  i = mpc_input_new_file(filename, f);
-  err = mpca_lang_st(i, &st);
-  mpc_input_delete(i);
-  
-  free(st.parsers);
-  va_end(va);  
-  
-  fclose(f);
+  switch (p->type) {
+    
+    case MPC_TYPE_EXPECT:
+    case MPC_TYPE_MEMO:
+      mpc_gen_out(G, "  return ");
+      mpc_gen_call(G, mpc_gen_child(p, 0), MPC_GEN_S, ", s, e");
+      mpc_gen_out(G, ";\n");
+      return 1;
+    
+    case MPC_TYPE_PREDICT:
+      mpc_gen_out(G, "  int ok;\n  c->backtrack--;\n  ok = ");
+      mpc_gen_call(G, p->data.predict.x, MPC_GEN_S, ", s, e");
+      mpc_gen_out(G, ";\n  c->backtrack++;\n  return ok;\n");
+      return 1;
+    
+    case MPC_TYPE_NOT:
+      if (p->data.not.lf != mpcf_ctor_str) { return 0; }
+      mpc_gen_out(G, "  if (!");
+      mpc_gen_call(G, p, MPC_GEN_R, "");
+      mpc_gen_out(G, ") { return 0; }\n  *s = *e = c->pos;\n  return 1;\n");
+      return 1;
+    
+    case MPC_TYPE_MAYBE:
+      if (p->data.not.lf != mpcf_ctor_str) { return 0; }
+      mpc_gen_out(G, "  if (!");
+      mpc_gen_call(G, p->data.not.x, MPC_GEN_S, ", s, e");
+      mpc_gen_out(G, ") { *s = *e = c->pos; }\n  return 1;\n");
+      return 1;
+    
+    case MPC_TYPE_OR:
+      if (p->data.or.n == 0) { return 0; }
+      mpc_gen_or(G, p, MPC_GEN_S);
+      return 1;
+    
+    case MPC_TYPE_AND:
+      k = mpc_gen_nth(p);
+      if (k < 0 || k >= p->data.and.n) { return 0; }
+      mpc_gen_and_nth(G, p, MPC_GEN_S, k);
+      return 1;
+    
+    default: return 0;
+  }
   
-  return err;
 }
 
-static int mpc_nodecount_unretained(mpc_parser_t* p, int force) {
-
-  int i, total;
-
-  if (p->retained && !force) { return 0; }
-
-  if (p->type == MPC_TYPE_EXPECT) { return 1 + mpc_nodecount_unretained(p->data.expect.x, 0); }
-
-  if (p->type == MPC_TYPE_APPLY)    { return 1 + mpc_nodecount_unretained(p->data.apply.x, 0); }
-  if (p->type == MPC_TYPE_APPLY_TO) { return 1 + mpc_nodecount_unretained(p->data.apply_to.x, 0); }
-  if (p->type == MPC_TYPE_PREDICT)  { return 1 + mpc_nodecount_unretained(p->data.predict.x, 0); }
-
-  if (p->type == MPC_TYPE_NOT)   { return 1 + mpc_nodecount_unretained(p->data.not.x, 0); }
-  if (p->type == MPC_TYPE_MAYBE) { return 1 + mpc_nodecount_unretained(p->data.not.x, 0); }
-
-  if (p->type == MPC_TYPE_MANY)  { return 1 + mpc_nodecount_unretained(p->data.repeat.x, 0); }
-  if (p->type == MPC_TYPE_MANY1) { return 1 + mpc_nodecount_unretained(p->data.repeat.x, 0); }
-  if (p->type == MPC_TYPE_COUNT) { return 1 + mpc_nodecount_unretained(p->data.repeat.x, 0); }
-
-  if (p->type == MPC_TYPE_OR) { 
-    total = 0;
-    for(i = 0; i < p->data.or.n; i++) {
-      total += mpc_nodecount_unretained(p->data.or.xs[i], 0);
-    }
-    return total;
-  }
+static int mpc_gen_state(mpc_gen_t *G, mpc_parser_t *p) {
   
-  if (p->type == MPC_TYPE_AND) {
-    total = 0;
-    for(i = 0; i < p->data.and.n; i++) {
-      total += mpc_nodecount_unretained(p->data.and.xs[i], 0);
-    }
-    return total;
+  switch (p->type) {
+    
+    case MPC_TYPE_STATE:
+      mpc_gen_out(G, "  *x = mpcg_state(c);\n  return 1;\n");
+      return 1;
+    
+    case MPC_TYPE_EXPECT:
+    case MPC_TYPE_MEMO:
+      mpc_gen_out(G, "  return ");
+      mpc_gen_call(G, mpc_gen_child(p, 0), MPC_GEN_Q, ", x");
+      mpc_gen_out(G, ";\n");
+      return 1;
+    
+    default: return 0;
   }
-
-  return 1;
   
 }
 
-void mpc_stats(mpc_parser_t* p) {
-  printf("Stats\n");
-  printf("=====\n");
-  printf("Node Count: %i\n", mpc_nodecount_unretained(p, 1));
-}
-
-static void mpc_optimise_unretained(mpc_parser_t *p, int force) {
+/* Nodes which may be reached again before they return are kept from running out of stack */
+static void mpc_gen_node(mpc_gen_t *G, int k) {
   
-  int i, n, m;
-  mpc_parser_t *t;
+  int n = k / MPC_GEN_MODES, mode = k % MPC_GEN_MODES, ok;
+  mpc_parser_t *p = G->g->nodes + n;
   
-  if (p->retained && !force) { return; }
+  if (p->name) { mpc_gen_out(G, "/* %s */\n", p->name); }
+  mpc_gen_signature(G, n, mode, G->guard[n] ? "_" : "");
+  mpc_gen_out(G, " {\n");
   
-  /* Optimise Subexpressions */
+  switch (mode) {
+    case MPC_GEN_R: ok = mpc_gen_recognise(G, p); break;
+    case MPC_GEN_T: ok = mpc_gen_tree(G, p); break;
+    case MPC_GEN_S: ok = mpc_gen_span(G, p); break;
+    default:        ok = mpc_gen_state(G, p); break;
+  }
   
-  if (p->type == MPC_TYPE_EXPECT)   { mpc_optimise_unretained(p->data.expect.x, 0); }
-  if (p->type == MPC_TYPE_APPLY)    { mpc_optimise_unretained(p->data.apply.x, 0); }
-  if (p->type == MPC_TYPE_APPLY_TO) { mpc_optimise_unretained(p->data.apply_to.x, 0); }
-  if (p->type == MPC_TYPE_PREDICT)  { mpc_optimise_unretained(p->data.predict.x, 0); }
-  if (p->type == MPC_TYPE_NOT)      { mpc_optimise_unretained(p->data.not.x, 0); }
-  if (p->type == MPC_TYPE_MAYBE)    { mpc_optimise_unretained(p->data.not.x, 0); }
-  if (p->type == MPC_TYPE_MANY)     { mpc_optimise_unretained(p->data.repeat.x, 0); }
-  if (p->type == MPC_TYPE_MANY1)    { mpc_optimise_unretained(p->data.repeat.x, 0); }
-  if (p->type == MPC_TYPE_COUNT)    { mpc_optimise_unretained(p->data.repeat.x, 0); }
+  mpc_gen_out(G, "}\n\n");
+  if (!ok) { G->ok = 0; }
   
-  if (p->type == MPC_TYPE_OR) { 
-    for(i = 0; i < p->data.or.n; i++) {
-      mpc_optimise_unretained(p->data.or.xs[i], 0);
-    }
+  if (G->guard[n]) {
+    mpc_gen_signature(G, n, mode, "");
+    mpc_gen_out(G, " {\n  int ok;\n");
+    mpc_gen_out(G, "  if (c->depth == MPCG_DEPTH_MAX) { c->deep = 1; return 0; }\n");
+    mpc_gen_out(G, "  c->depth++;\n  ok = mpcg_%c%d_(c%s);\n  c->depth--;\n  return ok;\n}\n\n",
+      mpc_gen_modes[mode], n, mpc_gen_args(mode));
   }
-  
-  if (p->type == MPC_TYPE_AND) {
-    for(i = 0; i < p->data.and.n; i++) {
-      mpc_optimise_unretained(p->data.and.xs[i], 0);
+}
+
+static void mpc_gen_string(mpc_gen_t *G, const char *s) {
+  mpc_gen_out(G, "\"");
+  for (; *s; s++) {
+    if (*s == '"' || *s == '\\') { mpc_gen_out(G, "\\%c", *s); }
+    else if (isprint((unsigned char)*s)) { mpc_gen_out(G, "%c", *s); }
+    else { mpc_gen_out(G, "\\%03o", (unsigned char)*s); }
+  }
+  mpc_gen_out(G, "\"");
+}
+
+int mpc_generate(mpc_parser_t *p, const char *name, FILE *f) {
+  
+  int j, k, ok;
+  mpc_parser_t *q;
+  mpc_gen_t G;
+  
+  G.g = mpc_compile(p);
+  G.f = NULL;
+  G.ok = 1;
+  G.want = calloc(G.g->nodes_num, MPC_GEN_MODES);
+  G.guard = calloc(G.g->nodes_num, 1);
+  G.exact = calloc(G.g->nodes_num, 1);
+  G.todo_num = 0;
+  G.todo = malloc(sizeof(int) * G.g->nodes_num * MPC_GEN_MODES);
+  G.tags_num = 0;
+  G.tags = NULL;
+  G.sets_num = 0;
+  G.sets = NULL;
+  G.predict = 0;
+  G.boundary = 0;
+  
+  /* Nodes are numbered depth first, so any loop has an edge back to a lower number */
+  for (j = 0; j < G.g->nodes_num; j++) {
+    if (G.g->nodes[j].type == MPC_TYPE_PREDICT) { G.predict = 1; }
+    for (k = 0; (q = mpc_gen_child(G.g->nodes + j, k)); k++) {
+      if (q - G.g->nodes <= j) { G.guard[q - G.g->nodes] = 1; }
     }
-  }  
+  }
   
-  /* Perform optimisations */
+  /* The first pass only finds the functions and tables needed */
+  mpc_gen_want(&G, G.g->nodes, MPC_GEN_T);
+  for (j = 0; j < G.todo_num; j++) { mpc_gen_node(&G, G.todo[j]); }
+  ok = G.ok;
   
-  while (1) {
+  if (ok) {
     
-    /* Merge rhs `or` */
-    if (p->type == MPC_TYPE_OR
-    &&  p->data.or.xs[p->data.or.n-1]->type == MPC_TYPE_OR
-    && !p->data.or.xs[p->data.or.n-1]->retained) {
-      t = p->data.or.xs[p->data.or.n-1];
-      n = p->data.or.n; m = t->data.or.n;
-      p->data.or.n = n + m - 1;
-      p->data.or.xs = realloc(p->data.or.xs, sizeof(mpc_parser_t*) * (n + m -1));
-      memmove(p->data.or.xs + n - 1, t->data.or.xs, m * sizeof(mpc_parser_t*));
-      free(t->data.or.xs); free(t->name); free(t);
-      continue;
-    }
-
-    /* Merge lhs `or` */
-    if (p->type == MPC_TYPE_OR
-    &&  p->data.or.xs[0]->type == MPC_TYPE_OR
-    && !p->data.or.xs[0]->retained) {
-      t = p->data.or.xs[0];
-      n = p->data.or.n; m = t->data.or.n;
-      p->data.or.n = n + m - 1;
-      p->data.or.xs = realloc(p->data.or.xs, sizeof(mpc_parser_t*) * (n + m -1));
-      memmove(p->data.or.xs + m, t->data.or.xs + 1, n * sizeof(mpc_parser_t*));
-      memmove(p->data.or.xs, t->data.or.xs, m * sizeof(mpc_parser_t*));
-      free(t->data.or.xs); free(t->name); free(t);
-      continue;
-    }
+    G.f = f;
     
-    /* Remove ast `pass` */
-    if (p->type == MPC_TYPE_AND
-    &&  p->data.and.n == 2
-    &&  p->data.and.xs[0]->type == MPC_TYPE_PASS
-    && !p->data.and.xs[0]->retained
-    &&  p->data.and.f == mpcf_fold_ast) {
-      t = p->data.and.xs[1];
-      mpc_delete(p->data.and.xs[0]);
-      free(p->data.and.xs); free(p->data.and.dxs); free(p->name);
-      memcpy(p, t, sizeof(mpc_parser_t));
-      free(t);
-      continue;
-    }
+    mpc_gen_out(&G, "/*\n** Generated by mpc_generate. Do not edit.\n*/\n\n");
+    mpc_gen_out(&G, "#include \"mpc.h\"\n\n");
+    for (j = 0; mpc_gen_runtime[j]; j++) { mpc_gen_out(&G, "%s\n", mpc_gen_runtime[j]); }
+    for (j = 0; G.boundary && mpc_gen_runtime_boundary[j]; j++) { mpc_gen_out(&G, "%s\n", mpc_gen_runtime_boundary[j]); }
+    for (j = 0; mpc_gen_runtime_tree[j]; j++) { mpc_gen_out(&G, "%s\n", mpc_gen_runtime_tree[j]); }
+    mpc_gen_out(&G, "\n");
     
-    /* Merge ast lhs `and` */
-    if (p->type == MPC_TYPE_AND
-    &&  p->data.and.f == mpcf_fold_ast
-    &&  p->data.and.xs[0]->type == MPC_TYPE_AND
-    && !p->data.and.xs[0]->retained
-    &&  p->data.and.xs[0]->data.and.f == mpcf_fold_ast) {
-      t = p->data.and.xs[0];
-      n = p->data.and.n; m = t->data.and.n;
-      p->data.and.n = n + m - 1;
-      p->data.and.xs = realloc(p->data.and.xs, sizeof(mpc_parser_t*) * (n + m - 1));
-      p->data.and.dxs = realloc(p->data.and.dxs, sizeof(mpc_dtor_t) * (n + m - 1 - 1));
-      memmove(p->data.and.xs + m, p->data.and.xs + 1, (n - 1) * sizeof(mpc_parser_t*));
-      memmove(p->data.and.xs, t->data.and.xs, m * sizeof(mpc_parser_t*));
-      for (i = 0; i < p->data.and.n-1; i++) { p->data.and.dxs[i] = (mpc_dtor_t)mpc_ast_delete; }
-      free(t->data.and.xs); free(t->data.and.dxs); free(t->name); free(t); 
-      continue;
+    for (j = 0; j < G.sets_num; j++) {
+      mpc_gen_out(&G, "static const unsigned char mpcg_set%d[32] = {", j);
+      for (k = 0; k < 32; k++) { mpc_gen_out(&G, k ? ",%d" : "%d", G.sets[j * 32 + k]); }
+      mpc_gen_out(&G, "};\n");
     }
+    mpc_gen_out(&G, "\n");
     
-    /* Merge ast rhs `and` */
-    if (p->type == MPC_TYPE_AND
-    &&  p->data.and.f == mpcf_fold_ast
-    &&  p->data.and.xs[p->data.and.n-1]->type == MPC_TYPE_AND
-    && !p->data.and.xs[p->data.and.n-1]->retained
-    &&  p->data.and.xs[p->data.and.n-1]->data.and.f == mpcf_fold_ast) {
-      t = p->data.and.xs[p->data.and.n-1];
-      n = p->data.and.n; m = t->data.and.n;
-      p->data.and.n = n + m - 1;
-      p->data.and.xs = realloc(p->data.and.xs, sizeof(mpc_parser_t*) * (n + m -1));
-      p->data.and.dxs = realloc(p->data.and.dxs, sizeof(mpc_dtor_t) * (n + m - 1 - 1));
-      memmove(p->data.and.xs + n - 1, t->data.and.xs, m * sizeof(mpc_parser_t*));
-      for (i = 0; i < p->data.and.n-1; i++) { p->data.and.dxs[i] = (mpc_dtor_t)mpc_ast_delete; }
-      free(t->data.and.xs); free(t->data.and.dxs); free(t->name); free(t); 
-      continue;
-    }
-
-    /* Remove re `lift` */
-    if (p->type == MPC_TYPE_AND
-    &&  p->data.and.n == 2
-    &&  p->data.and.xs[0]->type == MPC_TYPE_LIFT
-    &&  p->data.and.xs[0]->data.lift.lf == mpcf_ctor_str
-    && !p->data.and.xs[0]->retained
-    &&  p->data.and.f == mpcf_strfold) {
-      t = p->data.and.xs[1];
-      mpc_delete(p->data.and.xs[0]);
-      free(p->data.and.xs); free(p->data.and.dxs); free(p->name);
-      memcpy(p, t, sizeof(mpc_parser_t));
-      free(t);
-      continue;
-    }
-
-    /* Merge re lhs `and` */
-    if (p->type == MPC_TYPE_AND
-    &&  p->data.and.f == mpcf_strfold
-    &&  p->data.and.xs[0]->type == MPC_TYPE_AND
-    && !p->data.and.xs[0]->retained
-    &&  p->data.and.xs[0]->data.and.f == mpcf_strfold) {
-      t = p->data.and.xs[0];
-      n = p->data.and.n; m = t->data.and.n;
-      p->data.and.n = n + m - 1;
-      p->data.and.xs = realloc(p->data.and.xs, sizeof(mpc_parser_t*) * (n + m - 1));
-      p->data.and.dxs = realloc(p->data.and.dxs, sizeof(mpc_dtor_t) * (n + m - 1 - 1));
-      memmove(p->data.and.xs + m, p->data.and.xs + 1, (n - 1) * sizeof(mpc_parser_t*));
-      memmove(p->data.and.xs, t->data.and.xs, m * sizeof(mpc_parser_t*));
-      for (i = 0; i < p->data.and.n-1; i++) { p->data.and.dxs[i] = free; }
-      free(t->data.and.xs); free(t->data.and.dxs); free(t->name); free(t); 
-      continue;
+    for (j = 0; j < G.g->nodes_num * MPC_GEN_MODES; j++) {
+      if (!G.want[j]) { continue; }
+      mpc_gen_signature(&G, j / MPC_GEN_MODES, j % MPC_GEN_MODES, "");
+      mpc_gen_out(&G, ";\n");
     }
+    mpc_gen_out(&G, "\n");
     
-    /* Merge re rhs `and` */
-    if (p->type == MPC_TYPE_AND
-    &&  p->data.and.f == mpcf_strfold
-    &&  p->data.and.xs[p->data.and.n-1]->type == MPC_TYPE_AND
-    && !p->data.and.xs[p->data.and.n-1]->retained
-    &&  p->data.and.xs[p->data.and.n-1]->data.and.f == mpcf_strfold) {
-      t = p->data.and.xs[p->data.and.n-1];
-      n = p->data.and.n; m = t->data.and.n;
-      p->data.and.n = n + m - 1;
-      p->data.and.xs = realloc(p->data.and.xs, sizeof(mpc_parser_t*) * (n + m -1));
-      p->data.and.dxs = realloc(p->data.and.dxs, sizeof(mpc_dtor_t) * (n + m - 1 - 1));
-      memmove(p->data.and.xs + n - 1, t->data.and.xs, m * sizeof(mpc_parser_t*));
-      for (i = 0; i < p->data.and.n-1; i++) { p->data.and.dxs[i] = free; }
-      free(t->data.and.xs); free(t->data.and.dxs); free(t->name); free(t); 
-      continue;
+    for (j = 0; j < G.g->nodes_num * MPC_GEN_MODES; j++) {
+      if (G.want[j]) { mpc_gen_node(&G, j); }
     }
     
-    return;
+    mpc_gen_out(&G, "int %s(const char *filename, const char *string, mpc_parser_t *p, const mpc_tags_t *t, mpc_result_t *r) {\n", name);
+    mpc_gen_out(&G, "  mpcg_t c;\n  mpcg_node_t *x;\n  int ok, tags[%d];\n", G.tags_num ? G.tags_num : 1);
+    for (j = 0; j < G.tags_num; j++) {
+      mpc_gen_out(&G, "  tags[%d] = mpcg_tag_id(t, ", j);
+      mpc_gen_string(&G, G.tags[j]);
+      mpc_gen_out(&G, ");\n");
+    }
+    mpc_gen_out(&G, "  mpcg_init(&c, string, t, tags);\n");
+    mpc_gen_out(&G, "  ok = mpcg_t0(&c, &x) && !c.deep;\n");
+    mpc_gen_out(&G, "  if (ok) { r->output = mpcg_layout(&c, t, x); }\n");
+    mpc_gen_out(&G, "  mpcg_done(&c);\n");
+    mpc_gen_out(&G, "  return ok ? 1 : mpc_parse_tree(filename, string, p, t, r);\n");
+    mpc_gen_out(&G, "}\n");
     
+    ok = !ferror(f);
   }
   
+  free(G.want);
+  free(G.guard);
+  free(G.exact);
+  free(G.todo);
+  free(G.tags);
+  free(G.sets);
+  mpc_program_delete(G.g);
+  return ok;
 }
-
-void mpc_optimise(mpc_parser_t *p) {
-  mpc_optimise_unretained(p, 1);
-}
-
@@ -17,6 +17,7 @@
 #include <math.h>
 #include <errno.h>
 #include <ctype.h>
+#include <time.h>
 
 /*
 ** State Type
@@ -60,6 +61,16 @@ typedef union {
 struct mpc_parser_t;
 typedef struct mpc_parser_t mpc_parser_t;
 
+/*
+** The parse functions keep all of their state in
+** the input they create and only ever read the
+** parser they are given, so once a grammar has
+** been built (and optimised) any number of
+** threads may parse with it at the same time.
+** Building, optimising, undefining or deleting
+** parsers must not overlap with parsing.
+*/
+
 int mpc_parse(const char *filename, const char *string, mpc_parser_t *p, mpc_result_t *r);
 int mpc_parse_file(const char *filename, FILE *file, mpc_parser_t *p, mpc_result_t *r);
 int mpc_parse_pipe(const char *filename, FILE *pipe, mpc_parser_t *p, mpc_result_t *r);
@@ -133,6 +144,7 @@ mpc_parser_t *mpc_or(int n, ...);
 mpc_parser_t *mpc_and(int n, mpc_fold_t f, ...);
 
 mpc_parser_t *mpc_predictive(mpc_parser_t *a);
+mpc_parser_t *mpc_memo(mpc_parser_t *a, mpc_dtor_t da, mpc_apply_t ca);
 
 /*
 ** Common Parsers
@@ -303,7 +315,8 @@ mpc_parser_t *mpca_and(int n, ...);
 enum {
   MPCA_LANG_DEFAULT              = 0,
   MPCA_LANG_PREDICTIVE           = 1,
-  MPCA_LANG_WHITESPACE_SENSITIVE = 2
+  MPCA_LANG_WHITESPACE_SENSITIVE = 2,
+  MPCA_LANG_PACKRAT              = 4
 };
 
 mpc_parser_t *mpca_grammar(int flags, const char *grammar, ...);
@@ -313,6 +326,129 @@ mpc_err_t *mpca_lang_file(int flags, FILE *f, ...);
 mpc_err_t *mpca_lang_pipe(int flags, FILE *f, ...);
 mpc_err_t *mpca_lang_contents(int flags, const char *filename, ...);
 
+/*
+** AST Arenas
+**
+** Parses with `mpc_parse_arena` build the same
+** `mpc_ast_t` as `mpc_parse` but place every node,
+** tag, contents string and child array in the
+** arena, so the trees from any number of parses
+** are released together by `mpc_arena_clear` or
+** `mpc_arena_delete`. Such trees are read only:
+** they must not be passed to `mpc_ast_delete` or
+** the other `mpc_ast_` functions which modify a
+** tree, and a node may appear in one twice.
+*/
+
+struct mpc_arena_t;
+typedef struct mpc_arena_t mpc_arena_t;
+
+mpc_arena_t *mpc_arena_new(void);
+void mpc_arena_clear(mpc_arena_t *a);
+void mpc_arena_delete(mpc_arena_t *a);
+
+int mpc_parse_arena(const char *filename, const char *string, mpc_parser_t *p, mpc_arena_t *a, mpc_result_t *r);
+
+/*
+** Compact AST
+**
+** The same tree `mpc_parse` builds for a grammar
+** made with `mpca_lang` or the `mpca_` functions,
+** laid out in three flat arrays. Tags are lists
+** of ids, interned once per grammar, so "expr|
+** number|regex" is `expr`, `number`, `regex`
+** then -1. Each node's children sit next to each
+** other, and contents are NUL terminated strings
+** in `text`; `state.pos` is the input offset.
+** Node 0 is the root. Tags must be reachable
+** from the parser given to `mpc_tags_new`, and
+** a table may be shared by any number of parses.
+*/
+
+struct mpc_tags_t;
+typedef struct mpc_tags_t mpc_tags_t;
+
+mpc_tags_t *mpc_tags_new(mpc_parser_t *p);
+void mpc_tags_delete(mpc_tags_t *t);
+int mpc_tags_find(const mpc_tags_t *t, const char *name);
+const char *mpc_tags_name(const mpc_tags_t *t, int tag);
+
+typedef struct {
+  int tags;
+  long contents;
+  long contents_len;
+  mpc_state_t state;
+  int children;
+  int children_num;
+} mpc_node_t;
+
+typedef struct {
+  const mpc_tags_t *names;
+  int nodes_num;
+  mpc_node_t *nodes;
+  int *tags;
+  char *text;
+} mpc_tree_t;
+
+int mpc_parse_tree(const char *filename, const char *string, mpc_parser_t *p, const mpc_tags_t *t, mpc_result_t *r);
+
+void mpc_tree_delete(mpc_tree_t *t);
+void mpc_tree_print(mpc_tree_t *t);
+void mpc_tree_print_to(mpc_tree_t *t, FILE *fp);
+
+int mpc_tree_has_tag(const mpc_tree_t *t, int n, int tag);
+const char *mpc_tree_contents(const mpc_tree_t *t, int n);
+
+/*
+** Compiled Grammars
+**
+** `mpc_compile` copies a finished grammar into
+** one contiguous array of nodes plus the tables
+** they use, so parsing walks compact memory
+** rather than nodes spread over the heap. Parse
+** with the parser from `mpc_program_start` using
+** any of the `mpc_parse` functions. It is owned
+** by the program and must not be changed or
+** deleted. Optimise the grammar first, as the
+** program is a snapshot; the grammar may then
+** be deleted while the program is in use.
+**
+** `mpc_program_save` writes a program to a file
+** that `mpc_program_load` reads back without the
+** grammar being built again. This only works for
+** programs using mpc's own functions and tags,
+** and the file is only readable by a build of
+** mpc with the same format and machine word size.
+** The program must be the last thing in the file,
+** as loading reads to the end and turns away a
+** file which is damaged, cut short or added to.
+** Saving returns 0 and loading NULL on failure.
+*/
+
+struct mpc_program_t;
+typedef struct mpc_program_t mpc_program_t;
+
+mpc_program_t *mpc_compile(mpc_parser_t *p);
+mpc_parser_t *mpc_program_start(mpc_program_t *g);
+void mpc_program_delete(mpc_program_t *g);
+
+int mpc_program_save(mpc_program_t *g, FILE *f);
+mpc_program_t *mpc_program_load(FILE *f);
+
+/*
+** `mpc_generate` writes C source for a function
+** named `name` which parses a string like
+** `mpc_parse_tree`, taking the same arguments,
+** without interpreting the grammar. Failed and
+** very deeply nested parses are handed to `p`,
+** which must be the grammar the code was made
+** from. Only grammars using mpc's own functions,
+** as `mpca_lang` builds, can be generated, and
+** 0 is returned for any other.
+*/
+
+int mpc_generate(mpc_parser_t *p, const char *name, FILE *f);
+
 /*
 ** Misc
 */
@@ -322,6 +458,61 @@ void mpc_print(mpc_parser_t *p);
 void mpc_optimise(mpc_parser_t *p);
 void mpc_stats(mpc_parser_t *p);
 
+/*
+** Counts of how the values made while parsing
+** with `p` were allocated, summed over every
+** parse from the call until it is passed NULL.
+** Values up to 256 bytes come from a pool kept
+** by each parse; `heap` counts those which did
+** not. Parses update the counts in place, so a
+** parser collecting them must not be shared
+** between threads. `mpc_stats` prints them.
+*/
+
+typedef struct {
+  unsigned long parses;
+  unsigned long pooled;
+  unsigned long heap;
+  unsigned long exported;
+  unsigned long pool_bytes;
+} mpc_pool_stats_t;
+
+void mpc_pool_stats(mpc_parser_t *p, mpc_pool_stats_t *s);
+
+/*
+** Per rule counts for parses with `p`, collected
+** into `f` from the call until it is passed NULL.
+** Every named parser run gets a row: how often it
+** was entered, succeeded and failed, the input
+** its successes consumed, how often a sequence
+** run inside it failed part way and rewound the
+** input, and the processor time spent in it, in
+** total and excluding other named rules. Parses
+** run slower while a profile is attached, and
+** like `mpc_pool_stats` update it in place.
+** `mpc_stats` prints it as a table too.
+*/
+
+typedef struct {
+  const char *name;
+  unsigned long calls;
+  unsigned long successes;
+  unsigned long failures;
+  unsigned long consumed;
+  unsigned long rewinds;
+  double time;
+  double self;
+} mpc_rule_stats_t;
+
+typedef struct mpc_profile_t mpc_profile_t;
+
+mpc_profile_t *mpc_profile_new(void);
+void mpc_profile_delete(mpc_profile_t *f);
+void mpc_profile(mpc_parser_t *p, mpc_profile_t *f);
+int mpc_profile_rule(const mpc_profile_t *f, int j, mpc_rule_stats_t *s);
+void mpc_profile_print(const mpc_profile_t *f, FILE *out);
+void mpc_profile_print_json(const mpc_profile_t *f, FILE *out);
+
 int mpc_test_pass(mpc_parser_t *p, const char *s, const void *d,
   int(*tester)(const void*, const void*), 
   mpc_dtor_t destructor, 
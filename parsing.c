@@ -1,14 +1,18 @@
+// clock_gettime, for the profiler, is POSIX rather than C99
+#define _POSIX_C_SOURCE 200809L
+
 #include "mpc.h"
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <math.h>
 
 #ifdef _WIN32
 #include <string.h>
-static char buffer[2048];
 /*Fake readline function*/
 char* readline(char* prompt) {
+  char buffer[2048];
   fputs(prompt, stdout);
   fgets(buffer, 2048, stdin);
   char* cpy = malloc(strlen(buffer)+1);
@@ -17,8 +21,19 @@ char* readline(char* prompt) {
 }
 /*Fake add_history function*/
 void add_history(char* unused) {}
+#include <io.h>
+#include <process.h>
+#define isatty _isatty
+#define fileno _fileno
+#define getpid _getpid
+// no threads here, so nothing needs keeping per thread
+#define LTHREAD
 #else
 #include <editline/readline.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#define LTHREAD __thread
 #endif
 //#include <editline/history.h> don't need for OSX
 
@@ -49,15 +64,151 @@ void add_history(char* unused) {}
   }
 
 
+// The Lispy grammar. It is built once and then only read, so any number of threads can
+// parse with the same one at the same time (see the note above mpc_parse in mpc.h).
+// It is kept compiled, and `lispy` is the start of the program rather than a parser of its own.
+typedef struct {
+  mpc_program_t* program;
+  mpc_parser_t* lispy;
+  // interned tag ids, so reading a tree compares ints rather than searching tag strings
+  mpc_tags_t* tags;
+  int tag_root, tag_number, tag_symbol, tag_string, tag_comment, tag_sexpr, tag_qexpr, tag_regex;
+  mpc_profile_t* profile;
+  bool profile_json;
+} lgrammar;
+
+static const char* lgrammar_source =
+  "number    : /-?(\\d+\\.)?\\d+(e-?\\d+)?/;"
+  "symbol    : /[a-zA-Z0-9_%+*\\-\\/\\\\=<>!&|]+/ ;"
+  "string    : /\"(\\\\.|[^\"])*\"/ ;"
+  "comment   : /;[^\\r\\n]*/;"
+  "sexpr     : '(' <expr>* ')' ;"
+  "qexpr     : '{' <expr>* '}' ;"
+  "expr      : <number> | <symbol> | <string> | <comment> | <sexpr> | <qexpr> ;"
+  "lispy     : /^/ <expr>* /$/ ;";
+
+mpc_program_t* lgrammar_build(void) {
+  mpc_parser_t* number = mpc_new("number");
+  mpc_parser_t* symbol = mpc_new("symbol");
+  mpc_parser_t* string = mpc_new("string");
+  mpc_parser_t* comment = mpc_new("comment");
+  mpc_parser_t* sexpr = mpc_new("sexpr");
+  mpc_parser_t* qexpr = mpc_new("qexpr");
+  mpc_parser_t* expr = mpc_new("expr");
+  mpc_parser_t* lispy = mpc_new("lispy");
+
+  mpca_lang(MPCA_LANG_DEFAULT, lgrammar_source,
+    number, symbol, string, comment, sexpr, qexpr, expr, lispy);
+
+  mpc_program_t* program = mpc_compile(lispy);
+  mpc_cleanup(8, number, symbol, string, comment, sexpr, qexpr, expr, lispy);
+  return program;
+}
+
+// The cache file is the grammar source and its NUL, then the saved program. A cache
+// written for a different grammar or build is ignored and overwritten.
+mpc_program_t* lgrammar_load(const char* path) {
+  FILE* f = fopen(path, "rb");
+  if (f == NULL) { return NULL; }
+
+  mpc_program_t* program = NULL;
+  const char* s = lgrammar_source;
+  int c;
+  while ((c = fgetc(f)) != EOF && c == (unsigned char)*s && *s) { s++; }
+  if (c == '\0' && *s == '\0') { program = mpc_program_load(f); }
+
+  fclose(f);
+  return program;
+}
+
+// The cache is written to a file of this process's own next to it, then renamed over it, so
+// a run starting meanwhile reads either the old cache or the whole new one, never part of it.
+void lgrammar_save(mpc_program_t* program, const char* path) {
+  char* tmp = malloc(strlen(path) + 32);
+  sprintf(tmp, "%s.%ld.tmp", path, (long)getpid());
+  FILE* f = fopen(tmp, "wb");
+  if (f == NULL) { free(tmp); return; }
+
+  int ok = fwrite(lgrammar_source, 1, strlen(lgrammar_source) + 1, f) == strlen(lgrammar_source) + 1
+        && mpc_program_save(program, f);
+
+  // Windows will not rename over an existing file
+  ok = fclose(f) == 0 && ok
+    && (rename(tmp, path) == 0 || (remove(path) == 0 && rename(tmp, path) == 0));
+  if (!ok) { remove(tmp); }
+  free(tmp);
+}
+
+// Set LISPY_GRAMMAR_CACHE to a file path to load the grammar from there instead of
+// building it at every start. The file is written on the first run.
+// Set LISPY_PARSE_PROFILE to "table" or "json" to count and time every grammar rule while
+// reading, reported on stderr at exit. Files are then parsed one at a time, with no preload.
+lgrammar* lgrammar_new(void) {
+  lgrammar* g = malloc(sizeof(lgrammar));
+  const char* cache = getenv("LISPY_GRAMMAR_CACHE");
+
+  g->program = cache ? lgrammar_load(cache) : NULL;
+  if (g->program == NULL) {
+    g->program = lgrammar_build();
+    if (cache) { lgrammar_save(g->program, cache); }
+  }
+  g->lispy = mpc_program_start(g->program);
+
+  g->tags = mpc_tags_new(g->lispy);
+  g->tag_root = mpc_tags_find(g->tags, ">");
+  g->tag_number = mpc_tags_find(g->tags, "number");
+  g->tag_symbol = mpc_tags_find(g->tags, "symbol");
+  g->tag_string = mpc_tags_find(g->tags, "string");
+  g->tag_comment = mpc_tags_find(g->tags, "comment");
+  g->tag_sexpr = mpc_tags_find(g->tags, "sexpr");
+  g->tag_qexpr = mpc_tags_find(g->tags, "qexpr");
+  g->tag_regex = mpc_tags_find(g->tags, "regex");
+
+  const char* profile = getenv("LISPY_PARSE_PROFILE");
+  g->profile = profile ? mpc_profile_new() : NULL;
+  g->profile_json = profile && strcmp(profile, "json") == 0;
+  if (g->profile) { mpc_profile(g->lispy, g->profile); }
+  return g;
+}
+
+void lgrammar_report(const lgrammar* g) {
+  if (g->profile == NULL) { return; }
+  if (g->profile_json) { mpc_profile_print_json(g->profile, stderr); }
+  else { mpc_profile_print(g->profile, stderr); }
+}
+
+void lgrammar_del(lgrammar* g) {
+  if (g->profile) { mpc_profile_delete(g->profile); }
+  mpc_tags_delete(g->tags);
+  mpc_program_delete(g->program);
+  free(g);
+}
+
+// `make` builds a first parsing binary, has it write lgrammar_gen.c with --generate, and
+// links that into the real one. The generated parser only ever gives the same answer as
+// the interpreted one; it hands errors and very deep nesting back to mpc_parse_tree.
+// Profiled parses always run the interpreted grammar, as that is what is being measured.
+#ifdef LISPY_GENERATED
+int lgrammar_parse_generated(const char* filename, const char* string, mpc_parser_t* p,
+                             const mpc_tags_t* t, mpc_result_t* r);
+#endif
+
+int lgrammar_parse(const lgrammar* g, const char* filename, const char* input, mpc_result_t* r) {
+#ifdef LISPY_GENERATED
+  if (g->profile == NULL) { return lgrammar_parse_generated(filename, input, g->lispy, g->tags, r); }
+#endif
+  return mpc_parse_tree(filename, input, g->lispy, g->tags, r);
+}
+
+int lgrammar_generate(const lgrammar* g, const char* path) {
+  FILE* f = fopen(path, "w");
+  if (f == NULL) { return 0; }
+  int ok = mpc_generate(g->lispy, "lgrammar_parse_generated", f);
+  if (fclose(f) != 0 || !ok) { remove(path); return 0; }
+  return 1;
+}
+
 // Forward declarations
-mpc_parser_t* Number;
-mpc_parser_t* Symbol;
-mpc_parser_t* String;
-mpc_parser_t* Comment;
-mpc_parser_t* Sexpr;
-mpc_parser_t* Qexpr;
-mpc_parser_t* Expr;
-mpc_parser_t* Lispy;
 struct lval;
 struct lenv;
 typedef struct lval lval;
@@ -70,7 +221,7 @@ void lval_println(lenv* e, lval* v);
 lenv* lenv_new(void);
 lenv* lenv_copy(lenv* e);
 void lenv_del(lenv* e);
-lval* lenv_get_name(lenv* e, lval* v);
+char* lenv_get_name(lenv* e, lval* v);
 void lenv_put(lenv* e, lval* k, lval* v, bool locked);
 lval* builtin_eval(lenv* e, lval* a);
 lval* builtin_list(lenv* e, lval* a);
@@ -82,7 +233,7 @@ lval* builtin_comparator(lenv* e, lval* a, char* op);
 typedef enum { LVAL_ERR, LVAL_NUM, LVAL_BOOL, LVAL_SYM, LVAL_STR, LVAL_FUN, LVAL_NFUN, LVAL_SEXPR, LVAL_QEXPR } lval_type;
 
 char* lval_name(lval_type type) {
-  char* name;
+  char* name = "unknown";
   switch (type) {
     case LVAL_ERR: 
       name = "error"; break;
@@ -135,60 +286,218 @@ struct lval {
   struct lval** cell;
 };
 
+// Memory accounting. Everything an lval or lenv owns is allocated through lmem_alloc,
+// lmem_realloc and lmem_free, and counted against a kind: the type the lval was made with,
+// or LMEM_ENV. A header before each block remembers its size and kind, so it is freed
+// against the right counts whatever has happened to its owner since. Each thread counts
+// on its own, and worker threads hand their counts over with lmem_flush before passing on
+// what they parsed, so totals read by the evaluating thread are exact.
+enum { LMEM_ENV = LVAL_QEXPR + 1, LMEM_KINDS };
+
+typedef struct {
+  unsigned long allocs[LMEM_KINDS];
+  unsigned long frees[LMEM_KINDS];
+  long bytes[LMEM_KINDS];  // live; one thread may free what another counted
+  long live;
+  long peak;               // highest live seen by this thread, counting what was handed over
+} lmem_stats;
+
+// the size shifted up past the kind; eight bytes keep the block aligned for anything an
+// lval or lenv holds, and keep an lval in the same malloc size class as without it
+typedef unsigned long long lmem_head;
+
+static LTHREAD lmem_stats lmem_here;
+static lmem_stats lmem_handed;
+// read by every thread, so only touched atomically; without pthreads there is only the one
+static long lmem_handed_live = 0;
+#ifndef _WIN32
+static pthread_mutex_t lmem_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+// only growth can make a new high-water mark
+void lmem_count(int kind, long bytes) {
+  lmem_here.bytes[kind] += bytes;
+  lmem_here.live += bytes;
+  if (bytes <= 0) { return; }
+#ifndef _WIN32
+  long live = lmem_here.live + __atomic_load_n(&lmem_handed_live, __ATOMIC_RELAXED);
+#else
+  long live = lmem_here.live + lmem_handed_live;
+#endif
+  if (live > lmem_here.peak) { lmem_here.peak = live; }
+}
+
+void* lmem_alloc(size_t size, int kind) {
+  lmem_head* h = malloc(sizeof(lmem_head) + size);
+  *h = (lmem_head)size << 4 | kind;
+  lmem_here.allocs[kind]++;
+  lmem_count(kind, size);
+  return h + 1;
+}
+
+void lmem_free(void* ptr) {
+  if (ptr == NULL) { return; }
+  lmem_head* h = (lmem_head*)ptr - 1;
+  int kind = *h & 15;
+  lmem_here.frees[kind]++;
+  lmem_count(kind, -(long)(*h >> 4));
+  free(h);
+}
+
+// like realloc, but a new block takes `kind`, and an old one keeps its own
+void* lmem_realloc(void* ptr, size_t size, int kind) {
+  if (ptr == NULL) { return lmem_alloc(size, kind); }
+  if (size == 0) { lmem_free(ptr); return NULL; }
+  lmem_head* h = (lmem_head*)ptr - 1;
+  kind = *h & 15;
+  long grown = (long)size - (long)(*h >> 4);
+  h = realloc(h, sizeof(lmem_head) + size);
+  *h = (lmem_head)size << 4 | kind;
+  lmem_count(kind, grown);
+  return h + 1;
+}
+
+char* lmem_strdup(const char* s, int kind) {
+  return strcpy(lmem_alloc(strlen(s) + 1, kind), s);
+}
+
+// hand this thread's counts over to whichever thread reads the totals
+void lmem_flush(void) {
+#ifndef _WIN32
+  pthread_mutex_lock(&lmem_lock);
+#endif
+  for (int k = 0; k < LMEM_KINDS; k++) {
+    lmem_handed.allocs[k] += lmem_here.allocs[k];
+    lmem_handed.frees[k] += lmem_here.frees[k];
+    lmem_handed.bytes[k] += lmem_here.bytes[k];
+  }
+  lmem_handed.live += lmem_here.live;
+#ifndef _WIN32
+  __atomic_add_fetch(&lmem_handed_live, lmem_here.live, __ATOMIC_RELAXED);
+#else
+  lmem_handed_live += lmem_here.live;
+#endif
+  memset(&lmem_here, 0, sizeof(lmem_stats));
+#ifndef _WIN32
+  pthread_mutex_unlock(&lmem_lock);
+#endif
+}
+
+// everything handed over so far plus this thread's own counts
+lmem_stats lmem_totals(void) {
+#ifndef _WIN32
+  pthread_mutex_lock(&lmem_lock);
+#endif
+  lmem_stats t = lmem_handed;
+#ifndef _WIN32
+  pthread_mutex_unlock(&lmem_lock);
+#endif
+  for (int k = 0; k < LMEM_KINDS; k++) {
+    t.allocs[k] += lmem_here.allocs[k];
+    t.frees[k] += lmem_here.frees[k];
+    t.bytes[k] += lmem_here.bytes[k];
+  }
+  t.live += lmem_here.live;
+  t.peak = lmem_here.peak;
+  return t;
+}
+
+const char* lmem_kind_name(int kind) {
+  return kind == LMEM_ENV ? "environment" : lval_name(kind);
+}
+
+// bytes are as asked for, leaving out the headers and malloc's own overhead
+void lmem_print(FILE* out) {
+  lmem_stats t = lmem_totals();
+  unsigned long allocs = 0, frees = 0;
+  fprintf(out, "%-18s %12s %12s %12s %12s\n", "Kind", "Allocs", "Frees", "Live", "Live bytes");
+  for (int k = 0; k < LMEM_KINDS; k++) {
+    fprintf(out, "%-18s %12lu %12lu %12lu %12ld\n", lmem_kind_name(k),
+      t.allocs[k], t.frees[k], t.allocs[k] - t.frees[k], t.bytes[k]);
+    allocs += t.allocs[k];
+    frees += t.frees[k];
+  }
+  fprintf(out, "%-18s %12lu %12lu %12lu %12ld\n", "total", allocs, frees, allocs - frees, t.live);
+  fprintf(out, "High-water mark: %ld bytes\n", t.peak);
+#ifndef _WIN32
+  // the whole process, mpc and malloc's overhead included; macOS counts bytes, not KB
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+#ifdef __APPLE__
+  ru.ru_maxrss /= 1024;
+#endif
+  fprintf(out, "Peak RSS: %ld KB\n", (long)ru.ru_maxrss);
+#endif
+}
+
+// Set LISPY_MEM_STATS to print memory use on stderr at exit, and LISPY_LEAK_CHECK to fail
+// with status 1 when anything made while running is still live once everything is freed.
+bool lmem_exit_check(bool freed) {
+  lmem_stats t = lmem_totals();
+  bool check = freed && getenv("LISPY_LEAK_CHECK") != NULL;
+  unsigned long blocks = 0;
+  for (int k = 0; k < LMEM_KINDS; k++) { blocks += t.allocs[k] - t.frees[k]; }
+  bool leaked = check && (t.live != 0 || blocks != 0);
+  if (getenv("LISPY_MEM_STATS") || leaked) { lmem_print(stderr); }
+  if (leaked) { fprintf(stderr, "Leak check failed: %ld bytes in %lu blocks never freed\n", t.live, blocks); }
+  return !leaked;
+}
+
+// lvals made on this thread so far; the profiler charges the difference to each call
+static LTHREAD unsigned long lval_made = 0;
+
+lval* lval_new(lval_type type) {
+  lval* v = lmem_alloc(sizeof(lval), type);
+  v->type = type;
+  lval_made++;
+  return v;
+}
+
 // create an lval of type num
 lval* lval_num(double num) {
-  lval* v = malloc(sizeof(lval));
-  v->type = LVAL_NUM;
+  lval* v = lval_new(LVAL_NUM);
   v->num = num;
   return v;
 }
 lval* lval_bool(bool b) {
-  lval* v = malloc(sizeof(lval));
-  v->type = LVAL_BOOL;
+  lval* v = lval_new(LVAL_BOOL);
   v->boolean = b;
   return v;
 }
 // create an lval of type err
 lval* lval_err(char* fmt, ...) {
-  lval* v = malloc(sizeof(lval));
-  v->type = LVAL_ERR;
+  lval* v = lval_new(LVAL_ERR);
 
   va_list va;
   va_start(va, fmt);
-  v->err = malloc(1024);
+  v->err = lmem_alloc(1024, LVAL_ERR);
   vsnprintf(v->err, 1023, fmt, va);
-  v->err = realloc(v->err, strlen(v->err)+1);
+  v->err = lmem_realloc(v->err, strlen(v->err)+1, LVAL_ERR);
   va_end(va);
 
   return v;
 }
 
 lval* lval_sym(char* s) {
-  lval* v = malloc(sizeof(lval));
-  v->type = LVAL_SYM;
-  v->sym = malloc(strlen(s) + 1);
-  strcpy(v->sym, s);
+  lval* v = lval_new(LVAL_SYM);
+  v->sym = lmem_strdup(s, LVAL_SYM);
   return v;
 }
 
 lval* lval_str(char* str) {
-  lval* v = malloc(sizeof(lval));
-  v->type = LVAL_STR;
-  v->str = malloc(strlen(str) + 1);
-  strcpy(v->str, str);
+  lval* v = lval_new(LVAL_STR);
+  v->str = lmem_strdup(str, LVAL_STR);
   return v;
 }
 
 lval* lval_fun(lbuiltin func) {
-  lval* v = malloc(sizeof(lval));
-  v->type = LVAL_FUN;
+  lval* v = lval_new(LVAL_FUN);
   v->builtin = func;
   return v;
 }
 
 lval* lval_lambda(lval* formals, lval* body) {
-  lval* v = malloc(sizeof(lval));
-  v->type = LVAL_FUN;
+  lval* v = lval_new(LVAL_FUN);
 
   v->builtin = NULL;
 
@@ -200,23 +509,20 @@ lval* lval_lambda(lval* formals, lval* body) {
 }
 
 lval* lval_nfun(lbuiltin func) {
-  lval* v = malloc(sizeof(lval));
-  v->type = LVAL_NFUN;
+  lval* v = lval_new(LVAL_NFUN);
   v->builtin = func;
   return v;
 }
 
 lval* lval_sexpr(void) {
-  lval* v = malloc(sizeof(lval));
-  v->type = LVAL_SEXPR;
+  lval* v = lval_new(LVAL_SEXPR);
   v->count = 0;
   v->cell = NULL;
   return v;
 }
 
 lval* lval_qexpr(void) {
-  lval* v = malloc(sizeof(lval));
-  v->type = LVAL_QEXPR;
+  lval* v = lval_new(LVAL_QEXPR);
   v->count = 0;
   v->cell = NULL;
   return v;
@@ -228,13 +534,13 @@ void lval_del(lval* v) {
     case LVAL_BOOL:
       break;
     case LVAL_ERR:
-      free(v->err);
+      lmem_free(v->err);
       break;
     case LVAL_SYM:
-      free(v->sym);
+      lmem_free(v->sym);
       break;
     case LVAL_STR:
-      free(v->str);
+      lmem_free(v->str);
       break;
     case LVAL_FUN:
     case LVAL_NFUN:
@@ -249,10 +555,10 @@ void lval_del(lval* v) {
       for (int i = 0; i < v->count; i++) {
         lval_del(v->cell[i]);
       }
-      free(v->cell);
+      lmem_free(v->cell);
     break;
   }
-  free(v);
+  lmem_free(v);
 }
 
 bool lval_equal(lval* a, lval* b) {
@@ -276,7 +582,7 @@ bool lval_equal(lval* a, lval* b) {
     case LVAL_QEXPR:
     case LVAL_SEXPR:
       if (a->count != b->count) { return false; }
-      for (int i = 0; i < a->num; i++) {
+      for (int i = 0; i < a->count; i++) {
         if (!lval_equal(a->cell[i], b->cell[i])) { return false;}
       }
       return true;
@@ -285,70 +591,433 @@ bool lval_equal(lval* a, lval* b) {
   return false;
 }
 
-void lval_print_str(lval* v) {
-  char* escaped = malloc(strlen(v->str) + 1);
-  strcpy(escaped, v->str);
-  escaped = mpcf_escape(escaped);
-  printf("\"%s\"", escaped);
-  free(escaped);
+// Number formatting. ldtoa writes the shortest decimal that reads back as exactly the same
+// double, using Grisu3 (Loitsch, "Printing Floating-Point Numbers Quickly and Accurately
+// with Integers", 2010). Grisu3 works in 64-bit integers and can tell when that wasn't
+// precise enough to be sure of the shortest digits, a few numbers in a thousand; those are found
+// by trying printf precisions instead. Whole numbers, most of what Lispy prints, take a
+// plain integer path. The layout is JavaScript's: 1234, 0.001, 1.5e-7 and 1e21, which the
+// reader takes back in, and -0 prints as 0 as it does there. The reader has no syntax for
+// the rest, so they print as inf, -inf and nan, names the environment binds to those numbers.
+enum { LDTOA_SIZE = 32 };
+
+// a 64-bit significand and binary exponent, f * 2^e
+typedef struct {
+  uint64_t f;
+  int e;
+} ldiyfp;
+
+// 10^(8i - 348), rounded to 64 bits
+static const ldiyfp ldtoa_powers[] = {
+  { 0xfa8fd5a0081c0288ULL, -1220 }, { 0xbaaee17fa23ebf76ULL, -1193 }, { 0x8b16fb203055ac76ULL, -1166 },
+  { 0xcf42894a5dce35eaULL, -1140 }, { 0x9a6bb0aa55653b2dULL, -1113 }, { 0xe61acf033d1a45dfULL, -1087 },
+  { 0xab70fe17c79ac6caULL, -1060 }, { 0xff77b1fcbebcdc4fULL, -1034 }, { 0xbe5691ef416bd60cULL, -1007 },
+  { 0x8dd01fad907ffc3cULL,  -980 }, { 0xd3515c2831559a83ULL,  -954 }, { 0x9d71ac8fada6c9b5ULL,  -927 },
+  { 0xea9c227723ee8bcbULL,  -901 }, { 0xaecc49914078536dULL,  -874 }, { 0x823c12795db6ce57ULL,  -847 },
+  { 0xc21094364dfb5637ULL,  -821 }, { 0x9096ea6f3848984fULL,  -794 }, { 0xd77485cb25823ac7ULL,  -768 },
+  { 0xa086cfcd97bf97f4ULL,  -741 }, { 0xef340a98172aace5ULL,  -715 }, { 0xb23867fb2a35b28eULL,  -688 },
+  { 0x84c8d4dfd2c63f3bULL,  -661 }, { 0xc5dd44271ad3cdbaULL,  -635 }, { 0x936b9fcebb25c996ULL,  -608 },
+  { 0xdbac6c247d62a584ULL,  -582 }, { 0xa3ab66580d5fdaf6ULL,  -555 }, { 0xf3e2f893dec3f126ULL,  -529 },
+  { 0xb5b5ada8aaff80b8ULL,  -502 }, { 0x87625f056c7c4a8bULL,  -475 }, { 0xc9bcff6034c13053ULL,  -449 },
+  { 0x964e858c91ba2655ULL,  -422 }, { 0xdff9772470297ebdULL,  -396 }, { 0xa6dfbd9fb8e5b88fULL,  -369 },
+  { 0xf8a95fcf88747d94ULL,  -343 }, { 0xb94470938fa89bcfULL,  -316 }, { 0x8a08f0f8bf0f156bULL,  -289 },
+  { 0xcdb02555653131b6ULL,  -263 }, { 0x993fe2c6d07b7facULL,  -236 }, { 0xe45c10c42a2b3b06ULL,  -210 },
+  { 0xaa242499697392d3ULL,  -183 }, { 0xfd87b5f28300ca0eULL,  -157 }, { 0xbce5086492111aebULL,  -130 },
+  { 0x8cbccc096f5088ccULL,  -103 }, { 0xd1b71758e219652cULL,   -77 }, { 0x9c40000000000000ULL,   -50 },
+  { 0xe8d4a51000000000ULL,   -24 }, { 0xad78ebc5ac620000ULL,     3 }, { 0x813f3978f8940984ULL,    30 },
+  { 0xc097ce7bc90715b3ULL,    56 }, { 0x8f7e32ce7bea5c70ULL,    83 }, { 0xd5d238a4abe98068ULL,   109 },
+  { 0x9f4f2726179a2245ULL,   136 }, { 0xed63a231d4c4fb27ULL,   162 }, { 0xb0de65388cc8ada8ULL,   189 },
+  { 0x83c7088e1aab65dbULL,   216 }, { 0xc45d1df942711d9aULL,   242 }, { 0x924d692ca61be758ULL,   269 },
+  { 0xda01ee641a708deaULL,   295 }, { 0xa26da3999aef774aULL,   322 }, { 0xf209787bb47d6b85ULL,   348 },
+  { 0xb454e4a179dd1877ULL,   375 }, { 0x865b86925b9bc5c2ULL,   402 }, { 0xc83553c5c8965d3dULL,   428 },
+  { 0x952ab45cfa97a0b3ULL,   455 }, { 0xde469fbd99a05fe3ULL,   481 }, { 0xa59bc234db398c25ULL,   508 },
+  { 0xf6c69a72a3989f5cULL,   534 }, { 0xb7dcbf5354e9beceULL,   561 }, { 0x88fcf317f22241e2ULL,   588 },
+  { 0xcc20ce9bd35c78a5ULL,   614 }, { 0x98165af37b2153dfULL,   641 }, { 0xe2a0b5dc971f303aULL,   667 },
+  { 0xa8d9d1535ce3b396ULL,   694 }, { 0xfb9b7cd9a4a7443cULL,   720 }, { 0xbb764c4ca7a44410ULL,   747 },
+  { 0x8bab8eefb6409c1aULL,   774 }, { 0xd01fef10a657842cULL,   800 }, { 0x9b10a4e5e9913129ULL,   827 },
+  { 0xe7109bfba19c0c9dULL,   853 }, { 0xac2820d9623bf429ULL,   880 }, { 0x80444b5e7aa7cf85ULL,   907 },
+  { 0xbf21e44003acdd2dULL,   933 }, { 0x8e679c2f5e44ff8fULL,   960 }, { 0xd433179d9c8cb841ULL,   986 },
+  { 0x9e19db92b4e31ba9ULL,  1013 }, { 0xeb96bf6ebadf77d9ULL,  1039 }, { 0xaf87023b9bf0ee6bULL,  1066 },
+};
+
+static const uint64_t ldtoa_pow10[] = {
+  1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL, 10000000ULL, 100000000ULL,
+  1000000000ULL, 10000000000ULL, 100000000000ULL, 1000000000000ULL, 10000000000000ULL,
+  100000000000000ULL, 1000000000000000ULL, 10000000000000000ULL, 100000000000000000ULL,
+  1000000000000000000ULL, 10000000000000000000ULL
+};
+
+enum { LDTOA_SIG_BITS = 52 };
+static const uint64_t ldtoa_hidden = 1ULL << LDTOA_SIG_BITS;
+
+// product rounded to the top 64 bits
+ldiyfp ldiyfp_mul(ldiyfp x, ldiyfp y) {
+  const uint64_t m32 = 0xFFFFFFFFULL;
+  uint64_t a = x.f >> 32, b = x.f & m32, c = y.f >> 32, d = y.f & m32;
+  uint64_t ac = a * c, bc = b * c, ad = a * d, bd = b * d;
+  uint64_t t = (bd >> 32) + (ad & m32) + (bc & m32) + (1ULL << 31);
+  return (ldiyfp){ ac + (ad >> 32) + (bc >> 32) + (t >> 32), x.e + y.e + 64 };
+}
+
+// shifted until the top bit is set; f must not be 0
+ldiyfp ldiyfp_normalize(ldiyfp x) {
+#ifdef __GNUC__
+  int s = __builtin_clzll(x.f);
+  x.f <<= s;
+  x.e -= s;
+#else
+  while (!(x.f & (1ULL << 63))) { x.f <<= 1; x.e--; }
+#endif
+  return x;
 }
 
-void lval_print_expr(lenv* e, lval* v, char open, char close) {
-  putchar(open);
+// w is between the doubles either side of v, exclusive: m- and m+ are the midpoints to them,
+// both with m+'s normalized exponent
+void ldtoa_boundaries(ldiyfp v, ldiyfp* minus, ldiyfp* plus) {
+  ldiyfp p = ldiyfp_normalize((ldiyfp){ (v.f << 1) + 1, v.e - 1 });
+  // the gap below a power of two is half the one above
+  ldiyfp m = v.f == ldtoa_hidden ? (ldiyfp){ (v.f << 2) - 1, v.e - 2 } : (ldiyfp){ (v.f << 1) - 1, v.e - 1 };
+  m.f <<= m.e - p.e;
+  m.e = p.e;
+  *minus = m;
+  *plus = p;
+}
+
+// Move the last digit down while that brings the number closer to w and keeps it in range.
+// The bounds are only known to within unit, so report whether the digits are certainly
+// the closest in range, to within unit either way.
+bool ldtoa_weed(char* buf, int len, uint64_t high_w, uint64_t unsafe, uint64_t rest,
+                uint64_t ten_kappa, uint64_t unit) {
+  uint64_t small = high_w - unit;
+  uint64_t big = high_w + unit;
+  while (rest < small && unsafe - rest >= ten_kappa &&
+         (rest + ten_kappa < small || small - rest >= rest + ten_kappa - small)) {
+    buf[len - 1]--;
+    rest += ten_kappa;
+  }
+  // moving down once more might be closer, depending on where in the unit w really is
+  if (rest < big && unsafe - rest >= ten_kappa &&
+      (rest + ten_kappa < big || big - rest > rest + ten_kappa - big)) {
+    return false;
+  }
+  return 2 * unit <= rest && rest <= unsafe - 4 * unit;
+}
+
+// Generate the fewest digits of a number between low and high, all scaled so w's exponent is
+// in [-60, -32], as close to w as they can be. Returns how many, or 0 if the imprecision of
+// the scaling leaves that in doubt. The digits are then worth 10^kappa each.
+int ldtoa_digits(ldiyfp low, ldiyfp w, ldiyfp high, char* buf, int* kappa) {
+  uint64_t unit = 1;
+  uint64_t too_low = low.f - unit;
+  uint64_t too_high = high.f + unit;
+  uint64_t unsafe = too_high - too_low;
+  ldiyfp one = { 1ULL << -w.e, w.e };
+  uint32_t integrals = (uint32_t)(too_high >> -one.e);
+  uint64_t fractionals = too_high & (one.f - 1);
+  int len = 0;
+
+  int k = 0;
+  while (k < 10 && integrals >= ldtoa_pow10[k]) { k++; }
+
+  while (k > 0) {
+    uint32_t divisor = (uint32_t)ldtoa_pow10[k - 1];
+    uint32_t d = integrals / divisor;
+    integrals %= divisor;
+    if (d || len) { buf[len++] = '0' + d; }
+    k--;
+    uint64_t rest = ((uint64_t)integrals << -one.e) + fractionals;
+    if (rest < unsafe) {
+      *kappa = k;
+      return ldtoa_weed(buf, len, too_high - w.f, unsafe, rest, (uint64_t)divisor << -one.e, unit) ? len : 0;
+    }
+  }
+
+  while (true) {
+    fractionals *= 10;
+    unit *= 10;
+    unsafe *= 10;
+    char d = (char)(fractionals >> -one.e);
+    if (d || len) { buf[len++] = '0' + d; }
+    fractionals &= one.f - 1;
+    k--;
+    if (fractionals < unsafe) {
+      *kappa = k;
+      return ldtoa_weed(buf, len, (too_high - w.f) * unit, unsafe, fractionals, one.f, unit) ? len : 0;
+    }
+  }
+}
+
+// The shortest digits of v by brute force: the first printf precision that reads back as v.
+int ldtoa_slow(double v, char* buf, int* k) {
+  char s[LDTOA_SIZE];
+  for (int p = 1; p <= 17; p++) {
+    snprintf(s, sizeof(s), "%.*e", p - 1, v);
+    if (strtod(s, NULL) == v || p == 17) {
+      char* e = strchr(s, 'e');
+      int len = 0;
+      for (char* c = s; c < e; c++) { if (*c != '.') { buf[len++] = *c; } }
+      while (len > 1 && buf[len - 1] == '0') { len--; }
+      *k = atoi(e + 1) - (len - 1);
+      return len;
+    }
+  }
+  return 0;
+}
+
+// the shortest digits of a finite positive v into buf, returning how many; v is them * 10^k
+int ldtoa_grisu3(double v, char* buf, int* k) {
+  uint64_t bits;
+  memcpy(&bits, &v, sizeof(bits));
+  int biased = (int)((bits >> LDTOA_SIG_BITS) & 0x7FF);
+  uint64_t sig = bits & (ldtoa_hidden - 1);
+  ldiyfp w = biased ? (ldiyfp){ sig + ldtoa_hidden, biased - 1075 } : (ldiyfp){ sig, -1074 };
+
+  ldiyfp minus, plus;
+  ldtoa_boundaries(w, &minus, &plus);
+
+  // a cached power of ten that brings plus's exponent into [-60, -32]
+  double dk = (-61 - plus.e) * 0.30102999566398114 + 347;
+  int ki = (int)dk;
+  if (dk - ki > 0.0) { ki++; }
+  int index = (ki >> 3) + 1;
+  *k = -(-348 + index * 8);
+  ldiyfp c = ldtoa_powers[index];
+
+  int kappa;
+  int len = ldtoa_digits(ldiyfp_mul(minus, c), ldiyfp_mul(ldiyfp_normalize(w), c), ldiyfp_mul(plus, c), buf, &kappa);
+  if (len == 0) { return ldtoa_slow(v, buf, k); }
+  *k += kappa;
+  return len;
+}
+
+int ldtoa_exponent(int e, char* out) {
+  char* p = out;
+  *p++ = 'e';
+  if (e < 0) { *p++ = '-'; e = -e; }
+  if (e >= 100) { *p++ = '0' + e / 100; e %= 100; *p++ = '0' + e / 10; }
+  else if (e >= 10) { *p++ = '0' + e / 10; }
+  *p++ = '0' + e % 10;
+  return p - out;
+}
+
+// lay out len digits worth digits * 10^k, the way JavaScript prints numbers
+int ldtoa_layout(const char* digits, int len, int k, char* out) {
+  int kk = len + k;  // 10^(kk-1) <= v < 10^kk
+  char* p = out;
+  if (k >= 0 && kk <= 21) {
+    memcpy(p, digits, len); p += len;
+    memset(p, '0', k); p += k;
+  } else if (kk > 0 && kk <= 21) {
+    memcpy(p, digits, kk); p += kk;
+    *p++ = '.';
+    memcpy(p, digits + kk, len - kk); p += len - kk;
+  } else if (kk > -6 && kk <= 0) {
+    *p++ = '0';
+    *p++ = '.';
+    memset(p, '0', -kk); p += -kk;
+    memcpy(p, digits, len); p += len;
+  } else {
+    *p++ = digits[0];
+    if (len > 1) {
+      *p++ = '.';
+      memcpy(p, digits + 1, len - 1); p += len - 1;
+    }
+    p += ldtoa_exponent(kk - 1, p);
+  }
+  return p - out;
+}
+
+// Write v into out, which has room for LDTOA_SIZE bytes, without a NUL. Returns the length.
+int ldtoa(double v, char* out) {
+  char* p = out;
+  if (isnan(v)) { memcpy(p, "nan", 3); return 3; }
+  if (v == 0) { *p = '0'; return 1; }
+  if (signbit(v)) { *p++ = '-'; v = -v; }
+  if (isinf(v)) { memcpy(p, "inf", 3); return p - out + 3; }
+
+  // whole numbers below 2^53 are exact, so their digits are all there is to them
+  if (v < 9007199254740992.0 && v == (double)(uint64_t)v) {
+    char digits[20];
+    int len = 0;
+    uint64_t n = (uint64_t)v;
+    do { digits[len++] = '0' + n % 10; n /= 10; } while (n);
+    while (len) { *p++ = digits[--len]; }
+    return p - out;
+  }
+
+  char digits[20];
+  int k;
+  int len = ldtoa_grisu3(v, digits, &k);
+  return p - out + ldtoa_layout(digits, len, k, p);
+}
+
+// Output buffer. Everything printed is appended to buf and written out in bulk, when the
+// buffer fills and at the end, rather than with a stdio call per element. With no file the
+// buffer just grows, and holds the text for whoever wants it. A line-buffered writer also
+// flushes at the end of each line, as stdio does on a terminal.
+enum { LWRITER_BLOCK = 65536 };
+
+typedef struct {
+  char* buf;
+  size_t len;
+  size_t cap;
+  FILE* f;
+  bool line;
+} lwriter;
+
+// stdout, set up by main
+lwriter lout = { NULL, 0, 0, NULL, false };
+
+void lwriter_flush(lwriter* w) {
+  if (w->f == NULL) { return; }
+  if (w->len) { fwrite(w->buf, 1, w->len, w->f); }
+  w->len = 0;
+  fflush(w->f);
+}
+
+// make room for n more bytes
+void lwriter_reserve(lwriter* w, size_t n) {
+  if (w->len + n <= w->cap) { return; }
+  if (w->f && w->len) {
+    fwrite(w->buf, 1, w->len, w->f);
+    w->len = 0;
+    if (n <= w->cap) { return; }
+  }
+  size_t cap = w->cap ? w->cap : LWRITER_BLOCK;
+  while (w->len + n > cap) { cap *= 2; }
+  w->buf = realloc(w->buf, cap);
+  w->cap = cap;
+}
+
+void lwriter_write(lwriter* w, const char* s, size_t n) {
+  lwriter_reserve(w, n);
+  memcpy(w->buf + w->len, s, n);
+  w->len += n;
+}
+
+void lwriter_putc(lwriter* w, char c) {
+  if (w->len == w->cap) { lwriter_reserve(w, 1); }
+  w->buf[w->len++] = c;
+}
+
+void lwriter_puts(lwriter* w, const char* s) {
+  lwriter_write(w, s, strlen(s));
+}
+
+void lwriter_printf(lwriter* w, const char* fmt, ...) {
+  va_list va;
+  lwriter_reserve(w, 64);
+  va_start(va, fmt);
+  int n = vsnprintf(w->buf + w->len, w->cap - w->len, fmt, va);
+  va_end(va);
+  if (n < 0) { return; }
+  if ((size_t)n >= w->cap - w->len) {
+    lwriter_reserve(w, n + 1);
+    va_start(va, fmt);
+    vsnprintf(w->buf + w->len, w->cap - w->len, fmt, va);
+    va_end(va);
+  }
+  w->len += n;
+}
+
+void lwriter_newline(lwriter* w) {
+  lwriter_putc(w, '\n');
+  if (w->line) { lwriter_flush(w); }
+}
+
+// a string literal as the reader would take it back, escaped as mpcf_escape does but in one
+// pass, copying the runs between escapes straight into the buffer
+void lwriter_str(lwriter* w, const char* s) {
+  lwriter_putc(w, '"');
+  const char* run = s;
+  for (; *s; s++) {
+    const char* esc;
+    switch (*s) {
+      case '\a': esc = "\\a"; break;
+      case '\b': esc = "\\b"; break;
+      case '\f': esc = "\\f"; break;
+      case '\n': esc = "\\n"; break;
+      case '\r': esc = "\\r"; break;
+      case '\t': esc = "\\t"; break;
+      case '\v': esc = "\\v"; break;
+      case '\\': esc = "\\\\"; break;
+      case '\'': esc = "\\'"; break;
+      case '"': esc = "\\\""; break;
+      default: continue;
+    }
+    lwriter_write(w, run, s - run);
+    lwriter_write(w, esc, 2);
+    run = s + 1;
+  }
+  lwriter_write(w, run, s - run);
+  lwriter_putc(w, '"');
+}
+
+void lval_write(lwriter* w, lenv* e, lval* v);
+
+void lval_write_expr(lwriter* w, lenv* e, lval* v, char open, char close) {
+  lwriter_putc(w, open);
   for (int i = 0; i < v->count; i++) {
-    lval_print(e, v->cell[i]);
-    if (i != v->count - 1) { putchar(' '); }
+    lval_write(w, e, v->cell[i]);
+    if (i != v->count - 1) { lwriter_putc(w, ' '); }
   }
-  putchar(close);
+  lwriter_putc(w, close);
 }
 
-void lval_print(lenv* e, lval* v) {
+void lval_write(lwriter* w, lenv* e, lval* v) {
   switch (v->type) {
     case LVAL_ERR:
-      printf("Error: %s", v->err);
+      lwriter_puts(w, "Error: ");
+      lwriter_puts(w, v->err);
       break;
     case LVAL_NUM:
-      printf("%f", v->num);
+      lwriter_reserve(w, LDTOA_SIZE);
+      w->len += ldtoa(v->num, w->buf + w->len);
       break;
     case LVAL_BOOL:
-      if (v->boolean) {
-        printf("true");
-      } else {
-        printf("false");
-      }
+      lwriter_puts(w, v->boolean ? "true" : "false");
       break;
     case LVAL_SYM:
-      printf("%s", v->sym);
+      lwriter_puts(w, v->sym);
       break;
     case LVAL_STR:
-      lval_print_str(v);
+      lwriter_str(w, v->str);
       break;
     case LVAL_FUN:
     case LVAL_NFUN:
       if (v->builtin) {
-        printf("<%s>", lenv_get_name(e, v)->sym);
+        char* name = lenv_get_name(e, v);
+        lwriter_putc(w, '<');
+        lwriter_puts(w, name ? name : "builtin");
+        lwriter_putc(w, '>');
       } else {
-        printf("(\\ "); lval_print(e, v->formals);
-        putchar(' '); lval_print(e, v->body); putchar(')');
+        lwriter_puts(w, "(\\ "); lval_write(w, e, v->formals);
+        lwriter_putc(w, ' '); lval_write(w, e, v->body); lwriter_putc(w, ')');
       }
       break;
     case LVAL_SEXPR:
-      lval_print_expr(e, v, '(', ')');
+      lval_write_expr(w, e, v, '(', ')');
       break;
     case LVAL_QEXPR:
-      lval_print_expr(e, v, '{', '}');
+      lval_write_expr(w, e, v, '{', '}');
       break;
   }
 }
+
+void lval_print(lenv* e, lval* v) {
+  lval_write(&lout, e, v);
+}
+
 void lval_println(lenv* e, lval* v) {
-  lval_print(e, v);
-  putchar('\n');
+  lval_write(&lout, e, v);
+  lwriter_newline(&lout);
 }
 
-lval* lval_read_num(mpc_ast_t* t) {
+lval* lval_read_num(const char* contents) {
   errno = 0;
-  double x = strtod(t->contents, NULL);
-  if (errno != ERANGE) {
+  double x = strtod(contents, NULL);
+  // underflow comes back as the nearest subnormal or zero, which is fine; overflow isn't
+  if (errno != ERANGE || !isinf(x)) {
     return lval_num(x);
   } else {
     return lval_err("invalid number");
@@ -357,25 +1026,26 @@ lval* lval_read_num(mpc_ast_t* t) {
 
 lval* lval_add(lval* v, lval* x) {
   v->count++;
-  v->cell = realloc(v->cell, sizeof(lval*) * v->count);
+  v->cell = lmem_realloc(v->cell, sizeof(lval*) * v->count, v->type);
   v->cell[v->count - 1] = x;
   return v;
 }
 
 lval* lval_join(lval* x, lval* y) {
-  while (y->count) {
-    x = lval_add(x, lval_pop(y, 0));
-  }
+  // move y's children over in one go rather than popping them off one at a time
+  x->cell = lmem_realloc(x->cell, sizeof(lval*) * (x->count + y->count), x->type);
+  memcpy(x->cell + x->count, y->cell, sizeof(lval*) * y->count);
+  x->count += y->count;
+  y->count = 0;
   lval_del(y);
   return x;
 }
 
-lval* lval_read_str(mpc_ast_t* t) {
-  // Trim terminal quote character
-  t->contents[strlen(t->contents) - 1] = '\0';
-  // And drop the beginning one, too
-  char* unescaped = malloc(strlen(t->contents + 1) + 1);
-  strcpy(unescaped, t->contents + 1);
+lval* lval_read_str(const char* contents, long len) {
+  // Drop the quote characters at either end
+  char* unescaped = malloc(len - 1);
+  memcpy(unescaped, contents + 1, len - 2);
+  unescaped[len - 2] = '\0';
 
   unescaped = mpcf_unescape(unescaped);
   lval* str = lval_str(unescaped);
@@ -383,30 +1053,545 @@ lval* lval_read_str(mpc_ast_t* t) {
   return str;
 }
 
-lval* lval_read(mpc_ast_t* t) {
-  if (strstr(t->tag, "number")) { return lval_read_num(t); }
-  if (strstr(t->tag, "symbol")) { return lval_sym(t->contents); }
-  if (strstr(t->tag, "string")) { return lval_read_str(t); }
+// A tag list is exactly one tag when its second entry is the -1 terminator.
+int lval_read_tag_is(const mpc_tree_t* t, int n, int tag) {
+  const int* tags = t->tags + t->nodes[n].tags;
+  return tags[0] == tag && tags[1] < 0;
+}
+
+lval* lval_read(const lgrammar* g, const mpc_tree_t* t, int n) {
+  const mpc_node_t* a = &t->nodes[n];
+  const char* contents = mpc_tree_contents(t, n);
+  if (mpc_tree_has_tag(t, n, g->tag_number)) { return lval_read_num(contents); }
+  if (mpc_tree_has_tag(t, n, g->tag_symbol)) { return lval_sym((char*)contents); }
+  if (mpc_tree_has_tag(t, n, g->tag_string)) { return lval_read_str(contents, a->contents_len); }
 
   // if root (>) or sexpr, create an empty list
   lval* x = NULL;
-  if (strcmp(t->tag, ">") == 0) { x = lval_sexpr(); }
-  if (strstr(t->tag, "sexpr")) { x = lval_sexpr(); }
-  if (strstr(t->tag, "qexpr")) { x = lval_qexpr(); }
+  if (lval_read_tag_is(t, n, g->tag_root)) { x = lval_sexpr(); }
+  if (mpc_tree_has_tag(t, n, g->tag_sexpr)) { x = lval_sexpr(); }
+  if (mpc_tree_has_tag(t, n, g->tag_qexpr)) { x = lval_qexpr(); }
+
+  for (int i = a->children; i < a->children + a->children_num; i++) {
+    contents = mpc_tree_contents(t, i);
+    if (strcmp(contents, "(") == 0) { continue; }
+    if (strcmp(contents, "{") == 0) { continue; }
+    if (strcmp(contents, ")") == 0) { continue; }
+    if (strcmp(contents, "}") == 0) { continue; }
+    if (mpc_tree_has_tag(t, i, g->tag_comment)) { continue; }
+    if (lval_read_tag_is(t, i, g->tag_regex)) { continue; }
+
+    x = lval_add(x, lval_read(g, t, i));
+  }
+  return x;
+}
+
+// Incremental reader. Source text is pushed in with lreader_feed and complete top-level
+// expressions come back out of lreader_next as soon as their closing bracket (or the
+// whitespace that ends a bare atom) has arrived, so the caller can evaluate the first forms
+// of a big file or pipe while the rest is still being read. A cheap bracket/string/comment
+// aware scan finds the boundaries; everything up to the last boundary is handed to Lispy in
+// one go.
+enum { LREADER_BLOCK = 65536 };
+
+// where the boundary scan is: inside how many brackets, and whether in a string or comment
+typedef struct {
+  int depth;
+  bool in_str;
+  bool in_esc;
+  bool in_comment;
+} lscan;
+
+// Scan buf[from, to) and return the end of the last complete top-level form found there, or
+// boundary if none ended.
+size_t lscan_run(lscan* s, const char* buf, size_t from, size_t to, size_t boundary) {
+  for (size_t k = from; k < to; k++) {
+    char c = buf[k];
+    if (s->in_comment) {
+      if (c == '\n' || c == '\r') {
+        s->in_comment = false;
+        if (s->depth == 0) { boundary = k + 1; }
+      }
+      continue;
+    }
+    if (s->in_str) {
+      if (s->in_esc) { s->in_esc = false; }
+      else if (c == '\\') { s->in_esc = true; }
+      else if (c == '"') {
+        s->in_str = false;
+        if (s->depth == 0) { boundary = k + 1; }
+      }
+      continue;
+    }
+    switch (c) {
+      case '"': s->in_str = true; break;
+      case ';': s->in_comment = true; break;
+      case '(': case '{': s->depth++; break;
+      case ')': case '}':
+        // a stray closer ends the form too; Lispy will report it
+        if (--s->depth <= 0) { s->depth = 0; boundary = k + 1; }
+        break;
+      case ' ': case '\t': case '\n': case '\r': case '\f': case '\v':
+        if (s->depth == 0) { boundary = k + 1; }
+        break;
+      default: break;
+    }
+  }
+  return boundary;
+}
+
+typedef struct {
+  const lgrammar* grammar;
+  char* filename;
+  char* buf;
+  size_t len;
+  size_t cap;
+  size_t scanned;   // bytes of buf already run through the boundary scan
+  size_t boundary;  // end of the last complete top-level form in buf
+  long row;         // position of buf[0] in the whole source, for error messages
+  long col;
+  lscan scan;
+  lval* forms;      // parsed forms not yet handed out
+} lreader;
+
+lreader* lreader_new(const lgrammar* g, char* filename) {
+  lreader* r = malloc(sizeof(lreader));
+  r->grammar = g;
+  r->filename = malloc(strlen(filename) + 1);
+  strcpy(r->filename, filename);
+  r->cap = LREADER_BLOCK;
+  r->buf = malloc(r->cap);
+  r->len = 0;
+  r->scanned = 0;
+  r->boundary = 0;
+  r->row = 0;
+  r->col = 0;
+  r->scan = (lscan){ 0, false, false, false };
+  r->forms = NULL;
+  return r;
+}
+
+void lreader_del(lreader* r) {
+  if (r->forms) { lval_del(r->forms); }
+  free(r->filename);
+  free(r->buf);
+  free(r);
+}
+
+// advance the boundary scan over everything fed so far
+void lreader_scan(lreader* r) {
+  r->boundary = lscan_run(&r->scan, r->buf, r->scanned, r->len, r->boundary);
+  r->scanned = r->len;
+}
+
+void lreader_feed(lreader* r, const char* data, size_t n) {
+  if (r->len + n + 1 > r->cap) {
+    while (r->len + n + 1 > r->cap) { r->cap *= 2; }
+    r->buf = realloc(r->buf, r->cap);
+  }
+  memcpy(r->buf + r->len, data, n);
+  r->len += n;
+  lreader_scan(r);
+}
 
-  for (int i = 0; i < t->children_num; i++) {
-    if (strcmp(t->children[i]->contents, "(") == 0) { continue; }
-    if (strcmp(t->children[i]->contents, "{") == 0) { continue; }
-    if (strcmp(t->children[i]->contents, ")") == 0) { continue; }
-    if (strcmp(t->children[i]->contents, "}") == 0) { continue; }
-    if (strstr(t->children[i]->tag, "comment")) { continue; }
-    if (strcmp(t->children[i]->tag, "regex") == 0) { continue; }
+// drop the first n bytes of the buffer, keeping track of where the rest starts
+void lreader_consume(lreader* r, size_t n) {
+  for (size_t k = 0; k < n; k++) {
+    if (r->buf[k] == '\n') { r->row++; r->col = 0; } else { r->col++; }
+  }
+  memmove(r->buf, r->buf + n, r->len - n);
+  r->len -= n;
+  r->scanned -= n;
+  r->boundary = r->boundary > n ? r->boundary - n : 0;
+}
+
+// Parse the first n bytes of the buffer into r->forms, or return the parse error. When the
+// error is not in the first form only the forms before it are parsed, and the rest is left
+// in the buffer to fail on its own next time; when it is, only that form is consumed.
+lval* lreader_parse(lreader* r, size_t n) {
+  size_t k = 0;
+  while (k < n && strchr(" \t\n\r\f\v", r->buf[k])) { k++; }
+  if (k == n) { lreader_consume(r, n); return NULL; }
+
+  char saved = r->buf[n];
+  r->buf[n] = '\0';
+  mpc_result_t res;
+  int ok = lgrammar_parse(r->grammar, r->filename, r->buf, &res);
+  r->buf[n] = saved;
+
+  lval* err = NULL;
+  if (ok) {
+    r->forms = lval_read(r->grammar, res.output, 0);
+    mpc_tree_delete(res.output);
+  } else {
+    lscan s = { 0, false, false, false };
+    size_t pos = res.error->state.pos < (long)n ? (size_t)res.error->state.pos : n;
+    size_t good = lscan_run(&s, r->buf, 0, pos, 0);
+    if (good > 0) {
+      mpc_err_delete(res.error);
+      return lreader_parse(r, good);
+    }
+    // the first boundary after the error ends the form it is in
+    size_t bad = 0;
+    for (size_t k = pos; k < n && bad == 0; k++) { bad = lscan_run(&s, r->buf, k, k + 1, 0); }
+    if (bad > 0) { n = bad; }
+
+    // positions are relative to the chunk; shift them back into the whole source
+    if (res.error->state.row == 0) { res.error->state.col += r->col; }
+    res.error->state.row += r->row;
+    char* err_msg = mpc_err_string(res.error);
+    mpc_err_delete(res.error);
+    err = lval_err("%s", err_msg);
+    free(err_msg);
+  }
+  lreader_consume(r, n);
+  return err;
+}
 
-    x = lval_add(x, lval_read(t->children[i]));
+// Return the next complete top-level form, a parse error, or NULL if more input is needed.
+// Once the source is exhausted pass eof so a trailing atom without whitespace is read too.
+lval* lreader_next(lreader* r, bool eof) {
+  while (true) {
+    if (r->forms) {
+      if (r->forms->count) { return lval_pop(r->forms, 0); }
+      lval_del(r->forms);
+      r->forms = NULL;
+    }
+    size_t n = eof ? r->len : r->boundary;
+    if (n == 0) { return NULL; }
+    lval* err = lreader_parse(r, n);
+    if (err) { return err; }
   }
-  return x;
 }
 
+// number of threads worth starting for parsing
+int lthreads(void) {
+#ifndef _WIN32
+  long cores = sysconf(_SC_NPROCESSORS_ONLN);
+  return cores < 1 ? 1 : cores > 16 ? 16 : (int)cores;
+#else
+  return 1;
+#endif
+}
+
+// size of a seekable file, or -1 for pipes and the like
+long lfile_size(FILE* f) {
+  if (fseek(f, 0, SEEK_END) != 0) { return -1; }
+  long size = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  return size;
+}
+
+// Big data files can be split at top-level boundaries into one chunk per thread and the
+// chunks parsed in parallel. Below this many bytes per chunk it isn't worth it.
+enum { LREADER_CHUNK_MIN = 4 << 20 };
+
+// How many chunks a file of this size should be parsed in. The speedup is still to be
+// measured on a machine with more than one core, so for now it takes LISPY_PARSE_CHUNKS
+// to be set before a file is split at all.
+int lreader_chunks(long size) {
+  if (getenv("LISPY_PARSE_CHUNKS") == NULL || size < 2L * LREADER_CHUNK_MIN) { return 1; }
+  long n = size / LREADER_CHUNK_MIN;
+  return n < lthreads() ? (int)n : lthreads();
+}
+
+typedef struct {
+  lreader* r;
+  const char* data;
+  size_t len;
+  lval* forms;
+} lchunk;
+
+// Parse everything complete in the reader onto the end of forms in one batch, as the
+// streaming reader would (mpc is much slower on one huge input than on many small ones).
+// Returns false once a parse error has been added.
+bool lreader_drain(lreader* r, bool eof, lval** forms) {
+  while (true) {
+    size_t n = eof ? r->len : r->boundary;
+    if (n == 0) { return true; }
+    lval* err = lreader_parse(r, n);
+    if (err) { *forms = lval_add(*forms, err); return false; }
+    if (r->forms) {
+      *forms = lval_join(*forms, r->forms);
+      r->forms = NULL;
+    }
+  }
+}
+
+// parse one chunk into forms, a reader block at a time; a parse error ends them
+void* lchunk_parse(void* arg) {
+  lchunk* c = arg;
+  size_t done = 0;
+  bool eof = false;
+  c->forms = lval_sexpr();
+  while (!eof) {
+    size_t m = c->len - done < LREADER_BLOCK ? c->len - done : LREADER_BLOCK;
+    lreader_feed(c->r, c->data + done, m);
+    done += m;
+    eof = done == c->len;
+    if (!lreader_drain(c->r, eof, &c->forms)) { break; }
+  }
+  lmem_flush();
+  return NULL;
+}
+
+// Read f to the end, cutting it into n chunks as it comes in, then parse the chunks on n
+// threads and join their forms up in order, dropping everything after a parse error.
+lval* lreader_read_chunks(const lgrammar* g, char* filename, FILE* f, long size, size_t n) {
+  // the boundary scan runs as the file is fed in; cut at the first boundary past each target
+  lreader* r = lreader_new(g, filename);
+  size_t* cuts = malloc(sizeof(size_t) * (n + 1));
+  char* block = malloc(LREADER_BLOCK);
+  cuts[0] = 0;
+  size_t k = 1;
+  size_t m;
+  while ((m = fread(block, 1, LREADER_BLOCK, f)) > 0) {
+    lreader_feed(r, block, m);
+    while (k < n && r->boundary >= (size_t)size / n * k && r->boundary > cuts[k-1]) {
+      cuts[k++] = r->boundary;
+    }
+  }
+  free(block);
+  if (cuts[k-1] < r->len) { cuts[k++] = r->len; }
+  n = k - 1;
+
+  lchunk* cs = malloc(sizeof(lchunk) * (n ? n : 1));
+  long row = 0, col = 0;
+  for (k = 0; k < n; k++) {
+    cs[k].r = lreader_new(g, filename);
+    cs[k].r->row = row;
+    cs[k].r->col = col;
+    cs[k].data = r->buf + cuts[k];
+    cs[k].len = cuts[k+1] - cuts[k];
+    cs[k].forms = NULL;
+    for (size_t j = cuts[k]; j < cuts[k+1]; j++) {
+      if (r->buf[j] == '\n') { row++; col = 0; } else { col++; }
+    }
+  }
+  free(cuts);
+
+#ifndef _WIN32
+  pthread_t* ts = malloc(sizeof(pthread_t) * (n ? n : 1));
+  bool* started = calloc(n ? n : 1, sizeof(bool));
+  for (k = 1; k < n; k++) { started[k] = pthread_create(&ts[k], NULL, lchunk_parse, &cs[k]) == 0; }
+  if (n) { lchunk_parse(&cs[0]); }
+  for (k = 1; k < n; k++) {
+    if (started[k]) { pthread_join(ts[k], NULL); } else { lchunk_parse(&cs[k]); }
+  }
+  free(started);
+  free(ts);
+#else
+  for (k = 0; k < n; k++) { lchunk_parse(&cs[k]); }
+#endif
+  lreader_del(r);
+
+  lval* forms = lval_sexpr();
+  bool stopped = false;
+  for (k = 0; k < n; k++) {
+    lval* x = cs[k].forms;
+    if (stopped) {
+      lval_del(x);
+    } else {
+      stopped = x->count && x->cell[x->count-1]->type == LVAL_ERR;
+      forms = lval_join(forms, x);
+    }
+    lreader_del(cs[k].r);
+  }
+  free(cs);
+  return forms;
+}
+
+// Read a whole file through an lreader, returning every form it holds in one sexpr. If the
+// file stops parsing, the parse error is the last element. NULL if it can't be opened.
+lval* lreader_read_file(const lgrammar* g, char* filename) {
+  FILE* f = fopen(filename, "rb");
+  if (f == NULL) { return NULL; }
+
+  long size = lfile_size(f);
+  int chunks = lreader_chunks(size);
+  if (chunks > 1) {
+    lval* forms = lreader_read_chunks(g, filename, f, size, chunks);
+    fclose(f);
+    return forms;
+  }
+
+  lreader* r = lreader_new(g, filename);
+  char* block = malloc(LREADER_BLOCK);
+  lval* forms = lval_sexpr();
+  bool eof = false;
+  while (!eof) {
+    size_t n = fread(block, 1, LREADER_BLOCK, f);
+    eof = n == 0;
+    lreader_feed(r, block, n);
+    if (!lreader_drain(r, eof, &forms)) { break; }
+  }
+  free(block);
+  lreader_del(r);
+  fclose(f);
+  return forms;
+}
+
+// Preloader. The files named on the command line are parsed on a pool of threads while
+// main evaluates them one after another, so startup costs the evaluation time and little
+// more. Each parsed file is also searched for top-level (load "literal") forms, and those
+// files are queued as well. builtin_load takes a file's forms from here when they are
+// available and reads the file itself otherwise: when the name was never queued, could not
+// be opened, or has already been taken once.
+typedef struct {
+  char* filename;
+  lval* forms;
+  bool done;
+  bool taken;
+} lpreload_file;
+
+#ifndef _WIN32
+
+typedef struct lpreload {
+  const lgrammar* grammar;
+  pthread_mutex_t lock;
+  pthread_cond_t ready;  // a file was queued or finished
+  lpreload_file* files;
+  int count;
+  int next;              // first file no worker has picked up yet
+  int busy;              // workers currently parsing
+  bool closing;
+  pthread_t* workers;
+  int nworkers;
+} lpreload;
+
+// queue filename unless it is already there; the lock must be held
+void lpreload_add(lpreload* pl, char* filename) {
+  if (strcmp(filename, "-") == 0) { return; }
+  for (int k = 0; k < pl->count; k++) {
+    if (strcmp(pl->files[k].filename, filename) == 0) { return; }
+  }
+  pl->files = realloc(pl->files, sizeof(lpreload_file) * (pl->count + 1));
+  lpreload_file* p = &pl->files[pl->count++];
+  p->filename = malloc(strlen(filename) + 1);
+  strcpy(p->filename, filename);
+  p->forms = NULL;
+  p->done = false;
+  p->taken = false;
+  pthread_cond_broadcast(&pl->ready);
+}
+
+// queue the files the top-level forms of a parsed file will load; the lock must be held
+void lpreload_discover(lpreload* pl, lval* forms) {
+  for (int i = 0; i < forms->count; i++) {
+    lval* x = forms->cell[i];
+    if (x->type != LVAL_SEXPR || x->count != 2) { continue; }
+    if (x->cell[0]->type != LVAL_SYM || strcmp(x->cell[0]->sym, "load") != 0) { continue; }
+    if (x->cell[1]->type != LVAL_STR) { continue; }
+    lpreload_add(pl, x->cell[1]->str);
+  }
+}
+
+void* lpreload_work(void* arg) {
+  lpreload* pl = arg;
+  pthread_mutex_lock(&pl->lock);
+  while (!pl->closing) {
+    if (pl->next == pl->count) {
+      // nothing left to parse, and once nobody is busy nothing more can be discovered
+      if (pl->busy == 0) { break; }
+      pthread_cond_wait(&pl->ready, &pl->lock);
+      continue;
+    }
+    int k = pl->next++;
+    char* filename = pl->files[k].filename;
+    pl->busy++;
+    pthread_mutex_unlock(&pl->lock);
+
+    lval* forms = lreader_read_file(pl->grammar, filename);
+    lmem_flush();
+
+    pthread_mutex_lock(&pl->lock);
+    pl->files[k].forms = forms;
+    pl->files[k].done = true;
+    if (forms) { lpreload_discover(pl, forms); }
+    pl->busy--;
+    pthread_cond_broadcast(&pl->ready);
+  }
+  // wake the other workers so they see the queue is finished too
+  pthread_cond_broadcast(&pl->ready);
+  pthread_mutex_unlock(&pl->lock);
+  return NULL;
+}
+
+lpreload* lpreload_new(const lgrammar* g) {
+  lpreload* pl = malloc(sizeof(lpreload));
+  pl->grammar = g;
+  pthread_mutex_init(&pl->lock, NULL);
+  pthread_cond_init(&pl->ready, NULL);
+  pl->files = NULL;
+  pl->count = 0;
+  pl->next = 0;
+  pl->busy = 0;
+  pl->closing = false;
+  pl->workers = NULL;
+  pl->nworkers = 0;
+  return pl;
+}
+
+// Start parsing everything queued so far, on one thread per core. With only one core there
+// is nothing to overlap with, and holding whole files of forms only slows things down, so
+// the preloader stays idle and every load streams its file as usual.
+void lpreload_start(lpreload* pl) {
+  int n = lthreads();
+  if (n < 2) { return; }
+  if (n > pl->count) { n = pl->count; }
+  pl->workers = malloc(sizeof(pthread_t) * (n ? n : 1));
+  for (int t = 0; t < n; t++) {
+    if (pthread_create(&pl->workers[pl->nworkers], NULL, lpreload_work, pl) == 0) { pl->nworkers++; }
+  }
+}
+
+// Hand over the forms of filename, waiting for it to finish parsing if need be. NULL if
+// the caller should read the file itself.
+lval* lpreload_take(lpreload* pl, char* filename) {
+  if (pl == NULL || pl->nworkers == 0) { return NULL; }
+  pthread_mutex_lock(&pl->lock);
+  lval* forms = NULL;
+  for (int k = 0; k < pl->count; k++) {
+    if (pl->files[k].taken || strcmp(pl->files[k].filename, filename) != 0) { continue; }
+    pl->files[k].taken = true;
+    while (!pl->files[k].done) { pthread_cond_wait(&pl->ready, &pl->lock); }
+    forms = pl->files[k].forms;
+    pl->files[k].forms = NULL;
+    break;
+  }
+  pthread_mutex_unlock(&pl->lock);
+  return forms;
+}
+
+void lpreload_del(lpreload* pl) {
+  pthread_mutex_lock(&pl->lock);
+  pl->closing = true;
+  pthread_cond_broadcast(&pl->ready);
+  pthread_mutex_unlock(&pl->lock);
+  for (int t = 0; t < pl->nworkers; t++) { pthread_join(pl->workers[t], NULL); }
+  for (int k = 0; k < pl->count; k++) {
+    if (pl->files[k].forms) { lval_del(pl->files[k].forms); }
+    free(pl->files[k].filename);
+  }
+  free(pl->files);
+  free(pl->workers);
+  pthread_cond_destroy(&pl->ready);
+  pthread_mutex_destroy(&pl->lock);
+  free(pl);
+}
+
+#else
+
+// no threads here; builtin_load always reads files itself
+typedef struct lpreload { int unused; } lpreload;
+lpreload* lpreload_new(const lgrammar* g) { return NULL; }
+void lpreload_add(lpreload* pl, char* filename) {}
+void lpreload_start(lpreload* pl) {}
+lval* lpreload_take(lpreload* pl, char* filename) { return NULL; }
+void lpreload_del(lpreload* pl) {}
+
+#endif
+
 // remove the first child lval* from v and return it, leaving v intact but for that removed
 // first child
 lval* lval_pop(lval* v, int i) {
@@ -416,7 +1601,7 @@ lval* lval_pop(lval* v, int i) {
   memmove(&v->cell[i], &v->cell[i+1], sizeof(lval*) * (v->count-i-1));
   v->count--;
 
-  v->cell = realloc(v->cell, sizeof(lval*) * v->count);
+  v->cell = lmem_realloc(v->cell, sizeof(lval*) * v->count, v->type);
 
   return x;
 }
@@ -430,8 +1615,7 @@ lval* lval_take(lval* v, int i) {
 
 // do a deep copy of the given lval, including all of its children.
 lval* lval_copy(lval* v) {
-  lval* x = malloc(sizeof(lval));
-  x->type = v->type;
+  lval* x = lval_new(v->type);
   switch (v->type) {
     case LVAL_NUM:
       x->num = v->num;
@@ -451,21 +1635,18 @@ lval* lval_copy(lval* v) {
       }
       break;
     case LVAL_ERR:
-      x->err = malloc(strlen(v->err) + 1);
-      strcpy(x->err, v->err);
+      x->err = lmem_strdup(v->err, LVAL_ERR);
       break;
     case LVAL_SYM:
-      x->sym = malloc(strlen(v->sym) + 1);
-      strcpy(x->sym, v->sym);
+      x->sym = lmem_strdup(v->sym, LVAL_SYM);
       break;
     case LVAL_STR:
-      x->str = malloc(strlen(v->str) + 1);
-      strcpy(x->str, v->str);
+      x->str = lmem_strdup(v->str, LVAL_STR);
       break;
     case LVAL_SEXPR:
     case LVAL_QEXPR:
       x->count = v->count;
-      x->cell = malloc(sizeof(lval*) * x->count);
+      x->cell = x->count ? lmem_alloc(sizeof(lval*) * x->count, x->type) : NULL;
       for (int i = 0; i < x->count; i++) {
         x->cell[i] = lval_copy(v->cell[i]);
       }
@@ -476,6 +1657,8 @@ lval* lval_copy(lval* v) {
 
 struct lenv {
   lenv* par;
+  const lgrammar* grammar;  // these two are only set on the global environment
+  lpreload* preload;
   int count;
   char** syms;
   lval** vals;
@@ -543,8 +1726,10 @@ lval* lval_call(lenv* e, lval* f, lval* a) {
 
 
 lenv* lenv_new(void) {
-  lenv* e = malloc(sizeof(lenv));
+  lenv* e = lmem_alloc(sizeof(lenv), LMEM_ENV);
   e->par = NULL;
+  e->grammar = NULL;
+  e->preload = NULL;
   e->count = 0;
   e->syms = NULL;
   e->vals = NULL;
@@ -553,16 +1738,16 @@ lenv* lenv_new(void) {
 }
 
 lenv* lenv_copy(lenv* e) {
-  lenv* x = malloc(sizeof(lenv));
+  lenv* x = lmem_alloc(sizeof(lenv), LMEM_ENV);
   x->par = e->par;
+  x->grammar = e->grammar;
+  x->preload = e->preload;
   x->count = e->count;
-  x->syms = malloc(sizeof(char*) * e->count);
-  x->vals = malloc(sizeof(lval*) * e->count);
-  x->locks = malloc(sizeof(bool) * e->count);
+  x->syms = lmem_alloc(sizeof(char*) * e->count, LMEM_ENV);
+  x->vals = lmem_alloc(sizeof(lval*) * e->count, LMEM_ENV);
+  x->locks = lmem_alloc(sizeof(bool) * e->count, LMEM_ENV);
   for (int i = 0; i < e->count; i++) {
-    char* sym_cpy = malloc(strlen(e->syms[i] + 1));
-    strcpy(sym_cpy, e->syms[i]);
-    x->syms[i] = sym_cpy;
+    x->syms[i] = lmem_strdup(e->syms[i], LMEM_ENV);
     x->vals[i] = lval_copy(e->vals[i]);
     x->locks[i] = e->locks[i];
   }
@@ -571,13 +1756,13 @@ lenv* lenv_copy(lenv* e) {
 
 void lenv_del(lenv* e) {
   for (int i = 0; i < e->count; i++) {
-    free(e->syms[i]);
+    lmem_free(e->syms[i]);
     lval_del(e->vals[i]);
   }
-  free(e->syms);
-  free(e->vals);
-  free(e->locks);
-  free(e);
+  lmem_free(e->syms);
+  lmem_free(e->vals);
+  lmem_free(e->locks);
+  lmem_free(e);
 }
 
 // look up the LVAL_FUN corresponding with the symbol in k
@@ -593,17 +1778,18 @@ lval* lenv_get(lenv* e, lval* k) {
   }
 }
 
-lval* lenv_get_name(lenv* e, lval* v) {
+// the name a builtin is bound to, or NULL if it has none
+char* lenv_get_name(lenv* e, lval* v) {
   for (int i = 0; i < e->count; i++) {
-    if (lval_equal(v, e->vals[i])) { 
-      lval_sym(e->syms[i]);
-    }
-  }
-  if (e->par) {
-    return lenv_get_name(e->par, v);
-  } else {
-    return lval_err("No symbol for function. How strange.");
+    if (lval_equal(v, e->vals[i])) { return e->syms[i]; }
   }
+  return e->par ? lenv_get_name(e->par, v) : NULL;
+}
+
+// the grammar and preloader are kept on the global environment; walk up to it
+lenv* lenv_global(lenv* e) {
+  while (e->par) { e = e->par; }
+  return e;
 }
 
 // store lval v with the symbol from lval k. If there is already an entry for k->sym,
@@ -616,17 +1802,16 @@ void lenv_put(lenv* e, lval* k, lval* v, bool locked) {
         lval_del(e->vals[i]);
         e->vals[i] = lval_copy(v);
       } else {
-        printf("Cannot override builtin function <%s>\n", k->sym);
+        lwriter_printf(&lout, "Cannot override builtin function <%s>\n", k->sym);
       }
       return;
     }
   }
   e->count++;
-  e->syms = realloc(e->syms, sizeof(char*) * e->count);
-  e->vals = realloc(e->vals, sizeof(lval*) * e->count);
-  e->locks = realloc(e->locks, sizeof(bool) * e->count);
-  e->syms[e->count - 1] = malloc(strlen(k->sym)+1);
-  strcpy(e->syms[e->count - 1], k->sym);
+  e->syms = lmem_realloc(e->syms, sizeof(char*) * e->count, LMEM_ENV);
+  e->vals = lmem_realloc(e->vals, sizeof(lval*) * e->count, LMEM_ENV);
+  e->locks = lmem_realloc(e->locks, sizeof(bool) * e->count, LMEM_ENV);
+  e->syms[e->count - 1] = lmem_strdup(k->sym, LMEM_ENV);
   e->vals[e->count - 1] = lval_copy(v);
   e->locks[e->count - 1] = locked;
 }
@@ -637,6 +1822,200 @@ void lenv_def(lenv* e, lval* k, lval* v, bool locked) {
   lenv_put(e, k, v, locked);
 }
 
+// Evaluator profiler. While (profile {expr}) runs, every call of a builtin or lambda is timed
+// and counted against the chain of calls that led to it, each function known by the symbol
+// it was called through. Only the evaluating thread ever touches it.
+typedef struct {
+  int name;
+  int parent;
+  int child;             // first callee; the others follow through next
+  int next;
+  unsigned long calls;
+  double time;           // seconds, including callees
+  unsigned long made;    // lvals made, including callees
+} lprof_node;
+
+typedef struct {
+  int node;
+  double start;
+  unsigned long made;
+} lprof_frame;
+
+typedef struct {
+  char** names;
+  int names_count;
+  lprof_node* nodes;
+  int count;
+  int slots;
+  lprof_frame* stack;
+  int depth;
+  int stack_slots;
+} lprofile;
+
+// set while (profile ...) runs
+static lprofile* lprofiler = NULL;
+
+// seconds from some fixed point
+double lclock(void) {
+#ifndef _WIN32
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+#else
+  return (double)clock() / CLOCKS_PER_SEC;
+#endif
+}
+
+int lprofile_name(lprofile* p, const char* name) {
+  for (int i = 0; i < p->names_count; i++) {
+    if (strcmp(p->names[i], name) == 0) { return i; }
+  }
+  p->names = realloc(p->names, sizeof(char*) * (p->names_count + 1));
+  p->names[p->names_count] = malloc(strlen(name) + 1);
+  strcpy(p->names[p->names_count], name);
+  return p->names_count++;
+}
+
+// the node for calling `name` from the call being run, made on first use
+int lprofile_child(lprofile* p, const char* name) {
+  int parent = p->depth ? p->stack[p->depth - 1].node : -1;
+  int first = parent >= 0 ? p->nodes[parent].child : -1;
+  for (int n = first; n >= 0; n = p->nodes[n].next) {
+    if (strcmp(p->names[p->nodes[n].name], name) == 0) { return n; }
+  }
+
+  if (p->count == p->slots) {
+    p->slots = p->slots ? p->slots * 2 : 64;
+    p->nodes = realloc(p->nodes, sizeof(lprof_node) * p->slots);
+  }
+  lprof_node* x = &p->nodes[p->count];
+  x->name = lprofile_name(p, name);
+  x->parent = parent;
+  x->child = -1;
+  x->next = first;
+  x->calls = 0;
+  x->time = 0;
+  x->made = 0;
+  if (parent >= 0) { p->nodes[parent].child = p->count; }
+  return p->count++;
+}
+
+void lprofile_enter(lprofile* p, int node) {
+  if (p->depth == p->stack_slots) {
+    p->stack_slots = p->stack_slots ? p->stack_slots * 2 : 64;
+    p->stack = realloc(p->stack, sizeof(lprof_frame) * p->stack_slots);
+  }
+  p->nodes[node].calls++;
+  p->stack[p->depth++] = (lprof_frame){ node, lclock(), lval_made };
+}
+
+void lprofile_leave(lprofile* p) {
+  lprof_frame* f = &p->stack[--p->depth];
+  p->nodes[f->node].time += lclock() - f->start;
+  p->nodes[f->node].made += lval_made - f->made;
+}
+
+// the profiled expression itself is the root, so every call made has a parent
+lprofile* lprofile_new(void) {
+  lprofile* p = calloc(1, sizeof(lprofile));
+  lprofile_enter(p, lprofile_child(p, "profile"));
+  return p;
+}
+
+void lprofile_del(lprofile* p) {
+  for (int i = 0; i < p->names_count; i++) { free(p->names[i]); }
+  free(p->names);
+  free(p->nodes);
+  free(p->stack);
+  free(p);
+}
+
+double lprofile_self(lprofile* p, int n) {
+  double t = p->nodes[n].time;
+  for (int c = p->nodes[n].child; c >= 0; c = p->nodes[c].next) { t -= p->nodes[c].time; }
+  return t > 0 ? t : 0;
+}
+
+unsigned long lprofile_self_made(lprofile* p, int n) {
+  unsigned long m = p->nodes[n].made;
+  for (int c = p->nodes[n].child; c >= 0; c = p->nodes[c].next) { m -= p->nodes[c].made; }
+  return m;
+}
+
+// one line per chain of calls, its frames joined by ';' and then the microseconds spent
+// in the last one, which is the collapsed stack format flamegraph.pl reads
+bool lprofile_write(lprofile* p, const char* path) {
+  FILE* f = fopen(path, "w");
+  if (f == NULL) { return false; }
+  int* chain = malloc(sizeof(int) * p->count);
+  for (int n = 0; n < p->count; n++) {
+    long us = (long)(lprofile_self(p, n) * 1e6 + 0.5);
+    if (p->nodes[n].calls == 0 || us == 0) { continue; }
+    int k = 0;
+    for (int c = n; c >= 0; c = p->nodes[c].parent) { chain[k++] = c; }
+    while (k--) { fprintf(f, "%s%c", p->names[p->nodes[chain[k]].name], k ? ';' : ' '); }
+    fprintf(f, "%ld\n", us);
+  }
+  free(chain);
+  return fclose(f) == 0;
+}
+
+typedef struct {
+  const char* name;
+  unsigned long calls;
+  double total;
+  double self;
+  unsigned long made;
+  unsigned long made_self;
+} lprof_row;
+
+int lprof_row_cmp(const void* a, const void* b) {
+  const lprof_row* x = a;
+  const lprof_row* y = b;
+  if (x->self != y->self) { return x->self < y->self ? 1 : -1; }
+  return strcmp(x->name, y->name);
+}
+
+// Calls summed up per function, most time of their own first. A function's total leaves out
+// any time it spent inside an outer call of itself, so recursion is not counted twice.
+void lprofile_print(lprofile* p, FILE* out) {
+  lprof_row* rows = calloc(p->names_count, sizeof(lprof_row));
+  int* active = calloc(p->names_count, sizeof(int));
+  int* todo = malloc(sizeof(int) * 2 * p->count);
+  for (int i = 0; i < p->names_count; i++) { rows[i].name = p->names[i]; }
+
+  // depth first from the root, each node pushed as ~n to be counted off again on the way out
+  int k = 0;
+  todo[k++] = 0;
+  while (k) {
+    int n = todo[--k];
+    if (n < 0) { active[p->nodes[~n].name]--; continue; }
+    lprof_node* x = &p->nodes[n];
+    lprof_row* r = &rows[x->name];
+    r->calls += x->calls;
+    r->self += lprofile_self(p, n);
+    r->made_self += lprofile_self_made(p, n);
+    if (active[x->name]++ == 0) {
+      r->total += x->time;
+      r->made += x->made;
+    }
+    todo[k++] = ~n;
+    for (int c = x->child; c >= 0; c = p->nodes[c].next) { todo[k++] = c; }
+  }
+
+  qsort(rows, p->names_count, sizeof(lprof_row), lprof_row_cmp);
+  fprintf(out, "%-20s %10s %12s %12s %12s %12s\n",
+    "Function", "Calls", "Total ms", "Self ms", "Lvals", "Self lvals");
+  for (int i = 0; i < p->names_count; i++) {
+    if (rows[i].calls == 0) { continue; }
+    fprintf(out, "%-20s %10lu %12.3f %12.3f %12lu %12lu\n", rows[i].name, rows[i].calls,
+      rows[i].total * 1e3, rows[i].self * 1e3, rows[i].made, rows[i].made_self);
+  }
+  free(rows);
+  free(active);
+  free(todo);
+}
+
 // take the first expr in a qexpr and discard the rest
 lval* builtin_head(lenv* e, lval* a) {
   ASSERT_NUM_ARGS(a, 1, "head");
@@ -796,9 +2175,15 @@ lval* builtin_env(lenv* e, lval* a) {
 
 // expects a to be NULL ... be careful~!
 lval* builtin_exit(lenv* e, lval* a) {
+  lenv* top = e;
+  while (top->par) { top = top->par; }
+  lgrammar_report(top->grammar);
   lenv_del(e);
+  // the expressions around the call are still live, so there is nothing to leak check
+  lmem_exit_check(false);
   // should clean up the MPC stuff but YOLO
-  printf("Exiting...\n");
+  lwriter_puts(&lout, "Exiting...\n");
+  lwriter_flush(&lout);
   exit(0);
 }
 
@@ -890,6 +2275,7 @@ lval* builtin_and(lenv* e, lval* a) {
     truth = truth && x->boolean;
     lval_del(x);
   }
+  lval_del(a);
   return lval_bool(truth);
 }
 lval* builtin_or(lenv* e, lval* a) {
@@ -902,6 +2288,7 @@ lval* builtin_or(lenv* e, lval* a) {
     truth = truth || x->boolean;
     lval_del(x);
   }
+  lval_del(a);
   return lval_bool(truth);
 }
 lval* builtin_not(lenv* e, lval* a) {
@@ -932,6 +2319,7 @@ lval* builtin_if(lenv* e, lval* a) {
   } else {
     x = lval_take(a, 1);
   }
+  lval_del(b);
   x->type = LVAL_SEXPR;
   return lval_eval(e, x);
 }
@@ -966,42 +2354,145 @@ lval* builtin_comparator(lenv* e, lval* a, char* op) {
   return lval_bool(truth);
 }
 
+// evaluate one top-level form of a loaded file, reporting (but not stopping on) errors
+void lval_eval_loaded(lenv* e, lval* x) {
+  x = lval_eval(e, x);
+  /* lval_println(e, x); */
+  if (x->type == LVAL_ERR) { lval_println(e, x); }
+  lval_del(x);
+}
+
+// evaluate a list of forms read ahead of time, returning the parse error that ends it if any
+lval* lval_eval_forms(lenv* e, lval* forms) {
+  lval* err = NULL;
+  for (int i = 0; i < forms->count; i++) {
+    if (forms->cell[i]->type == LVAL_ERR) { err = forms->cell[i]; continue; }
+    lval_eval_loaded(e, forms->cell[i]);
+  }
+  // the forms have all been consumed, only the list itself is left
+  forms->count = 0;
+  lval_del(forms);
+  return err;
+}
+
+// what load returns once a file is done: its parse error, if it stopped at one
+lval* lval_load_result(lval* err) {
+  if (err) {
+    lwriter_puts(&lout, "wah-wuh\n");
+    lval* x = lval_err("Could not load library %s", err->err);
+    lval_del(err);
+    return x;
+  }
+  return lval_sexpr();
+}
+
 lval* builtin_load(lenv* e, lval* a) {
   ASSERT_NUM_ARGS(a, 1, "load");
   ASSERT_TYPE(a, 0, LVAL_STR, "load");
 
-  mpc_result_t r;
-  if (mpc_parse_contents(a->cell[0]->str, Lispy, &r)) {
-    lval* expr = lval_read(r.output);
-    mpc_ast_delete(r.output);
-
-    while (expr->count) {
-      lval* x = lval_eval(e, lval_pop(expr, 0));
-      /* lval_println(e, x); */
-      if (x->type == LVAL_ERR) { lval_println(e, x); }
-      lval_del(x);
-    }
+  char* filename = a->cell[0]->str;
+  lval* err = NULL;
 
-    lval_del(expr);
+  // already parsed by the preloader, so only the evaluation is left
+  lval* forms = lpreload_take(lenv_global(e)->preload, filename);
+  if (forms) {
     lval_del(a);
-    return lval_sexpr();
-  } else {
-    printf("wah-wuh\n");
-    char * err_msg = mpc_err_string(r.error);
-    mpc_err_delete(r.error);
+    return lval_load_result(lval_eval_forms(e, forms));
+  }
 
-    lval* err = lval_err("Could not load library %s", err_msg);
-    free(err_msg);
+  // "-" reads the program from stdin
+  bool from_stdin = strcmp(filename, "-") == 0;
+  FILE* f = from_stdin ? stdin : fopen(filename, "rb");
+  if (f == NULL) {
+    lval* err = lval_err("Could not load library %s: error: Unable to open file!\n", filename);
     lval_del(a);
     return err;
   }
+
+  // With LISPY_PARSE_CHUNKS set, big files are split up and parsed on several threads
+  // before any of them is evaluated
+  long size = from_stdin ? -1 : lfile_size(f);
+  int chunks = lreader_chunks(size);
+  if (chunks > 1) {
+    forms = lreader_read_chunks(lenv_global(e)->grammar, filename, f, size, chunks);
+    fclose(f);
+    lval_del(a);
+    return lval_load_result(lval_eval_forms(e, forms));
+  }
+
+  // Forms are evaluated as soon as the reader has them, while the rest of the file is
+  // still on its way in. Pipes are read a line at a time so we never sit on a complete
+  // form waiting for a full block.
+  lreader* r = lreader_new(lenv_global(e)->grammar, from_stdin ? "<stdin>" : filename);
+  char* block = malloc(LREADER_BLOCK);
+  bool eof = false;
+  while (!err && !eof) {
+    size_t n;
+    if (from_stdin) {
+      n = fgets(block, LREADER_BLOCK, f) ? strlen(block) : 0;
+    } else {
+      n = fread(block, 1, LREADER_BLOCK, f);
+    }
+    eof = n == 0;
+    lreader_feed(r, block, n);
+
+    lval* x;
+    while ((x = lreader_next(r, eof))) {
+      if (x->type == LVAL_ERR) { err = x; break; }
+      lval_eval_loaded(e, x);
+    }
+  }
+  free(block);
+  lreader_del(r);
+  if (!from_stdin) { fclose(f); }
+  lval_del(a);
+  return lval_load_result(err);
+}
+
+// (profile {expr}) evaluates expr like eval while profiling every call made on the way.
+// The calls go to profile.folded, or the file named after expr, as collapsed stacks for
+// flamegraph.pl, and a summary per function is printed on stderr.
+lval* builtin_profile(lenv* e, lval* a) {
+  LASSERT(a, a->count == 1 || a->count == 2,
+      "Function 'profile' passed %i arguments. Expected an expression and maybe a file name.", a->count);
+  if (a->count == 2) { ASSERT_TYPE(a, 1, LVAL_STR, "profile"); }
+  lval* path = a->count == 2 ? lval_pop(a, 1) : lval_str("profile.folded");
+
+  // already profiling further out, which covers this too
+  if (lprofiler) {
+    lval_del(path);
+    return builtin_eval(e, a);
+  }
+
+  lprofiler = lprofile_new();
+  lval* x = builtin_eval(e, a);
+  lprofile_leave(lprofiler);
+
+  lprofile_print(lprofiler, stderr);
+  if (!lprofile_write(lprofiler, path->str)) {
+    lval_del(x);
+    x = lval_err("Could not write profile to %s", path->str);
+  }
+  lprofile_del(lprofiler);
+  lprofiler = NULL;
+  lval_del(path);
+  return x;
+}
+
+// mem-stats prints what lvals and environments are using right now, and evaluates to
+// {live-bytes high-water-mark} so a script can keep an eye on its own memory
+lval* builtin_mem_stats(lenv* e, lval* a) {
+  lmem_stats t = lmem_totals();
+  lwriter_flush(&lout);
+  lmem_print(stdout);
+  return lval_add(lval_add(lval_qexpr(), lval_num(t.live)), lval_num(t.peak));
 }
 
 lval* builtin_print (lenv* e, lval* a) {
   for (int i = 0; i < a->count; i++) {
-    lval_print(e, a->cell[i]); putchar(' ');
+    lval_write(&lout, e, a->cell[i]); lwriter_putc(&lout, ' ');
   }
-  putchar('\n');
+  lwriter_newline(&lout);
   lval_del(a);
   return lval_sexpr();
 }
@@ -1029,6 +2520,12 @@ void lenv_add_nullary_builtin(lenv* e, char* name, lbuiltin func) {
   lenv_put(e, k, v, true);
   lval_del(k); lval_del(v);
 }
+void lenv_add_number(lenv* e, char* name, double num) {
+  lval* k = lval_sym(name);
+  lval* v = lval_num(num);
+  lenv_put(e, k, v, true);
+  lval_del(k); lval_del(v);
+}
 
 void lenv_add_builtins(lenv* e) {
   lenv_add_builtin(e, "list", builtin_list);
@@ -1045,6 +2542,7 @@ void lenv_add_builtins(lenv* e) {
   lenv_add_builtin(e, "\\", builtin_lambda);
   lenv_add_nullary_builtin(e, "env", builtin_env);
   lenv_add_nullary_builtin(e, "exit", builtin_exit);
+  lenv_add_nullary_builtin(e, "mem-stats", builtin_mem_stats);
   lenv_add_nullary_builtin(e, "true", builtin_true);
   lenv_add_nullary_builtin(e, "false", builtin_false);
   lenv_add_builtin(e, "+", builtin_add);
@@ -1065,15 +2563,23 @@ void lenv_add_builtins(lenv* e) {
   lenv_add_builtin(e, "load", builtin_load);
   lenv_add_builtin(e, "print", builtin_print);
   lenv_add_builtin(e, "error", builtin_error);
+  lenv_add_builtin(e, "profile", builtin_profile);
+  // what ldtoa prints for the numbers the reader can't spell
+  lenv_add_number(e, "inf", INFINITY);
+  lenv_add_number(e, "-inf", -INFINITY);
+  lenv_add_number(e, "nan", NAN);
 }
 
 lval* lval_eval(lenv* e, lval* v) {
   if(v->type == LVAL_SYM) {
     lval* x = lenv_get(e, v);
+    int node = lprofiler && x->type == LVAL_NFUN ? lprofile_child(lprofiler, v->sym) : -1;
     lval_del(v);
 
     if (x->type == LVAL_NFUN) {
+      if (node >= 0) { lprofile_enter(lprofiler, node); }
       lval* result = x->builtin(e, NULL);
+      if (node >= 0) { lprofile_leave(lprofiler); }
       lval_del(x);
       return result;
     }
@@ -1086,6 +2592,12 @@ lval* lval_eval(lenv* e, lval* v) {
 }
 
 lval* lval_eval_sexpr(lenv* e, lval* v) {
+  // looked up before the symbol is evaluated away; only counted if the call happens
+  int node = -1;
+  if (lprofiler && v->count > 1) {
+    node = lprofile_child(lprofiler, v->cell[0]->type == LVAL_SYM ? v->cell[0]->sym : "<anonymous>");
+  }
+
   for (int i = 0; i < v->count; i++) {
     v->cell[i] = lval_eval(e, v->cell[i]);
   }
@@ -1110,39 +2622,71 @@ lval* lval_eval_sexpr(lenv* e, lval* v) {
     return err;
   }
 
+  if (node >= 0) { lprofile_enter(lprofiler, node); }
   lval* result = lval_call(e, f, v);
+  if (node >= 0) { lprofile_leave(lprofiler); }
   lval_del(f);
   return result;
 }
 
+// Batch mode, for piping programs through the interpreter. Stdin is read a block at a time
+// and each top-level form is evaluated and its value printed, as load reads a file, but with
+// no banner, prompt or parse tree and with output only written a block at a time.
+void lbatch(lenv* e) {
+  lout.line = false;
+  lreader* r = lreader_new(lenv_global(e)->grammar, "<stdin>");
+  char* block = malloc(LREADER_BLOCK);
+  bool eof = false;
+  while (!eof) {
+    size_t n = fread(block, 1, LREADER_BLOCK, stdin);
+    eof = n == 0;
+    lreader_feed(r, block, n);
+
+    // a parse error only costs the forms it was found among; reading carries on after them
+    lval* x;
+    while ((x = lreader_next(r, eof))) {
+      if (x->type != LVAL_ERR) { x = lval_eval(e, x); }
+      lval_println(e, x);
+      lval_del(x);
+    }
+  }
+  free(block);
+  lreader_del(r);
+  lwriter_flush(&lout);
+}
 
-// cc -std=c99 -Wall parsing.c mpc.s -ledit -lm -o parsing
+// cc -std=c99 -Wall -pthread parsing.c mpc.s -ledit -lm -o parsing
+// or `make`, which also builds the generated parser in (see lgrammar_parse)
 int main(int argc, char** argv) {
-  Number = mpc_new("number");
-  Symbol = mpc_new("symbol");
-  String = mpc_new("string");
-  Comment = mpc_new("comment");
-  Sexpr = mpc_new("sexpr");
-  Qexpr = mpc_new("qexpr");
-  Expr = mpc_new("expr");
-  Lispy = mpc_new("lispy");
-
-  mpca_lang(MPCA_LANG_DEFAULT,
-    "number    : /-?(\\d+\\.)?\\d+/;"
-    "symbol    : /[a-zA-Z0-9_%+*\\-\\/\\\\=<>!&|]+/ ;"
-    "string    : /\"(\\\\.|[^\"])*\"/ ;"
-    "comment   : /;[^\\r\\n]*/;"
-    "sexpr     : '(' <expr>* ')' ;"
-    "qexpr     : '{' <expr>* '}' ;"
-    "expr      : <number> | <symbol> | <string> | <comment> | <sexpr> | <qexpr> ;"
-    "lispy     : /^/ <expr>* /$/ ;",
-    Number, Symbol, String, Comment, Sexpr, Qexpr, Expr, Lispy);
+  lgrammar* g = lgrammar_new();
 
+  if (argc == 3 && strcmp(argv[1], "--generate") == 0) {
+    int ok = lgrammar_generate(g, argv[2]);
+    if (!ok) { fprintf(stderr, "could not generate %s\n", argv[2]); }
+    lgrammar_del(g);
+    return ok ? 0 : 1;
+  }
 
   lenv* e = lenv_new();
+  e->grammar = g;
   lenv_add_builtins(e);
-
-  if (argc >= 2) {
+  lout.f = stdout;
+  lout.line = isatty(fileno(stdout));
+
+  // --batch, or stdin that isn't a terminal, with no files given
+  bool batch = argc == 2 && strcmp(argv[1], "--batch") == 0;
+  if (argc == 1 && !isatty(fileno(stdin))) { batch = true; }
+
+  if (batch) {
+    lbatch(e);
+  } else if (argc >= 2) {
+    // parse all the files up front on other threads; they are still evaluated in order
+    // the profile is not shared between threads
+    e->preload = g->profile ? NULL : lpreload_new(g);
+    if (e->preload) {
+      for (int i = 1; i < argc; i++) { lpreload_add(e->preload, argv[i]); }
+      lpreload_start(e->preload);
+    }
     for (int i = 1; i < argc; i++) {
       lval* args = lval_add(lval_sexpr(), lval_str(argv[i]));
       lval* x = builtin_load(e, args);
@@ -1155,31 +2699,36 @@ int main(int argc, char** argv) {
 
     while (1) {
       char* input = readline("lispy> ");
+      if (input == NULL) { break; }
       add_history(input);
 
       /* Attempt to parse the user input */
       mpc_result_t r;
-      if (mpc_parse("<stdin>", input, Lispy, &r)) {
-        mpc_ast_print(r.output);
-        /* mpc_ast_t* a = r.output; */
-        /* printf("Tag: %s\n", a->tag); */
-        /* printf("Contents: %s\n", a->contents); */
-        /* printf("Number of children: %i\n", a->children_num); */
-        /* printf("Number of nodes: %i\n", number_of_nodes(r.output)); */
-        lval* x = lval_read(r.output);
+      if (lgrammar_parse(g, "<stdin>", input, &r)) {
+        mpc_tree_print(r.output);
+        /* mpc_tree_t* t = r.output; */
+        /* printf("Tag: %s\n", mpc_tags_name(t->names, t->tags[t->nodes[0].tags])); */
+        /* printf("Contents: %s\n", mpc_tree_contents(t, 0)); */
+        /* printf("Number of children: %i\n", t->nodes[0].children_num); */
+        /* printf("Number of nodes: %i\n", t->nodes_num); */
+        lval* x = lval_read(g, r.output, 0);
         x = lval_eval(e, x);
         lval_println(e, x);
         lval_del(x);
-        mpc_ast_delete(r.output);
+        mpc_tree_delete(r.output);
       } else {
         mpc_err_print(r.error);
         mpc_err_delete(r.error);
       }
+      lwriter_flush(&lout);
       free(input);
     }
   }
+  lwriter_flush(&lout);
+  if (e->preload) { lpreload_del(e->preload); }
   lenv_del(e);
 
-  mpc_cleanup(8, Number, Symbol, String, Comment, Sexpr, Qexpr, Expr, Lispy);
-  return 0;
+  lgrammar_report(g);
+  lgrammar_del(g);
+  return lmem_exit_check(true) ? 0 : 1;
 }
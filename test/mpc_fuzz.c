@@ -0,0 +1,492 @@
+/*
+** mpc differential fuzzer
+**
+** Parses random inputs every way mpc can and
+** checks that each gives the same tree, or the
+** same error, as the plain parser. Regular
+** expressions are run through their DFA, their
+** recogniser and the tree they were built from.
+** Grammars made by `mpca_lang`, with and without
+** packrat memos, are run compiled, saved and
+** loaded, on files, and into arenas and compact
+** trees, and their saved programs are damaged to
+** check loading turns them away. Inputs come
+** from a fixed seed, so a failure always
+** reproduces.
+**
+**   mpc_fuzz [count]
+**
+** runs `count` inputs per case, 20000 by default.
+** Mismatches are printed, and any makes the exit
+** status 1.
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "mpc.c"
+
+static long fuzz_count = 20000;
+static long fuzz_runs = 0;
+static long fuzz_bad = 0;
+
+/*
+** Inputs
+*/
+
+static unsigned long fuzz_seed;
+
+static int fuzz_rand(void) {
+  fuzz_seed = fuzz_seed * 1103515245 + 12345;
+  return (int)((fuzz_seed >> 16) & 0x7fff);
+}
+
+/* Fills `in` with up to `len_max - 1` characters drawn from `al` */
+static void fuzz_input(char *in, const char *al, int len_max) {
+  int len = fuzz_rand() % len_max, k;
+  for (k = 0; k < len; k++) { in[k] = al[fuzz_rand() % strlen(al)]; }
+  in[len] = '\0';
+}
+
+static FILE *fuzz_file(const char *in) {
+  return fmemopen((char*)in, strlen(in), "r");
+}
+
+/*
+** Results
+**
+** Each parse is turned into a string, either
+** its printed output or its error message, so
+** that any two ways of parsing are compared
+** with a `strcmp`. Trees are printed to one
+** scratch file, rewritten for each.
+*/
+
+static FILE *fuzz_out;
+
+static FILE *fuzz_print(void) {
+  if (fuzz_out == NULL) { fuzz_out = tmpfile(); }
+  rewind(fuzz_out);
+  return fuzz_out;
+}
+
+static char *fuzz_read(FILE *f) {
+  long n = ftell(f);
+  char *s = malloc(n + 1);
+  rewind(f);
+  n = (long)fread(s, 1, n, f);
+  s[n] = '\0';
+  return s;
+}
+
+static char *fuzz_string(int ok, mpc_result_t *r) {
+  char *s;
+  if (ok) {
+    s = malloc(strlen(r->output) + 3);
+    sprintf(s, "'%s'", (char*)r->output);
+    free(r->output);
+    return s;
+  }
+  s = mpc_err_string(r->error);
+  mpc_err_delete(r->error);
+  return s;
+}
+
+static char *fuzz_ast(int ok, mpc_result_t *r) {
+  FILE *f;
+  if (!ok) { return fuzz_string(ok, r); }
+  f = fuzz_print();
+  mpc_ast_print_to(r->output, f);
+  mpc_ast_delete(r->output);
+  return fuzz_read(f);
+}
+
+static char *fuzz_arena(int ok, mpc_result_t *r, mpc_arena_t *a) {
+  FILE *f;
+  if (!ok) { return fuzz_string(ok, r); }
+  f = fuzz_print();
+  mpc_ast_print_to(r->output, f);
+  mpc_arena_clear(a);
+  return fuzz_read(f);
+}
+
+static char *fuzz_tree(int ok, mpc_result_t *r) {
+  FILE *f;
+  if (!ok) { return fuzz_string(ok, r); }
+  f = fuzz_print();
+  mpc_tree_print_to(r->output, f);
+  mpc_tree_delete(r->output);
+  return fuzz_read(f);
+}
+
+/* Compares `got` with `want`, taking ownership of `got` */
+static void fuzz_check(const char *name, const char *how, const char *in, const char *want, char *got) {
+  fuzz_runs++;
+  if (strcmp(want, got) != 0) {
+    if (fuzz_bad++ < 10) {
+      printf("%s, %s, on [%s]:\n  expected %s\n  got      %s\n", name, how, in, want, got);
+    }
+  }
+  free(got);
+}
+
+/*
+** Regular Expressions
+**
+** Each expression is followed by a '#' so that
+** the errors from where it stops are compared
+** too, and run on strings and on pipes.
+*/
+
+typedef int (*fuzz_parse_t)(const char *filename, FILE *f, mpc_parser_t *p, mpc_result_t *r);
+
+static char *fuzz_regex_run(mpc_parser_t *q, const char *in, fuzz_parse_t parse) {
+  mpc_parser_t *w = mpc_and(2, mpcf_strfold, q, mpc_char('#'), free);
+  mpc_result_t r;
+  int ok;
+  FILE *f;
+  if (parse) {
+    f = fuzz_file(in);
+    ok = parse("<fuzz>", f, w, &r);
+    fclose(f);
+  } else {
+    ok = mpc_parse("<fuzz>", in, w, &r);
+  }
+  /* `q` is shared by every run, so is detached before `w` is deleted */
+  w->data.and.xs[0] = mpc_pass();
+  mpc_delete(w);
+  return fuzz_string(ok, &r);
+}
+
+static void fuzz_regex(const char *re, const char *al, int len_max) {
+
+  mpc_parser_t *dfa = mpc_re(re);
+  mpc_parser_t *rec = mpc_re(re);
+  mpc_parser_t *tree = rec->data.regex.x;
+  char in[256], *want;
+  long t;
+
+  mpc_dfa_delete(rec->data.regex.dfa);
+  rec->data.regex.dfa = NULL;
+
+  for (t = 0; t < fuzz_count; t++) {
+    fuzz_input(in, al, len_max);
+    want = fuzz_regex_run(tree, in, NULL);
+    fuzz_check(re, "dfa", in, want, fuzz_regex_run(dfa, in, NULL));
+    fuzz_check(re, "recogniser", in, want, fuzz_regex_run(rec, in, NULL));
+    free(want);
+    want = fuzz_regex_run(tree, in, mpc_parse_pipe);
+    fuzz_check(re, "dfa pipe", in, want, fuzz_regex_run(dfa, in, mpc_parse_pipe));
+    fuzz_check(re, "recogniser pipe", in, want, fuzz_regex_run(rec, in, mpc_parse_pipe));
+    free(want);
+  }
+
+  mpc_delete(dfa);
+  mpc_delete(rec);
+
+}
+
+static void fuzz_regexes(void) {
+
+  static const char *res[] = {
+    "[a-zA-Z0-9_%+*\\-\\/\\\\=<>!&|]+", ";[^\\r\\n]*", "a*b", "(ab)?c", "[^\\n]*", "\\d+",
+    "x{3}", "\\w+\\s", "(ab)*", "(a(bc)?)*x?", "a(b|c)*d?", "(ab|cd)+e?", "a?b?c?", "(a|b)?c*",
+    "ab{2}c", "[abc]+[de]*f?", "(x[yz])*", "-?[0-9]+", ".x", "a+|b+", "(a|b)*(c|d)?",
+    "((ab)?c)?d", "(a?b|c)", "(b|a?)c", "a{2}b*", "[a-c]?[d-f]+x", "(\\d\\s)+", "(a(b(c)*)?)+",
+    "(ab)+c", "-?(\\d+\\.)?\\d+", "a|ab", "^a$", "\\w*", "[^a-c]+", "(\\s|x)*y", "[a-c]|[d-f]",
+    "\\bx", "(a|\\d)+", NULL };
+
+  /* Long runs of escapes and whitespace, for the span scanners */
+  static const char *spans[] = {
+    "\"(\\\\.|[^\"])*\"", "'(\\\\.|[^'])+'", "(\\\\.|[^\"])*", "(\\\\.|[a-z\\\\])+x?", "\\s*",
+    "[ \\t\\n]*x", "[^a]*a", NULL };
+
+  int j;
+
+  fuzz_seed = 7;
+  for (j = 0; res[j]; j++) { fuzz_regex(res[j], "abcdexyz#;\n 09-f\"\\.", 12); }
+  for (j = 0; spans[j]; j++) { fuzz_regex(spans[j], "aaaaaaaaaaaaxx   \t\"\\\\\n;bcd09'", 130); }
+
+}
+
+/*
+** Grammars
+**
+** Each grammar is made twice, the second time
+** with `MPCA_LANG_PACKRAT`, and every way of
+** parsing with either must match a plain parse
+** without packrat.
+*/
+
+enum { FUZZ_LISPY, FUZZ_MATHS, FUZZ_PROG, FUZZ_GRAMMARS };
+
+typedef struct {
+  mpc_parser_t *ps[15];
+  mpc_parser_t *tops[FUZZ_GRAMMARS];
+} fuzz_langs_t;
+
+static void fuzz_langs_new(fuzz_langs_t *l, int flags) {
+
+  mpc_parser_t **ps = l->ps;
+  mpc_err_t *err;
+
+  ps[ 0] = mpc_new("number");
+  ps[ 1] = mpc_new("symbol");
+  ps[ 2] = mpc_new("string");
+  ps[ 3] = mpc_new("comment");
+  ps[ 4] = mpc_new("sexpr");
+  ps[ 5] = mpc_new("qexpr");
+  ps[ 6] = mpc_new("expr");
+  ps[ 7] = mpc_new("lispy");
+  ps[ 8] = mpc_new("expression");
+  ps[ 9] = mpc_new("product");
+  ps[10] = mpc_new("value");
+  ps[11] = mpc_new("maths");
+  ps[12] = mpc_new("kw");
+  ps[13] = mpc_new("stmt");
+  ps[14] = mpc_new("prog");
+
+  err = mpca_lang(flags,
+    " number  : /-?(\\d+\\.)?\\d+/ ;                                          "
+    " symbol  : /[a-zA-Z0-9_%+*\\-\\/\\\\=<>!&|]+/ ;                            "
+    " string  : /\"(\\\\.|[^\"])*\"/ ;                                         "
+    " comment : /;[^\\r\\n]*/ ;                                               "
+    " sexpr   : '(' <expr>* ')' ;                                             "
+    " qexpr   : '{' <expr>* '}' ;                                             "
+    " expr    : <number> | <symbol> | <string> | <comment> | <sexpr> | <qexpr> ; "
+    " lispy   : /^/ <expr>* /$/ ;                                             ",
+    ps[0], ps[1], ps[2], ps[3], ps[4], ps[5], ps[6], ps[7], NULL);
+
+  if (err == NULL) {
+    err = mpca_lang(flags,
+      " expression : <product> (('+' | '-') <product>)* ;                       "
+      " product    : <value> (('*' | '/') <value>)* ;                           "
+      " value      : /[0-9]+/ | '(' <expression> ')' | \"abs\" <value>          "
+      "            | ('-' | \"neg\") <value> ;                                  "
+      " maths      : /^/ <expression> /$/ ;                                     ",
+      ps[8], ps[9], ps[10], ps[11], NULL);
+  }
+
+  /* Alternatives sharing prefixes, for the FIRST set dispatch */
+  if (err == NULL) {
+    err = mpca_lang(flags,
+      " kw   : \"if\" | \"in\" | \"int\" | \"for\" | 'x'? 'y' | /[a-z]+/ ;        "
+      " stmt : <kw> ';' | '{' <stmt>* '}' | ';' | \"\" 'q' | (\"ab\" | 'a') 'c' ; "
+      " prog : /^/ <stmt>* /$/ ;                                                ",
+      ps[12], ps[13], ps[14], NULL);
+  }
+
+  if (err) {
+    mpc_err_print(err);
+    mpc_err_delete(err);
+    exit(EXIT_FAILURE);
+  }
+
+  l->tops[FUZZ_LISPY] = ps[7];
+  l->tops[FUZZ_MATHS] = ps[11];
+  l->tops[FUZZ_PROG] = ps[14];
+
+}
+
+static void fuzz_langs_delete(fuzz_langs_t *l) {
+  mpc_parser_t **ps = l->ps;
+  mpc_cleanup(15, ps[0], ps[1], ps[2], ps[3], ps[4], ps[5], ps[6], ps[7],
+    ps[8], ps[9], ps[10], ps[11], ps[12], ps[13], ps[14]);
+}
+
+typedef struct {
+  const char *name;
+  mpc_parser_t *p;
+  mpc_program_t *compiled;
+  mpc_program_t *loaded;
+  mpc_tags_t *tags;
+  mpc_arena_t *arena;
+} fuzz_grammar_t;
+
+static mpc_program_t *fuzz_reload(mpc_program_t *g) {
+  FILE *f = tmpfile();
+  mpc_program_t *h;
+  if (!mpc_program_save(g, f)) {
+    fprintf(stderr, "mpc_program_save failed\n");
+    exit(EXIT_FAILURE);
+  }
+  rewind(f);
+  h = mpc_program_load(f);
+  fclose(f);
+  if (h == NULL) {
+    fprintf(stderr, "mpc_program_load failed\n");
+    exit(EXIT_FAILURE);
+  }
+  return h;
+}
+
+static void fuzz_grammar_new(fuzz_grammar_t *g, const char *name, mpc_parser_t *p) {
+  g->name = name;
+  g->p = p;
+  g->compiled = mpc_compile(p);
+  g->loaded = fuzz_reload(g->compiled);
+  g->tags = mpc_tags_new(p);
+  g->arena = mpc_arena_new();
+}
+
+static void fuzz_grammar_delete(fuzz_grammar_t *g) {
+  mpc_program_delete(g->compiled);
+  mpc_program_delete(g->loaded);
+  mpc_tags_delete(g->tags);
+  mpc_arena_delete(g->arena);
+}
+
+static char *fuzz_grammar_file(mpc_parser_t *p, const char *in, fuzz_parse_t parse) {
+  mpc_result_t r;
+  FILE *f = fuzz_file(in);
+  int ok = parse("<fuzz>", f, p, &r);
+  fclose(f);
+  return fuzz_ast(ok, &r);
+}
+
+/* Every way of parsing `in` with `g`, against the result `want` */
+static void fuzz_grammar_check(fuzz_grammar_t *g, const char *in, const char *want) {
+
+  mpc_result_t r;
+  int ok;
+
+  ok = mpc_parse("<fuzz>", in, g->p, &r);
+  fuzz_check(g->name, "plain", in, want, fuzz_ast(ok, &r));
+
+  ok = mpc_parse("<fuzz>", in, mpc_program_start(g->compiled), &r);
+  fuzz_check(g->name, "compiled", in, want, fuzz_ast(ok, &r));
+
+  ok = mpc_parse("<fuzz>", in, mpc_program_start(g->loaded), &r);
+  fuzz_check(g->name, "loaded", in, want, fuzz_ast(ok, &r));
+
+  fuzz_check(g->name, "file", in, want, fuzz_grammar_file(g->p, in, mpc_parse_file));
+
+  ok = mpc_parse_arena("<fuzz>", in, g->p, g->arena, &r);
+  fuzz_check(g->name, "arena", in, want, fuzz_arena(ok, &r, g->arena));
+
+  ok = mpc_parse_tree("<fuzz>", in, g->p, g->tags, &r);
+  fuzz_check(g->name, "tree", in, want, fuzz_tree(ok, &r));
+
+}
+
+/*
+** Damaged Programs
+**
+** A saved program with bits flipped, cut short
+** or added to must be turned away by its checksum.
+** With the checksum made to match again the flips
+** reach the checks on each node instead, and the
+** load must come back without crashing, but what
+** it loads is not parsed with, as a function of
+** the right kind may still be the wrong one.
+*/
+
+static char *fuzz_saved(mpc_program_t *g, long *n) {
+  FILE *f = fuzz_print();
+  if (!mpc_program_save(g, f)) {
+    fprintf(stderr, "mpc_program_save failed\n");
+    exit(EXIT_FAILURE);
+  }
+  *n = ftell(f);
+  return fuzz_read(f);
+}
+
+static void fuzz_damaged_load(const char *name, const char *how, char *saved, long n, int rejected) {
+  FILE *f = fmemopen(saved, n, "r");
+  mpc_program_t *g = mpc_program_load(f);
+  fclose(f);
+  fuzz_runs++;
+  if (g == NULL) { return; }
+  if (rejected && fuzz_bad++ < 10) { printf("%s, %s: damaged program was loaded\n", name, how); }
+  mpc_program_delete(g);
+}
+
+static void fuzz_damaged(const char *name, mpc_program_t *g) {
+
+  long n, t, at, sum;
+  char *saved = fuzz_saved(g, &n), *bad = malloc(n + 1);
+  int k, flips;
+
+  for (t = 0; t < fuzz_count / 10; t++) {
+
+    memcpy(bad, saved, n);
+    flips = 1 + fuzz_rand() % 3;
+    for (k = 0; k < flips; k++) {
+      at = ((long)fuzz_rand() << 15 | fuzz_rand()) % n;
+      bad[at] ^= (char)(1 << fuzz_rand() % 8);
+    }
+    if (memcmp(bad, saved, n) == 0) { continue; }
+    fuzz_damaged_load(name, "flipped", bad, n, 1);
+
+    sum = mpc_image_sum(bad, n - (long)sizeof(long));
+    memcpy(bad + n - sizeof(long), &sum, sizeof(long));
+    fuzz_damaged_load(name, "flipped under a good checksum", bad, n, 0);
+
+    memcpy(bad, saved, n);
+    fuzz_damaged_load(name, "cut short", bad, 1 + fuzz_rand() % (n - 1), 1);
+    bad[n] = (char)fuzz_rand();
+    fuzz_damaged_load(name, "added to", bad, n + 1, 1);
+  }
+
+  free(saved);
+  free(bad);
+
+}
+
+static void fuzz_grammar(const char *name, mpc_parser_t *plain, mpc_parser_t *packrat,
+  const char *al, int len_max) {
+
+  fuzz_grammar_t g, h;
+  mpc_result_t r;
+  char in[256], packrat_name[64], *want;
+  long t;
+  int ok;
+
+  sprintf(packrat_name, "%s packrat", name);
+  fuzz_grammar_new(&g, name, plain);
+  fuzz_grammar_new(&h, packrat_name, packrat);
+
+  for (t = 0; t < fuzz_count; t++) {
+    fuzz_input(in, al, len_max);
+    ok = mpc_parse("<fuzz>", in, plain, &r);
+    want = fuzz_ast(ok, &r);
+    fuzz_grammar_check(&g, in, want);
+    fuzz_grammar_check(&h, in, want);
+    free(want);
+  }
+
+  fuzz_damaged(name, g.compiled);
+  fuzz_damaged(packrat_name, h.compiled);
+
+  fuzz_grammar_delete(&g);
+  fuzz_grammar_delete(&h);
+
+}
+
+static void fuzz_grammars(void) {
+
+  fuzz_langs_t plain, packrat;
+
+  fuzz_langs_new(&plain, MPCA_LANG_DEFAULT);
+  fuzz_langs_new(&packrat, MPCA_LANG_PACKRAT);
+
+  fuzz_seed = 1;
+  fuzz_grammar("lispy", plain.tops[FUZZ_LISPY], packrat.tops[FUZZ_LISPY], "(){} 1-2.ab\";\nx", 40);
+  fuzz_grammar("maths", plain.tops[FUZZ_MATHS], packrat.tops[FUZZ_MATHS], "0123+-*/() absneg", 30);
+  fuzz_grammar("prog", plain.tops[FUZZ_PROG], packrat.tops[FUZZ_PROG], "ifnrtoxyqabc;{} ", 30);
+
+  fuzz_langs_delete(&plain);
+  fuzz_langs_delete(&packrat);
+
+}
+
+int main(int argc, char **argv) {
+
+  if (argc > 1) { fuzz_count = atol(argv[1]); }
+
+  fuzz_regexes();
+  fuzz_grammars();
+
+  printf("%ld/%ld mismatches\n", fuzz_bad, fuzz_runs);
+  return fuzz_bad ? EXIT_FAILURE : 0;
+
+}
@@ -0,0 +1,172 @@
+/*
+** mpc regression output
+**
+** Parses a fixed set of inputs with a Lispy
+** grammar and a handful of regular expressions
+** and prints every tree and error. `make check`
+** compares this with `test/mpc_regress.out`,
+** which was written by mpc before any of its
+** parsers were rewritten, so a change in either
+** the trees or the error messages shows up as a
+** diff.
+**
+** The last few are expressions nested far deeper
+** than the C stack allows, which that mpc could
+** not parse at all. They are summed up rather
+** than printed, by walks which keep to the heap
+** as the parsers now must.
+*/
+
+#include "mpc.h"
+
+#define REGRESS_DEPTH 100000
+
+static const char *regress_inputs[] = {
+  "(+ 1 2)", "{1 2 3}", "-5 -x 1.5 \"hi\\\"there\" ; comment\n", "(+ 1 2", ")", "(def {x} \"abc)", "\"a\\\" b",
+  "1. 2", "(a (b (c {d e} \"f\")))", "", "   ", "((", "; only comment", "abc}", "\"unterminated",
+  "(\\ {x y} {+ x y})", "12.5.3", "-", "(print \"a\\nb\")", "{}()", NULL };
+
+static const char *regress_res[] = { "a*b", "(ab)?c", "[^\\n]*", "\\d+", "a|ab", "x{3}", "^a$", "\\w+\\s", NULL };
+static const char *regress_res_inputs[] = { "aaab", "abc", "xyz\n", "123a", "ab", "xxxx", "a", "ab_9 x", NULL };
+
+/* `depth` brackets, alternately round and curly, closed again unless `open` */
+static char *regress_deep(int depth, int open) {
+  char *s = malloc(2 * depth + 1);
+  int j;
+  for (j = 0; j < depth; j++) {
+    s[j] = j % 2 ? '{' : '(';
+    s[2 * depth - 1 - j] = j % 2 ? '}' : ')';
+  }
+  s[open ? depth : 2 * depth] = '\0';
+  return s;
+}
+
+/* Follows the one child which has children of its own, as each level of a nested input has */
+static void regress_ast_depth(mpc_ast_t *a) {
+  int depth = 0, j;
+  while (a) {
+    mpc_ast_t *next = NULL;
+    for (j = 0; j < a->children_num; j++) {
+      if (a->children[j]->children_num) { next = a->children[j]; }
+    }
+    if (strstr(a->tag, "sexpr") || strstr(a->tag, "qexpr")) { depth++; }
+    a = next;
+  }
+  printf("ast depth %d\n", depth);
+}
+
+static void regress_tree_depth(mpc_tree_t *t, const mpc_tags_t *tags) {
+  int depth = 0, n = 0, j, sexpr = mpc_tags_find(tags, "sexpr"), qexpr = mpc_tags_find(tags, "qexpr");
+  while (n >= 0) {
+    mpc_node_t *x = t->nodes + n;
+    if (mpc_tree_has_tag(t, n, sexpr) || mpc_tree_has_tag(t, n, qexpr)) { depth++; }
+    n = -1;
+    for (j = 0; j < x->children_num; j++) {
+      if (t->nodes[x->children + j].children_num) { n = x->children + j; }
+    }
+  }
+  printf("tree depth %d, %d nodes\n", depth, t->nodes_num);
+}
+
+static void regress_deeps(mpc_parser_t *Lispy) {
+
+  mpc_tags_t *tags = mpc_tags_new(Lispy);
+  char *deep = regress_deep(REGRESS_DEPTH, 0);
+  char *open = regress_deep(REGRESS_DEPTH, 1);
+  mpc_result_t r;
+
+  printf("=== %d deep\n", REGRESS_DEPTH);
+  if (mpc_parse("<t>", deep, Lispy, &r)) {
+    regress_ast_depth(r.output);
+    mpc_ast_delete(r.output);
+  } else {
+    mpc_err_print(r.error);
+    mpc_err_delete(r.error);
+  }
+
+  if (mpc_parse_tree("<t>", deep, Lispy, tags, &r)) {
+    regress_tree_depth(r.output, tags);
+    mpc_tree_delete(r.output);
+  } else {
+    mpc_err_print(r.error);
+    mpc_err_delete(r.error);
+  }
+
+  /* Every level is left half built when the end of input is reached, and must be freed */
+  printf("=== %d deep, never closed\n", REGRESS_DEPTH);
+  if (mpc_parse("<t>", open, Lispy, &r)) {
+    mpc_ast_delete(r.output);
+  } else {
+    mpc_err_print(r.error);
+    mpc_err_delete(r.error);
+  }
+
+  free(deep);
+  free(open);
+  mpc_tags_delete(tags);
+
+}
+
+int main(void) {
+
+  mpc_parser_t *Number  = mpc_new("number");
+  mpc_parser_t *Symbol  = mpc_new("symbol");
+  mpc_parser_t *String  = mpc_new("string");
+  mpc_parser_t *Comment = mpc_new("comment");
+  mpc_parser_t *Sexpr   = mpc_new("sexpr");
+  mpc_parser_t *Qexpr   = mpc_new("qexpr");
+  mpc_parser_t *Expr    = mpc_new("expr");
+  mpc_parser_t *Lispy   = mpc_new("lispy");
+  mpc_result_t r;
+  mpc_err_t *err;
+  int j, k;
+
+  err = mpca_lang(MPCA_LANG_DEFAULT,
+    " number  : /-?(\\d+\\.)?\\d+/ ;                                          "
+    " symbol  : /[a-zA-Z0-9_%+*\\-\\/\\\\=<>!&|]+/ ;                            "
+    " string  : /\"(\\\\.|[^\"])*\"/ ;                                         "
+    " comment : /;[^\\r\\n]*/ ;                                               "
+    " sexpr   : '(' <expr>* ')' ;                                             "
+    " qexpr   : '{' <expr>* '}' ;                                             "
+    " expr    : <number> | <symbol> | <string> | <comment> | <sexpr> | <qexpr> ; "
+    " lispy   : /^/ <expr>* /$/ ;                                             ",
+    Number, Symbol, String, Comment, Sexpr, Qexpr, Expr, Lispy, NULL);
+
+  if (err) {
+    mpc_err_print(err);
+    mpc_err_delete(err);
+    return EXIT_FAILURE;
+  }
+
+  for (j = 0; regress_inputs[j]; j++) {
+    printf("=== [%s]\n", regress_inputs[j]);
+    if (mpc_parse("<t>", regress_inputs[j], Lispy, &r)) {
+      mpc_ast_print(r.output);
+      mpc_ast_delete(r.output);
+    } else {
+      mpc_err_print(r.error);
+      mpc_err_delete(r.error);
+    }
+  }
+
+  for (j = 0; regress_res[j]; j++) {
+    mpc_parser_t *p = mpc_re(regress_res[j]);
+    for (k = 0; regress_res_inputs[k]; k++) {
+      printf("re %s on %s -> ", regress_res[j], regress_res_inputs[k]);
+      if (mpc_parse("<re>", regress_res_inputs[k], p, &r)) {
+        printf("'%s'\n", (char*)r.output);
+        free(r.output);
+      } else {
+        mpc_err_print(r.error);
+        mpc_err_delete(r.error);
+      }
+    }
+    mpc_delete(p);
+  }
+
+  regress_deeps(Lispy);
+
+  mpc_cleanup(8, Number, Symbol, String, Comment, Sexpr, Qexpr, Expr, Lispy);
+  return 0;
+
+}
@@ -0,0 +1,135 @@
+#!/usr/bin/env bash
+# Lispy differential test: the generated grammar parser against the interpreted one.
+#
+#   test/run.sh ./parsing ./parsing_boot
+#
+# Both builds read every script in test/lispy, the same scripts from stdin, and
+# generated inputs, the second build with and without a saved grammar
+# (LISPY_GRAMMAR_CACHE). Their output, errors and exit status must be identical.
+# The first build's must also match test/lispy/NAME.out for each script, and
+# NAME.batch.out for it on stdin, so what both print is pinned down too. Last,
+# both builds run every script again with LISPY_LEAK_CHECK set and must exit 0.
+# The generated inputs, random from a fixed seed or nested 100k deep, are written
+# into $TEST_OUT (test/out by default).
+
+set -e
+
+[ $# -eq 2 ] || { echo "usage: $0 parsing parsing_boot" >&2; exit 2; }
+
+dir=$(cd "$(dirname "$0")" && pwd)
+out=${TEST_OUT:-$dir/out}
+new=$(cd "$(dirname "$1")" && pwd)/$(basename "$1")
+boot=$(cd "$(dirname "$2")" && pwd)/$(basename "$2")
+mkdir -p "$out"
+rm -f "$out/grammar.cache"
+
+# Any mix of the characters the grammar cares about, mostly parse errors
+gen_noise() {
+  awk -v seed="$1" 'BEGIN {
+    srand(seed)
+    al = "(){} 1-2.ab\";\n\\x"
+    for (i = 0; i < 400; i++) {
+      n = int(rand() * 40); s = ""
+      for (k = 0; k < n; k++) s = s substr(al, int(rand() * length(al)) + 1, 1)
+      print s
+    }
+  }'
+}
+
+# Well formed literals nested at random, each printed back
+gen_forms() {
+  awk -v seed="$1" '
+    function form(d,   r, s, k, n) {
+      r = rand()
+      if (d > 6 || r < 0.3) return int(rand() * 2000) - 1000
+      if (r < 0.4) return (int(rand() * 100000) - 50000) / 1000
+      if (r < 0.5) return "\"s" int(rand() * 10) "\\\"\\n\""
+      if (r < 0.6) return "; c\n"
+      n = int(rand() * 5); s = "{"
+      for (k = 0; k < n; k++) s = s (k ? " " : "") form(d + 1)
+      return s "}"
+    }
+    BEGIN { srand(seed); for (i = 0; i < 400; i++) print "(print " form(0) ")" }'
+}
+
+# A literal nested 100k deep, far past the generated parser's MPCG_DEPTH_MAX, so it falls
+# back to the grammar; then the same brackets left open, so the parse fails at the bottom
+gen_deep() {
+  awk -v open="$1" 'BEGIN {
+    d = 100000
+    for (i = 0; i < d; i++) { o = o (i % 2 ? "(" : "{"); c = (i % 2 ? ")" : "}") c }
+    print "(def {deep} " o (open ? "" : c) ")"
+    print "(print (len deep) (len (head deep)))"
+  }'
+}
+
+for s in 1 2 3; do
+  gen_noise $s > "$out/noise$s.lspy"
+  gen_forms $s > "$out/forms$s.lspy"
+done
+gen_deep 0 > "$out/deep.lspy"
+gen_deep 1 > "$out/deep_open.lspy"
+
+fail=0
+# run name stdin args...
+run() {
+  local name=$1 in=$2 want got
+  shift 2
+  want=$(cd "$dir/lispy" && "$new" "$@" < "$in" 2>&1; echo "exit $?")
+  for mode in plain cache-cold cache-warm; do
+    if [ $mode = plain ]; then
+      got=$(cd "$dir/lispy" && "$boot" "$@" < "$in" 2>&1; echo "exit $?")
+    else
+      got=$(cd "$dir/lispy" && LISPY_GRAMMAR_CACHE="$out/grammar.cache" "$boot" "$@" < "$in" 2>&1; echo "exit $?")
+    fi
+    if [ "$want" != "$got" ]; then
+      echo "FAIL $name ($mode)"
+      diff <(echo "$want") <(echo "$got") | head -10
+      fail=1
+    fi
+  done
+  rm -f "$out/grammar.cache"
+}
+
+# pin name stdin expected args...
+pin() {
+  local name=$1 in=$2 file=$3 got
+  shift 3
+  got=$(cd "$dir/lispy" && "$new" "$@" < "$in" 2>&1; echo "exit $?")
+  if [ "$got" != "$(cat "$file")" ]; then
+    echo "FAIL $name (expected $(basename "$file"))"
+    diff "$file" <(echo "$got") | head -10
+    fail=1
+  fi
+}
+
+for f in "$dir"/lispy/*.lspy; do
+  pin "$(basename "$f")" /dev/null "${f%.lspy}.out" "$(basename "$f")"
+  pin "$(basename "$f") on stdin" "$f" "${f%.lspy}.batch.out" --batch
+done
+
+for f in "$dir"/lispy/*.lspy "$out"/*.lspy; do
+  run "$(basename "$f")" /dev/null "$f"
+  run "$(basename "$f") on stdin" "$f" --batch
+done
+
+# leaks name stdin args...
+leaks() {
+  local name=$1 in=$2 b err
+  shift 2
+  for b in "$new" "$boot"; do
+    if ! err=$(cd "$dir/lispy" && LISPY_LEAK_CHECK=1 "$b" "$@" < "$in" 2>&1 >/dev/null); then
+      echo "FAIL $name ($(basename "$b") leak check)"
+      echo "$err" | tail -10
+      fail=1
+    fi
+  done
+}
+
+for f in "$dir"/lispy/*.lspy "$out"/*.lspy; do
+  leaks "$(basename "$f")" /dev/null "$f"
+  leaks "$(basename "$f") on stdin" "$f" --batch
+done
+
+if [ $fail = 0 ]; then echo "lispy: generated and interpreted parsers agree, and nothing leaks"; fi
+exit $fail